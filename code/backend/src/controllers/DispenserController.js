@@ -1,4 +1,5 @@
 const AWS = require('aws-sdk');
+const wireFormat = require('../utils/wireFormat');
 
 // Configure AWS DynamoDB
 const dynamodb = new AWS.DynamoDB.DocumentClient({
@@ -95,9 +96,10 @@ exports.triggerDispensers = async (req, res) => {
           timestamp: new Date().toISOString()
         };
 
+        // Encoded in the dispenser's configured wire format (JSON by default)
         const mqttParams = {
           topic: mqttTopic,
-          payload: JSON.stringify(mqttMessage),
+          payload: wireFormat.encode(mqttMessage, dispenser.wire_format),
           qos: 1
         };
 
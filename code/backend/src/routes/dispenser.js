@@ -3,6 +3,7 @@ const router = express.Router();
 const AWS = require('aws-sdk');
 const authMiddleware = require("../middleware/authMiddleware");
 const checkRole = require('../middleware/checkRole');
+const wireFormat = require('../utils/wireFormat');
 const { getAutoDispenseMedicines, triggerDispensers } = require("../controllers/DispenserController");
 
 const rateLimit = require('express-rate-limit');
@@ -58,7 +59,7 @@ router.get('/available-medicines', authMiddleware, checkRole(['pharmacist', 'doc
 // Backend API endpoint to handle dispenser configuration
 router.put('/configure', authMiddleware, async (req, res) => {
   try {
-    const { dispenser_name, medicine_id, medication_id } = req.body;
+    const { dispenser_name, medicine_id, medication_id, wire_format } = req.body;
     const medId = medicine_id !== undefined ? medicine_id : medication_id;
 
     if (!dispenser_name) {
@@ -68,25 +69,61 @@ router.put('/configure', authMiddleware, async (req, res) => {
       });
     }
 
+    if (wire_format !== undefined && !wireFormat.isFormat(wire_format)) {
+      return res.status(400).json({
+        success: false,
+        error: `wire_format must be one of: ${wireFormat.formats.join(', ')}`
+      });
+    }
+
+    const setClauses = [];
+    const removeClauses = [];
+    const values = {};
+    if (medId === null) {
+      removeClauses.push('medicine_id');
+    } else if (medId !== undefined) {
+      setClauses.push('medicine_id = :medicine_id');
+      values[':medicine_id'] = medId;
+    }
+    if (wire_format !== undefined) {
+      setClauses.push('wire_format = :wire_format');
+      values[':wire_format'] = wire_format;
+    }
+    if (setClauses.length === 0 && removeClauses.length === 0) {
+      return res.status(400).json({
+        success: false,
+        error: 'Nothing to update'
+      });
+    }
+
     const params = {
       TableName: 'DispenserStatus',
       Key: {
         dispenser_name: dispenser_name
       },
-      UpdateExpression: 'SET medicine_id = :medicine_id',
-      ExpressionAttributeValues: {
-        ':medicine_id': medId
-      },
+      UpdateExpression: [
+        setClauses.length ? `SET ${setClauses.join(', ')}` : '',
+        removeClauses.length ? `REMOVE ${removeClauses.join(', ')}` : ''
+      ].join(' ').trim(),
       ReturnValues: 'ALL_NEW'
     };
-
-    if (medId === null) {
-      params.UpdateExpression = 'REMOVE medicine_id';
-      delete params.ExpressionAttributeValues;
+    if (Object.keys(values).length > 0) {
+      params.ExpressionAttributeValues = values;
     }
 
     const result = await dynamodb.update(params).promise();
 
+    // Switch the device's status messages too. The command is sent as JSON,
+    // which every firmware accepts; the device resets to JSON on reboot and
+    // reports its format in the online message on the health topic.
+    if (wire_format !== undefined) {
+      await iotdata.publish({
+        topic: `mediflow/${dispenser_name}/command`,
+        payload: wireFormat.encode({ command: 'wire', format: wire_format }),
+        qos: 1
+      }).promise();
+    }
+
     res.json({
       success: true,
       message: 'Dispenser configuration updated successfully',
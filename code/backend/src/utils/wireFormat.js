@@ -0,0 +1,128 @@
+const { keys, formats } = require('./wireSchema');
+
+// Command/status payloads for the dispenser topics, in JSON or in the
+// MessagePack form the firmware understands: a flat map keyed by the
+// schema's integer codes (see code/firmware/src/WireFormat.h).
+
+const names = Object.fromEntries(Object.entries(keys).map(([name, code]) => [code, name]));
+
+const isFormat = (format) => formats.includes(format);
+
+const encodeValue = (value, out) => {
+  if (value === null || value === undefined) {
+    out.push(Buffer.from([0xc0]));
+  } else if (typeof value === 'boolean') {
+    out.push(Buffer.from([value ? 0xc3 : 0xc2]));
+  } else if (typeof value === 'number' && Number.isInteger(value) && Math.abs(value) <= 0x7fffffff) {
+    if (value >= 0 && value <= 0x7f) {
+      out.push(Buffer.from([value]));
+    } else if (value < 0 && value >= -32) {
+      out.push(Buffer.from([value & 0xff]));
+    } else {
+      const buf = Buffer.alloc(5);
+      buf[0] = 0xd2;
+      buf.writeInt32BE(value, 1);
+      out.push(buf);
+    }
+  } else if (typeof value === 'number') {
+    const buf = Buffer.alloc(9);
+    buf[0] = 0xcb;
+    buf.writeDoubleBE(value, 1);
+    out.push(buf);
+  } else {
+    const text = Buffer.from(String(value), 'utf8');
+    if (text.length < 32) {
+      out.push(Buffer.from([0xa0 | text.length]));
+    } else if (text.length <= 0xff) {
+      out.push(Buffer.from([0xd9, text.length]));
+    } else {
+      const header = Buffer.alloc(3);
+      header[0] = 0xda;
+      header.writeUInt16BE(text.length, 1);
+      out.push(header);
+    }
+    out.push(text);
+  }
+};
+
+// Returns a string for JSON and a Buffer for MessagePack. Keys that are not
+// in the schema are dropped from MessagePack messages.
+exports.encode = (message, format = 'json') => {
+  if (format !== 'msgpack') {
+    return JSON.stringify(message);
+  }
+  const entries = Object.entries(message).filter(([name, value]) => keys[name] !== undefined && value !== undefined);
+  if (entries.length > 15) {
+    throw new Error('Too many fields for a wire message');
+  }
+  const out = [Buffer.from([0x80 | entries.length])];
+  for (const [name, value] of entries) {
+    out.push(Buffer.from([keys[name]]));
+    encodeValue(value, out);
+  }
+  return Buffer.concat(out);
+};
+
+const decodeValue = (buf, at) => {
+  const type = buf[at.pos++];
+  const read = (length) => {
+    if (at.pos + length > buf.length) {
+      throw new Error('Truncated wire message');
+    }
+    const slice = buf.subarray(at.pos, at.pos + length);
+    at.pos += length;
+    return slice;
+  };
+  const map = (count) => {
+    const result = {};
+    for (let i = 0; i < count; i++) {
+      const key = decodeValue(buf, at);
+      result[names[key] || key] = decodeValue(buf, at);
+    }
+    return result;
+  };
+  const array = (count) => Array.from({ length: count }, () => decodeValue(buf, at));
+
+  if (type === undefined) throw new Error('Truncated wire message');
+  if (type <= 0x7f) return type;
+  if (type >= 0xe0) return type - 0x100;
+  if ((type & 0xf0) === 0x80) return map(type & 0x0f);
+  if ((type & 0xf0) === 0x90) return array(type & 0x0f);
+  if ((type & 0xe0) === 0xa0) return read(type & 0x1f).toString('utf8');
+  switch (type) {
+    case 0xc0: return null;
+    case 0xc2: return false;
+    case 0xc3: return true;
+    case 0xca: return read(4).readFloatBE(0);
+    case 0xcb: return read(8).readDoubleBE(0);
+    case 0xcc: return read(1).readUInt8(0);
+    case 0xcd: return read(2).readUInt16BE(0);
+    case 0xce: return read(4).readUInt32BE(0);
+    case 0xcf: return Number(read(8).readBigUInt64BE(0));
+    case 0xd0: return read(1).readInt8(0);
+    case 0xd1: return read(2).readInt16BE(0);
+    case 0xd2: return read(4).readInt32BE(0);
+    case 0xd3: return Number(read(8).readBigInt64BE(0));
+    case 0xd9: return read(read(1).readUInt8(0)).toString('utf8');
+    case 0xda: return read(read(2).readUInt16BE(0)).toString('utf8');
+    case 0xdb: return read(read(4).readUInt32BE(0)).toString('utf8');
+    case 0xdc: return array(read(2).readUInt16BE(0));
+    case 0xdd: return array(read(4).readUInt32BE(0));
+    case 0xde: return map(read(2).readUInt16BE(0));
+    case 0xdf: return map(read(4).readUInt32BE(0));
+    default: throw new Error(`Unsupported wire type 0x${type.toString(16)}`);
+  }
+};
+
+// Accepts either format; a MessagePack map is told apart by its first byte
+exports.decode = (payload) => {
+  const buf = Buffer.isBuffer(payload) ? payload : Buffer.from(payload);
+  const first = buf[0];
+  if ((first & 0xf0) === 0x80 || first === 0xde || first === 0xdf) {
+    return decodeValue(buf, { pos: 0 });
+  }
+  return JSON.parse(buf.toString('utf8'));
+};
+
+exports.isFormat = isFormat;
+exports.formats = formats;
@@ -0,0 +1,45 @@
+// Generated from code/firmware/src/WireSchema.h by
+// code/firmware/tools/wire/wire_schema_js.cpp. Do not edit.
+
+// MessagePack map key code of every JSON key
+const keys = {
+  command: 1,
+  quantity: 2,
+  medicine_name: 3,
+  medicine_id: 4,
+  prescription_id: 5,
+  timestamp: 6,
+  bulkSpeed: 7,
+  creepSpeed: 8,
+  taperPills: 9,
+  creepPills: 10,
+  kp: 11,
+  ki: 12,
+  format: 13,
+  status: 14,
+  error: 15,
+  reason: 16,
+  offset: 17,
+  targetCount: 18,
+  pillCount: 19,
+  position: 20,
+  channel: 21,
+  overshoot: 22,
+  durationMs: 23,
+  intervalMinMs: 24,
+  intervalMeanMs: 25,
+  intervalMaxMs: 26,
+  doubles: 27,
+  rejected: 28,
+  jams: 29,
+  times: 30,
+  grace: 31,
+};
+
+// Status formats a device can be switched to with the "wire" command
+const formats = [
+  'json',
+  'msgpack',
+];
+
+module.exports = { keys, formats };
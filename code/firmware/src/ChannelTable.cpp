@@ -0,0 +1,18 @@
+#include "Channels.h"
+
+// Dispenser_A: a single bin that serves every medicine. To add a bin, add
+// a row with its own pins and servo numbers and name the medicine it holds,
+// e.g.
+//   { "Metformin 850mg", 34, 2, HAL_NO_PIN, 3, 13, { 16, 17, 4, 15 }, { HAL_NO_PIN, 0, 0, HAL_NO_PIN, 0 } },
+const ChannelConfig channelTable[] = {
+  {
+    NULL,                                      // Any medicine
+    LASER_PIN,
+    0, HAL_NO_PIN,                             // Gate servo not fitted
+    1, 21,                                     // Refill servo
+    { RPWM_PIN, LPWM_PIN, R_EN_PIN, L_EN_PIN },
+    { N20_ENA, N20_IN1, N20_IN2, N20_ENC_A, N20_ENC_B },
+  },
+};
+
+const uint8_t channelCount = sizeof(channelTable) / sizeof(channelTable[0]);
@@ -0,0 +1,17 @@
+#include "Channels.h"
+#include <strings.h>
+
+int channelForMedicine(const char *medicineName) {
+  int fallback = -1;
+  for (uint8_t i = 0; i < channelCount; i++) {
+    const char *medicine = channelTable[i].medicine;
+    if (medicine == NULL) {
+      if (fallback < 0) {
+        fallback = i;
+      }
+    } else if (medicineName != NULL && strcasecmp(medicine, medicineName) == 0) {
+      return i;
+    }
+  }
+  return fallback;
+}
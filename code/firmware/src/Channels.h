@@ -0,0 +1,40 @@
+#ifndef CHANNELS_H
+#define CHANNELS_H
+
+/**
+ * Channels - The medicine bins driven by this controller
+ *
+ * Each channel is one bin with its own laser, gate, turntable, optional
+ * agitator and refill servo. A dispense command is routed to a channel by
+ * its medicine_name, and channels dispense concurrently. All of them
+ * report on the device's single status topic, tagged with "channel".
+ *
+ * The table is per board: ChannelTable.cpp for the ESP32 build,
+ * sim/SimChannelTable.cpp for the simulator.
+ */
+
+#include <Arduino.h>
+#include "Hal.h"
+#include "LaserModule.h"
+#include "MotorControl.h"
+
+#define CHANNEL_MAX LASER_MAX_CHANNELS
+
+struct ChannelConfig {
+  const char *medicine;     // medicine_name served (case-insensitive); NULL: any medicine no other channel serves
+  uint8_t laserPin;
+  HalServo gateServo;
+  uint8_t gatePin;          // HAL_NO_PIN: no gate fitted
+  HalServo refillServo;
+  uint8_t refillPin;
+  TurntablePins turntable;
+  AgitatorPins agitator;
+};
+
+extern const ChannelConfig channelTable[];
+extern const uint8_t channelCount;
+
+// Channel serving medicineName, or -1 if none does
+int channelForMedicine(const char *medicineName);
+
+#endif
@@ -0,0 +1,939 @@
+#include "CommandParser.h"
+#include <string.h>
+
+bool StrSlice::equals(const char *literal) const {
+  size_t n = strlen(literal);
+  return n == len && memcmp(ptr, literal, n) == 0;
+}
+
+namespace {
+
+struct Cursor {
+  uint8_t *data;
+  size_t pos;
+  size_t end;
+
+  bool atEnd() const { return pos >= end; }
+  uint8_t peek() const { return data[pos]; }
+
+  void skipWhitespace() {
+    while (pos < end) {
+      uint8_t c = data[pos];
+      if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+        break;
+      }
+      pos++;
+    }
+  }
+};
+
+int hexValue(uint8_t c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool readHex4(Cursor &cur, uint32_t &value) {
+  if (cur.end - cur.pos < 4) {
+    return false;
+  }
+  value = 0;
+  for (int i = 0; i < 4; i++) {
+    int h = hexValue(cur.data[cur.pos++]);
+    if (h < 0) {
+      return false;
+    }
+    value = (value << 4) | (uint32_t)h;
+  }
+  return true;
+}
+
+// Appends a code point as UTF-8. The encoded form is never longer than the
+// escape sequence it replaces, so the write position cannot overtake reads.
+size_t encodeUtf8(uint8_t *out, uint32_t cp) {
+  if (cp < 0x80) {
+    out[0] = (uint8_t)cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    out[0] = (uint8_t)(0xC0 | (cp >> 6));
+    out[1] = (uint8_t)(0x80 | (cp & 0x3F));
+    return 2;
+  }
+  if (cp < 0x10000) {
+    out[0] = (uint8_t)(0xE0 | (cp >> 12));
+    out[1] = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+    out[2] = (uint8_t)(0x80 | (cp & 0x3F));
+    return 3;
+  }
+  out[0] = (uint8_t)(0xF0 | (cp >> 18));
+  out[1] = (uint8_t)(0x80 | ((cp >> 12) & 0x3F));
+  out[2] = (uint8_t)(0x80 | ((cp >> 6) & 0x3F));
+  out[3] = (uint8_t)(0x80 | (cp & 0x3F));
+  return 4;
+}
+
+// Parses a string at the cursor, decoding escapes in place
+ParseError parseString(Cursor &cur, StrSlice &out) {
+  if (cur.atEnd() || cur.peek() != '"') {
+    return PARSE_BAD_STRING;
+  }
+  cur.pos++;
+
+  size_t start = cur.pos;
+
+  // Fast path: no escapes, nothing to move
+  while (cur.pos < cur.end) {
+    uint8_t c = cur.data[cur.pos];
+    if (c == '"' || c == '\\' || c < 0x20) {
+      break;
+    }
+    cur.pos++;
+  }
+
+  size_t write = cur.pos;
+  while (true) {
+    if (cur.atEnd()) {
+      return PARSE_BAD_STRING;
+    }
+    uint8_t c = cur.data[cur.pos++];
+    if (c == '"') {
+      break;
+    }
+    if (c < 0x20) {
+      return PARSE_BAD_STRING;
+    }
+    if (c != '\\') {
+      cur.data[write++] = c;
+      continue;
+    }
+
+    if (cur.atEnd()) {
+      return PARSE_BAD_STRING;
+    }
+    c = cur.data[cur.pos++];
+    switch (c) {
+      case '"': case '\\': case '/':
+        cur.data[write++] = c;
+        break;
+      case 'b': cur.data[write++] = '\b'; break;
+      case 'f': cur.data[write++] = '\f'; break;
+      case 'n': cur.data[write++] = '\n'; break;
+      case 'r': cur.data[write++] = '\r'; break;
+      case 't': cur.data[write++] = '\t'; break;
+      case 'u': {
+        uint32_t cp;
+        if (!readHex4(cur, cp)) {
+          return PARSE_BAD_STRING;
+        }
+        if (cp >= 0xD800 && cp <= 0xDBFF) {
+          uint32_t low;
+          if (cur.end - cur.pos < 6 || cur.data[cur.pos] != '\\' || cur.data[cur.pos + 1] != 'u') {
+            return PARSE_BAD_STRING;
+          }
+          cur.pos += 2;
+          if (!readHex4(cur, low) || low < 0xDC00 || low > 0xDFFF) {
+            return PARSE_BAD_STRING;
+          }
+          cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+          return PARSE_BAD_STRING;
+        }
+        write += encodeUtf8(cur.data + write, cp);
+        break;
+      }
+      default:
+        return PARSE_BAD_STRING;
+    }
+  }
+
+  size_t length = write - start;
+  if (length > 0xFFFF) {
+    return PARSE_STRING_TOO_LONG;
+  }
+  out.ptr = (const char *)(cur.data + start);
+  out.len = (uint16_t)length;
+  return PARSE_OK;
+}
+
+// Validates a JSON number and returns its text span
+ParseError scanNumber(Cursor &cur, StrSlice &text, bool &isInteger) {
+  size_t start = cur.pos;
+  isInteger = true;
+
+  if (!cur.atEnd() && cur.peek() == '-') {
+    cur.pos++;
+  }
+  if (cur.atEnd()) {
+    return PARSE_BAD_NUMBER;
+  }
+  if (cur.peek() == '0') {
+    cur.pos++;
+  } else if (cur.peek() >= '1' && cur.peek() <= '9') {
+    while (!cur.atEnd() && cur.peek() >= '0' && cur.peek() <= '9') cur.pos++;
+  } else {
+    return PARSE_BAD_NUMBER;
+  }
+
+  if (!cur.atEnd() && cur.peek() == '.') {
+    isInteger = false;
+    cur.pos++;
+    if (cur.atEnd() || cur.peek() < '0' || cur.peek() > '9') {
+      return PARSE_BAD_NUMBER;
+    }
+    while (!cur.atEnd() && cur.peek() >= '0' && cur.peek() <= '9') cur.pos++;
+  }
+
+  if (!cur.atEnd() && (cur.peek() == 'e' || cur.peek() == 'E')) {
+    isInteger = false;
+    cur.pos++;
+    if (!cur.atEnd() && (cur.peek() == '+' || cur.peek() == '-')) {
+      cur.pos++;
+    }
+    if (cur.atEnd() || cur.peek() < '0' || cur.peek() > '9') {
+      return PARSE_BAD_NUMBER;
+    }
+    while (!cur.atEnd() && cur.peek() >= '0' && cur.peek() <= '9') cur.pos++;
+  }
+
+  text.ptr = (const char *)(cur.data + start);
+  text.len = (uint16_t)(cur.pos - start);
+  return PARSE_OK;
+}
+
+ParseError parseInt(Cursor &cur, int32_t &value) {
+  StrSlice text;
+  bool isInteger;
+  ParseError err = scanNumber(cur, text, isInteger);
+  if (err != PARSE_OK) {
+    return err;
+  }
+  if (!isInteger) {
+    return PARSE_WRONG_TYPE;
+  }
+
+  bool negative = text.ptr[0] == '-';
+  int64_t result = 0;
+  for (uint16_t i = negative ? 1 : 0; i < text.len; i++) {
+    result = result * 10 + (text.ptr[i] - '0');
+    if (result > INT32_MAX) {
+      return PARSE_BAD_NUMBER;
+    }
+  }
+  value = (int32_t)(negative ? -result : result);
+  return PARSE_OK;
+}
+
+ParseError parseFloat(Cursor &cur, float &value) {
+  StrSlice text;
+  bool isInteger;
+  ParseError err = scanNumber(cur, text, isInteger);
+  if (err != PARSE_OK) {
+    return err;
+  }
+
+  // The span is already validated, so a simple accumulation is enough for
+  // the handful of gains we accept.
+  const char *p = text.ptr;
+  const char *end = text.ptr + text.len;
+  bool negative = (*p == '-');
+  if (negative) p++;
+
+  float result = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    result = result * 10 + (*p++ - '0');
+  }
+  if (p < end && *p == '.') {
+    p++;
+    float scale = 0.1f;
+    while (p < end && *p >= '0' && *p <= '9') {
+      result += (*p++ - '0') * scale;
+      scale *= 0.1f;
+    }
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    bool negExp = (*p == '-');
+    if (*p == '+' || *p == '-') p++;
+    int exponent = 0;
+    while (p < end && exponent < 100) {
+      exponent = exponent * 10 + (*p++ - '0');
+    }
+    while (exponent-- > 0) {
+      result = negExp ? result / 10 : result * 10;
+    }
+  }
+  value = negative ? -result : result;
+  return PARSE_OK;
+}
+
+ParseError expectLiteral(Cursor &cur, const char *literal) {
+  size_t n = strlen(literal);
+  if (cur.end - cur.pos < n || memcmp(cur.data + cur.pos, literal, n) != 0) {
+    return PARSE_BAD_LITERAL;
+  }
+  cur.pos += n;
+  return PARSE_OK;
+}
+
+ParseError skipValue(Cursor &cur, int depth);
+
+ParseError skipContainer(Cursor &cur, int depth, bool isObject) {
+  if (depth >= COMMAND_MAX_DEPTH) {
+    return PARSE_TOO_DEEP;
+  }
+  uint8_t close = isObject ? '}' : ']';
+  cur.pos++;
+  cur.skipWhitespace();
+  if (!cur.atEnd() && cur.peek() == close) {
+    cur.pos++;
+    return PARSE_OK;
+  }
+
+  while (true) {
+    ParseError err;
+    if (isObject) {
+      StrSlice key;
+      cur.skipWhitespace();
+      if (cur.atEnd() || cur.peek() != '"') {
+        return PARSE_EXPECTED_KEY;
+      }
+      if ((err = parseString(cur, key)) != PARSE_OK) {
+        return err;
+      }
+      cur.skipWhitespace();
+      if (cur.atEnd() || cur.peek() != ':') {
+        return PARSE_EXPECTED_COLON;
+      }
+      cur.pos++;
+    }
+    if ((err = skipValue(cur, depth + 1)) != PARSE_OK) {
+      return err;
+    }
+    cur.skipWhitespace();
+    if (cur.atEnd()) {
+      return PARSE_EXPECTED_COMMA;
+    }
+    uint8_t c = cur.data[cur.pos++];
+    if (c == close) {
+      return PARSE_OK;
+    }
+    if (c != ',') {
+      return PARSE_EXPECTED_COMMA;
+    }
+  }
+}
+
+ParseError skipValue(Cursor &cur, int depth) {
+  cur.skipWhitespace();
+  if (cur.atEnd()) {
+    return PARSE_WRONG_TYPE;
+  }
+
+  StrSlice ignored;
+  bool isInteger;
+  switch (cur.peek()) {
+    case '"': return parseString(cur, ignored);
+    case '{': return skipContainer(cur, depth, true);
+    case '[': return skipContainer(cur, depth, false);
+    case 't': return expectLiteral(cur, "true");
+    case 'f': return expectLiteral(cur, "false");
+    case 'n': return expectLiteral(cur, "null");
+    default: return scanNumber(cur, ignored, isInteger);
+  }
+}
+
+ParseError parseSchemaString(Cursor &cur, StrSlice &out) {
+  if (cur.atEnd() || cur.peek() != '"') {
+    return PARSE_WRONG_TYPE;
+  }
+  ParseError err = parseString(cur, out);
+  if (err == PARSE_OK && out.len > COMMAND_MAX_STRING_LEN) {
+    return PARSE_STRING_TOO_LONG;
+  }
+  return err;
+}
+
+// Minutes after midnight: an integer in [0, COMMAND_MINUTES_PER_DAY)
+ParseError checkMinute(int32_t minute, uint16_t &out) {
+  if (minute < 0 || minute >= COMMAND_MINUTES_PER_DAY) {
+    return PARSE_BAD_NUMBER;
+  }
+  out = (uint16_t)minute;
+  return PARSE_OK;
+}
+
+// Array of up to COMMAND_MAX_TIMES dose times
+ParseError parseTimes(Cursor &cur, Command &cmd) {
+  if (cur.atEnd() || cur.peek() != '[') {
+    return PARSE_WRONG_TYPE;
+  }
+  cur.pos++;
+  cur.skipWhitespace();
+  if (!cur.atEnd() && cur.peek() == ']') {
+    cur.pos++;
+    return PARSE_OK;
+  }
+  while (true) {
+    if (cmd.timeCount >= COMMAND_MAX_TIMES) {
+      return PARSE_TOO_MANY_ITEMS;
+    }
+    int32_t minute;
+    cur.skipWhitespace();
+    ParseError err = parseInt(cur, minute);
+    if (err == PARSE_OK) {
+      err = checkMinute(minute, cmd.times[cmd.timeCount++]);
+    }
+    if (err != PARSE_OK) {
+      return err;
+    }
+    cur.skipWhitespace();
+    if (cur.atEnd()) {
+      return PARSE_EXPECTED_COMMA;
+    }
+    uint8_t c = cur.data[cur.pos++];
+    if (c == ']') {
+      return PARSE_OK;
+    }
+    if (c != ',') {
+      return PARSE_EXPECTED_COMMA;
+    }
+  }
+}
+
+ParseError parseField(Cursor &cur, const StrSlice &key, Command &cmd) {
+  // Dispatch on length first so most keys are matched with a single memcmp
+  switch (key.len) {
+    case 2:
+      if (key.equals("kp")) {
+        cmd.present |= FIELD_KP;
+        return parseFloat(cur, cmd.kp);
+      }
+      if (key.equals("ki")) {
+        cmd.present |= FIELD_KI;
+        return parseFloat(cur, cmd.ki);
+      }
+      break;
+    case 5:
+      if (key.equals("times")) {
+        cmd.present |= FIELD_TIMES;
+        cmd.timeCount = 0;
+        return parseTimes(cur, cmd);
+      }
+      if (key.equals("grace")) {
+        cmd.present |= FIELD_GRACE;
+        return parseInt(cur, cmd.grace);
+      }
+      break;
+    case 6:
+      if (key.equals("format")) {
+        cmd.present |= FIELD_FORMAT;
+        return parseSchemaString(cur, cmd.format);
+      }
+      break;
+    case 7:
+      if (key.equals("command")) {
+        cmd.present |= FIELD_COMMAND;
+        return parseSchemaString(cur, cmd.command);
+      }
+      break;
+    case 8:
+      if (key.equals("quantity")) {
+        cmd.present |= FIELD_QUANTITY;
+        return parseInt(cur, cmd.quantity);
+      }
+      break;
+    case 9:
+      if (key.equals("bulkSpeed")) {
+        cmd.present |= FIELD_BULK_SPEED;
+        return parseInt(cur, cmd.bulkSpeed);
+      }
+      break;
+    case 10:
+      if (key.equals("creepSpeed")) {
+        cmd.present |= FIELD_CREEP_SPEED;
+        return parseInt(cur, cmd.creepSpeed);
+      }
+      if (key.equals("taperPills")) {
+        cmd.present |= FIELD_TAPER_PILLS;
+        return parseInt(cur, cmd.taperPills);
+      }
+      if (key.equals("creepPills")) {
+        cmd.present |= FIELD_CREEP_PILLS;
+        return parseInt(cur, cmd.creepPills);
+      }
+      break;
+    case 11:
+      if (key.equals("medicine_id")) {
+        cmd.present |= FIELD_MEDICINE_ID;
+        if (!cur.atEnd() && cur.peek() == '"') {
+          return parseSchemaString(cur, cmd.medicineId);
+        }
+        bool isInteger;
+        return scanNumber(cur, cmd.medicineId, isInteger);
+      }
+      break;
+    case 13:
+      if (key.equals("medicine_name")) {
+        cmd.present |= FIELD_MEDICINE_NAME;
+        return parseSchemaString(cur, cmd.medicineName);
+      }
+      break;
+    case 15:
+      if (key.equals("prescription_id")) {
+        cmd.present |= FIELD_PRESCRIPTION_ID;
+        return parseSchemaString(cur, cmd.prescriptionId);
+      }
+      break;
+  }
+  return skipValue(cur, 1);
+}
+
+
+// --- MessagePack ---
+
+bool isMsgpackMap(uint8_t b) {
+  return (b & 0xF0) == 0x80 || b == 0xDE || b == 0xDF;
+}
+
+// Big-endian unsigned of 'width' bytes at the cursor
+bool readBigEndian(Cursor &cur, uint8_t width, uint64_t &value) {
+  if (cur.end - cur.pos < width) {
+    return false;
+  }
+  value = 0;
+  for (uint8_t i = 0; i < width; i++) {
+    value = value << 8 | cur.data[cur.pos++];
+  }
+  return true;
+}
+
+// Length of a str/bin/array/map from its type byte (already consumed).
+// 'sized' is the first type code with a length field: str8/bin8 (then 16,
+// 32 bits) or array16/map16 (then 32 bits).
+bool readLength(Cursor &cur, uint8_t type, uint8_t fixMask, uint8_t fixBase,
+                uint8_t sized, uint32_t &length) {
+  uint64_t value;
+  if ((type & ~fixMask) == fixBase) {
+    length = type & fixMask;
+    return true;
+  }
+  bool from16 = sized == 0xDC || sized == 0xDE;
+  uint8_t width = (uint8_t)((from16 ? 2 : 1) << (type - sized));
+  if (!readBigEndian(cur, width, value)) {
+    return false;
+  }
+  length = (uint32_t)value;
+  return true;
+}
+
+ParseError msgpackString(Cursor &cur, StrSlice &out) {
+  if (cur.atEnd()) {
+    return PARSE_BAD_STRING;
+  }
+  uint8_t type = cur.data[cur.pos];
+  if ((type & 0xE0) != 0xA0 && (type < 0xD9 || type > 0xDB)) {
+    return PARSE_WRONG_TYPE;
+  }
+  cur.pos++;
+  uint32_t length;
+  if (!readLength(cur, type, 0x1F, 0xA0, 0xD9, length) || cur.end - cur.pos < length) {
+    return PARSE_BAD_STRING;
+  }
+  if (length > COMMAND_MAX_STRING_LEN) {
+    return PARSE_STRING_TOO_LONG;
+  }
+  out.ptr = (const char *)(cur.data + cur.pos);
+  out.len = (uint16_t)length;
+  cur.pos += length;
+  return PARSE_OK;
+}
+
+// Any numeric type; isInteger is false for float32/float64
+ParseError msgpackNumber(Cursor &cur, int64_t &integer, double &real, bool &isInteger) {
+  if (cur.atEnd()) {
+    return PARSE_BAD_NUMBER;
+  }
+  uint8_t type = cur.data[cur.pos++];
+  uint64_t raw;
+  isInteger = true;
+  if (type <= 0x7F) {
+    integer = type;
+  } else if (type >= 0xE0) {
+    integer = (int8_t)type;
+  } else if (type >= 0xCC && type <= 0xCF) {
+    if (!readBigEndian(cur, (uint8_t)(1 << (type - 0xCC)), raw) || raw > INT64_MAX) {
+      return PARSE_BAD_NUMBER;
+    }
+    integer = (int64_t)raw;
+  } else if (type >= 0xD0 && type <= 0xD3) {
+    uint8_t width = (uint8_t)(1 << (type - 0xD0));
+    if (!readBigEndian(cur, width, raw)) {
+      return PARSE_BAD_NUMBER;
+    }
+    // Sign-extend
+    integer = width == 8 ? (int64_t)raw : (int64_t)(raw << (64 - 8 * width)) >> (64 - 8 * width);
+  } else if (type == 0xCA) {
+    float f;
+    if (!readBigEndian(cur, 4, raw)) {
+      return PARSE_BAD_NUMBER;
+    }
+    uint32_t bits = (uint32_t)raw;
+    memcpy(&f, &bits, sizeof(f));
+    real = f;
+    isInteger = false;
+  } else if (type == 0xCB) {
+    if (!readBigEndian(cur, 8, raw)) {
+      return PARSE_BAD_NUMBER;
+    }
+    memcpy(&real, &raw, sizeof(real));
+    isInteger = false;
+  } else {
+    cur.pos--;
+    return PARSE_WRONG_TYPE;
+  }
+  if (isInteger) {
+    real = (double)integer;
+  }
+  return PARSE_OK;
+}
+
+ParseError msgpackInt(Cursor &cur, int32_t &value) {
+  int64_t integer;
+  double real;
+  bool isInteger;
+  ParseError err = msgpackNumber(cur, integer, real, isInteger);
+  if (err != PARSE_OK) {
+    return err;
+  }
+  if (!isInteger) {
+    return PARSE_WRONG_TYPE;
+  }
+  if (integer > INT32_MAX || integer < INT32_MIN) {
+    return PARSE_BAD_NUMBER;
+  }
+  value = (int32_t)integer;
+  return PARSE_OK;
+}
+
+ParseError msgpackFloat(Cursor &cur, float &value) {
+  int64_t integer;
+  double real;
+  bool isInteger;
+  ParseError err = msgpackNumber(cur, integer, real, isInteger);
+  if (err == PARSE_OK) {
+    value = (float)real;
+  }
+  return err;
+}
+
+ParseError msgpackTimes(Cursor &cur, Command &cmd) {
+  if (cur.atEnd()) {
+    return PARSE_WRONG_TYPE;
+  }
+  uint8_t type = cur.data[cur.pos];
+  if ((type & 0xF0) != 0x90 && type != 0xDC && type != 0xDD) {
+    return PARSE_WRONG_TYPE;
+  }
+  cur.pos++;
+  uint32_t count;
+  if (!readLength(cur, type, 0x0F, 0x90, 0xDC, count)) {
+    return PARSE_WRONG_TYPE;
+  }
+  if (count > COMMAND_MAX_TIMES) {
+    return PARSE_TOO_MANY_ITEMS;
+  }
+  cmd.timeCount = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    int32_t minute;
+    ParseError err = msgpackInt(cur, minute);
+    if (err == PARSE_OK) {
+      err = checkMinute(minute, cmd.times[cmd.timeCount++]);
+    }
+    if (err != PARSE_OK) {
+      return err;
+    }
+  }
+  return PARSE_OK;
+}
+
+ParseError msgpackSkip(Cursor &cur, int depth) {
+  if (cur.atEnd()) {
+    return PARSE_WRONG_TYPE;
+  }
+  uint8_t type = cur.data[cur.pos];
+  uint32_t length;
+  uint32_t items = 0;
+  uint64_t raw;
+
+  if (type <= 0x7F || type >= 0xE0 || type == 0xC0 || type == 0xC2 || type == 0xC3) {
+    cur.pos++;
+    return PARSE_OK;
+  }
+  if ((type >= 0xCA && type <= 0xD3)) {
+    int64_t integer;
+    double real;
+    bool isInteger;
+    return msgpackNumber(cur, integer, real, isInteger);
+  }
+  cur.pos++;
+  if ((type & 0xE0) == 0xA0 || (type >= 0xD9 && type <= 0xDB)) {
+    if (!readLength(cur, type, 0x1F, 0xA0, 0xD9, length)) {
+      return PARSE_BAD_STRING;
+    }
+  } else if (type >= 0xC4 && type <= 0xC6) {
+    if (!readLength(cur, type, 0x00, 0xFF, 0xC4, length)) {
+      return PARSE_BAD_STRING;
+    }
+  } else if (type >= 0xD4 && type <= 0xD8) {
+    length = 1 + (1u << (type - 0xD4));    // fixext: type byte + data
+  } else if (type >= 0xC7 && type <= 0xC9) {
+    if (!readBigEndian(cur, (uint8_t)(1 << (type - 0xC7)), raw)) {
+      return PARSE_BAD_STRING;
+    }
+    length = 1 + (uint32_t)raw;
+  } else if ((type & 0xF0) == 0x90 || type == 0xDC || type == 0xDD) {
+    if (!readLength(cur, type, 0x0F, 0x90, 0xDC, items)) {
+      return PARSE_WRONG_TYPE;
+    }
+    length = 0;
+  } else if (isMsgpackMap(type)) {
+    if (!readLength(cur, type, 0x0F, 0x80, 0xDE, items)) {
+      return PARSE_WRONG_TYPE;
+    }
+    items *= 2;
+    length = 0;
+  } else {
+    return PARSE_WRONG_TYPE;   // 0xC1 is never used
+  }
+
+  if (cur.end - cur.pos < length) {
+    return PARSE_BAD_STRING;
+  }
+  cur.pos += length;
+  if (items > 0) {
+    if (depth >= COMMAND_MAX_DEPTH) {
+      return PARSE_TOO_DEEP;
+    }
+    for (uint32_t i = 0; i < items; i++) {
+      ParseError err = msgpackSkip(cur, depth + 1);
+      if (err != PARSE_OK) {
+        return err;
+      }
+    }
+  }
+  return PARSE_OK;
+}
+
+#define WIRE_KEY_MATCH(id, code, name) if (key.equals(name)) return id;
+// Generic encoders may key the map by name instead of code
+int wireKeyByName(const StrSlice &key) {
+  WIRE_KEYS(WIRE_KEY_MATCH)
+  return -1;
+}
+#undef WIRE_KEY_MATCH
+
+ParseError msgpackField(Cursor &cur, int key, Command &cmd) {
+  switch (key) {
+    case WIRE_KEY_COMMAND:
+      cmd.present |= FIELD_COMMAND;
+      return msgpackString(cur, cmd.command);
+    case WIRE_KEY_QUANTITY:
+      cmd.present |= FIELD_QUANTITY;
+      return msgpackInt(cur, cmd.quantity);
+    case WIRE_KEY_MEDICINE_NAME:
+      cmd.present |= FIELD_MEDICINE_NAME;
+      return msgpackString(cur, cmd.medicineName);
+    case WIRE_KEY_MEDICINE_ID:
+      cmd.present |= FIELD_MEDICINE_ID;
+      if (!cur.atEnd() && ((cur.peek() & 0xE0) == 0xA0 || (cur.peek() >= 0xD9 && cur.peek() <= 0xDB))) {
+        return msgpackString(cur, cmd.medicineId);
+      }
+      return msgpackSkip(cur, 1);
+    case WIRE_KEY_PRESCRIPTION_ID:
+      cmd.present |= FIELD_PRESCRIPTION_ID;
+      return msgpackString(cur, cmd.prescriptionId);
+    case WIRE_KEY_BULK_SPEED:
+      cmd.present |= FIELD_BULK_SPEED;
+      return msgpackInt(cur, cmd.bulkSpeed);
+    case WIRE_KEY_CREEP_SPEED:
+      cmd.present |= FIELD_CREEP_SPEED;
+      return msgpackInt(cur, cmd.creepSpeed);
+    case WIRE_KEY_TAPER_PILLS:
+      cmd.present |= FIELD_TAPER_PILLS;
+      return msgpackInt(cur, cmd.taperPills);
+    case WIRE_KEY_CREEP_PILLS:
+      cmd.present |= FIELD_CREEP_PILLS;
+      return msgpackInt(cur, cmd.creepPills);
+    case WIRE_KEY_KP:
+      cmd.present |= FIELD_KP;
+      return msgpackFloat(cur, cmd.kp);
+    case WIRE_KEY_KI:
+      cmd.present |= FIELD_KI;
+      return msgpackFloat(cur, cmd.ki);
+    case WIRE_KEY_FORMAT:
+      cmd.present |= FIELD_FORMAT;
+      return msgpackString(cur, cmd.format);
+    case WIRE_KEY_TIMES:
+      cmd.present |= FIELD_TIMES;
+      return msgpackTimes(cur, cmd);
+    case WIRE_KEY_GRACE:
+      cmd.present |= FIELD_GRACE;
+      return msgpackInt(cur, cmd.grace);
+  }
+  return msgpackSkip(cur, 1);
+}
+
+ParseError parseMsgpack(Cursor &cur, Command &cmd) {
+  uint8_t type = cur.data[cur.pos++];
+  uint32_t count;
+  if (!readLength(cur, type, 0x0F, 0x80, 0xDE, count)) {
+    return PARSE_EXPECTED_OBJECT;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (cur.atEnd()) {
+      return PARSE_EXPECTED_KEY;
+    }
+    int key;
+    uint8_t k = cur.peek();
+    if (k <= 0x7F) {
+      key = k;
+      cur.pos++;
+    } else if ((k & 0xE0) == 0xA0 || (k >= 0xD9 && k <= 0xDB)) {
+      StrSlice name;
+      ParseError err = msgpackString(cur, name);
+      if (err != PARSE_OK) {
+        return err == PARSE_STRING_TOO_LONG ? PARSE_EXPECTED_KEY : err;
+      }
+      key = wireKeyByName(name);
+    } else {
+      return PARSE_EXPECTED_KEY;
+    }
+    ParseError err = msgpackField(cur, key, cmd);
+    if (err != PARSE_OK) {
+      return err;
+    }
+  }
+  return PARSE_OK;
+}
+
+}  // namespace
+
+ParseError parseCommand(uint8_t *data, size_t length, Command &cmd, size_t *errorOffset) {
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.type = CMD_NONE;
+  cmd.encoding = WIRE_JSON;
+
+  Cursor cur = { data, 0, length };
+  ParseError err = PARSE_OK;
+
+  cur.skipWhitespace();
+  if (cur.atEnd()) {
+    err = PARSE_EMPTY;
+  } else if (isMsgpackMap(cur.peek())) {
+    cmd.encoding = WIRE_MSGPACK;
+    err = parseMsgpack(cur, cmd);
+  } else if (cur.peek() != '{') {
+    err = PARSE_EXPECTED_OBJECT;
+  } else {
+    cur.pos++;
+    cur.skipWhitespace();
+    if (!cur.atEnd() && cur.peek() == '}') {
+      cur.pos++;
+    } else {
+      while (err == PARSE_OK) {
+        StrSlice key;
+        cur.skipWhitespace();
+        if (cur.atEnd() || cur.peek() != '"') {
+          err = PARSE_EXPECTED_KEY;
+          break;
+        }
+        if ((err = parseString(cur, key)) != PARSE_OK) {
+          break;
+        }
+        cur.skipWhitespace();
+        if (cur.atEnd() || cur.peek() != ':') {
+          err = PARSE_EXPECTED_COLON;
+          break;
+        }
+        cur.pos++;
+        cur.skipWhitespace();
+        if ((err = parseField(cur, key, cmd)) != PARSE_OK) {
+          break;
+        }
+        cur.skipWhitespace();
+        if (cur.atEnd()) {
+          err = PARSE_EXPECTED_COMMA;
+          break;
+        }
+        uint8_t c = cur.data[cur.pos++];
+        if (c == '}') {
+          break;
+        }
+        if (c != ',') {
+          err = PARSE_EXPECTED_COMMA;
+        }
+      }
+    }
+  }
+
+  if (err == PARSE_OK) {
+    if (cmd.encoding == WIRE_JSON) {
+      cur.skipWhitespace();
+    }
+    if (!cur.atEnd()) {
+      err = PARSE_TRAILING_DATA;
+    } else if (!cmd.has(FIELD_COMMAND)) {
+      err = PARSE_MISSING_COMMAND;
+    }
+  }
+
+  if (err != PARSE_OK) {
+    if (errorOffset) {
+      *errorOffset = cur.pos;
+    }
+    cmd.type = CMD_NONE;
+    return err;
+  }
+
+  if (cmd.command.equals("dispense")) {
+    cmd.type = CMD_DISPENSE;
+  } else if (cmd.command.equals("tune")) {
+    cmd.type = CMD_TUNE;
+  } else if (cmd.command.equals("trace")) {
+    cmd.type = CMD_TRACE;
+  } else if (cmd.command.equals("wire")) {
+    cmd.type = CMD_WIRE;
+  } else if (cmd.command.equals("ping")) {
+    cmd.type = CMD_PING;
+  } else if (cmd.command.equals("schedule")) {
+    cmd.type = CMD_SCHEDULE;
+  } else if (cmd.command.equals("unschedule")) {
+    cmd.type = CMD_UNSCHEDULE;
+  } else {
+    cmd.type = CMD_UNKNOWN;
+  }
+  return PARSE_OK;
+}
+
+const char *parseErrorName(ParseError error) {
+  switch (error) {
+    case PARSE_OK: return "ok";
+    case PARSE_EMPTY: return "empty";
+    case PARSE_EXPECTED_OBJECT: return "expected_object";
+    case PARSE_EXPECTED_KEY: return "expected_key";
+    case PARSE_EXPECTED_COLON: return "expected_colon";
+    case PARSE_EXPECTED_COMMA: return "expected_comma";
+    case PARSE_BAD_STRING: return "bad_string";
+    case PARSE_BAD_NUMBER: return "bad_number";
+    case PARSE_BAD_LITERAL: return "bad_literal";
+    case PARSE_WRONG_TYPE: return "wrong_type";
+    case PARSE_STRING_TOO_LONG: return "string_too_long";
+    case PARSE_TOO_DEEP: return "too_deep";
+    case PARSE_TOO_MANY_ITEMS: return "too_many_items";
+    case PARSE_TRAILING_DATA: return "trailing_data";
+    case PARSE_MISSING_COMMAND: return "missing_command";
+  }
+  return "unknown";
+}
@@ -0,0 +1,132 @@
+#ifndef COMMANDPARSER_H
+#define COMMANDPARSER_H
+
+/**
+ * CommandParser - Single-pass, in-place parser for the command envelope
+ *
+ * Parses the payload received on SUBSCRIBE_TOPIC directly inside the MQTT
+ * client's buffer. String fields are returned as slices pointing into that
+ * buffer (escape sequences are decoded in place), so no heap, no VLAs and
+ * no copies are involved. Any valid JSON object is accepted regardless of
+ * whitespace or key order; unknown keys (including nested objects/arrays)
+ * are skipped.
+ *
+ * A payload starting with a MessagePack map header is parsed as MessagePack
+ * instead: keys are WireSchema.h codes (or their names as strings), values
+ * are read in their binary form without any number parsing.
+ *
+ * The parser has no Arduino dependencies so it can also be built on the
+ * host (see tools/bench/).
+ *
+ * Slices are only valid until the MQTT client reuses its buffer, i.e. for
+ * the duration of the message callback.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "WireFormat.h"
+
+#define COMMAND_MAX_STRING_LEN 64  // medicine_name, prescription_id, ...
+#define COMMAND_MAX_DEPTH 8        // Nesting allowed inside skipped values
+#define COMMAND_MAX_TIMES 8        // Dose times of one "schedule" command
+#define COMMAND_MINUTES_PER_DAY 1440
+
+// View into the parsed buffer; not NUL-terminated
+struct StrSlice {
+  const char *ptr;
+  uint16_t len;
+
+  bool empty() const { return len == 0; }
+  bool equals(const char *literal) const;
+};
+
+enum CommandType {
+  CMD_NONE,
+  CMD_DISPENSE,
+  CMD_TUNE,
+  CMD_TRACE,
+  CMD_WIRE,
+  CMD_PING,
+  CMD_SCHEDULE,
+  CMD_UNSCHEDULE,
+  CMD_UNKNOWN
+};
+
+// Bits in Command::present
+enum CommandField : uint32_t {
+  FIELD_COMMAND = 1u << 0,
+  FIELD_QUANTITY = 1u << 1,
+  FIELD_MEDICINE_NAME = 1u << 2,
+  FIELD_MEDICINE_ID = 1u << 3,
+  FIELD_PRESCRIPTION_ID = 1u << 4,
+  FIELD_BULK_SPEED = 1u << 5,
+  FIELD_CREEP_SPEED = 1u << 6,
+  FIELD_TAPER_PILLS = 1u << 7,
+  FIELD_CREEP_PILLS = 1u << 8,
+  FIELD_KP = 1u << 9,
+  FIELD_KI = 1u << 10,
+  FIELD_FORMAT = 1u << 11,
+  FIELD_TIMES = 1u << 12,
+  FIELD_GRACE = 1u << 13,
+};
+
+// Fixed-size schema of every command the dispenser understands
+struct Command {
+  CommandType type;
+  WireFormat encoding;  // Format the command arrived in
+  uint32_t present;     // CommandField bits of the keys that were found
+
+  StrSlice command;
+  StrSlice medicineName;
+  StrSlice medicineId;      // Accepted as number or string, kept as text (empty for a MessagePack number)
+  StrSlice prescriptionId;
+  int32_t quantity;
+
+  // "tune" command
+  int32_t bulkSpeed;
+  int32_t creepSpeed;
+  int32_t taperPills;
+  int32_t creepPills;
+  float kp;
+  float ki;
+
+  // "wire" command
+  StrSlice format;
+
+  // "schedule" command: daily dose times in minutes after local midnight,
+  // and how late a dose may still be given
+  uint16_t times[COMMAND_MAX_TIMES];
+  uint8_t timeCount;
+  int32_t grace;
+
+  bool has(CommandField field) const { return (present & field) != 0; }
+};
+
+enum ParseError {
+  PARSE_OK,
+  PARSE_EMPTY,
+  PARSE_EXPECTED_OBJECT,
+  PARSE_EXPECTED_KEY,
+  PARSE_EXPECTED_COLON,
+  PARSE_EXPECTED_COMMA,
+  PARSE_BAD_STRING,
+  PARSE_BAD_NUMBER,
+  PARSE_BAD_LITERAL,
+  PARSE_WRONG_TYPE,
+  PARSE_STRING_TOO_LONG,
+  PARSE_TOO_DEEP,
+  PARSE_TOO_MANY_ITEMS,
+  PARSE_TRAILING_DATA,
+  PARSE_MISSING_COMMAND
+};
+
+/**
+ * Parse a command envelope in place. 'data' is modified (escape sequences
+ * are decoded inside string values). On error, 'errorOffset' (if given)
+ * receives the byte offset where parsing stopped.
+ */
+ParseError parseCommand(uint8_t *data, size_t length, Command &cmd, size_t *errorOffset = NULL);
+
+const char *parseErrorName(ParseError error);
+
+#endif
@@ -0,0 +1,184 @@
+#include "DispenseJournal.h"
+#include "Hal.h"
+#include "Trace.h"
+
+static const char *const SLOT_KEYS[2] = { "dj0", "dj1" };
+
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t length) {
+  // CRC-16/CCITT-FALSE, as in the outbox
+  for (size_t i = 0; i < length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+static void putLe(uint8_t *at, uint32_t value, uint8_t bytes) {
+  for (uint8_t i = 0; i < bytes; i++) {
+    at[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static uint32_t getLe(const uint8_t *at, uint8_t bytes) {
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < bytes; i++) {
+    value |= (uint32_t)at[i] << (8 * i);
+  }
+  return value;
+}
+
+void JournalWriter::putU8(uint8_t value) {
+  if (overflow || len >= size) {
+    overflow = true;
+    return;
+  }
+  buf[len++] = value;
+}
+
+void JournalWriter::putI16(int16_t value) {
+  putU8((uint8_t)value);
+  putU8((uint8_t)((uint16_t)value >> 8));
+}
+
+void JournalWriter::putU32(uint32_t value) {
+  putI16((int16_t)(uint16_t)value);
+  putI16((int16_t)(uint16_t)(value >> 16));
+}
+
+void JournalWriter::putString(const char *value) {
+  size_t length = strlen(value);
+  if (length > 255 || size - len < length + 1) {
+    overflow = true;
+    return;
+  }
+  buf[len++] = (uint8_t)length;
+  memcpy(buf + len, value, length);
+  len += length;
+}
+
+uint8_t JournalReader::getU8() {
+  if (!valid || pos >= size) {
+    valid = false;
+    return 0;
+  }
+  return buf[pos++];
+}
+
+int16_t JournalReader::getI16() {
+  uint8_t low = getU8();
+  uint8_t high = getU8();
+  return (int16_t)(low | (uint16_t)high << 8);
+}
+
+uint32_t JournalReader::getU32() {
+  uint16_t low = (uint16_t)getI16();
+  uint16_t high = (uint16_t)getI16();
+  return low | (uint32_t)high << 16;
+}
+
+void JournalReader::getString(char *dest, size_t destSize) {
+  size_t length = getU8();
+  if (!valid || size - pos < length) {
+    valid = false;
+    dest[0] = '\0';
+    return;
+  }
+  size_t kept = length < destSize - 1 ? length : destSize - 1;
+  memcpy(dest, buf + pos, kept);
+  dest[kept] = '\0';
+  pos += length;
+}
+
+DispenseJournal::DispenseJournal()
+    : pendingLength(0), dirty(false), transition(false), lastSubmitMs(0), sequence(0), writes(0), failures(0) {
+}
+
+// Reads one slot into record and checks it; seq/length are set when valid
+bool DispenseJournal::readSlot(uint8_t slot, uint32_t &seq, uint16_t &length) {
+  size_t stored = halStoreRead(SLOT_KEYS[slot], record, sizeof(record));
+  if (stored < JOURNAL_HEADER_BYTES || getLe(record, 2) != JOURNAL_MAGIC || record[2] != JOURNAL_VERSION) {
+    return false;
+  }
+  seq = getLe(record + 4, 4);
+  length = (uint16_t)getLe(record + 8, 2);
+  return (size_t)JOURNAL_HEADER_BYTES + length == stored &&
+         crc16(0xFFFF, record + JOURNAL_HEADER_BYTES, length) == getLe(record + 10, 2);
+}
+
+size_t DispenseJournal::load(const uint8_t **body) {
+  uint32_t seq[2] = { 0, 0 };
+  uint16_t length[2] = { 0, 0 };
+  bool valid[2];
+  valid[0] = readSlot(0, seq[0], length[0]);
+  valid[1] = readSlot(1, seq[1], length[1]);
+
+  int newest = -1;
+  if (valid[0] && valid[1]) {
+    newest = (int32_t)(seq[1] - seq[0]) > 0 ? 1 : 0;
+  } else if (valid[0] || valid[1]) {
+    newest = valid[0] ? 0 : 1;
+  }
+  if (newest < 0) {
+    return 0;
+  }
+  // record holds slot 1 now; slot 0 has to be read again
+  if (newest == 0) {
+    readSlot(0, seq[0], length[0]);
+  }
+  sequence = seq[newest];
+  *body = record + JOURNAL_HEADER_BYTES;
+  return length[newest];
+}
+
+void DispenseJournal::touch(bool orderTransition) {
+  dirty = true;
+  transition = transition || orderTransition;
+}
+
+uint8_t *DispenseJournal::claim(uint32_t nowMs, size_t *size) {
+  if (!dirty || nowMs - lastSubmitMs < (transition ? JOURNAL_BATCH_MS : JOURNAL_PROGRESS_MS) ||
+      pendingLength.load(std::memory_order_acquire) != 0) {
+    return NULL;
+  }
+  *size = sizeof(record) - JOURNAL_HEADER_BYTES;
+  return record + JOURNAL_HEADER_BYTES;
+}
+
+void DispenseJournal::submit(size_t length, uint32_t nowMs) {
+  dirty = false;
+  transition = false;
+  lastSubmitMs = nowMs;
+  if (length > 0) {
+    pendingLength.store((uint16_t)length, std::memory_order_release);
+  }
+}
+
+bool DispenseJournal::save() {
+  uint16_t length = pendingLength.load(std::memory_order_acquire);
+  if (length == 0) {
+    return false;
+  }
+
+  // The slot not holding the newest record is overwritten
+  uint32_t seq = sequence + 1;
+  putLe(record, JOURNAL_MAGIC, 2);
+  record[2] = JOURNAL_VERSION;
+  record[3] = 0;
+  putLe(record + 4, seq, 4);
+  putLe(record + 8, length, 2);
+  putLe(record + 10, crc16(0xFFFF, record + JOURNAL_HEADER_BYTES, length), 2);
+
+  TRACE(TRACE_JOURNAL_SAVE_BEGIN, length);
+  bool ok = halStoreWrite(SLOT_KEYS[seq & 1], record, JOURNAL_HEADER_BYTES + length);
+  TRACE(TRACE_JOURNAL_SAVE_END, ok);
+  if (ok) {
+    sequence = seq;
+    writes++;
+  } else {
+    failures++;
+  }
+  pendingLength.store(0, std::memory_order_release);
+  return ok;
+}
@@ -0,0 +1,127 @@
+#ifndef DISPENSEJOURNAL_H
+#define DISPENSEJOURNAL_H
+
+/**
+ * DispenseJournal - Crash-consistent record of the dispense state
+ *
+ * The orders queued or running on each channel, the running order's pill
+ * count and each turntable's inventory estimate otherwise live only in
+ * RAM. They are kept as one small record in two alternating flash slots
+ * (halStoreWrite keys "dj0"/"dj1"), each with a sequence number and a
+ * CRC: a reset while one slot is written leaves the other, older one
+ * intact, and load() returns the newest slot that checks out.
+ *
+ * Writes are batched and rate-bounded. The motion side touch()es the
+ * journal on every change; order transitions (queued, started, finished)
+ * are saved at most once per JOURNAL_BATCH_MS, so a burst of commands
+ * costs one write, and pill/inventory progress at most once per
+ * JOURNAL_PROGRESS_MS. Strings are length-prefixed, so a typical record
+ * is 100-200 B, under ten 32 B NVS entries. The simulator replay (about
+ * two saves per 30-pill order) puts a few hundred orders a day at around
+ * ten erases per page of the default NVS partition a day, decades inside
+ * its 100k-cycle endurance.
+ *
+ * The motion side only encodes into the hand-off buffer; the flash write
+ * runs on the network task (save()). The write still turns the flash
+ * cache off on both cores, for up to a page erase (tens of ms), and the
+ * motion task stalls for that long. The laser ISRs are IRAM-only (see
+ * halAttachEdgeInterrupt()) and keep timestamping edges into their ring,
+ * so the pills that pass are counted from their real edge times once the
+ * write is done. While a save is in flight the journal stays dirty and
+ * the next due pass encodes the newer state.
+ *
+ * Record: [magic u16][version u8][reserved u8][sequence u32][length u16][crc16 u16][body]
+ *
+ * Usage:
+ * 1. setup:   if (size_t n = journal.load(&body)) { JournalReader in(body, n); ... }
+ * 2. motion:  journal.touch(transition);
+ *             if (uint8_t *body = journal.claim(millis(), &size)) { JournalWriter out(body, size); ...; journal.submit(out.finish(), millis()); }
+ * 3. network: journal.save();
+ */
+
+#include <Arduino.h>
+#include <atomic>
+
+#define JOURNAL_MAGIC 0x4A44         // "DJ"
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_BYTES 12
+#define JOURNAL_RECORD_MAX 1280      // Header + body; fits every channel, ORDER_QUEUE_DEPTH orders and the executed ids
+#define JOURNAL_BATCH_MS 1000        // Order transitions: at most one save per this long
+#define JOURNAL_PROGRESS_MS 5000     // Pill counts and inventory: at most one save per this long
+
+// Little-endian field writer over the record body; finish() returns the
+// length, 0 when the body did not fit
+class JournalWriter {
+private:
+  uint8_t *buf;
+  size_t size;
+  size_t len;
+  bool overflow;
+
+public:
+  JournalWriter(uint8_t *buf, size_t size) : buf(buf), size(size), len(0), overflow(false) {}
+
+  void putU8(uint8_t value);
+  void putI16(int16_t value);
+  void putU32(uint32_t value);
+  void putString(const char *value);  // u8 length + bytes, up to 255
+  size_t finish() { return overflow ? 0 : len; }
+};
+
+// Reads what JournalWriter wrote; ok() turns false on a short or malformed body
+class JournalReader {
+private:
+  const uint8_t *buf;
+  size_t size;
+  size_t pos;
+  bool valid;
+
+public:
+  JournalReader(const uint8_t *buf, size_t size) : buf(buf), size(size), pos(0), valid(true) {}
+
+  uint8_t getU8();
+  int16_t getI16();
+  uint32_t getU32();
+  void getString(char *dest, size_t destSize);  // Truncated to destSize - 1, NUL-terminated
+  bool ok() const { return valid; }
+};
+
+class DispenseJournal {
+private:
+  uint8_t record[JOURNAL_RECORD_MAX];
+  std::atomic<uint16_t> pendingLength;  // Body handed to save(); 0 when the buffer is free
+
+  // Motion side
+  bool dirty;
+  bool transition;
+  uint32_t lastSubmitMs;
+
+  // Network side (and load() before the tasks start)
+  uint32_t sequence;  // Of the newest record on flash
+  uint32_t writes;
+  uint32_t failures;
+
+  bool readSlot(uint8_t slot, uint32_t &seq, uint16_t &length);
+
+public:
+  DispenseJournal();
+
+  // Newest valid record body, 0 if there is none; call once before the tasks start
+  size_t load(const uint8_t **body);
+
+  // Motion side: the state changed; transitions are saved sooner than progress
+  void touch(bool orderTransition);
+  // Motion side: body buffer to encode into when a save is due and the
+  // previous one was written, else NULL
+  uint8_t *claim(uint32_t nowMs, size_t *size);
+  void submit(size_t length, uint32_t nowMs);
+
+  // Network side: writes a submitted record to the older slot. Returns
+  // false when nothing was pending or the write failed.
+  bool save();
+
+  uint32_t getWrites() const { return writes; }
+  uint32_t getFailures() const { return failures; }
+};
+
+#endif
@@ -0,0 +1,181 @@
+#include "DispenseTelemetry.h"
+
+DispenseTelemetry::DispenseTelemetry() {
+  publisher = NULL;
+  channel = 0;
+  active = false;
+  order = 0;
+  prescriptionId[0] = '\0';
+  targetCount = 0;
+  pillCount = 0;
+  publishedCount = 0;
+  doubles = 0;
+  startMs = 0;
+  lastPublishMs = 0;
+  publishCount = 0;
+}
+
+bool DispenseTelemetry::publish(WireWriter &msg, const uint8_t *buf, bool durable) {
+  publishCount++;
+  size_t length = msg.finish();
+  return publisher && length > 0 ? publisher(buf, length, durable) : false;
+}
+
+// Order lifecycle messages are independent of the dispense being reported
+void DispenseTelemetry::queued(const char *id, int target, uint8_t position) {
+  uint8_t buf[TELEMETRY_MSG_LEN];
+  WireWriter msg(buf, sizeof(buf), wireStatusFormat());
+  msg.addString(WIRE_KEY_STATUS, "queued");
+  msg.addInt(WIRE_KEY_TARGET_COUNT, target);
+  msg.addInt(WIRE_KEY_POSITION, position);
+  msg.addString(WIRE_KEY_PRESCRIPTION_ID, id);
+  msg.addInt(WIRE_KEY_CHANNEL, channel);
+  publish(msg, buf, true);
+}
+
+void DispenseTelemetry::rejected(const char *id, const char *reason, bool onChannel) {
+  uint8_t buf[TELEMETRY_MSG_LEN];
+  WireWriter msg(buf, sizeof(buf), wireStatusFormat());
+  msg.addString(WIRE_KEY_STATUS, "rejected");
+  msg.addString(WIRE_KEY_ERROR, reason);
+  msg.addString(WIRE_KEY_PRESCRIPTION_ID, id);
+  if (onChannel) {
+    msg.addInt(WIRE_KEY_CHANNEL, channel);
+  }
+  publish(msg, buf, true);
+}
+
+void DispenseTelemetry::start(int target, const char *id, size_t idLength, uint8_t progressOrder, uint32_t nowMs) {
+  active = true;
+  order = progressOrder;
+  targetCount = target;
+  pillCount = 0;
+  publishedCount = 0;
+  doubles = 0;
+  startMs = nowMs;
+  lastPublishMs = nowMs;
+  publishCount = 0;
+
+  if (id == NULL) {
+    idLength = 0;
+  }
+  if (idLength > TELEMETRY_ID_LEN) {
+    idLength = TELEMETRY_ID_LEN;
+  }
+  if (idLength > 0) {
+    memcpy(prescriptionId, id, idLength);
+  }
+  prescriptionId[idLength] = '\0';
+
+  uint8_t buf[TELEMETRY_MSG_LEN];
+  WireWriter msg(buf, sizeof(buf), wireStatusFormat());
+  msg.addString(WIRE_KEY_STATUS, "dispensing_started");
+  msg.addInt(WIRE_KEY_TARGET_COUNT, targetCount);
+  if (prescriptionId[0] != '\0') {
+    msg.addString(WIRE_KEY_PRESCRIPTION_ID, prescriptionId);
+  }
+  msg.addInt(WIRE_KEY_CHANNEL, channel);
+  publish(msg, buf, true);
+}
+
+void DispenseTelemetry::progress(uint8_t progressOrder, int totalCount, uint32_t doubleCount, uint32_t nowMs) {
+  if (!active || progressOrder != order) {
+    return;
+  }
+
+  pillCount = totalCount;
+  doubles = doubleCount;
+  if (pillCount - publishedCount >= config.everyPills) {
+    publishProgress(nowMs);
+  }
+}
+
+void DispenseTelemetry::poll(uint32_t nowMs) {
+  if (active && pillCount != publishedCount && nowMs - lastPublishMs >= config.everyMs) {
+    publishProgress(nowMs);
+  }
+}
+
+void DispenseTelemetry::publishProgress(uint32_t nowMs) {
+  uint8_t buf[TELEMETRY_MSG_LEN];
+  WireWriter msg(buf, sizeof(buf), wireStatusFormat());
+  msg.addInt(WIRE_KEY_PILL_COUNT, pillCount);
+  msg.addInt(WIRE_KEY_TARGET_COUNT, targetCount);
+  if (doubles > 0) {
+    msg.addInt(WIRE_KEY_DOUBLES, doubles);
+  }
+  msg.addInt(WIRE_KEY_CHANNEL, channel);
+  publish(msg, buf, false);
+
+  publishedCount = pillCount;
+  lastPublishMs = nowMs;
+}
+
+void DispenseTelemetry::complete(const DispenseSummary &summary, uint32_t nowMs) {
+  if (!active) {
+    return;
+  }
+  pillCount = summary.pillCount;
+  doubles = summary.doubles;
+
+  uint8_t buf[TELEMETRY_MSG_LEN];
+  WireWriter msg(buf, sizeof(buf), wireStatusFormat());
+  msg.addInt(WIRE_KEY_PILL_COUNT, pillCount);
+  msg.addInt(WIRE_KEY_TARGET_COUNT, targetCount);
+  msg.addString(WIRE_KEY_STATUS, "complete");
+  msg.addInt(WIRE_KEY_OVERSHOOT, pillCount - targetCount);
+  msg.addInt(WIRE_KEY_DURATION_MS, nowMs - startMs);
+  msg.addInt(WIRE_KEY_INTERVAL_MIN_MS, summary.intervalMinUs / 1000);
+  msg.addInt(WIRE_KEY_INTERVAL_MEAN_MS, summary.intervalMeanUs / 1000);
+  msg.addInt(WIRE_KEY_INTERVAL_MAX_MS, summary.intervalMaxUs / 1000);
+  msg.addInt(WIRE_KEY_DOUBLES, doubles);
+  msg.addInt(WIRE_KEY_REJECTED, summary.rejected);
+  if (summary.jams > 0) {
+    msg.addInt(WIRE_KEY_JAMS, summary.jams);
+  }
+  if (prescriptionId[0] != '\0') {
+    msg.addString(WIRE_KEY_PRESCRIPTION_ID, prescriptionId);
+  }
+  msg.addInt(WIRE_KEY_CHANNEL, channel);
+  publish(msg, buf, true);
+
+  publishedCount = pillCount;
+  lastPublishMs = nowMs;
+  active = false;
+}
+
+void DispenseTelemetry::error(const char *reason, uint32_t nowMs) {
+  if (!active) {
+    return;
+  }
+
+  uint8_t buf[TELEMETRY_MSG_LEN];
+  WireWriter msg(buf, sizeof(buf), wireStatusFormat());
+  msg.addInt(WIRE_KEY_PILL_COUNT, pillCount);
+  msg.addInt(WIRE_KEY_TARGET_COUNT, targetCount);
+  msg.addString(WIRE_KEY_STATUS, "error");
+  msg.addString(WIRE_KEY_ERROR, reason);
+  msg.addInt(WIRE_KEY_DURATION_MS, nowMs - startMs);
+  if (prescriptionId[0] != '\0') {
+    msg.addString(WIRE_KEY_PRESCRIPTION_ID, prescriptionId);
+  }
+  msg.addInt(WIRE_KEY_CHANNEL, channel);
+  publish(msg, buf, true);
+
+  lastPublishMs = nowMs;
+  active = false;
+}
+
+void DispenseTelemetry::interrupted(const char *id, int target, int dispensed) {
+  uint8_t buf[TELEMETRY_MSG_LEN];
+  WireWriter msg(buf, sizeof(buf), wireStatusFormat());
+  msg.addInt(WIRE_KEY_PILL_COUNT, dispensed);
+  msg.addInt(WIRE_KEY_TARGET_COUNT, target);
+  msg.addString(WIRE_KEY_STATUS, "error");
+  msg.addString(WIRE_KEY_ERROR, "interrupted");
+  if (id[0] != '\0') {
+    msg.addString(WIRE_KEY_PRESCRIPTION_ID, id);
+  }
+  msg.addInt(WIRE_KEY_CHANNEL, channel);
+  publish(msg, buf, true);
+}
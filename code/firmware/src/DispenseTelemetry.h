@@ -0,0 +1,103 @@
+#ifndef DISPENSETELEMETRY_H
+#define DISPENSETELEMETRY_H
+
+/**
+ * DispenseTelemetry - Coalesced progress reporting for one dispense
+ *
+ * Instead of one publish per pill, progress is published every
+ * 'everyPills' pills or every 'everyMs' milliseconds, whichever comes
+ * first; the count is sampled from the motion side's DispenseProgress
+ * (TaskMessages.h), not fed pill by pill. Queue, start, complete and error
+ * transitions are always published immediately. Per-dispense statistics
+ * (pill interval min/mean/max, duration, overshoot), measured on the
+ * motion side, are sent with the completion message.
+ *
+ * There is one instance per dispenser channel; every message it sends
+ * carries "channel" so the channels can share the status topic. Messages
+ * are encoded in the device's status format (see WireFormat.h).
+ *
+ * Usage:
+ * 1. telemetry.setPublisher(fn);   // fn(payload, length, durable) publishes on PUBLISH_TOPIC
+ *    telemetry.setChannel(n);
+ * 2. telemetry.queued(...)         // on dispense command (or rejected(...))
+ *    telemetry.start(...)          // when the order starts running
+ * 3. telemetry.progress(...)       // every pass, with the channel's DispenseProgress
+ * 4. telemetry.poll(millis())      // every loop pass
+ * 5. telemetry.complete(...) or telemetry.error(...)
+ *
+ * interrupted(...) reports an order that was running when the device
+ * reset; it needs no preceding start().
+ */
+
+#include <Arduino.h>
+#include "WireFormat.h"
+
+#define TELEMETRY_ID_LEN 64
+#define TELEMETRY_MSG_LEN 320
+
+// 'durable' is set for start/complete/error transitions, which must not be
+// lost; progress updates are best-effort.
+typedef bool (*TelemetryPublishFn)(const uint8_t *payload, size_t length, bool durable);
+
+// Figures of a finished dispense, from EVENT_DISPENSE_COMPLETE
+struct DispenseSummary {
+  int pillCount;
+  uint32_t doubles;
+  uint32_t rejected;
+  uint16_t jams;
+  uint32_t intervalMinUs;   // 0 with fewer than two transits
+  uint32_t intervalMeanUs;
+  uint32_t intervalMaxUs;
+};
+
+struct TelemetryConfig {
+  uint16_t everyPills = 5;   // Publish progress after this many pills...
+  uint32_t everyMs = 1000;   // ...or after this long with unpublished progress
+};
+
+class DispenseTelemetry {
+private:
+  TelemetryConfig config;
+  TelemetryPublishFn publisher;
+  uint8_t channel;
+
+  bool active;
+  uint8_t order;          // DispenseProgress order number of the running dispense
+  char prescriptionId[TELEMETRY_ID_LEN + 1];
+  int targetCount;
+  int pillCount;
+  int publishedCount;
+  uint32_t doubles;
+  uint32_t startMs;
+  uint32_t lastPublishMs;
+
+  uint32_t publishCount;  // Messages sent for the current dispense
+
+  void publishProgress(uint32_t nowMs);
+  bool publish(WireWriter &msg, const uint8_t *buf, bool durable);
+
+public:
+  DispenseTelemetry();
+
+  void setPublisher(TelemetryPublishFn fn) { publisher = fn; }
+  void setChannel(uint8_t n) { channel = n; }
+  void setConfig(const TelemetryConfig &cfg) { config = cfg; }
+  const TelemetryConfig &getConfig() const { return config; }
+
+  void queued(const char *id, int target, uint8_t position);
+  // onChannel is false when the order could not be routed to any channel
+  void rejected(const char *id, const char *reason, bool onChannel);
+  void start(int target, const char *id, size_t idLength, uint8_t progressOrder, uint32_t nowMs);
+  // Sampled progress; ignored unless it belongs to the running dispense
+  void progress(uint8_t progressOrder, int totalCount, uint32_t doubleCount, uint32_t nowMs);
+  void poll(uint32_t nowMs);
+  void complete(const DispenseSummary &summary, uint32_t nowMs);
+  void error(const char *reason, uint32_t nowMs);
+  // dispensed is the last journaled count, a lower bound
+  void interrupted(const char *id, int target, int dispensed);
+
+  bool isActive() const { return active; }
+  uint32_t getPublishCount() const { return publishCount; }
+};
+
+#endif
@@ -0,0 +1,867 @@
+#include "Dispenser.h"
+#include "Hal.h"
+#include "MotorControl.h"
+#include "LaserModule.h"
+#include "PillDetector.h"
+#include "CommandParser.h"
+#include "RefillSequencer.h"
+#include "OrderQueue.h"
+#include "Channels.h"
+#include "DispenseJournal.h"
+#include "DoseSchedule.h"
+#include "Trace.h"
+
+#define MOTOR_UPDATE_INTERVAL_MS 10  // Speed control period; outputs are timed by MotionScheduler
+#define TURNTABLE_STARVED_MS 3000   // No pill for this long: the table is empty
+#define ORDER_GATE_SETTLE_MS 150    // Feeding stopped: pills in flight land and are counted before the gate closes
+#define ORDER_GATE_CLOSE_MS 40      // Gate travel before the next order opens it again
+#define ORDER_TIMEOUT_MS 180000     // A running order that takes longer fails
+
+MotionCommandQueue motionCommands;
+MotionEventQueue motionEvents;
+
+// Order queue figures for health reports (written by the motion side)
+static std::atomic<uint8_t> queueDepth{0};
+static std::atomic<uint32_t> queueOldestWaitMs{0};
+static LoopLatency queueMaxWaitMs;  // Worst wait of the orders started since the last take
+static std::atomic<bool> motionBusy{false};  // Orders queued/running or a refill in progress
+
+// --- Motion side state (owned by the motion task only) ---
+
+// One bin of the dispenser (see Channels.h)
+struct ChannelState {
+  uint8_t index;
+  const ChannelConfig *config;
+  int pillCount = 0;
+  int targetPillCount = 10;
+  bool dispensing = false;        // Feeding; the order stays open for the settle window after
+  const char *failReason = NULL;  // Why the open order failed, NULL if it reached its target
+  PillDetector pillDetector;
+  DispenseSpeedController speedController;
+  RefillSequencer refill;
+  N20Motor agitator;
+  Order *currentOrder = NULL;     // Owes the network task a completion or error event
+  uint8_t progressOrder = 0;      // Bumped by every order started (see DispenseProgress)
+  uint32_t doubles = 0;           // Transits of the running order counted as two pills
+  uint32_t lastPillUs = 0;        // Pill spacing of the running order, for its completion report
+  uint32_t intervalMinUs = 0;
+  uint32_t intervalMaxUs = 0;
+  uint64_t intervalSumUs = 0;
+  uint32_t intervalSamples = 0;
+  uint32_t stageAtMs = 0;         // Earliest start of the next queued order
+  int turntablePillCount = 10;    // Starting number of pills on the turntable
+  uint32_t lastFeedMs = 0;        // Last counted pill, dispense start or refill
+  unsigned long previousMillis = 0;
+};
+
+static ChannelState channels[CHANNEL_MAX];
+static DispenseProgress progress[CHANNEL_MAX];  // Read by the network task
+static OrderQueue orders;
+static DoseSchedule schedule;    // Network side
+static DispenseJournal journal;  // Encoded here, written by the network task
+
+// Journal body (see DispenseJournal.h):
+//   [channels u8] per channel: [turntable pills i16]
+//   [orders u8]   per order, oldest first: [channel u8][running u8][quantity i16]
+//                 [dispensed i16][prescription_id str][medicine_name str]
+//   [executed u8] per completed prescription_id, oldest first: [hash u32]
+// Records written before the executed ids were added end after the orders.
+static void saveJournal(uint32_t now) {
+  size_t size;
+  uint8_t *body = journal.claim(now, &size);
+  if (body == NULL) {
+    return;
+  }
+  JournalWriter out(body, size);
+  out.putU8(channelCount);
+  for (uint8_t i = 0; i < channelCount; i++) {
+    out.putI16((int16_t)constrain(channels[i].turntablePillCount, -32768, 32767));
+  }
+
+  Order *pending[ORDER_QUEUE_DEPTH];
+  uint8_t count = orders.pending(pending, ORDER_QUEUE_DEPTH);
+  out.putU8(count);
+  for (uint8_t i = 0; i < count; i++) {
+    const Order *order = pending[i];
+    bool running = order->state == ORDER_RUNNING;
+    out.putU8(order->channel);
+    out.putU8(running);
+    out.putI16((int16_t)constrain(order->quantity, 0, 32767));
+    out.putI16(running ? (int16_t)constrain(channels[order->channel].pillCount, 0, 32767) : 0);
+    out.putString(order->prescriptionId);
+    out.putString(order->medicineName);
+  }
+
+  uint32_t executed[ORDER_EXECUTED_IDS];
+  uint8_t executedCount = orders.executedIds(executed, ORDER_EXECUTED_IDS);
+  out.putU8(executedCount);
+  for (uint8_t i = 0; i < executedCount; i++) {
+    out.putU32(executed[i]);
+  }
+  journal.submit(out.finish(), now);
+}
+
+// Push an event to the network task; never blocks the motion task. The
+// ring always has room: see eventRoom()
+static void emitEvent(MotionEvent &event) {
+  event.timeMs = millis();
+  if (!motionEvents.push(event)) {
+    TRACE(TRACE_EVENT_DROPPED, event.type);
+  }
+}
+
+// Whether 'events' more fit in the event ring besides the completion or
+// error still owed by every running order. Commands are taken and orders
+// started only when they do, so no lifecycle event is ever dropped; while
+// the network task is held up they wait in their queues instead.
+static bool eventRoom(size_t events) {
+  size_t owed = 0;
+  for (uint8_t i = 0; i < channelCount; i++) {
+    owed += channels[i].currentOrder != NULL ? 1 : 0;
+  }
+  return motionEvents.size() + owed + events <= MOTION_EVENT_QUEUE_SIZE;
+}
+
+// Picks up where the last run stopped: turntable inventory estimates and
+// queued orders, which run again. The order that was running does not:
+// pills counted after its last journal save are unknown, so it is failed
+// and reported with the journaled count. Its id joins the executed ids, so
+// a redelivered command cannot dispense the full quantity again; the
+// remainder has to be ordered under a new prescription_id.
+static void restoreJournal() {
+  const uint8_t *body;
+  size_t length = journal.load(&body);
+  if (length == 0) {
+    return;
+  }
+
+  JournalReader in(body, length);
+  uint8_t savedChannels = in.getU8();
+  for (uint8_t i = 0; i < savedChannels; i++) {
+    int16_t pills = in.getI16();
+    if (i < channelCount && in.ok()) {
+      channels[i].turntablePillCount = pills;
+    }
+  }
+
+  uint8_t count = in.getU8();
+  uint8_t resumed = 0;
+  uint32_t interrupted[CHANNEL_MAX];
+  uint8_t interruptedCount = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t channel = in.getU8();
+    bool running = in.getU8() != 0;
+    int16_t quantity = in.getI16();
+    int16_t dispensed = in.getI16();
+    char id[ORDER_ID_LEN + 1];
+    char medicine[ORDER_ID_LEN + 1];
+    in.getString(id, sizeof(id));
+    in.getString(medicine, sizeof(medicine));
+    if (!in.ok()) {
+      break;
+    }
+
+    Order *order = NULL;
+    uint32_t now = millis();
+    if (channel >= channelCount || quantity <= 0 || orders.enqueue(id, medicine, quantity, channel, now, &order) != ORDER_ADMITTED) {
+      continue;
+    }
+    if (!running) {
+      resumed++;
+      continue;
+    }
+    orders.start(order, now);
+    orders.finish(order, false, dispensed, now);
+    if (order->prescriptionId[0] != '\0' && interruptedCount < CHANNEL_MAX) {
+      interrupted[interruptedCount++] = OrderQueue::idHash(order->prescriptionId);
+    }
+
+    MotionEvent event;
+    memset(&event, 0, sizeof(event));
+    event.type = EVENT_DISPENSE_INTERRUPTED;
+    event.channel = channel;
+    event.pillCount = dispensed;
+    event.targetCount = quantity;
+    memcpy(event.prescriptionId, order->prescriptionId, sizeof(event.prescriptionId));
+    emitEvent(event);
+    Serial.print("Order interrupted by reset on channel ");
+    Serial.print(channel);
+    Serial.print(", dispensed at least ");
+    Serial.println(dispensed);
+  }
+
+  // Redelivered commands for orders that already ran are still duplicates
+  uint8_t executedCount = in.getU8();
+  for (uint8_t i = 0; i < executedCount; i++) {
+    uint32_t hash = in.getU32();
+    if (!in.ok()) {
+      break;
+    }
+    orders.addExecuted(hash);
+  }
+  // Newest last, so a full ring of older ids does not push them out
+  for (uint8_t i = 0; i < interruptedCount; i++) {
+    orders.addExecuted(interrupted[i]);
+  }
+  Serial.print("Journal restored, orders resumed: ");
+  Serial.println(resumed);
+  // The interrupted order is no longer pending
+  journal.touch(true);
+}
+
+// First thing after reset: every actuator is driven to its safe state
+// (turntables stopped, gates closed, refill arms at rest) before the pill
+// sensors are armed. No delays, so this finishes within a few milliseconds.
+void dispenserSetup() {
+  for (uint8_t i = 0; i < channelCount; i++) {
+    ChannelState &ch = channels[i];
+    const ChannelConfig &config = channelTable[i];
+    ch.index = i;
+    ch.config = &config;
+
+    motorSetup(config.turntable);
+
+    // N20 agitator instead of stepper
+    setupN20Motor(ch.agitator, config.agitator, i);
+
+    halServoAttach(config.gateServo, config.gatePin, 500, 2400);
+    closeGate(config.gateServo);
+
+    ch.refill.setServo(config.refillServo);
+    halServoAttach(config.refillServo, config.refillPin, 500, 2400);
+    motionWrite(MOTION_OUT_SERVO, config.refillServo, ch.refill.getParams().restAngle);
+  }
+
+  // Applies the safe state above at once, then hands the outputs to the timer
+  motionSchedulerBegin();
+  restoreJournal();
+  schedule.load();
+
+  laserSetup();
+  for (uint8_t i = 0; i < channelCount; i++) {
+    laserAttach(i, channelTable[i].laserPin);
+  }
+  Serial.print("Channels: ");
+  Serial.println(channelCount);
+}
+
+static void copySlice(char *dest, size_t size, const StrSlice &slice) {
+  size_t length = slice.len < size - 1 ? slice.len : size - 1;
+  if (length > 0) {
+    memcpy(dest, slice.ptr, length);
+  }
+  dest[length] = '\0';
+}
+
+// "schedule"/"unschedule": the table is the network side's, so this is
+// applied here and confirmed at once; no motion command is involved
+static size_t submitSchedule(const Command &cmd, uint8_t *reply, size_t replySize) {
+  char prescriptionId[COMMAND_MAX_STRING_LEN + 1];
+  char medicineName[COMMAND_MAX_STRING_LEN + 1];
+  copySlice(prescriptionId, sizeof(prescriptionId), cmd.prescriptionId);
+  copySlice(medicineName, sizeof(medicineName), cmd.medicineName);
+
+  ScheduleResult result = SCHEDULE_OK;
+  const char *error = NULL;
+  if (cmd.type == CMD_UNSCHEDULE) {
+    if (cmd.has(FIELD_PRESCRIPTION_ID)) {
+      result = schedule.remove(prescriptionId);
+    } else {
+      schedule.clear();
+    }
+  } else if (channelForMedicine(medicineName) < 0) {
+    error = "unknown_medicine";
+  } else {
+    int32_t grace = cmd.has(FIELD_GRACE) ? cmd.grace : SCHEDULE_GRACE_DEFAULT_MIN;
+    grace = grace < 0 ? 0 : grace > COMMAND_MINUTES_PER_DAY ? COMMAND_MINUTES_PER_DAY : grace;
+    result = schedule.set(prescriptionId, medicineName, cmd.quantity, cmd.times,
+                          cmd.has(FIELD_TIMES) ? cmd.timeCount : 0, (uint16_t)grace);
+  }
+  if (result != SCHEDULE_OK) {
+    error = scheduleResultName(result);
+  }
+  if (error == NULL && !schedule.save()) {
+    error = "flash";
+  }
+
+  Serial.print("Schedule: ");
+  Serial.print(error ? error : "updated");
+  Serial.print(", dose times: ");
+  Serial.println(schedule.doseTimes());
+
+  WireWriter msg(reply, replySize, wireStatusFormat());
+  msg.addString(WIRE_KEY_STATUS, error ? "error" : cmd.type == CMD_SCHEDULE ? "scheduled" : "unscheduled");
+  if (error) {
+    msg.addString(WIRE_KEY_ERROR, error);
+  }
+  if (cmd.has(FIELD_PRESCRIPTION_ID)) {
+    msg.addString(WIRE_KEY_PRESCRIPTION_ID, prescriptionId);
+  }
+  return msg.finish();
+}
+
+// Runs on the network task. The payload is parsed in place inside the MQTT
+// client's buffer; see CommandParser.h. Accepted commands are handed to the
+// motion side through motionCommands.
+size_t dispenserSubmit(uint8_t *payload, size_t length, uint8_t *reply, size_t replySize) {
+  Command cmd;
+  size_t errorOffset = 0;
+  ParseError err = parseCommand(payload, length, cmd, &errorOffset);
+  if (err != PARSE_OK) {
+    Serial.print("Rejected command: ");
+    Serial.print(parseErrorName(err));
+    Serial.print(" at offset ");
+    Serial.println((unsigned)errorOffset);
+
+    WireWriter msg(reply, replySize, wireStatusFormat());
+    msg.addString(WIRE_KEY_STATUS, "error");
+    msg.addString(WIRE_KEY_ERROR, "parse");
+    msg.addString(WIRE_KEY_REASON, parseErrorName(err));
+    msg.addInt(WIRE_KEY_OFFSET, errorOffset);
+    return msg.finish();
+  }
+
+  MotionCommand motion;
+  memset(&motion, 0, sizeof(motion));
+
+  if (cmd.type == CMD_DISPENSE)
+  {
+    Serial.println("✓ Dispense command detected");
+    
+    motion.type = MOTION_DISPENSE;
+    if (cmd.has(FIELD_QUANTITY))
+    {
+      motion.quantity = cmd.quantity;
+      Serial.print("Target pill count set to: ");
+      Serial.println(motion.quantity);
+    }
+    else
+    {
+      Serial.println("Warning: No quantity specified, using default");
+      motion.quantity = 10;
+    }
+    copySlice(motion.medicineName, sizeof(motion.medicineName), cmd.medicineName);
+    copySlice(motion.prescriptionId, sizeof(motion.prescriptionId), cmd.prescriptionId);
+    
+    if (cmd.has(FIELD_MEDICINE_NAME)) {
+      Serial.print("Medicine: ");
+      Serial.println(motion.medicineName);
+    }
+  }
+  else if (cmd.type == CMD_TUNE)
+  {
+    motion.type = MOTION_TUNE;
+    motion.tuneFields = cmd.present;
+    motion.bulkSpeed = cmd.bulkSpeed;
+    motion.creepSpeed = cmd.creepSpeed;
+    motion.taperPills = cmd.taperPills;
+    motion.creepPills = cmd.creepPills;
+    motion.kp = cmd.kp;
+    motion.ki = cmd.ki;
+  }
+  else if (cmd.type == CMD_TRACE)
+  {
+    // Dumped by the network task; see Trace.h
+    traceRequestDump();
+    return 0;
+  }
+  else if (cmd.type == CMD_PING)
+  {
+    // No-op round trip, for measuring command latency
+    WireWriter msg(reply, replySize, wireStatusFormat());
+    msg.addString(WIRE_KEY_STATUS, "pong");
+    return msg.finish();
+  }
+  else if (cmd.type == CMD_SCHEDULE || cmd.type == CMD_UNSCHEDULE)
+  {
+    return submitSchedule(cmd, reply, replySize);
+  }
+  else if (cmd.type == CMD_WIRE)
+  {
+    // Status format of this device; confirmed in the new format
+    WireFormat format;
+    bool known = wireFormatFromName(cmd.format.ptr, cmd.format.len, format);
+    if (known) {
+      wireSetStatusFormat(format);
+    }
+    WireWriter msg(reply, replySize, wireStatusFormat());
+    msg.addString(WIRE_KEY_STATUS, known ? "wire" : "error");
+    if (!known) {
+      msg.addString(WIRE_KEY_ERROR, "unknown_format");
+    }
+    msg.addString(WIRE_KEY_FORMAT, wireFormatName(wireStatusFormat()));
+    return msg.finish();
+  }
+  else
+  {
+    Serial.println("No dispense command found in message");
+    Serial.println("Expected: \"command\":\"dispense\"");
+    return 0;
+  }
+
+  if (!motionCommands.push(motion)) {
+    Serial.println("Motion command queue full, command dropped");
+    WireWriter msg(reply, replySize, wireStatusFormat());
+    msg.addString(WIRE_KEY_STATUS, "error");
+    msg.addString(WIRE_KEY_ERROR, "busy");
+    return msg.finish();
+  }
+  return 0;
+}
+
+
+// Admit a dispense command to the order queue of the channel holding its
+// medicine. A running order is never touched; the new one starts after it.
+static void queueOrder(const MotionCommand &cmd) {
+  MotionEvent event;
+  memset(&event, 0, sizeof(event));
+  event.channel = MOTION_NO_CHANNEL;
+  event.targetCount = cmd.quantity;
+  memcpy(event.prescriptionId, cmd.prescriptionId, sizeof(event.prescriptionId));
+
+  if (cmd.quantity <= 0) {
+    event.type = EVENT_ORDER_REJECTED;
+    event.reason = "bad_quantity";
+    emitEvent(event);
+    return;
+  }
+
+  int channel = channelForMedicine(cmd.medicineName);
+  if (channel < 0) {
+    event.type = EVENT_ORDER_REJECTED;
+    event.reason = "unknown_medicine";
+    emitEvent(event);
+    return;
+  }
+
+  Order *order = NULL;
+  OrderAdmit admit = orders.enqueue(cmd.prescriptionId, cmd.medicineName, cmd.quantity, channel, millis(), &order);
+  event.channel = channel;
+  if (admit == ORDER_ADMITTED) {
+    journal.touch(true);
+    event.type = EVENT_ORDER_QUEUED;
+    event.position = orders.position(order);
+  } else {
+    event.type = EVENT_ORDER_REJECTED;
+    event.reason = admit == ORDER_DUPLICATE ? "duplicate" : "queue_full";
+  }
+  emitEvent(event);
+}
+
+static void startOrder(ChannelState &ch, Order *order) {
+  uint32_t now = millis();
+  orders.start(order, now);
+  queueMaxWaitMs.record(now - order->enqueuedMs);
+  ch.currentOrder = order;
+  ch.targetPillCount = order->quantity;
+
+  // Learned pill width is kept per medicine for double-pill detection
+  ch.pillDetector.beginDispense(order->medicineName, strlen(order->medicineName));
+  ch.pillCount = 0;
+  ch.doubles = 0;
+  ch.intervalMinUs = UINT32_MAX;
+  ch.intervalMaxUs = 0;
+  ch.intervalSumUs = 0;
+  ch.intervalSamples = 0;
+  ch.progressOrder++;
+  progress[ch.index].store(ch.progressOrder, 0, 0);
+  ch.speedController.begin(ch.targetPillCount, now);
+  ch.lastFeedMs = now;
+  ch.dispensing = true; 
+  journal.touch(true);
+  openGate(ch.config->gateServo);
+  TRACE(TRACE_ORDER_BEGIN, ch.index);
+
+  MotionEvent event;
+  memset(&event, 0, sizeof(event));
+  event.type = EVENT_DISPENSE_STARTED;
+  event.channel = ch.index;
+  event.order = ch.progressOrder;
+  event.targetCount = ch.targetPillCount;
+  memcpy(event.prescriptionId, order->prescriptionId, sizeof(event.prescriptionId));
+  emitEvent(event);
+}
+
+// Stop feeding. The order stays open, gate included, for
+// ORDER_GATE_SETTLE_MS: pills still in flight land in its cup and are
+// counted against it before closeOrder() reports it.
+static void stopFeeding(ChannelState &ch, const char *failReason) {
+  TRACE(TRACE_FEED_STOP, ch.index << 12 | constrain(ch.pillCount, 0, 0xfff));
+  stopMotor(ch.config->turntable);
+  stopN20Motor(ch.agitator); // Stop N20 motor instead of stepper
+  ch.speedController.stop();
+  ch.dispensing = false;
+  ch.failReason = failReason;
+  ch.stageAtMs = millis() + ORDER_GATE_SETTLE_MS;
+}
+
+// Report the order with every pill that reached its cup, overshoot
+// included, and free the channel for the next one
+static void closeOrder(ChannelState &ch) {
+  closeGate(ch.config->gateServo);
+  TRACE(TRACE_ORDER_END, ch.index);
+  uint32_t now = millis();
+
+  MotionEvent event;
+  memset(&event, 0, sizeof(event));
+  event.channel = ch.index;
+  event.pillCount = ch.pillCount;
+  event.targetCount = ch.targetPillCount;
+  if (ch.failReason == NULL) {
+    event.type = EVENT_DISPENSE_COMPLETE;
+    event.rejected = ch.pillDetector.getRejectedCount();
+    event.jams = ch.agitator.jams;
+    event.doubles = (uint16_t)ch.doubles;
+    if (ch.intervalSamples > 0) {
+      event.intervalMinUs = ch.intervalMinUs;
+      event.intervalMeanUs = (uint32_t)(ch.intervalSumUs / ch.intervalSamples);
+      event.intervalMaxUs = ch.intervalMaxUs;
+    }
+  } else {
+    event.type = EVENT_DISPENSE_ERROR;
+    event.reason = ch.failReason;
+  }
+  emitEvent(event);
+
+  orders.finish(ch.currentOrder, ch.failReason == NULL, ch.pillCount, now);
+  ch.currentOrder = NULL;
+  ch.pillDetector.endDispense();
+  ch.stageAtMs = now + ORDER_GATE_CLOSE_MS;
+  journal.touch(true);
+}
+
+// Runtime update of the dispense speed profile of every channel; omitted
+// keys keep their value
+static void applyTune(const MotionCommand &cmd) {
+  for (uint8_t i = 0; i < channelCount; i++) {
+    DispenseSpeedController &speedController = channels[i].speedController;
+    DispenseSpeedParams params = speedController.getParams();
+    if (cmd.tuneFields & FIELD_BULK_SPEED) params.bulkSpeed = cmd.bulkSpeed;
+    if (cmd.tuneFields & FIELD_CREEP_SPEED) params.creepSpeed = cmd.creepSpeed;
+    if (cmd.tuneFields & FIELD_TAPER_PILLS) params.taperPills = cmd.taperPills;
+    if (cmd.tuneFields & FIELD_CREEP_PILLS) params.creepPills = cmd.creepPills;
+    if (cmd.tuneFields & FIELD_KP) params.kp = cmd.kp;
+    if (cmd.tuneFields & FIELD_KI) params.ki = cmd.ki;
+    speedController.setParams(params);
+  }
+  TRACE(TRACE_TUNE, cmd.tuneFields);
+}
+
+// Count one detected transit (one or two pills) against the channel's
+// order, also while it settles: those pills are in its cup too
+static void handlePill(ChannelState &ch, const PillEvent &pill) {
+  if (ch.currentOrder == NULL) {
+    return;
+  }
+
+  ch.pillCount += pill.count;
+  ch.turntablePillCount -= pill.count;
+  journal.touch(false);
+  if (ch.dispensing) {
+    ch.speedController.onPill(pill.count, millis());
+  }
+  ch.lastFeedMs = millis();
+
+  if (ch.pillCount > pill.count) {
+    uint32_t interval = (pill.startUs - ch.lastPillUs) / pill.count;
+    if (interval < ch.intervalMinUs) ch.intervalMinUs = interval;
+    if (interval > ch.intervalMaxUs) ch.intervalMaxUs = interval;
+    ch.intervalSumUs += interval;
+    ch.intervalSamples++;
+  }
+  ch.lastPillUs = pill.startUs;
+  if (pill.flags & PILL_FLAG_DOUBLE) {
+    ch.doubles++;
+  }
+  progress[ch.index].store(ch.progressOrder, ch.pillCount, ch.doubles);
+
+  // Traced rather than printed: a Serial line per pill stalls this task
+  TRACE(TRACE_PILL, ch.index << 8 | pill.count);
+  if (pill.flags & PILL_FLAG_DOUBLE) {
+    uint32_t width = pill.widthUs / 100 < 0xfff ? pill.widthUs / 100 : 0xfff;
+    TRACE(TRACE_PILL_DOUBLE, ch.index << 12 | width);
+  }
+
+  if (ch.dispensing && ch.pillCount >= ch.targetPillCount) {
+    stopFeeding(ch, NULL);
+  }
+}
+
+// Order staging, refill and motor control of one channel
+static void stepChannel(ChannelState &ch, unsigned long currentMillis) {
+  // Report the order once the pills in flight have landed
+  if (ch.currentOrder != NULL && !ch.dispensing && (int32_t)(currentMillis - ch.stageAtMs) >= 0) {
+    closeOrder(ch);
+  }
+  // Stage the next order once the gate has closed on the previous one, and
+  // there is room for its start and completion events
+  if (ch.currentOrder == NULL && (int32_t)(currentMillis - ch.stageAtMs) >= 0 && eventRoom(2)) {
+    Order *next = orders.next(ch.index);
+    if (next != NULL) {
+      startOrder(ch, next);
+    }
+  }
+  if (ch.dispensing && currentMillis - ch.currentOrder->startedMs >= ORDER_TIMEOUT_MS) {
+    stopFeeding(ch, "timeout");
+  }
+
+  PillEvent pill;
+  if (ch.pillDetector.poll(micros(), pill)) {
+    handlePill(ch, pill);
+  }
+
+  // === Refill Logic ===
+  // Refill may overlap bulk/taper dispensing, but not the final creep where
+  // extra pills on the turntable would risk overshoot.
+  int demand = (ch.dispensing ? ch.targetPillCount - ch.pillCount : 0) + orders.queuedPills(ch.index);
+  bool overlapSafe = !ch.dispensing || ch.speedController.getPhase() != PHASE_CREEP;
+
+  // The estimate only drops for counted pills, so uncounted ones (overshoot,
+  // unflagged doubles) leave it too high. A turntable that has stopped
+  // feeding is empty whatever the estimate says.
+  if (ch.dispensing && !ch.refill.isBusy() && currentMillis - ch.lastFeedMs >= TURNTABLE_STARVED_MS) {
+    TRACE(TRACE_TURNTABLE_STARVED, ch.index);
+    ch.turntablePillCount = 0;
+    journal.touch(false);
+    overlapSafe = true;
+  }
+
+  if (ch.refill.shouldRefill(ch.turntablePillCount, demand, overlapSafe)) {
+    ch.refill.start(currentMillis);
+    TRACE(TRACE_REFILL_BEGIN, ch.index);
+  }
+  if (ch.refill.update(currentMillis)) {
+    TRACE(TRACE_REFILL_END, ch.index);
+    ch.turntablePillCount += ch.refill.getParams().refillAmount;
+    journal.touch(false);
+    ch.lastFeedMs = currentMillis;
+    TRACE(TRACE_TURNTABLE_REFILLED, ch.index << 12 | constrain(ch.turntablePillCount, 0, 0xfff));
+  }
+
+  // === DC Motor Control (speed control period) ===
+  if (currentMillis - ch.previousMillis >= MOTOR_UPDATE_INTERVAL_MS) {
+    ch.previousMillis = currentMillis;
+    if (ch.dispensing) {
+      ch.speedController.update(currentMillis);
+      setN20MotorSpeed(ch.agitator, ch.speedController.getAgitatorSpeed());
+      if (!ch.agitator.running) {
+        startN20Motor(ch.agitator); // Start N20 motor with DC motor
+      }
+      N20State agitator = updateN20Motor(ch.agitator, currentMillis);
+      if (agitator == N20_JAMMED) {
+        stopFeeding(ch, "jam");
+      } else {
+        // Hold the turntable while the agitator backs off a jam
+        setMotorSpeed(ch.config->turntable, agitator == N20_REVERSING ? 0 : ch.speedController.getTurntableSpeed());
+      }
+    } else {
+      stopMotor(ch.config->turntable);
+      if (ch.agitator.running) {
+        stopN20Motor(ch.agitator); // Stop N20 motor with DC motor
+      }
+    }
+  }
+}
+
+// One pass of the motion/counting loop
+void dispenserStep() {
+  // Idle passes are not traced, so the ring holds the dispense activity
+  bool traced = motionBusy.load(std::memory_order_relaxed);
+  if (traced) {
+    TRACE(TRACE_MOTION_STEP_BEGIN, 0);
+  }
+  unsigned long currentMillis = millis();
+
+  // === STEP 1: Commands from the network task ===
+  // Each may be answered with an event, so they wait while there is no room
+  MotionCommand cmd;
+  while (eventRoom(1) && motionCommands.pop(cmd)) {
+    if (cmd.type == MOTION_DISPENSE) {
+      queueOrder(cmd);
+    } else if (cmd.type == MOTION_TUNE) {
+      applyTune(cmd);
+    }
+  }
+
+  // === STEP 2: Pill Counting via Laser Edge Events ===
+  // Edges are captured by the laser ISRs, so pills that pass while this task
+  // is busy are still counted here, in order. Each channel's detector
+  // filters beam chatter and splits touching pills.
+  LaserEdge edge;
+  PillEvent pill;
+  while (laserPopEdge(edge)) {
+    if (edge.channel >= channelCount) {
+      continue;
+    }
+    ChannelState &ch = channels[edge.channel];
+    if (ch.pillDetector.onEdge(edge.timestampUs, edge.blocked, pill)) {
+      handlePill(ch, pill);
+    }
+  }
+
+  static uint32_t lastDroppedEdges = 0;
+  if (laserDroppedEdges() != lastDroppedEdges) {
+    lastDroppedEdges = laserDroppedEdges();
+    TRACE(TRACE_EDGES_DROPPED, lastDroppedEdges);
+  }
+
+  // === STEP 3: Orders, refill and motors of each channel ===
+  for (uint8_t i = 0; i < channelCount; i++) {
+    stepChannel(channels[i], currentMillis);
+  }
+
+  if (orders.depth() != queueDepth.load(std::memory_order_relaxed)) {
+    TRACE(TRACE_QUEUE_DEPTH, orders.depth());
+  }
+  queueDepth.store(orders.depth(), std::memory_order_relaxed);
+  queueOldestWaitMs.store(orders.oldestWaitMs(currentMillis), std::memory_order_relaxed);
+  saveJournal(currentMillis);
+
+  // === STEP 4: Run Turbine Pump (non-blocking) ===
+  //runTurbine(true);
+
+  bool busy = orders.depth() > 0;
+  for (uint8_t i = 0; i < channelCount; i++) {
+    busy = busy || channels[i].refill.isBusy();
+  }
+  motionBusy.store(busy, std::memory_order_relaxed);
+  if (traced) {
+    TRACE(TRACE_MOTION_STEP_END, 0);
+  }
+}
+
+// Forward motion events to telemetry (runs on the network task). The
+// order lifecycle is logged here rather than on the motion task, where a
+// Serial line can stall counting and the speed loop.
+static void handleMotionEvent(DispenseTelemetry *telemetry, const MotionEvent &event) {
+  bool onChannel = event.channel < channelCount;
+  DispenseTelemetry &channelTelemetry = telemetry[onChannel ? event.channel : 0];
+  switch (event.type) {
+    case EVENT_ORDER_QUEUED:
+      Serial.print("Order queued on channel ");
+      Serial.print(event.channel);
+      Serial.print(" at position ");
+      Serial.println(event.position);
+      channelTelemetry.queued(event.prescriptionId, event.targetCount, event.position);
+      break;
+    case EVENT_ORDER_REJECTED:
+      Serial.print("Order rejected: ");
+      Serial.println(event.reason);
+      channelTelemetry.rejected(event.prescriptionId, event.reason, onChannel);
+      break;
+    case EVENT_DISPENSE_STARTED:
+      Serial.print("Dispense started on channel ");
+      Serial.print(event.channel);
+      Serial.print(", target pills: ");
+      Serial.println(event.targetCount);
+      channelTelemetry.start(event.targetCount, event.prescriptionId, strlen(event.prescriptionId), event.order,
+                             event.timeMs);
+      break;
+    case EVENT_DISPENSE_COMPLETE: {
+      DispenseSummary summary;
+      summary.pillCount = event.pillCount;
+      summary.doubles = event.doubles;
+      summary.rejected = event.rejected;
+      summary.jams = event.jams;
+      summary.intervalMinUs = event.intervalMinUs;
+      summary.intervalMeanUs = event.intervalMeanUs;
+      summary.intervalMaxUs = event.intervalMaxUs;
+      Serial.print("Dispense complete on channel ");
+      Serial.print(event.channel);
+      Serial.print(", pills: ");
+      Serial.println(event.pillCount);
+      channelTelemetry.complete(summary, event.timeMs);
+      break;
+    }
+    case EVENT_DISPENSE_ERROR:
+      Serial.print("Dispense failed on channel ");
+      Serial.print(event.channel);
+      Serial.print(": ");
+      Serial.println(event.reason);
+      channelTelemetry.error(event.reason, event.timeMs);
+      break;
+    case EVENT_DISPENSE_INTERRUPTED:
+      channelTelemetry.interrupted(event.prescriptionId, event.targetCount, event.pillCount);
+      break;
+  }
+}
+
+// Events first, so a start is known before the progress that follows it
+void dispenserForwardEvents(DispenseTelemetry *telemetry) {
+  MotionEvent event;
+  while (motionEvents.pop(event)) {
+    handleMotionEvent(telemetry, event);
+  }
+  uint32_t now = millis();
+  for (uint8_t i = 0; i < channelCount; i++) {
+    uint8_t order;
+    int32_t pills;
+    uint32_t doubles;
+    progress[i].load(order, pills, doubles);
+    telemetry[i].progress(order, pills, doubles, now);
+  }
+}
+
+DispenserQueueStats dispenserTakeQueueStats() {
+  DispenserQueueStats stats;
+  stats.depth = queueDepth.load(std::memory_order_relaxed);
+  stats.oldestWaitMs = queueOldestWaitMs.load(std::memory_order_relaxed);
+  stats.maxWaitMs = queueMaxWaitMs.take();
+  return stats;
+}
+
+bool dispenserBusy() {
+  return motionBusy.load(std::memory_order_relaxed);
+}
+
+void dispenserSaveJournal() {
+  journal.save();
+}
+
+// Each due dose becomes a dispense order with its own prescription_id,
+// "<prescription_id>@<dose time>", so its status messages tell the doses
+// apart and the order queue's executed ids never run one twice.
+size_t dispenserRunSchedule(uint32_t utcNow, int32_t utcOffsetS, uint8_t *reply, size_t replySize) {
+  DoseDue due;
+  while (schedule.next(utcNow, utcOffsetS, due)) {
+    for (uint8_t i = 0; i < SCHEDULE_RULES_MAX; i++) {
+      if (!(due.rules & (1u << i))) {
+        continue;
+      }
+      const ScheduleRule &rule = schedule.rule(i);
+      char prescriptionId[COMMAND_MAX_STRING_LEN + 1];
+      snprintf(prescriptionId, sizeof(prescriptionId), "%s@%lu", rule.prescriptionId, (unsigned long)due.utcTime);
+      TRACE(TRACE_DOSE_DUE, due.lateS);
+
+      // Missed-dose policy: too late to give, report it instead
+      if (due.lateS > rule.graceMin * 60u) {
+        schedule.handled(due, i);
+        Serial.print("Dose missed: ");
+        Serial.println(prescriptionId);
+        WireWriter msg(reply, replySize, wireStatusFormat());
+        msg.addString(WIRE_KEY_STATUS, "missed");
+        msg.addString(WIRE_KEY_PRESCRIPTION_ID, prescriptionId);
+        msg.addString(WIRE_KEY_MEDICINE_NAME, rule.medicineName);
+        msg.addInt(WIRE_KEY_QUANTITY, rule.quantity);
+        msg.addInt(WIRE_KEY_TIMESTAMP, due.utcTime);
+        return msg.finish();
+      }
+
+      MotionCommand motion;
+      memset(&motion, 0, sizeof(motion));
+      motion.type = MOTION_DISPENSE;
+      motion.quantity = rule.quantity;
+      memcpy(motion.medicineName, rule.medicineName, sizeof(motion.medicineName));
+      memcpy(motion.prescriptionId, prescriptionId, sizeof(motion.prescriptionId));
+      if (!motionCommands.push(motion)) {
+        schedule.save();
+        return 0;  // The rest of this dose time goes on the next pass
+      }
+      schedule.handled(due, i);
+      Serial.print("Scheduled dose: ");
+      Serial.println(prescriptionId);
+    }
+  }
+  schedule.save();
+  return 0;
+}
@@ -0,0 +1,81 @@
+#ifndef DISPENSER_H
+#define DISPENSER_H
+
+/**
+ * Dispenser - Dispense logic shared by the firmware and the host simulator
+ *
+ * Motion side (motion task on the device, the simulator's 1 ms tick on the
+ * host): dispense commands into the order queue (OrderQueue.h), laser
+ * edges -> pill counts, refill sequencing and turntable/agitator speed,
+ * for every channel in the channel table (Channels.h). Orders are routed
+ * to a channel by medicine_name. All hardware access goes through Hal.h;
+ * actuator outputs are applied by the motion scheduler's timer
+ * (MotionScheduler.h), not by the motion pass itself.
+ *
+ * Network side: the MQTT boundary is the message itself. A received
+ * command payload is handed to dispenserSubmit(), and motion events are
+ * turned into status messages by dispenserForwardEvents(); on the device
+ * PubSubClient (or the LAN endpoint) carries those bytes, on the host the
+ * simulated broker does.
+ *
+ * Usage:
+ * 1. setup:        dispenserSetup();
+ * 2. motion task:  dispenserStep();                       // every 1 ms
+ * 3. MQTT callback: if (size_t n = dispenserSubmit(payload, length, reply, sizeof(reply))) publish(reply, n);
+ * 4. network task: dispenserForwardEvents(telemetry);    // DispenseTelemetry[channelCount]
+ *                  dispenserSaveJournal();
+ *                  while (size_t n = dispenserRunSchedule(utc, offset, reply, sizeof(reply))) publish(reply, n);
+ *
+ * Queued and running orders and the turntable inventory estimates are
+ * journaled to flash (DispenseJournal.h) and restored by dispenserSetup().
+ */
+
+#include <Arduino.h>
+#include "DispenseTelemetry.h"
+#include "TaskMessages.h"
+
+#define DISPENSER_REPLY_LEN 128
+
+// Inter-task queues (see TaskMessages.h)
+extern MotionCommandQueue motionCommands;
+extern MotionEventQueue motionEvents;
+
+void dispenserSetup();
+void dispenserStep();
+
+// Parses a command payload (JSON or MessagePack) in place and queues it for
+// the motion side, or applies a "schedule"/"unschedule" to the dose
+// schedule. Returns the length of a reply to publish back (an error, the
+// "wire" or schedule confirmation or a "ping" answer) in the status format,
+// 0 for none. MQTT commands and the LAN endpoint (LocalEndpoint.h) both land here.
+size_t dispenserSubmit(uint8_t *payload, size_t length, uint8_t *reply, size_t replySize);
+
+// Network side, once the wall clock is known: turns the on-device dose
+// schedule (DoseSchedule.h) into dispense orders as doses fall due.
+// Returns the length of a "missed" report to publish for a dose that is
+// too late to give, 0 when there is nothing (more) to report; call it
+// again until it returns 0. Writes the schedule cursor to flash.
+size_t dispenserRunSchedule(uint32_t utcNow, int32_t utcOffsetS, uint8_t *reply, size_t replySize);
+
+// Drains motion events into the telemetry publishers, one per channel, and
+// hands each the pill progress of its running order
+void dispenserForwardEvents(DispenseTelemetry *telemetry);
+
+// Writes the latest dispense state journal record to flash, if one is
+// pending. Network task only: it blocks for the flash write.
+void dispenserSaveJournal();
+
+struct DispenserQueueStats {
+  uint8_t depth;          // Queued + running orders
+  uint32_t oldestWaitMs;  // Longest wait of an order still queued
+  uint32_t maxWaitMs;     // Worst queue wait of the orders started since the last call
+};
+
+// Order queue figures for health reports; safe to call from the network task
+DispenserQueueStats dispenserTakeQueueStats();
+
+// True while orders are queued or running or a refill is in progress;
+// safe to call from the network task
+bool dispenserBusy();
+
+#endif
@@ -0,0 +1,323 @@
+#include "DoseSchedule.h"
+#include <string.h>
+#include "Hal.h"
+#include "DispenseJournal.h"
+
+#define SCHEDULE_VERSION 1
+#define SCHEDULE_KEY_RULES "sched"
+#define SCHEDULE_KEY_CURSOR "schedc"
+
+// Encode/decode buffer of the rules record; network task (and setup) only
+static uint8_t record[SCHEDULE_RECORD_MAX];
+
+DoseSchedule::DoseSchedule()
+    : slotCount(0), cursor(0), handledMask(0), lastLocal(0), rulesDirty(false), cursorDirty(false) {
+  memset(rules, 0, sizeof(rules));
+}
+
+int DoseSchedule::find(const char *prescriptionId) const {
+  for (uint8_t i = 0; i < SCHEDULE_RULES_MAX; i++) {
+    if (rules[i].used && strcmp(rules[i].prescriptionId, prescriptionId) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+uint16_t DoseSchedule::slotFor(uint16_t minute) const {
+  uint16_t low = 0;
+  uint16_t high = slotCount;
+  while (low < high) {
+    uint16_t mid = (low + high) / 2;
+    if (slots[mid].minute < minute) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// Whether the rule's times find a slot, counting only the minutes no rule uses yet
+bool DoseSchedule::fits(const ScheduleRule &rule) const {
+  uint16_t added = 0;
+  for (uint8_t i = 0; i < rule.timeCount; i++) {
+    uint16_t at = slotFor(rule.times[i]);
+    if (at == slotCount || slots[at].minute != rule.times[i]) {
+      added++;
+    }
+  }
+  return slotCount + added <= SCHEDULE_SLOTS_MAX;
+}
+
+void DoseSchedule::addSlots(uint8_t index) {
+  const ScheduleRule &rule = rules[index];
+  for (uint8_t i = 0; i < rule.timeCount; i++) {
+    uint16_t minute = rule.times[i];
+    uint16_t at = slotFor(minute);
+    if (at == slotCount || slots[at].minute != minute) {
+      memmove(&slots[at + 1], &slots[at], (slotCount - at) * sizeof(Slot));
+      slots[at].minute = minute;
+      slots[at].rules = 0;
+      slotCount++;
+    }
+    slots[at].rules |= (uint16_t)(1u << index);
+  }
+}
+
+void DoseSchedule::removeSlots(uint8_t index) {
+  uint16_t bit = (uint16_t)(1u << index);
+  uint16_t kept = 0;
+  for (uint16_t i = 0; i < slotCount; i++) {
+    slots[i].rules &= ~bit;
+    if (slots[i].rules != 0) {
+      slots[kept++] = slots[i];
+    }
+  }
+  slotCount = kept;
+  handledMask &= ~bit;
+}
+
+ScheduleResult DoseSchedule::set(const char *prescriptionId, const char *medicineName, int32_t quantity,
+                                 const uint16_t *times, uint8_t timeCount, uint16_t graceMin) {
+  size_t idLength = strlen(prescriptionId);
+  if (idLength == 0 || idLength > SCHEDULE_ID_MAX) {
+    return SCHEDULE_BAD_ID;
+  }
+  if (timeCount == 0 || timeCount > COMMAND_MAX_TIMES || quantity <= 0 || medicineName[0] == '\0') {
+    return SCHEDULE_BAD_DOSE;
+  }
+
+  ScheduleRule rule;
+  memset(&rule, 0, sizeof(rule));
+  rule.used = true;
+  rule.quantity = quantity;
+  rule.graceMin = graceMin < COMMAND_MINUTES_PER_DAY ? graceMin : COMMAND_MINUTES_PER_DAY;
+  rule.fromLocal = lastLocal;
+  memcpy(rule.prescriptionId, prescriptionId, idLength + 1);
+  strncpy(rule.medicineName, medicineName, sizeof(rule.medicineName) - 1);
+
+  // Sorted and without repeats, so one dose time is one slot bit
+  for (uint8_t i = 0; i < timeCount; i++) {
+    uint8_t at = rule.timeCount;
+    while (at > 0 && rule.times[at - 1] > times[i]) {
+      at--;
+    }
+    if (at > 0 && rule.times[at - 1] == times[i]) {
+      continue;
+    }
+    memmove(&rule.times[at + 1], &rule.times[at], (rule.timeCount - at) * sizeof(uint16_t));
+    rule.times[at] = times[i];
+    rule.timeCount++;
+  }
+
+  int index = find(prescriptionId);
+  if (index >= 0) {
+    // Replacing: the old rule's slots are freed first, and restored if the new one does not fit
+    removeSlots((uint8_t)index);
+    if (!fits(rule)) {
+      addSlots((uint8_t)index);
+      return SCHEDULE_FULL;
+    }
+  } else {
+    for (uint8_t i = 0; i < SCHEDULE_RULES_MAX && index < 0; i++) {
+      if (!rules[i].used) {
+        index = i;
+      }
+    }
+    if (index < 0 || !fits(rule)) {
+      return SCHEDULE_FULL;
+    }
+  }
+  rules[index] = rule;
+  addSlots((uint8_t)index);
+  rulesDirty = true;
+  return SCHEDULE_OK;
+}
+
+ScheduleResult DoseSchedule::remove(const char *prescriptionId) {
+  int index = find(prescriptionId);
+  if (index < 0) {
+    return SCHEDULE_NOT_FOUND;
+  }
+  removeSlots((uint8_t)index);
+  memset(&rules[index], 0, sizeof(ScheduleRule));
+  rulesDirty = true;
+  return SCHEDULE_OK;
+}
+
+void DoseSchedule::clear() {
+  memset(rules, 0, sizeof(rules));
+  slotCount = 0;
+  handledMask = 0;
+  rulesDirty = true;
+}
+
+uint8_t DoseSchedule::ruleCount() const {
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < SCHEDULE_RULES_MAX; i++) {
+    count += rules[i].used ? 1 : 0;
+  }
+  return count;
+}
+
+bool DoseSchedule::next(uint32_t utcNow, int32_t utcOffsetS, DoseDue &due) {
+  uint32_t local = (uint32_t)((int64_t)utcNow + utcOffsetS);
+  lastLocal = local;
+
+  // Rules received before the clock was known start from now
+  for (uint8_t i = 0; i < SCHEDULE_RULES_MAX; i++) {
+    if (rules[i].used && rules[i].fromLocal == 0) {
+      rules[i].fromLocal = local;
+      rulesDirty = true;
+    }
+  }
+
+  if (cursor == 0 || slotCount == 0) {
+    // Nothing to catch up on: the first clock reading, or no doses to time
+    if (local > cursor) {
+      cursor = local;
+      handledMask = 0;
+      cursorDirty = slotCount > 0;
+    }
+    return false;
+  }
+  if (local <= cursor) {
+    return false;  // Clock stepped back: wait until it passes the last dose again
+  }
+  if (local - cursor > SCHEDULE_CATCHUP_S) {
+    cursor = local - SCHEDULE_CATCHUP_S;
+    handledMask = 0;
+    cursorDirty = true;
+  }
+
+  while (true) {
+    // First dose time after the cursor: the slot after its minute of the day
+    uint32_t dayStart = cursor - cursor % SCHEDULE_DAY_S;
+    uint16_t at = slotFor((uint16_t)((cursor % SCHEDULE_DAY_S) / 60 + 1));
+    if (at == slotCount) {
+      dayStart += SCHEDULE_DAY_S;
+      at = 0;
+    }
+    uint32_t doseTime = dayStart + slots[at].minute * 60u;
+    if (doseTime > local) {
+      return false;
+    }
+
+    due.localTime = doseTime;
+    due.utcTime = (uint32_t)((int64_t)doseTime - utcOffsetS);
+    due.lateS = local - doseTime;
+    due.rules = slots[at].rules & ~handledMask;
+    for (uint8_t i = 0; i < SCHEDULE_RULES_MAX; i++) {
+      if ((due.rules & (1u << i)) && rules[i].fromLocal >= doseTime) {
+        due.rules &= ~(uint16_t)(1u << i);  // Before the rule was received
+      }
+    }
+    if (due.rules != 0) {
+      return true;
+    }
+    cursor = doseTime;
+    handledMask = 0;
+    cursorDirty = true;
+  }
+}
+
+void DoseSchedule::handled(DoseDue &due, uint8_t rule) {
+  uint16_t bit = (uint16_t)(1u << rule);
+  due.rules &= ~bit;
+  handledMask |= bit;
+  if (due.rules == 0) {
+    cursor = due.localTime;
+    handledMask = 0;
+  }
+  cursorDirty = true;
+}
+
+// Rules record:  [version u8][rules u8] per rule: [index u8][quantity u32][grace i16]
+//                [from u32][times u8][minute i16]...[prescription_id str][medicine_name str]
+// Cursor record: [cursor u32][handled u32]
+void DoseSchedule::load() {
+  size_t length = halStoreRead(SCHEDULE_KEY_RULES, record, sizeof(record));
+  if (length > 0) {
+    JournalReader in(record, length);
+    uint8_t version = in.getU8();
+    uint8_t count = in.getU8();
+    for (uint8_t n = 0; n < count && in.ok() && version == SCHEDULE_VERSION; n++) {
+      ScheduleRule rule;
+      memset(&rule, 0, sizeof(rule));
+      uint8_t index = in.getU8();
+      rule.used = true;
+      rule.quantity = (int32_t)in.getU32();
+      rule.graceMin = (uint16_t)in.getI16();
+      rule.fromLocal = in.getU32();
+      rule.timeCount = in.getU8();
+      for (uint8_t i = 0; i < rule.timeCount && i < COMMAND_MAX_TIMES; i++) {
+        rule.times[i] = (uint16_t)in.getI16();
+      }
+      in.getString(rule.prescriptionId, sizeof(rule.prescriptionId));
+      in.getString(rule.medicineName, sizeof(rule.medicineName));
+      if (in.ok() && index < SCHEDULE_RULES_MAX && rule.timeCount <= COMMAND_MAX_TIMES && !rules[index].used &&
+          fits(rule)) {
+        rules[index] = rule;
+        addSlots(index);
+      }
+    }
+  }
+
+  uint8_t saved[8];
+  if (halStoreRead(SCHEDULE_KEY_CURSOR, saved, sizeof(saved)) == sizeof(saved)) {
+    JournalReader in(saved, sizeof(saved));
+    cursor = in.getU32();
+    handledMask = (uint16_t)in.getU32();
+  }
+}
+
+bool DoseSchedule::save() {
+  bool ok = true;
+  if (rulesDirty) {
+    JournalWriter out(record, sizeof(record));
+    out.putU8(SCHEDULE_VERSION);
+    out.putU8(ruleCount());
+    for (uint8_t index = 0; index < SCHEDULE_RULES_MAX; index++) {
+      const ScheduleRule &rule = rules[index];
+      if (!rule.used) {
+        continue;
+      }
+      out.putU8(index);
+      out.putU32((uint32_t)rule.quantity);
+      out.putI16((int16_t)rule.graceMin);
+      out.putU32(rule.fromLocal);
+      out.putU8(rule.timeCount);
+      for (uint8_t i = 0; i < rule.timeCount; i++) {
+        out.putI16((int16_t)rule.times[i]);
+      }
+      out.putString(rule.prescriptionId);
+      out.putString(rule.medicineName);
+    }
+    size_t length = out.finish();
+    ok = length > 0 && halStoreWrite(SCHEDULE_KEY_RULES, record, length);
+    rulesDirty = !ok;
+    cursorDirty = true;  // Written with the rules, so the cursor matches them
+  }
+  if (cursorDirty) {
+    uint8_t saved[8];
+    JournalWriter out(saved, sizeof(saved));
+    out.putU32(cursor);
+    out.putU32(handledMask);
+    bool written = halStoreWrite(SCHEDULE_KEY_CURSOR, saved, out.finish());
+    cursorDirty = !written;
+    ok = ok && written;
+  }
+  return ok;
+}
+
+const char *scheduleResultName(ScheduleResult result) {
+  switch (result) {
+    case SCHEDULE_OK: return "ok";
+    case SCHEDULE_BAD_ID: return "bad_prescription_id";
+    case SCHEDULE_BAD_DOSE: return "bad_dose";
+    case SCHEDULE_FULL: return "schedule_full";
+    case SCHEDULE_NOT_FOUND: return "not_found";
+  }
+  return "unknown";
+}
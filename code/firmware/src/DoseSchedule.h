@@ -0,0 +1,139 @@
+#ifndef DOSESCHEDULE_H
+#define DOSESCHEDULE_H
+
+/**
+ * DoseSchedule - Recurring doses kept and timed on the device
+ *
+ * A prescription on a fixed regimen is pushed once with the "schedule"
+ * command instead of one "dispense" command per dose:
+ *
+ *   {"command":"schedule","prescription_id":"RX-42","medicine_name":"Paracetamol",
+ *    "quantity":2,"times":[480,1200],"grace":60}
+ *
+ * times are daily dose times in minutes after local midnight, grace how
+ * many minutes late a dose may still be given (SCHEDULE_GRACE_DEFAULT_MIN
+ * if absent). Pushing the same prescription_id again replaces its rule;
+ * {"command":"unschedule","prescription_id":...} removes it, and without a
+ * prescription_id removes them all.
+ *
+ * The table is fixed-size: SCHEDULE_RULES_MAX rules and one slot per
+ * distinct dose time, sorted by minute of the day. Each slot holds a bit
+ * mask of the rules due at that minute, so finding the next dose after
+ * any moment is one binary search over the slots, however many doses a
+ * day the rules add up to.
+ *
+ * Time is the wall clock (SNTP on the device), in seconds since the epoch
+ * plus the local UTC offset. A cursor marks the last dose time that was
+ * fully handled; next() returns the first one after it that is due, and
+ * once each of its rules was handled() the cursor moves past it. So:
+ * - the clock stepping back never repeats a dose: nothing is due until it
+ *   passes the cursor again;
+ * - the clock stepping forward, or the device being off, leaves the doses
+ *   in between due at once, with how late they are (lateS) for the
+ *   caller's missed-dose policy. Doses more than SCHEDULE_CATCHUP_S
+ *   behind are dropped;
+ * - a rule only covers doses after it was received (or after the first
+ *   time the clock was known, if that came later).
+ *
+ * The rules and the cursor are kept in flash (halStoreWrite keys "sched"
+ * and "schedc"); rules are written when they change, the cursor at most a
+ * few times per dose. No Arduino dependencies beyond Hal.h, so it builds
+ * for the simulator too.
+ *
+ * Usage (network task):
+ * 1. setup:  schedule.load();
+ * 2. command: schedule.set(...); / schedule.remove(id);
+ * 3. each pass, once the clock is set:
+ *      DoseDue due;
+ *      while (schedule.next(utcNow, utcOffsetS, due)) { for each rule in due.rules: ...; schedule.handled(due, rule); }
+ *      schedule.save();
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "CommandParser.h"
+
+#define SCHEDULE_RULES_MAX 16                          // Bits of a slot's rule mask
+#define SCHEDULE_SLOTS_MAX (SCHEDULE_RULES_MAX * COMMAND_MAX_TIMES)
+#define SCHEDULE_ID_MAX (COMMAND_MAX_STRING_LEN - 11)  // Room for "@" and the dose time in a dose's prescription_id
+#define SCHEDULE_GRACE_DEFAULT_MIN 60
+#define SCHEDULE_CATCHUP_S 86400                       // Doses further behind are dropped
+#define SCHEDULE_DAY_S 86400
+#define SCHEDULE_RECORD_MAX 2560                       // Every rule, encoded
+
+struct ScheduleRule {
+  bool used;
+  uint8_t timeCount;
+  uint16_t graceMin;
+  int32_t quantity;
+  uint32_t fromLocal;    // Doses at or before this local time are not this rule's; 0 until the clock is known
+  uint16_t times[COMMAND_MAX_TIMES];
+  char prescriptionId[SCHEDULE_ID_MAX + 1];
+  char medicineName[COMMAND_MAX_STRING_LEN + 1];
+};
+
+// One dose time that is due
+struct DoseDue {
+  uint32_t localTime;    // Seconds since the epoch, local wall clock
+  uint32_t utcTime;
+  uint32_t lateS;        // How long ago it was due
+  uint16_t rules;        // Bit mask of the rules still to handle
+};
+
+enum ScheduleResult : uint8_t {
+  SCHEDULE_OK,
+  SCHEDULE_BAD_ID,       // Missing or longer than SCHEDULE_ID_MAX
+  SCHEDULE_BAD_DOSE,     // No times, no medicine or no positive quantity
+  SCHEDULE_FULL,
+  SCHEDULE_NOT_FOUND
+};
+
+class DoseSchedule {
+private:
+  struct Slot {
+    uint16_t minute;
+    uint16_t rules;
+  };
+
+  ScheduleRule rules[SCHEDULE_RULES_MAX];
+  Slot slots[SCHEDULE_SLOTS_MAX];
+  uint16_t slotCount;
+
+  uint32_t cursor;       // Local time of the last fully handled dose time; 0 until the clock is known
+  uint16_t handledMask;  // Rules already handled of the dose time after the cursor
+  uint32_t lastLocal;    // Latest local time seen by next()
+  bool rulesDirty;
+  bool cursorDirty;
+
+  int find(const char *prescriptionId) const;
+  uint16_t slotFor(uint16_t minute) const;   // First slot at or after minute
+  bool fits(const ScheduleRule &rule) const;
+  void addSlots(uint8_t index);
+  void removeSlots(uint8_t index);
+
+public:
+  DoseSchedule();
+
+  ScheduleResult set(const char *prescriptionId, const char *medicineName, int32_t quantity,
+                     const uint16_t *times, uint8_t timeCount, uint16_t graceMin);
+  ScheduleResult remove(const char *prescriptionId);
+  void clear();
+
+  // Earliest dose time after the cursor that is due at utcNow, false if none
+  bool next(uint32_t utcNow, int32_t utcOffsetS, DoseDue &due);
+  // One rule of a due dose time was given or reported missed
+  void handled(DoseDue &due, uint8_t rule);
+
+  const ScheduleRule &rule(uint8_t index) const { return rules[index]; }
+  uint8_t ruleCount() const;
+  uint16_t doseTimes() const { return slotCount; }
+
+  // Before the tasks start; keeps an empty table when nothing valid is stored
+  void load();
+  // Writes what changed; blocks for the flash write
+  bool save();
+};
+
+const char *scheduleResultName(ScheduleResult result);
+
+#endif
@@ -0,0 +1,75 @@
+#include "EnvSampler.h"
+#include "Hal.h"
+#include "Trace.h"
+
+EnvSampler::EnvSampler() {
+  next = 0;
+  count = 0;
+  lastSampleMs = 0;
+  nextAttemptMs = 0;
+  failures = 0;
+}
+
+bool EnvSampler::poll(uint32_t nowMs, bool busy) {
+  if (busy || (int32_t)(nowMs - nextAttemptMs) < 0) {
+    return false;
+  }
+
+  float temperature;
+  float humidity;
+  TRACE(TRACE_ENV_SAMPLE_BEGIN, 0);
+  bool ok = halReadEnvironment(temperature, humidity);
+  TRACE(TRACE_ENV_SAMPLE_END, 0);
+  if (!ok) {
+    failures++;
+    nextAttemptMs = nowMs + config.retryMs;
+    return true;
+  }
+
+  temperatures[next] = temperature;
+  humidities[next] = humidity;
+  next = (next + 1) % ENV_WINDOW_SAMPLES;
+  if (count < ENV_WINDOW_SAMPLES) {
+    count++;
+  }
+  lastSampleMs = nowMs;
+  nextAttemptMs = nowMs + config.periodMs;
+  return true;
+}
+
+EnvReading EnvSampler::reading(uint32_t nowMs) const {
+  EnvReading r;
+  memset(&r, 0, sizeof(r));
+  r.failures = failures;
+  r.samples = count;
+  r.valid = count > 0;
+  if (!r.valid) {
+    r.stale = true;
+    r.temperatureC = r.humidityPct = NAN;
+    r.temperatureMin = r.temperatureMax = r.temperatureMean = NAN;
+    r.humidityMin = r.humidityMax = r.humidityMean = NAN;
+    return r;
+  }
+
+  r.ageMs = nowMs - lastSampleMs;
+  r.stale = r.ageMs > config.staleMs;
+  uint8_t newest = (next + ENV_WINDOW_SAMPLES - 1) % ENV_WINDOW_SAMPLES;
+  r.temperatureC = temperatures[newest];
+  r.humidityPct = humidities[newest];
+
+  r.temperatureMin = r.temperatureMax = temperatures[0];
+  r.humidityMin = r.humidityMax = humidities[0];
+  float temperatureSum = 0;
+  float humiditySum = 0;
+  for (uint8_t i = 0; i < count; i++) {
+    if (temperatures[i] < r.temperatureMin) r.temperatureMin = temperatures[i];
+    if (temperatures[i] > r.temperatureMax) r.temperatureMax = temperatures[i];
+    if (humidities[i] < r.humidityMin) r.humidityMin = humidities[i];
+    if (humidities[i] > r.humidityMax) r.humidityMax = humidities[i];
+    temperatureSum += temperatures[i];
+    humiditySum += humidities[i];
+  }
+  r.temperatureMean = temperatureSum / count;
+  r.humidityMean = humiditySum / count;
+  return r;
+}
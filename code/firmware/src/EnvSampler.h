@@ -0,0 +1,69 @@
+#ifndef ENVSAMPLER_H
+#define ENVSAMPLER_H
+
+/**
+ * EnvSampler - Cached DHT temperature/humidity with a rolling window
+ *
+ * A DHT11 transaction bit-bangs the bus with interrupts off for ~25 ms.
+ * The sampler owns the sensor: it reads it from the network task (so the
+ * laser ISRs on the motion core are never masked), only while no dispense
+ * or refill is in progress, and at most every periodMs. Everything else
+ * reads the cached values; a cache that has not been refreshed for staleMs
+ * is reported as stale.
+ *
+ * Usage:
+ * 1. Network task, every pass: sampler.poll(millis(), dispenserBusy());
+ * 2. Health report:            EnvReading env = sampler.reading(millis());
+ */
+
+#include <Arduino.h>
+
+#define ENV_WINDOW_SAMPLES 30   // min/max/mean over the last N samples
+
+struct EnvSamplerConfig {
+  uint32_t periodMs = 10000;    // Between samples
+  uint32_t retryMs = 2500;      // After a failed read (DHT11 needs 2 s between reads)
+  uint32_t staleMs = 120000;    // Cache older than this is stale
+};
+
+struct EnvReading {
+  bool valid;              // At least one good sample so far
+  bool stale;
+  uint32_t ageMs;          // Since the last good sample
+  float temperatureC;      // Last good sample
+  float humidityPct;
+  float temperatureMin;    // Over the window
+  float temperatureMax;
+  float temperatureMean;
+  float humidityMin;
+  float humidityMax;
+  float humidityMean;
+  uint8_t samples;         // In the window
+  uint32_t failures;       // Failed reads since boot
+};
+
+class EnvSampler {
+private:
+  EnvSamplerConfig config;
+  float temperatures[ENV_WINDOW_SAMPLES];
+  float humidities[ENV_WINDOW_SAMPLES];
+  uint8_t next;
+  uint8_t count;
+  uint32_t lastSampleMs;   // Last good sample
+  uint32_t nextAttemptMs;
+  uint32_t failures;
+
+public:
+  EnvSampler();
+
+  void setConfig(const EnvSamplerConfig &cfg) { config = cfg; }
+  const EnvSamplerConfig &getConfig() const { return config; }
+
+  // Reads the sensor when a sample is due and busy is false. Returns true
+  // when it took a sample (and so blocked for the DHT transaction).
+  bool poll(uint32_t nowMs, bool busy);
+
+  EnvReading reading(uint32_t nowMs) const;
+};
+
+#endif
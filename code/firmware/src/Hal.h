@@ -0,0 +1,79 @@
+#ifndef HAL_H
+#define HAL_H
+
+/**
+ * Hal - Hardware access used by the dispense logic
+ *
+ * LaserModule, MotorControl, the refill/gate servos and the DHT only touch
+ * hardware through these functions, so the same modules build for two
+ * targets:
+ * - esp32doit-devkit-v1: HalEsp32.cpp (Arduino core, PCNT, ESP32Servo, DHT, NVS)
+ * - native:              sim/SimHal.cpp (discrete-event simulator)
+ *
+ * Timing (millis/micros) and Serial still come from <Arduino.h>; the native
+ * env puts src/sim first on the include path, where Arduino.h maps them to
+ * the simulator clock. The MQTT side is abstracted one level up, at the
+ * message boundary (see Dispenser.h).
+ *
+ * Pin levels and modes use the Arduino HIGH/LOW and INPUT/OUTPUT values.
+ */
+
+#include <Arduino.h>
+
+// Servo outputs are numbered 0..HAL_SERVO_COUNT-1; Channels.h assigns them
+typedef uint8_t HalServo;
+#define HAL_SERVO_COUNT 8
+
+#define HAL_NO_PIN 0xFF
+
+typedef void (*HalIsr)();
+typedef void (*HalTimerFn)();
+
+void halPinMode(uint8_t pin, uint8_t mode);
+void halDigitalWrite(uint8_t pin, uint8_t level);
+int halDigitalRead(uint8_t pin);          // ISR-safe
+void halPwmWrite(uint8_t pin, uint8_t duty);
+
+// isr runs on every level change of pin, also while the other core writes
+// flash (cache off): it and everything it calls must be IRAM_ATTR, and the
+// data it touches DRAM_ATTR or plain static RAM, never const tables
+void halAttachEdgeInterrupt(uint8_t pin, HalIsr isr);
+
+// micros() time base, callable from that isr
+uint32_t halMicros();
+
+// Quadrature encoder on a hardware pulse counter (4 counts per encoder
+// cycle). Units are numbered 0..HAL_ENCODER_COUNT-1. The count is
+// cumulative and signed; it does not wrap in practice (int32).
+#define HAL_ENCODER_COUNT 8
+bool halEncoderAttach(uint8_t unit, uint8_t pinA, uint8_t pinB);
+int32_t halEncoderRead(uint8_t unit);
+
+// Writes to a servo that was never attached are ignored
+void halServoAttach(HalServo servo, uint8_t pin, int minPulseUs, int maxPulseUs);
+void halServoWrite(HalServo servo, int angle);
+
+// Calls fn every periodUs from a high-priority timer context (on the
+// device a task on the motion core, woken by a hardware timer), not from
+// the motion task. One timer only.
+bool halTimerStart(uint32_t periodUs, HalTimerFn fn);
+
+// CPU cycle counter of the calling core (wraps); ISR-safe
+uint32_t halCycleCount();
+uint8_t halCoreId();
+uint32_t halCpuHz();
+
+void halSensorBegin();
+// One DHT transaction. Blocks for ~25 ms with interrupts off on the calling
+// core; only call it through EnvSampler. Returns false (and NAN values)
+// when the sensor did not answer.
+bool halReadEnvironment(float &temperatureC, float &humidityPct);
+
+// Small records that survive a reset (NVS on the device), by key of up to
+// 15 characters. A write replaces the whole record and blocks for a flash
+// write, so call these from the network task or before the tasks start.
+// halStoreRead returns the stored length (0 if absent or larger than size).
+size_t halStoreRead(const char *key, void *data, size_t size);
+bool halStoreWrite(const char *key, const void *data, size_t length);
+
+#endif
@@ -0,0 +1,267 @@
+#include "Hal.h"
+#include <ESP32Servo.h>
+#include <DHT.h>
+#include <Preferences.h>
+#include <driver/gpio.h>
+#include <driver/pcnt.h>
+#include <hal/cpu_hal.h>
+#include <hal/gpio_ll.h>
+#include <esp_timer.h>
+
+#define DHT_PIN 5
+#define DHT_TYPE DHT11
+#define STORE_NAMESPACE "mediflow"
+
+// The PCNT counters are 16 bit; they reset at +-ENCODER_LIMIT and the
+// limit interrupt carries the overflow into encoderBase
+#define ENCODER_LIMIT 10000
+#define ENCODER_FILTER 100   // Glitch filter, APB cycles (1.25 us)
+
+// halTimerStart: hardware timer 0 at 1 MHz wakes a task pinned to the
+// motion core, above the motion task, which runs the callback
+#define TIMER_NUMBER 0
+#define TIMER_DIVIDER 80     // 80 MHz APB clock
+#define TIMER_CORE 1
+#define TIMER_TASK_STACK 3072
+#define TIMER_TASK_PRIORITY (configMAX_PRIORITIES - 1)
+
+static Servo servos[HAL_SERVO_COUNT];
+static DHT dht(DHT_PIN, DHT_TYPE);
+static bool pwmTimersAllocated = false;
+static volatile int32_t encoderBase[HAL_ENCODER_COUNT];
+static bool pcntServiceInstalled = false;
+static bool gpioServiceInstalled = false;
+static HalTimerFn timerFn = NULL;
+static TaskHandle_t timerTask = NULL;
+static hw_timer_t *timer = NULL;
+static Preferences store;
+static bool storeOpen = false;
+
+void halPinMode(uint8_t pin, uint8_t mode) {
+  pinMode(pin, mode);
+}
+
+void halDigitalWrite(uint8_t pin, uint8_t level) {
+  digitalWrite(pin, level);
+}
+
+// Called from the laser ISR. The Arduino core's digitalRead() is in flash
+// unless it is built with CONFIG_ARDUINO_ISR_IRAM, so the register is read
+// inline.
+int IRAM_ATTR halDigitalRead(uint8_t pin) {
+  return gpio_ll_get_level(&GPIO, (gpio_num_t)pin);
+}
+
+void halPwmWrite(uint8_t pin, uint8_t duty) {
+  analogWrite(pin, duty);
+}
+
+static void IRAM_ATTR onEdge(void *arg) {
+  ((HalIsr)arg)();
+}
+
+// attachInterrupt() installs the GPIO ISR service without
+// ESP_INTR_FLAG_IRAM, which masks it for as long as a flash write keeps
+// the cache off (an NVS page erase takes tens of ms): the edges of a pill
+// passing meanwhile collapse into one late interrupt. Installed IRAM-only,
+// the laser ISRs keep timestamping edges into their ring, and the motion
+// task counts them once the write is done.
+void halAttachEdgeInterrupt(uint8_t pin, HalIsr isr) {
+  if (!gpioServiceInstalled) {
+    gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+    gpioServiceInstalled = true;
+  }
+  gpio_set_intr_type((gpio_num_t)pin, GPIO_INTR_ANYEDGE);
+  gpio_isr_handler_add((gpio_num_t)pin, onEdge, (void *)isr);
+  gpio_intr_enable((gpio_num_t)pin);
+}
+
+// Same clock as micros(), which is not in IRAM either
+uint32_t IRAM_ATTR halMicros() {
+  return (uint32_t)esp_timer_get_time();
+}
+
+static void IRAM_ATTR onEncoderLimit(void *arg) {
+  pcnt_unit_t unit = (pcnt_unit_t)(intptr_t)arg;
+  uint32_t status = 0;
+  pcnt_get_event_status(unit, &status);
+  if (status & PCNT_EVT_H_LIM) {
+    encoderBase[unit] += ENCODER_LIMIT;
+  } else if (status & PCNT_EVT_L_LIM) {
+    encoderBase[unit] -= ENCODER_LIMIT;
+  }
+}
+
+// Both PCNT channels of the unit count, each using the other pin as
+// direction, which gives 4 counts per encoder cycle without any CPU load
+bool halEncoderAttach(uint8_t unit, uint8_t pinA, uint8_t pinB) {
+  if (unit >= HAL_ENCODER_COUNT || pinA == HAL_NO_PIN || pinB == HAL_NO_PIN) {
+    return false;
+  }
+  pcnt_unit_t pcntUnit = (pcnt_unit_t)unit;
+
+  pcnt_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.unit = pcntUnit;
+  config.counter_h_lim = ENCODER_LIMIT;
+  config.counter_l_lim = -ENCODER_LIMIT;
+  config.lctrl_mode = PCNT_MODE_REVERSE;
+  config.hctrl_mode = PCNT_MODE_KEEP;
+
+  config.channel = PCNT_CHANNEL_0;
+  config.pulse_gpio_num = pinA;
+  config.ctrl_gpio_num = pinB;
+  config.pos_mode = PCNT_COUNT_DEC;
+  config.neg_mode = PCNT_COUNT_INC;
+  if (pcnt_unit_config(&config) != ESP_OK) {
+    return false;
+  }
+
+  config.channel = PCNT_CHANNEL_1;
+  config.pulse_gpio_num = pinB;
+  config.ctrl_gpio_num = pinA;
+  config.pos_mode = PCNT_COUNT_INC;
+  config.neg_mode = PCNT_COUNT_DEC;
+  if (pcnt_unit_config(&config) != ESP_OK) {
+    return false;
+  }
+
+  pcnt_set_filter_value(pcntUnit, ENCODER_FILTER);
+  pcnt_filter_enable(pcntUnit);
+  pcnt_event_enable(pcntUnit, PCNT_EVT_H_LIM);
+  pcnt_event_enable(pcntUnit, PCNT_EVT_L_LIM);
+
+  if (!pcntServiceInstalled) {
+    pcnt_isr_service_install(0);
+    pcntServiceInstalled = true;
+  }
+  pcnt_isr_handler_add(pcntUnit, onEncoderLimit, (void *)(intptr_t)unit);
+
+  pcnt_counter_pause(pcntUnit);
+  pcnt_counter_clear(pcntUnit);
+  encoderBase[unit] = 0;
+  pcnt_counter_resume(pcntUnit);
+  return true;
+}
+
+int32_t halEncoderRead(uint8_t unit) {
+  if (unit >= HAL_ENCODER_COUNT) {
+    return 0;
+  }
+  // Retry if the limit interrupt moved the base while the counter was read
+  int32_t base;
+  int16_t count;
+  do {
+    base = encoderBase[unit];
+    pcnt_get_counter_value((pcnt_unit_t)unit, &count);
+  } while (base != encoderBase[unit]);
+  return base + count;
+}
+
+void halServoAttach(HalServo servo, uint8_t pin, int minPulseUs, int maxPulseUs) {
+  if (servo >= HAL_SERVO_COUNT || pin == HAL_NO_PIN) {
+    return;
+  }
+  if (!pwmTimersAllocated) {
+    ESP32PWM::allocateTimer(0);
+    ESP32PWM::allocateTimer(1);
+    ESP32PWM::allocateTimer(2);
+    ESP32PWM::allocateTimer(3);
+    pwmTimersAllocated = true;
+  }
+  servos[servo].setPeriodHertz(50);
+  servos[servo].attach(pin, minPulseUs, maxPulseUs);
+}
+
+void halServoWrite(HalServo servo, int angle) {
+  if (servo < HAL_SERVO_COUNT && servos[servo].attached()) {
+    servos[servo].write(angle);
+  }
+}
+
+static void IRAM_ATTR onTimer() {
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(timerTask, &woken);
+  if (woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+static void timerLoop(void *arg) {
+  for (;;) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    timerFn();
+  }
+}
+
+// The esp_timer task would run the callback on core 0, behind WiFi, lwIP
+// and the TLS work of the network task. The actuator writes are not
+// ISR-safe (LEDC and servo driver calls), so the interrupt only wakes a
+// task on the motion core. The interrupt is allocated on the calling
+// core; call this from setup(), which runs there.
+bool halTimerStart(uint32_t periodUs, HalTimerFn fn) {
+  timerFn = fn;
+  if (xTaskCreatePinnedToCore(timerLoop, "motion_out", TIMER_TASK_STACK, NULL, TIMER_TASK_PRIORITY, &timerTask,
+                              TIMER_CORE) != pdPASS) {
+    return false;
+  }
+  timer = timerBegin(TIMER_NUMBER, TIMER_DIVIDER, true);
+  if (timer == NULL) {
+    return false;
+  }
+  timerAttachInterrupt(timer, onTimer, true);
+  timerAlarmWrite(timer, periodUs, true);
+  timerAlarmEnable(timer);
+  return true;
+}
+
+uint32_t IRAM_ATTR halCycleCount() {
+  return cpu_hal_get_cycle_count();
+}
+
+uint8_t IRAM_ATTR halCoreId() {
+  return (uint8_t)xPortGetCoreID();
+}
+
+uint32_t halCpuHz() {
+  return getCpuFrequencyMhz() * 1000000UL;
+}
+
+void halSensorBegin() {
+  dht.begin();
+}
+
+bool halReadEnvironment(float &temperatureC, float &humidityPct) {
+  // read(true) runs the transaction; the getters then use its result
+  if (!dht.read(true)) {
+    temperatureC = NAN;
+    humidityPct = NAN;
+    return false;
+  }
+  temperatureC = dht.readTemperature();
+  humidityPct = dht.readHumidity();
+  return !isnan(temperatureC) && !isnan(humidityPct);
+}
+
+static bool openStore() {
+  if (!storeOpen) {
+    storeOpen = store.begin(STORE_NAMESPACE, false);
+  }
+  return storeOpen;
+}
+
+size_t halStoreRead(const char *key, void *data, size_t size) {
+  if (!openStore()) {
+    return 0;
+  }
+  size_t length = store.getBytesLength(key);
+  if (length == 0 || length > size) {
+    return 0;
+  }
+  return store.getBytes(key, data, length);
+}
+
+// Preferences commits every put, so one call is one NVS write
+bool halStoreWrite(const char *key, const void *data, size_t length) {
+  return openStore() && store.putBytes(key, data, length) == length;
+}
@@ -0,0 +1,64 @@
+#ifndef HEALTHMETRICS_H
+#define HEALTHMETRICS_H
+
+/**
+ * Health metric table, shared by the firmware (HealthSeries.h) and the host
+ * decoder (tools/health/). Plain C preprocessor only, no Arduino
+ * dependencies.
+ *
+ * HEALTH_METRIC(id, name, scale, encoding):
+ * - scale:    values are integers; the decoder divides by scale
+ * - HEALTH_ENCODING_DELTA:  gauges, each sample stored as the change from
+ *                           the previous one
+ * - HEALTH_ENCODING_DOD:    counters, stored as the change of that change
+ *                           (delta-of-delta), so a steady rate costs 1 bit
+ *
+ * The column order is part of the batch format, so only append new metrics
+ * at the end (the batch header carries the metric count).
+ */
+
+#define HEALTH_ENCODING_DELTA 0
+#define HEALTH_ENCODING_DOD 1
+
+#define HEALTH_METRICS(HEALTH_METRIC) \
+  HEALTH_METRIC(HEALTH_TEMPERATURE, "temperature", 100, HEALTH_ENCODING_DELTA) \
+  HEALTH_METRIC(HEALTH_HUMIDITY, "humidity", 100, HEALTH_ENCODING_DELTA) \
+  HEALTH_METRIC(HEALTH_RSSI, "rssi", 1, HEALTH_ENCODING_DELTA) \
+  HEALTH_METRIC(HEALTH_HEAP_FREE, "heapFree", 1, HEALTH_ENCODING_DELTA) \
+  HEALTH_METRIC(HEALTH_MOTION_MAX_US, "motionMaxUs", 1, HEALTH_ENCODING_DELTA) \
+  HEALTH_METRIC(HEALTH_NETWORK_MAX_US, "networkMaxUs", 1, HEALTH_ENCODING_DELTA) \
+  HEALTH_METRIC(HEALTH_RECONNECTS, "reconnects", 1, HEALTH_ENCODING_DOD) \
+  HEALTH_METRIC(HEALTH_OUTBOX_PENDING, "outboxPending", 1, HEALTH_ENCODING_DELTA) \
+  HEALTH_METRIC(HEALTH_QUEUE_DEPTH, "queueDepth", 1, HEALTH_ENCODING_DELTA) \
+  HEALTH_METRIC(HEALTH_QUEUE_WAIT_MAX_MS, "queueWaitMaxMs", 1, HEALTH_ENCODING_DELTA) \
+  HEALTH_METRIC(HEALTH_ENV_FAILURES, "envFailures", 1, HEALTH_ENCODING_DOD) \
+  HEALTH_METRIC(HEALTH_WIFI_RECONNECTS, "wifiReconnects", 1, HEALTH_ENCODING_DOD) \
+  HEALTH_METRIC(HEALTH_WIFI_JOIN_ATTEMPTS, "wifiJoinAttempts", 1, HEALTH_ENCODING_DOD) \
+  HEALTH_METRIC(HEALTH_WIFI_RECONNECT_MS, "wifiReconnectMs", 1, HEALTH_ENCODING_DELTA)
+
+#define HEALTH_METRIC_ENUM(id, name, scale, encoding) id,
+enum HealthMetric {
+  HEALTH_METRICS(HEALTH_METRIC_ENUM)
+  HEALTH_METRIC_COUNT
+};
+#undef HEALTH_METRIC_ENUM
+
+#define HEALTH_BATCH_MAGIC 0x484D   // "MH"
+#define HEALTH_BATCH_VERSION 1
+
+/*
+ * Batch: a 16-byte little-endian header followed by a bit stream (MSB
+ * first). Samples are stored row by row, each metric as one code of the
+ * value (first sample), delta or delta-of-delta in zigzag form:
+ *
+ *   0                 zero
+ *   10    + 7 bits
+ *   110   + 9 bits
+ *   1110  + 12 bits
+ *   11110 + 40 bits
+ *   11111             no value (e.g. RSSI while offline); the next value
+ *                     continues from the last one present
+ */
+#define HEALTH_HEADER_BYTES 16
+
+#endif
@@ -0,0 +1,135 @@
+#include "HealthSeries.h"
+#include <string.h>
+
+#define HEALTH_CODE_MAX_BITS 45     // 11110 + 40 bits
+#define HEALTH_SAMPLE_MAX_BITS (HEALTH_METRIC_COUNT * HEALTH_CODE_MAX_BITS)
+#define HEALTH_STREAM_BITS ((HEALTH_BATCH_BYTES - HEALTH_HEADER_BYTES) * 8)
+
+static_assert(sizeof(HealthBatchHeader) == HEALTH_HEADER_BYTES, "HealthBatchHeader layout");
+static_assert(HEALTH_SAMPLE_MAX_BITS <= HEALTH_STREAM_BITS, "HEALTH_BATCH_BYTES too small for one sample");
+
+#define HEALTH_METRIC_ENCODING(id, name, scale, encoding) encoding,
+static const uint8_t ENCODINGS[HEALTH_METRIC_COUNT] = {
+  HEALTH_METRICS(HEALTH_METRIC_ENCODING)
+};
+#undef HEALTH_METRIC_ENCODING
+
+HealthSeries::HealthSeries(uint16_t periodS) : periodS(periodS) {
+  sequence = 0;
+  reset();
+}
+
+void HealthSeries::reset() {
+  memset(buffer, 0, sizeof(buffer));
+  bitLength = 0;
+  samples = 0;
+  startS = 0;
+  for (uint8_t i = 0; i < HEALTH_METRIC_COUNT; i++) {
+    previous[i] = 0;
+    previousDelta[i] = 0;
+    seen[i] = false;
+  }
+}
+
+// Bits past the end of the buffer are counted but not stored; add() then
+// rolls the sample back
+void HealthSeries::writeBits(uint64_t value, uint8_t count) {
+  while (count > 0) {
+    count--;
+    if (((value >> count) & 1) && bitLength < HEALTH_STREAM_BITS) {
+      uint32_t at = HEALTH_HEADER_BYTES * 8 + bitLength;
+      buffer[at >> 3] |= (uint8_t)(0x80 >> (at & 7));
+    }
+    bitLength++;
+  }
+}
+
+// Zigzag value in the smallest bucket that holds it (see HealthMetrics.h)
+void HealthSeries::writeCode(int64_t value) {
+  uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+  if (zigzag == 0) {
+    writeBits(0x0, 1);
+  } else if (zigzag < (1ULL << 7)) {
+    writeBits(0x2, 2);
+    writeBits(zigzag, 7);
+  } else if (zigzag < (1ULL << 9)) {
+    writeBits(0x6, 3);
+    writeBits(zigzag, 9);
+  } else if (zigzag < (1ULL << 12)) {
+    writeBits(0xE, 4);
+    writeBits(zigzag, 12);
+  } else {
+    writeBits(0x1E, 5);
+    writeBits(zigzag, 40);
+  }
+}
+
+bool HealthSeries::add(const int32_t values[HEALTH_METRIC_COUNT], uint32_t uptimeS) {
+  if (samples == UINT8_MAX) {
+    return false;
+  }
+  uint32_t startBits = bitLength;
+  int64_t savedPrevious[HEALTH_METRIC_COUNT];
+  int64_t savedDelta[HEALTH_METRIC_COUNT];
+  bool savedSeen[HEALTH_METRIC_COUNT];
+  memcpy(savedPrevious, previous, sizeof(previous));
+  memcpy(savedDelta, previousDelta, sizeof(previousDelta));
+  memcpy(savedSeen, seen, sizeof(seen));
+
+  for (uint8_t i = 0; i < HEALTH_METRIC_COUNT; i++) {
+    if (values[i] == HEALTH_MISSING) {
+      writeBits(0x1F, 5);
+      continue;
+    }
+    int64_t value = values[i];
+    if (!seen[i]) {
+      // First value of the batch: stored whole
+      writeCode(value);
+      seen[i] = true;
+    } else {
+      int64_t delta = value - previous[i];
+      writeCode(ENCODINGS[i] == HEALTH_ENCODING_DOD ? delta - previousDelta[i] : delta);
+      previousDelta[i] = delta;
+    }
+    previous[i] = value;
+  }
+
+  if (bitLength > HEALTH_STREAM_BITS) {
+    // Did not fit: clear the partial sample, the batch is unchanged
+    uint32_t at = HEALTH_HEADER_BYTES * 8 + startBits;
+    if (at & 7) {
+      buffer[at >> 3] &= (uint8_t)(0xFF << (8 - (at & 7)));
+      at += 8 - (at & 7);
+    }
+    memset(buffer + (at >> 3), 0, sizeof(buffer) - (at >> 3));
+    bitLength = startBits;
+    memcpy(previous, savedPrevious, sizeof(previous));
+    memcpy(previousDelta, savedDelta, sizeof(previousDelta));
+    memcpy(seen, savedSeen, sizeof(seen));
+    return false;
+  }
+  if (samples == 0) {
+    startS = uptimeS;
+  }
+  samples++;
+  return true;
+}
+
+const uint8_t *HealthSeries::seal() {
+  HealthBatchHeader header;
+  header.magic = HEALTH_BATCH_MAGIC;
+  header.version = HEALTH_BATCH_VERSION;
+  header.metrics = HEALTH_METRIC_COUNT;
+  header.sequence = sequence++;
+  header.samples = samples;
+  header.reserved = 0;
+  header.periodS = periodS;
+  header.bits = (uint16_t)bitLength;
+  header.startS = startS;
+  memcpy(buffer, &header, sizeof(header));
+  return buffer;
+}
+
+size_t HealthSeries::size() const {
+  return HEALTH_HEADER_BYTES + (bitLength + 7) / 8;
+}
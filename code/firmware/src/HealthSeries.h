@@ -0,0 +1,76 @@
+#ifndef HEALTHSERIES_H
+#define HEALTHSERIES_H
+
+/**
+ * HealthSeries - Compressed health time series, published as batches
+ *
+ * The network task samples the health metrics (HealthMetrics.h) every
+ * periodS seconds into a fixed buffer, encoding each value as it arrives
+ * (delta or delta-of-delta, variable-width codes, Gorilla style), so an
+ * unchanged metric costs one bit per sample. Every few minutes, or when
+ * the buffer cannot take the next sample, the batch is published as one
+ * binary message instead of one JSON message per sample.
+ * tools/health/health_decode turns batches back into JSON rows.
+ *
+ * Usage:
+ *   int32_t values[HEALTH_METRIC_COUNT] = { ... };  // HEALTH_MISSING if unknown
+ *   if (!series.add(values, millis() / 1000)) {
+ *     publish(series.seal(), series.size());
+ *     series.reset();
+ *     series.add(values, millis() / 1000);
+ *   }
+ *   // ...and the same publish/reset when the batch period is over
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "HealthMetrics.h"
+
+#define HEALTH_BATCH_BYTES 440      // Header + bit stream; fits an outbox record
+#define HEALTH_MISSING INT32_MIN    // Sample value with no reading
+
+struct HealthBatchHeader {
+  uint16_t magic;        // HEALTH_BATCH_MAGIC
+  uint8_t version;
+  uint8_t metrics;       // Columns per sample
+  uint16_t sequence;     // Batch number since boot; gaps are lost batches
+  uint8_t samples;
+  uint8_t reserved;
+  uint16_t periodS;      // Between samples
+  uint16_t bits;         // Length of the bit stream
+  uint32_t startS;       // Uptime at the first sample
+} __attribute__((packed));
+
+class HealthSeries {
+private:
+  uint8_t buffer[HEALTH_BATCH_BYTES];
+  uint32_t bitLength;      // Bits written after the header
+  uint8_t samples;
+  uint16_t sequence;
+  uint16_t periodS;
+  uint32_t startS;
+  int64_t previous[HEALTH_METRIC_COUNT];
+  int64_t previousDelta[HEALTH_METRIC_COUNT];
+  bool seen[HEALTH_METRIC_COUNT];
+
+  void writeBits(uint64_t value, uint8_t count);
+  void writeCode(int64_t value);
+
+public:
+  explicit HealthSeries(uint16_t periodS);
+
+  // Appends one sample; false (and the batch unchanged) when it does not
+  // fit, in which case the batch is published and the sample added again
+  bool add(const int32_t values[HEALTH_METRIC_COUNT], uint32_t uptimeS);
+
+  uint8_t sampleCount() const { return samples; }
+
+  // Fills in the header; the batch is buffer[0, size())
+  const uint8_t *seal();
+  size_t size() const;
+
+  // Starts the next batch
+  void reset();
+};
+
+#endif
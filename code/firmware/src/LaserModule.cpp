@@ -1,13 +1,51 @@
 #include "LaserModule.h"
+#include "Hal.h"
+#include "SpscRing.h"
+#include "Trace.h"
+
+// Read by the ISRs while flash writes keep the cache off, so in DRAM
+static DRAM_ATTR SpscRing<LaserEdge, LASER_EDGE_QUEUE_SIZE> laserEdges;
+static DRAM_ATTR uint8_t receiverPins[LASER_MAX_CHANNELS];
+
+// The ISRs take no argument, so each channel gets its own
+template <uint8_t CHANNEL>
+static void IRAM_ATTR onLaserEdge() {
+  LaserEdge edge;
+  edge.timestampUs = halMicros();
+  edge.channel = CHANNEL;
+  edge.blocked = (halDigitalRead(receiverPins[CHANNEL]) == HIGH);
+  laserEdges.push(edge);
+  TRACE(TRACE_LASER_EDGE, CHANNEL << 1 | edge.blocked);
+}
+
+static const HalIsr laserIsrs[LASER_MAX_CHANNELS] = {
+  onLaserEdge<0>, onLaserEdge<1>, onLaserEdge<2>, onLaserEdge<3>
+};
 
 void laserSetup() {
-  pinMode(LASER_PIN, INPUT);
- 
-  pinMode(LASER_TRANSMITTER_PIN, OUTPUT);
-  digitalWrite(LASER_TRANSMITTER_PIN, HIGH);
+  halPinMode(LASER_TRANSMITTER_PIN, OUTPUT);
+  halDigitalWrite(LASER_TRANSMITTER_PIN, HIGH);
+}
+
+bool laserAttach(uint8_t channel, uint8_t receiverPin) {
+  if (channel >= LASER_MAX_CHANNELS) {
+    return false;
+  }
+  receiverPins[channel] = receiverPin;
+  halPinMode(receiverPin, INPUT);
+  halAttachEdgeInterrupt(receiverPin, laserIsrs[channel]);
+  return true;
 }
 
-bool isLaserBlocked() {
-  int laserValue = digitalRead(LASER_PIN);
+bool isLaserBlocked(uint8_t channel) {
+  int laserValue = halDigitalRead(receiverPins[channel]);
   return (laserValue == HIGH);
-}
\ No newline at end of file
+}
+
+bool laserPopEdge(LaserEdge &edge) {
+  return laserEdges.pop(edge);
+}
+
+uint32_t laserDroppedEdges() {
+  return laserEdges.dropped();
+}
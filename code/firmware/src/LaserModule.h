@@ -3,10 +3,35 @@
 
 #include <Arduino.h>
 
+// Receiver of the first channel (see Channels.h for the full table)
 #define LASER_PIN 22
-#define LASER_TRANSMITTER_PIN 23
+#define LASER_TRANSMITTER_PIN 23   // Powers the transmitters of all channels
 
+#define LASER_MAX_CHANNELS 4
+
+// Depth of the ISR -> loop() edge queue (must be a power of two). Shared by
+// all channels: their GPIO interrupts are all serviced on the motion core,
+// one after the other, so there is still a single producer.
+#define LASER_EDGE_QUEUE_SIZE 128
+
+// One beam transition captured by a laser ISR
+struct LaserEdge {
+  uint32_t timestampUs;  // micros() at the moment of the edge
+  uint8_t channel;       // Channel whose beam changed
+  bool blocked;          // Beam state after the edge
+};
+
+// Switches the transmitters on; call once before laserAttach()
 void laserSetup();
-bool isLaserBlocked();
 
-#endif 
\ No newline at end of file
+// Starts capturing edges of one channel's receiver
+bool laserAttach(uint8_t channel, uint8_t receiverPin);
+bool isLaserBlocked(uint8_t channel);
+
+// Pops the oldest captured edge; returns false when the queue is empty
+bool laserPopEdge(LaserEdge &edge);
+
+// Number of edges lost because loop() did not drain the queue in time
+uint32_t laserDroppedEdges();
+
+#endif 
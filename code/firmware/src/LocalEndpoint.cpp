@@ -0,0 +1,176 @@
+#include "LocalEndpoint.h"
+#include "Hal.h"
+#include "Outbox.h"
+
+#define LOCAL_NONCE_KEY "lnonce"
+
+static_assert(LOCAL_BODY_MAX <= OUTBOX_MAX_PAYLOAD, "A local command must fit an outbox record");
+
+LocalEndpoint::LocalEndpoint() : server(LOCAL_PORT) {
+  enabled = false;
+  listening = false;
+  memset(key, 0, sizeof(key));
+  lastNonce = 0;
+  onCommand = NULL;
+  onRecorded = NULL;
+  lastActivityMs = 0;
+  memset(&metrics, 0, sizeof(metrics));
+}
+
+bool LocalEndpoint::begin(const char *keyHex, LocalCommandFn handler, LocalRecordFn recorder) {
+  if (!localKeyFromHex(keyHex, key)) {
+    Serial.println("Local endpoint off (no key)");
+    return false;
+  }
+  onCommand = handler;
+  onRecorded = recorder;
+  if (halStoreRead(LOCAL_NONCE_KEY, &lastNonce, sizeof(lastNonce)) != sizeof(lastNonce)) {
+    lastNonce = 0;
+  }
+  enabled = true;
+  return true;
+}
+
+void LocalEndpoint::drop() {
+  client.stop();
+  request.clear();
+}
+
+void LocalEndpoint::respond(uint16_t code, const char *reason, const uint8_t *body, size_t length, bool sign) {
+  char head[256];
+  int headLength = snprintf(head, sizeof(head),
+                            "HTTP/1.1 %u %s\r\nContent-Type: %s\r\nContent-Length: %u\r\n",
+                            code, reason,
+                            length > 0 && (body[0] & 0xF0) == 0x80 ? "application/msgpack" : "application/json",
+                            (unsigned)length);
+  if (sign) {
+    char signature[LOCAL_SIGNATURE_HEX + 1];
+    localSign(key, "res", request.getNonce(), body, length, signature);
+    headLength += snprintf(head + headLength, sizeof(head) - headLength,
+                           "X-MediFlow-Nonce: %llu\r\nX-MediFlow-Signature: %s\r\n",
+                           (unsigned long long)request.getNonce(), signature);
+  }
+  headLength += snprintf(head + headLength, sizeof(head) - headLength, "\r\n");
+
+  // Head and body in one segment
+  uint8_t packet[sizeof(head) + LOCAL_REPLY_MAX];
+  size_t bodyLength = length < LOCAL_REPLY_MAX ? length : LOCAL_REPLY_MAX;
+  memcpy(packet, head, headLength);
+  memcpy(packet + headLength, body, bodyLength);
+  client.write(packet, headLength + bodyLength);
+}
+
+void LocalEndpoint::handle() {
+  static const uint8_t AUTH_ERROR[] = "{\"error\":\"auth\"}";
+  static const uint8_t PATH_ERROR[] = "{\"error\":\"not_found\"}";
+  static const uint8_t STORE_ERROR[] = "{\"error\":\"store\"}";
+
+  if (!request.startsWith("POST /command ")) {
+    metrics.malformed++;
+    respond(404, "Not Found", PATH_ERROR, sizeof(PATH_ERROR) - 1, false);
+    return;
+  }
+
+  char expected[LOCAL_SIGNATURE_HEX + 1];
+  size_t length = request.bodyLength();
+  localSign(key, "req", request.getNonce(), request.body(), length, expected);
+  if (!request.nonceValid() || request.getNonce() <= lastNonce ||
+      !localSignatureEquals(expected, request.getSignature())) {
+    metrics.rejected++;
+    Serial.println("Local endpoint: rejected unauthenticated or replayed request");
+    respond(401, "Unauthorized", AUTH_ERROR, sizeof(AUTH_ERROR) - 1, false);
+    return;
+  }
+  lastNonce = request.getNonce();
+
+  // The nonce is in flash before the command acts, so a reset right after
+  // it cannot let the same request run twice. Without it, nothing runs.
+  if (!halStoreWrite(LOCAL_NONCE_KEY, &lastNonce, sizeof(lastNonce))) {
+    metrics.rejected++;
+    Serial.println("Local endpoint: nonce not stored, request refused");
+    respond(503, "Service Unavailable", STORE_ERROR, sizeof(STORE_ERROR) - 1, false);
+    return;
+  }
+
+  memcpy(command, request.body(), length);
+  uint8_t reply[LOCAL_REPLY_MAX];
+  size_t replyLength = onCommand(request.body(), length, reply, sizeof(reply));
+  respond(200, "OK", reply, replyLength, true);
+  metrics.accepted++;
+
+  // Slow work after the reply: the outbox record
+  if (onRecorded) {
+    onRecorded(command, length);
+  }
+}
+
+void LocalEndpoint::poll(uint32_t nowMs, bool wifiConnected) {
+  if (!enabled) {
+    return;
+  }
+  if (!listening) {
+    if (!wifiConnected) {
+      return;
+    }
+    WiFi.setSleep(false);
+    server.begin();
+    server.setNoDelay(true);
+    listening = true;
+    Serial.print("Local endpoint listening on port ");
+    Serial.println(LOCAL_PORT);
+  }
+
+  if (!client.connected()) {
+    client = server.available();
+    if (!client) {
+      return;
+    }
+    client.setNoDelay(true);
+    lastActivityMs = nowMs;
+  }
+
+  int available = client.available();
+  while (available > 0) {
+    size_t room;
+    uint8_t *at = request.space(&room);
+    int read = client.read(at, (size_t)available < room ? (size_t)available : room);
+    if (read <= 0) {
+      break;
+    }
+    available -= read;
+    lastActivityMs = nowMs;
+
+    LocalStatus status = request.commit(read);
+    while (status == LOCAL_COMPLETE) {
+      uint32_t startedUs = micros();
+      bool keepAlive = request.keepAlive();
+      handle();
+      uint32_t elapsedUs = micros() - startedUs;
+      if (elapsedUs > metrics.maxHandleUs) {
+        metrics.maxHandleUs = elapsedUs;
+      }
+      if (!keepAlive) {
+        drop();
+        return;
+      }
+      request.consume();
+      status = request.commit(0);  // A pipelined request may be complete already
+    }
+    if (status == LOCAL_TOO_LARGE || status == LOCAL_MALFORMED) {
+      static const uint8_t FRAME_ERROR[] = "{\"error\":\"request\"}";
+      metrics.malformed++;
+      respond(status == LOCAL_TOO_LARGE ? 413 : 400, status == LOCAL_TOO_LARGE ? "Payload Too Large" : "Bad Request",
+              FRAME_ERROR, sizeof(FRAME_ERROR) - 1, false);
+      drop();
+      return;
+    }
+  }
+
+  uint32_t limitMs = request.empty() ? LOCAL_IDLE_TIMEOUT_MS : LOCAL_REQUEST_TIMEOUT_MS;
+  if (nowMs - lastActivityMs > limitMs) {
+    if (!request.empty()) {
+      metrics.malformed++;
+    }
+    drop();
+  }
+}
@@ -0,0 +1,86 @@
+#ifndef LOCALENDPOINT_H
+#define LOCALENDPOINT_H
+
+/**
+ * LocalEndpoint - Authenticated LAN control endpoint
+ *
+ * Accepts the command schema of the MQTT command topic over plain HTTP on
+ * the local network (LocalProtocol.h), so a pharmacy workstation on the
+ * same LAN can dispense without the cloud round trip, or while the broker
+ * is unreachable. Accepted commands go through the same handler as MQTT
+ * commands (dispenserSubmit()); the resulting status messages take the
+ * usual durable path through the outbox, and the command itself is handed
+ * to onRecorded() after the reply is sent, so the cloud learns of it once
+ * the link is back.
+ *
+ * Requests are authenticated with HMAC-SHA256 under a per-device key and
+ * a nonce that must grow with every request; the last nonce is written
+ * to flash before the command runs (a request whose nonce cannot be
+ * stored is refused with 503), so a captured request cannot be replayed,
+ * not even after a reset. That NVS write is part of every request's
+ * latency. Replies are signed too.
+ *
+ * poll() never waits: it takes whatever bytes have arrived and answers a
+ * request as soon as it is complete. One client is served at a time;
+ * keep-alive connections skip the TCP handshake on later requests. WiFi
+ * modem sleep is turned off while the endpoint runs, as it would hold
+ * inbound packets until the next beacon (100 ms or more).
+ *
+ * Usage:
+ * 1. setup:   endpoint.begin(keyHex, handleCommand, recordCommand);  // no-op without a key
+ * 2. network: endpoint.poll(millis(), wifiConnected);
+ */
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include "LocalProtocol.h"
+
+#define LOCAL_REQUEST_TIMEOUT_MS 2000   // A started request must complete within this
+#define LOCAL_IDLE_TIMEOUT_MS 30000     // Keep-alive connection closed when idle this long
+#define LOCAL_REPLY_MAX 160
+
+// Handles one command; returns the reply length (0: no reply of its own)
+typedef size_t (*LocalCommandFn)(uint8_t *payload, size_t length, uint8_t *reply, size_t replySize);
+// Called with each accepted command after it was answered
+typedef void (*LocalRecordFn)(const uint8_t *payload, size_t length);
+
+struct LocalEndpointMetrics {
+  uint32_t accepted;
+  uint32_t rejected;      // Bad signature, stale nonce or nonce not stored
+  uint32_t malformed;     // Bad framing, too large or timed out
+  uint32_t maxHandleUs;   // Longest request handling, body complete to reply written
+};
+
+class LocalEndpoint {
+private:
+  WiFiServer server;
+  WiFiClient client;
+  bool enabled;
+  bool listening;
+  uint8_t key[LOCAL_KEY_BYTES];
+  uint64_t lastNonce;
+  LocalCommandFn onCommand;
+  LocalRecordFn onRecorded;
+
+  LocalMessage request;
+  uint32_t lastActivityMs;
+  uint8_t command[LOCAL_BODY_MAX];  // Pristine copy; the handler parses in place
+  LocalEndpointMetrics metrics;
+
+  void handle();
+  void respond(uint16_t code, const char *reason, const uint8_t *body, size_t length, bool sign);
+  void drop();
+
+public:
+  LocalEndpoint();
+
+  // Enables the endpoint; returns false (and stays off) without a valid key
+  bool begin(const char *keyHex, LocalCommandFn handler, LocalRecordFn recorder);
+
+  // Network task: accept, read and answer without blocking
+  void poll(uint32_t nowMs, bool wifiConnected);
+
+  LocalEndpointMetrics getMetrics() const { return metrics; }
+};
+
+#endif
@@ -0,0 +1,319 @@
+#include "LocalProtocol.h"
+#include <string.h>
+
+static const uint32_t SHA256_K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, uint8_t n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+Sha256::Sha256() {
+  static const uint32_t INITIAL[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  memcpy(state, INITIAL, sizeof(state));
+  length = 0;
+  used = 0;
+}
+
+void Sha256::compress() {
+  uint32_t w[64];
+  for (uint8_t i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+           (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+  }
+  for (uint8_t i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (uint8_t i = 0; i < 64; i++) {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void Sha256::update(const void *data, size_t size) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  length += size;
+  while (size > 0) {
+    size_t room = 64 - used;
+    size_t take = room < size ? room : size;
+    memcpy(block + used, bytes, take);
+    used += (uint8_t)take;
+    bytes += take;
+    size -= take;
+    if (used == 64) {
+      compress();
+      used = 0;
+    }
+  }
+}
+
+void Sha256::finish(uint8_t digest[32]) {
+  uint64_t bits = length * 8;
+  uint8_t pad = 0x80;
+  update(&pad, 1);
+  pad = 0;
+  while (used != 56) {
+    update(&pad, 1);
+  }
+  uint8_t size[8];
+  for (uint8_t i = 0; i < 8; i++) {
+    size[i] = (uint8_t)(bits >> (56 - 8 * i));
+  }
+  update(size, 8);
+  for (uint8_t i = 0; i < 8; i++) {
+    digest[4 * i] = (uint8_t)(state[i] >> 24);
+    digest[4 * i + 1] = (uint8_t)(state[i] >> 16);
+    digest[4 * i + 2] = (uint8_t)(state[i] >> 8);
+    digest[4 * i + 3] = (uint8_t)state[i];
+  }
+}
+
+void localSign(const uint8_t key[LOCAL_KEY_BYTES], const char *direction, uint64_t nonce,
+               const uint8_t *body, size_t length, char hex[LOCAL_SIGNATURE_HEX + 1]) {
+  // HMAC (RFC 2104); the key is shorter than the 64-byte block
+  uint8_t pad[64];
+  memset(pad, 0x36, sizeof(pad));
+  for (uint8_t i = 0; i < LOCAL_KEY_BYTES; i++) {
+    pad[i] ^= key[i];
+  }
+
+  char nonceText[24];
+  char *at = nonceText + sizeof(nonceText);
+  *--at = '\n';
+  do {
+    *--at = (char)('0' + nonce % 10);
+    nonce /= 10;
+  } while (nonce > 0);
+
+  Sha256 inner;
+  inner.update(pad, sizeof(pad));
+  inner.update(direction, strlen(direction));
+  inner.update("\n", 1);
+  inner.update(at, nonceText + sizeof(nonceText) - at);
+  inner.update(body, length);
+  uint8_t digest[32];
+  inner.finish(digest);
+
+  for (uint8_t i = 0; i < sizeof(pad); i++) {
+    pad[i] ^= 0x36 ^ 0x5c;
+  }
+  Sha256 outer;
+  outer.update(pad, sizeof(pad));
+  outer.update(digest, sizeof(digest));
+  outer.finish(digest);
+
+  static const char HEX_DIGITS[] = "0123456789abcdef";
+  for (uint8_t i = 0; i < 32; i++) {
+    hex[2 * i] = HEX_DIGITS[digest[i] >> 4];
+    hex[2 * i + 1] = HEX_DIGITS[digest[i] & 0x0F];
+  }
+  hex[LOCAL_SIGNATURE_HEX] = '\0';
+}
+
+bool localSignatureEquals(const char *a, const char *b) {
+  uint8_t diff = 0;
+  for (uint8_t i = 0; i < LOCAL_SIGNATURE_HEX; i++) {
+    diff |= (uint8_t)(a[i] ^ b[i]);
+  }
+  return diff == 0;
+}
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool localKeyFromHex(const char *hex, uint8_t key[LOCAL_KEY_BYTES]) {
+  if (hex == NULL || strlen(hex) != LOCAL_KEY_BYTES * 2) {
+    return false;
+  }
+  for (uint8_t i = 0; i < LOCAL_KEY_BYTES; i++) {
+    int high = hexValue(hex[2 * i]);
+    int low = hexValue(hex[2 * i + 1]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    key[i] = (uint8_t)(high << 4 | low);
+  }
+  return true;
+}
+
+LocalMessage::LocalMessage() {
+  length = 0;
+  reset();
+}
+
+// Forgets the message being framed; buffered bytes are kept
+void LocalMessage::reset() {
+  headLength = 0;
+  contentLength = 0;
+  nonce = 0;
+  hasNonce = false;
+  close = false;
+  signature[0] = '\0';
+}
+
+uint8_t *LocalMessage::space(size_t *room) {
+  *room = sizeof(buffer) - 1 - length;
+  return buffer + length;
+}
+
+// Case-insensitive match of a header name at the start of a line
+static bool headerIs(const char *line, size_t lineLength, const char *name, const char **value) {
+  size_t nameLength = strlen(name);
+  if (lineLength <= nameLength || line[nameLength] != ':') {
+    return false;
+  }
+  for (size_t i = 0; i < nameLength; i++) {
+    char c = line[i];
+    if (c >= 'A' && c <= 'Z') {
+      c = (char)(c - 'A' + 'a');
+    }
+    if (c != name[i]) {
+      return false;
+    }
+  }
+  *value = line + nameLength + 1;
+  while (**value == ' ' || **value == '\t') {
+    (*value)++;
+  }
+  return true;
+}
+
+static bool parseDecimal(const char *text, const char *end, uint64_t &out) {
+  if (text >= end) {
+    return false;
+  }
+  out = 0;
+  for (const char *c = text; c < end; c++) {
+    if (*c < '0' || *c > '9' || out > (UINT64_MAX - 9) / 10) {
+      return false;
+    }
+    out = out * 10 + (uint64_t)(*c - '0');
+  }
+  return true;
+}
+
+LocalStatus LocalMessage::parseHead() {
+  const char *head = (const char *)buffer;
+  const char *end = head + headLength - 2;  // The blank line's CRLF
+  const char *line = (const char *)memchr(head, '\n', end - head);
+  if (line == NULL) {
+    return LOCAL_MALFORMED;
+  }
+  line++;  // Headers start after the start line
+
+  while (line < end) {
+    const char *next = (const char *)memchr(line, '\n', end - line);
+    const char *lineEnd = next ? next : end;
+    const char *valueEnd = lineEnd > line && lineEnd[-1] == '\r' ? lineEnd - 1 : lineEnd;
+    size_t lineLength = valueEnd - line;
+    const char *value;
+    uint64_t number;
+
+    if (headerIs(line, lineLength, "content-length", &value)) {
+      if (!parseDecimal(value, valueEnd, number)) {
+        return LOCAL_MALFORMED;
+      }
+      if (number > LOCAL_BODY_MAX) {
+        return LOCAL_TOO_LARGE;
+      }
+      contentLength = (size_t)number;
+    } else if (headerIs(line, lineLength, "x-mediflow-nonce", &value)) {
+      hasNonce = parseDecimal(value, valueEnd, nonce);
+    } else if (headerIs(line, lineLength, "x-mediflow-signature", &value)) {
+      if (valueEnd - value == LOCAL_SIGNATURE_HEX) {
+        for (uint8_t i = 0; i < LOCAL_SIGNATURE_HEX; i++) {
+          char c = value[i];
+          signature[i] = c >= 'A' && c <= 'F' ? (char)(c - 'A' + 'a') : c;
+        }
+        signature[LOCAL_SIGNATURE_HEX] = '\0';
+      }
+    } else if (headerIs(line, lineLength, "connection", &value)) {
+      close = valueEnd - value == 5 && (value[0] == 'c' || value[0] == 'C');
+    }
+    line = lineEnd + 1;
+  }
+  return LOCAL_INCOMPLETE;
+}
+
+LocalStatus LocalMessage::commit(size_t added) {
+  size_t previous = length;
+  length += added;
+
+  if (headLength == 0) {
+    // The blank line may straddle the previous read
+    size_t from = previous > 3 ? previous - 3 : 0;
+    for (size_t i = from; i + 4 <= length; i++) {
+      if (memcmp(buffer + i, "\r\n\r\n", 4) == 0) {
+        headLength = i + 4;
+        break;
+      }
+    }
+    if (headLength == 0) {
+      return length > LOCAL_HEAD_MAX ? LOCAL_TOO_LARGE : LOCAL_INCOMPLETE;
+    }
+    if (headLength > LOCAL_HEAD_MAX) {
+      return LOCAL_TOO_LARGE;
+    }
+    LocalStatus status = parseHead();
+    if (status != LOCAL_INCOMPLETE) {
+      return status;
+    }
+  }
+  return length >= headLength + contentLength ? LOCAL_COMPLETE : LOCAL_INCOMPLETE;
+}
+
+void LocalMessage::consume() {
+  size_t total = headLength + contentLength;
+  if (headLength == 0 || total > length) {
+    length = 0;
+  } else {
+    memmove(buffer, buffer + total, length - total);
+    length -= total;
+  }
+  reset();
+}
+
+void LocalMessage::clear() {
+  length = 0;
+  reset();
+}
+
+bool LocalMessage::startsWith(const char *startLine) const {
+  size_t prefix = strlen(startLine);
+  return headLength >= prefix && memcmp(buffer, startLine, prefix) == 0;
+}
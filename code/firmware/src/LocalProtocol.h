@@ -0,0 +1,108 @@
+#ifndef LOCALPROTOCOL_H
+#define LOCALPROTOCOL_H
+
+/**
+ * LocalProtocol - Framing and authentication of the LAN control endpoint
+ *
+ * A command is an HTTP/1.1 request carrying the same payload as the MQTT
+ * command topic (JSON or MessagePack, see CommandParser.h):
+ *
+ *   POST /command HTTP/1.1
+ *   Content-Length: <n>
+ *   X-MediFlow-Nonce: <decimal u64, larger than any nonce used before>
+ *   X-MediFlow-Signature: <hex HMAC-SHA256(key, "req\n" nonce "\n" body)>
+ *
+ * The device answers with the command's reply, signed the same way under
+ * "res\n" and the request's nonce, so each side proves it holds the
+ * shared key: the device only acts on signed, fresh requests and the
+ * client only trusts signed replies. The prefixes keep a request's
+ * signature from being replayed as a reply. Connections are kept alive
+ * between requests unless "Connection: close" is sent.
+ *
+ * No Arduino dependencies: the device (LocalEndpoint.h) and the host tool
+ * (tools/local/) share this code.
+ *
+ * Usage:
+ *   LocalMessage msg;
+ *   size_t room; uint8_t *at = msg.space(&room);  // read up to room bytes into at
+ *   if (msg.commit(n) == LOCAL_COMPLETE) { ...; msg.consume(); }
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOCAL_PORT 8080
+#define LOCAL_KEY_BYTES 32
+#define LOCAL_HEAD_MAX 512          // Start line and headers
+#define LOCAL_BODY_MAX 448          // OUTBOX_MAX_PAYLOAD: a command is recorded in the outbox
+#define LOCAL_SIGNATURE_HEX 64
+
+// SHA-256 (FIPS 180-4), incremental
+class Sha256 {
+private:
+  uint32_t state[8];
+  uint8_t block[64];
+  uint64_t length;   // Bytes hashed so far
+  uint8_t used;      // Bytes in block
+
+  void compress();
+
+public:
+  Sha256();
+  void update(const void *data, size_t size);
+  void finish(uint8_t digest[32]);
+};
+
+// HMAC-SHA256 over direction "\n" nonce "\n" body, as lowercase hex
+void localSign(const uint8_t key[LOCAL_KEY_BYTES], const char *direction, uint64_t nonce,
+               const uint8_t *body, size_t length, char hex[LOCAL_SIGNATURE_HEX + 1]);
+
+// Compares two signatures in constant time
+bool localSignatureEquals(const char *a, const char *b);
+
+// Parses LOCAL_KEY_BYTES * 2 hex digits; false if the key is missing or malformed
+bool localKeyFromHex(const char *hex, uint8_t key[LOCAL_KEY_BYTES]);
+
+enum LocalStatus : uint8_t {
+  LOCAL_INCOMPLETE,
+  LOCAL_COMPLETE,
+  LOCAL_TOO_LARGE,
+  LOCAL_MALFORMED
+};
+
+// One HTTP message (request or response), framed incrementally in a fixed
+// buffer. Bytes after a complete message are kept for the next one.
+class LocalMessage {
+private:
+  uint8_t buffer[LOCAL_HEAD_MAX + LOCAL_BODY_MAX + 1];
+  size_t length;         // Bytes in buffer
+  size_t headLength;     // Up to and including the blank line; 0 until seen
+  size_t contentLength;
+  uint64_t nonce;
+  bool hasNonce;
+  bool close;
+  char signature[LOCAL_SIGNATURE_HEX + 1];
+
+  void reset();
+  LocalStatus parseHead();
+
+public:
+  LocalMessage();
+
+  uint8_t *space(size_t *room);
+  LocalStatus commit(size_t added);
+  void consume();        // Drops the completed message
+  void clear();          // Drops everything buffered
+  bool empty() const { return length == 0; }
+
+  // Valid once commit() returned LOCAL_COMPLETE
+  bool startsWith(const char *startLine) const;
+  uint8_t *body() { return buffer + headLength; }
+  size_t bodyLength() const { return contentLength; }
+  bool nonceValid() const { return hasNonce; }
+  uint64_t getNonce() const { return nonce; }
+  const char *getSignature() const { return signature; }
+  bool keepAlive() const { return !close; }
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include "MotionScheduler.h"
+
+struct MotionOutput {
+  MotionOutputKind kind;
+  uint8_t id;
+  std::atomic<uint32_t> command{0};  // target u16 << 16 | rampMs u16; motion side writes
+
+  // Motion side
+  int target;
+
+  // Timer side
+  uint32_t applied;     // Last command picked up
+  int from;
+  int to;
+  int written;          // Value on the hardware, -1 before the first write
+  uint32_t writtenUs;
+  uint32_t startUs;
+  uint32_t rampUs;
+};
+
+static MotionOutput outputs[MOTION_OUTPUT_MAX];
+static std::atomic<uint8_t> outputCount{0};
+static std::atomic<uint32_t> hardwareWrites{0};
+
+static uint32_t packCommand(int value, uint16_t rampMs) {
+  return (uint32_t)(uint16_t)value << 16 | rampMs;
+}
+
+static MotionOutput *findOutput(MotionOutputKind kind, uint8_t id) {
+  uint8_t count = outputCount.load(std::memory_order_relaxed);
+  for (uint8_t i = 0; i < count; i++) {
+    if (outputs[i].id == id && outputs[i].kind == kind) {
+      return &outputs[i];
+    }
+  }
+  return NULL;
+}
+
+static void writeHardware(const MotionOutput &output, int value) {
+  switch (output.kind) {
+    case MOTION_OUT_DIGITAL:
+      halDigitalWrite(output.id, value ? HIGH : LOW);
+      break;
+    case MOTION_OUT_PWM:
+      halPwmWrite(output.id, (uint8_t)value);
+      break;
+    case MOTION_OUT_SERVO:
+      halServoWrite(output.id, value);
+      break;
+  }
+  hardwareWrites.store(hardwareWrites.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// Timer callback: pick up new commands, advance ramps, write what changed.
+// Costs one atomic load per output when nothing moves.
+static void motionTick() {
+  uint32_t nowUs = micros();
+  uint8_t count = outputCount.load(std::memory_order_acquire);
+  for (uint8_t i = 0; i < count; i++) {
+    MotionOutput &output = outputs[i];
+    uint32_t command = output.command.load(std::memory_order_acquire);
+    if (command != output.applied) {
+      output.applied = command;
+      output.from = output.written < 0 ? (int)(int16_t)(command >> 16) : output.written;
+      output.to = (int16_t)(command >> 16);
+      output.startUs = nowUs;
+      output.rampUs = (command & 0xFFFF) * 1000UL;
+    } else if (output.written == output.to) {
+      continue;
+    }
+
+    int value = output.to;
+    uint32_t elapsedUs = nowUs - output.startUs;
+    if (elapsedUs < output.rampUs) {
+      value = output.from + (int)((int64_t)(output.to - output.from) * elapsedUs / output.rampUs);
+    }
+    // A servo takes a new pulse width once per frame; writing faster
+    // only costs time. The end of a ramp waits for the next frame too.
+    if (value != output.written &&
+        (output.kind != MOTION_OUT_SERVO || output.written < 0 || nowUs - output.writtenUs >= MOTION_SERVO_FRAME_US)) {
+      writeHardware(output, value);
+      output.written = value;
+      output.writtenUs = nowUs;
+    }
+  }
+}
+
+void motionSchedulerBegin() {
+  motionTick();
+  if (!halTimerStart(MOTION_TIMER_PERIOD_US, motionTick)) {
+    Serial.println("Motion timer not available");
+  }
+}
+
+void motionWrite(MotionOutputKind kind, uint8_t id, int value, uint16_t rampMs) {
+  if (id == HAL_NO_PIN && kind != MOTION_OUT_SERVO) {
+    return;
+  }
+  MotionOutput *output = findOutput(kind, id);
+  if (output == NULL) {
+    uint8_t count = outputCount.load(std::memory_order_relaxed);
+    if (count >= MOTION_OUTPUT_MAX) {
+      Serial.println("Motion scheduler: too many outputs");
+      return;
+    }
+    output = &outputs[count];
+    output->kind = kind;
+    output->id = id;
+    output->target = value;
+    output->applied = ~packCommand(value, rampMs);
+    output->written = -1;
+    output->command.store(packCommand(value, rampMs), std::memory_order_relaxed);
+    outputCount.store(count + 1, std::memory_order_release);
+    return;
+  }
+  if (value == output->target) {
+    return;
+  }
+  output->target = value;
+  output->command.store(packCommand(value, rampMs), std::memory_order_release);
+}
+
+int motionTarget(MotionOutputKind kind, uint8_t id) {
+  MotionOutput *output = findOutput(kind, id);
+  return output ? output->target : 0;
+}
+
+uint32_t motionHardwareWrites() {
+  return hardwareWrites.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,58 @@
+#ifndef MOTIONSCHEDULER_H
+#define MOTIONSCHEDULER_H
+
+/**
+ * MotionScheduler - Timer-driven actuator outputs with ramps
+ *
+ * Owns every actuator output of the dispenser: the turntable H-bridge
+ * PWM and enable pins, the N20 enable/direction pins and the gate and
+ * refill servos. The motion side only states targets with motionWrite();
+ * a hardware timer (halTimerStart, MOTION_TIMER_PERIOD_US) applies them,
+ * so output timing no longer depends on how long a motion pass took.
+ *
+ * - Ramps: a write with rampMs > 0 moves the output linearly from where
+ *   it is to the target over that time, evaluated on every timer tick.
+ * - Write-on-change: a target equal to the last one is dropped on the
+ *   motion side, and the timer only touches the hardware when the value
+ *   it computes differs from the one last written. Servos are written at
+ *   most once per MOTION_SERVO_FRAME_US, the rate they can follow.
+ *
+ * Each output holds its latest command in one atomic word (target and
+ * ramp time), so the motion side never blocks and a command is never
+ * lost; if targets change faster than the timer runs, the newest wins.
+ * Outputs are registered on their first write, from the motion side
+ * only (dispenserSetup() or the motion task).
+ *
+ * Usage:
+ * 1. setup:  motionWrite(...) for the safe state, then motionSchedulerBegin();
+ * 2. motion: motionWrite(MOTION_OUT_PWM, pin, duty, rampMs);
+ *            motionWrite(MOTION_OUT_SERVO, servo, angle, rampMs);
+ */
+
+#include <Arduino.h>
+#include <atomic>
+#include "Hal.h"
+
+#define MOTION_TIMER_PERIOD_US 500
+#define MOTION_SERVO_FRAME_US 20000  // 50 Hz servo frame: at most one write per frame
+#define MOTION_OUTPUT_MAX 40   // 9 per channel at CHANNEL_MAX channels
+
+enum MotionOutputKind : uint8_t {
+  MOTION_OUT_DIGITAL,  // id: pin, value: LOW/HIGH
+  MOTION_OUT_PWM,      // id: pin, value: duty 0-255
+  MOTION_OUT_SERVO     // id: HalServo, value: angle
+};
+
+// Applies every pending command once, then starts the timer
+void motionSchedulerBegin();
+
+// Motion side: set an output's target, reached after rampMs (0: next tick)
+void motionWrite(MotionOutputKind kind, uint8_t id, int value, uint16_t rampMs = 0);
+
+// Motion side: last target written to an output, 0 if it was never written
+int motionTarget(MotionOutputKind kind, uint8_t id);
+
+// Hardware writes made by the timer since boot
+uint32_t motionHardwareWrites();
+
+#endif
@@ -1,41 +1,360 @@
-
 #include "MotorControl.h"
+#include "Trace.h"
+
+void motorSetup(const TurntablePins &pins) {
+  halPinMode(pins.rpwm, OUTPUT);
+  halPinMode(pins.lpwm, OUTPUT);
+  halPinMode(pins.rEn, OUTPUT);
+  halPinMode(pins.lEn, OUTPUT);
+
+  // Zero duty before the bridge is enabled, so it never starts driving.
+  // The scheduler applies outputs in the order they were first written.
+  stopMotor(pins);
+  motionWrite(MOTION_OUT_DIGITAL, pins.rEn, HIGH);
+  motionWrite(MOTION_OUT_DIGITAL, pins.lEn, HIGH);
+}
+
+// Outputs go through the motion scheduler, which drops unchanged values,
+// so these may be called on every motor tick
+void setMotorSpeed(const TurntablePins &pins, int speed) {
+  bool fromStandstill = motionTarget(MOTION_OUT_PWM, pins.lpwm) == 0;
+  motionWrite(MOTION_OUT_PWM, pins.rpwm, 0);
+  motionWrite(MOTION_OUT_PWM, pins.lpwm, speed, fromStandstill ? TURNTABLE_SOFT_START_MS : 0);
+}
+
+void stopMotor(const TurntablePins &pins) {
+  motionWrite(MOTION_OUT_PWM, pins.rpwm, 0);
+  motionWrite(MOTION_OUT_PWM, pins.lpwm, 0);
+}
+
+void openGate(HalServo gate) {
+  motionWrite(MOTION_OUT_SERVO, gate, 90);
+}
+
+void closeGate(HalServo gate) {
+  motionWrite(MOTION_OUT_SERVO, gate, 0);
+}
+
+// Direction and PWM of the L298N outputs
+static void driveN20(N20Motor &motor, bool forward, int pwm) {
+  motor.pwm = pwm;
+  motionWrite(MOTION_OUT_DIGITAL, motor.pins.in1, forward ? HIGH : LOW);
+  motionWrite(MOTION_OUT_DIGITAL, motor.pins.in2, forward ? LOW : HIGH);
+  motionWrite(MOTION_OUT_PWM, motor.pins.ena, pwm);
+}
+
+static void releaseN20(N20Motor &motor) {
+  motor.pwm = 0;
+  motionWrite(MOTION_OUT_PWM, motor.pins.ena, 0);
+  motionWrite(MOTION_OUT_DIGITAL, motor.pins.in1, LOW);
+  motionWrite(MOTION_OUT_DIGITAL, motor.pins.in2, LOW);
+}
+
+void setupN20Motor(N20Motor &motor, const AgitatorPins &pins, uint8_t encoderUnit) {
+  motor.pins = pins;
+  motor.encoderUnit = encoderUnit;
+  motor.hasEncoder = false;
+  motor.running = false;
+  motor.speed = 150;
+  motor.pwm = 0;
+  motor.state = N20_STOPPED;
+  motor.position = 0;
+  motor.lastUpdateMs = 0;
+  motor.measuredCps = 0;
+  motor.integral = 0;
+  motor.slow = false;
+  motor.slowSinceMs = 0;
+  motor.stateSinceMs = 0;
+  motor.retries = 0;
+  motor.jams = 0;
+  if (pins.ena == HAL_NO_PIN) {
+    return;
+  }
+
+  halPinMode(pins.ena, OUTPUT);
+  halPinMode(pins.in1, OUTPUT);
+  halPinMode(pins.in2, OUTPUT);
+  
+  // Initialize motor to stopped state
+  releaseN20(motor);
+
+  if (pins.encA != HAL_NO_PIN) {
+    motor.hasEncoder = halEncoderAttach(encoderUnit, pins.encA, pins.encB);
+    if (!motor.hasEncoder) {
+      Serial.println("N20 encoder not available, running open loop");
+    }
+  }
+}
+
+void startN20Motor(N20Motor &motor) {
+  motor.running = true;
+  motor.state = N20_FORWARD;
+  motor.integral = 0;
+  motor.slow = false;
+  motor.retries = 0;
+  motor.jams = 0;
+  motor.stateSinceMs = millis();
+  if (motor.pins.ena == HAL_NO_PIN) {
+    return;
+  }
+  if (motor.hasEncoder) {
+    motor.position = halEncoderRead(motor.encoderUnit);
+    motor.lastUpdateMs = millis();
+    motor.measuredCps = 0;
+  }
+  driveN20(motor, true, motor.speed);
+  TRACE(TRACE_N20_STATE, motor.encoderUnit << 8 | motor.state);
+}
+
+void stopN20Motor(N20Motor &motor) {
+  motor.running = false;
+  motor.state = N20_STOPPED;
+  if (motor.pins.ena == HAL_NO_PIN) {
+    return;
+  }
+  releaseN20(motor);
+  TRACE(TRACE_N20_STATE, motor.encoderUnit << 8 | motor.state);
+}
 
-Servo gateServo;
+void setN20MotorSpeed(N20Motor &motor, int speed) {
+  motor.speed = constrain(speed, 0, 255);
+  // With an encoder the speed loop owns the PWM
+  if (motor.running && motor.state == N20_FORWARD && !motor.hasEncoder && motor.pins.ena != HAL_NO_PIN) {
+    driveN20(motor, true, motor.speed);
+  }
+}
+
+void reverseN20Motor(N20Motor &motor) {
+  motor.running = true;
+  if (motor.pins.ena == HAL_NO_PIN) {
+    return;
+  }
+  driveN20(motor, false, motor.state == N20_REVERSING ? motor.params.reversePwm : motor.speed);
+  TRACE(TRACE_N20_STATE, motor.encoderUnit << 8 | motor.state);
+}
+
+// PID on the encoder speed with the target PWM as feed-forward. The
+// derivative acts on the measurement, so target steps do not kick it.
+static void runN20SpeedLoop(N20Motor &motor, float targetCps, float previousCps, uint32_t dtMs) {
+  const N20LoopParams &p = motor.params;
+  float error = targetCps - motor.measuredCps;
+  motor.integral += p.ki * error;
+  motor.integral = constrain(motor.integral, -p.integralLimit, p.integralLimit);
+  float derivative = (motor.measuredCps - previousCps) * 1000.0f / dtMs;
+
+  int pwm = motor.speed + (int)(p.kp * error + motor.integral - p.kd * derivative);
+  pwm = constrain(pwm, 0, 255);
+  if (pwm != motor.pwm) {
+    driveN20(motor, true, pwm);
+  }
+}
 
-void motorSetup() {
-  Serial.begin(115200);
-  Serial.println("Motor driver setup initialized");
-  delay(2000);
+N20State updateN20Motor(N20Motor &motor, uint32_t nowMs) {
+  if (!motor.running || !motor.hasEncoder || motor.state == N20_JAMMED) {
+    return motor.state;
+  }
 
-  pinMode(RPWM_PIN, OUTPUT);
-  pinMode(LPWM_PIN, OUTPUT);
-  pinMode(R_EN_PIN, OUTPUT);
-  pinMode(L_EN_PIN, OUTPUT);
+  uint32_t dtMs = nowMs - motor.lastUpdateMs;
+  if (dtMs == 0) {
+    return motor.state;
+  }
+  int32_t position = halEncoderRead(motor.encoderUnit);
+  float cps = (float)(position - motor.position) * 1000.0f / dtMs;
+  float previousCps = motor.measuredCps;
+  motor.measuredCps = (motor.measuredCps + cps) / 2;
+  motor.position = position;
+  motor.lastUpdateMs = nowMs;
 
-  digitalWrite(R_EN_PIN, HIGH);
-  digitalWrite(L_EN_PIN, HIGH);
+  const N20LoopParams &p = motor.params;
+  if (motor.state == N20_REVERSING) {
+    if (nowMs - motor.stateSinceMs >= p.reverseMs) {
+      motor.state = N20_FORWARD;
+      TRACE(TRACE_N20_STATE, motor.encoderUnit << 8 | motor.state);
+      motor.stateSinceMs = nowMs;
+      motor.integral = 0;
+      motor.slow = false;
+      driveN20(motor, true, motor.speed);
+    }
+    return motor.state;
+  }
+
+  float targetCps = motor.speed * p.countsPerSecPerPwm;
+  if (targetCps <= 0) {
+    motor.slow = false;
+    if (motor.pwm != 0) {
+      driveN20(motor, true, 0);
+    }
+    return motor.state;
+  }
+  runN20SpeedLoop(motor, targetCps, previousCps, dtMs);
+
+  // Stall: far below the target speed for jamMs, whatever the PWM did
+  if (motor.measuredCps < targetCps * p.jamSpeedPct / 100) {
+    if (!motor.slow) {
+      motor.slow = true;
+      motor.slowSinceMs = nowMs;
+    } else if (nowMs - motor.slowSinceMs >= p.jamMs) {
+      motor.jams++;
+      TRACE(TRACE_N20_JAM, motor.retries + 1);
+      motor.slow = false;
+      motor.integral = 0;
+      motor.stateSinceMs = nowMs;
+      if (++motor.retries > p.maxRetries) {
+        motor.state = N20_JAMMED;
+        TRACE(TRACE_N20_STATE, motor.encoderUnit << 8 | motor.state);
+        releaseN20(motor);
+        return motor.state;
+      }
+      motor.state = N20_REVERSING;
+      reverseN20Motor(motor);
+    }
+  } else {
+    motor.slow = false;
+    if (motor.retries > 0 && nowMs - motor.stateSinceMs >= p.recoveredMs) {
+      motor.retries = 0;
+    }
+  }
+  return motor.state;
+}
+
+DispenseSpeedController::DispenseSpeedController() {
+  stop();
 }
 
-void setMotorSpeed(int speed) {
-  analogWrite(RPWM_PIN, 0);
-  analogWrite(LPWM_PIN, speed);
+void DispenseSpeedController::begin(int targetCount, uint32_t nowMs) {
+  target = targetCount;
+  dispensed = 0;
+  lastPillMs = nowMs;
+  intervalMs = params.bulkIntervalMs;
+  pauseUntilMs = nowMs;
+  pulseStartMs = nowMs;
+  pulsing = false;
+  runSinceMs = nowMs;
+  integral = 0;
+  phase = PHASE_BULK;
+  update(nowMs);
 }
 
-void stopMotor() {
-  analogWrite(RPWM_PIN, 0);
-  analogWrite(LPWM_PIN, 0);
+void DispenseSpeedController::stop() {
+  phase = PHASE_IDLE;
+  target = 0;
+  dispensed = 0;
+  lastPillMs = 0;
+  intervalMs = 0;
+  pauseUntilMs = 0;
+  pulseStartMs = 0;
+  pulsing = false;
+  runSinceMs = 0;
+  integral = 0;
+  turntableSpeed = 0;
+  agitatorSpeed = 0;
 }
 
-// void servoSetup() {
-//   gateServo.attach(SERVO_PIN);
-//   closeGate();
-// }
+void DispenseSpeedController::onPill(int count, uint32_t nowMs) {
+  if (phase == PHASE_IDLE || phase == PHASE_DONE || count <= 0) {
+    return;
+  }
+
+  // A double transit is two pills in one interval
+  uint32_t measured = (nowMs - lastPillMs) / count;
+  intervalMs = (intervalMs * 3 + measured) / 4;
+  lastPillMs = nowMs;
+  dispensed += count;
+
+  update(nowMs);
+}
 
-void openGate() {
-  gateServo.write(90); 
+int DispenseSpeedController::interpolate(int bulkValue, int creepValue, int remaining) const {
+  if (remaining > params.taperPills) {
+    return bulkValue;
+  }
+  if (remaining <= params.creepPills || params.taperPills <= params.creepPills) {
+    return creepValue;
+  }
+  int span = params.taperPills - params.creepPills;
+  int pos = remaining - params.creepPills;
+  return creepValue + (bulkValue - creepValue) * pos / span;
 }
 
-void closeGate() {
-  gateServo.write(0); 
+void DispenseSpeedController::update(uint32_t nowMs) {
+  if (phase == PHASE_IDLE || phase == PHASE_DONE) {
+    turntableSpeed = 0;
+    agitatorSpeed = 0;
+    return;
+  }
+
+  int remaining = target - dispensed;
+  if (remaining <= 0) {
+    phase = PHASE_DONE;
+    turntableSpeed = 0;
+    agitatorSpeed = 0;
+    return;
+  }
+
+  if (remaining == 1) {
+    phase = PHASE_CREEP;
+  } else if (remaining <= params.taperPills) {
+    phase = PHASE_TAPER;
+  } else {
+    phase = PHASE_BULK;
+  }
+
+  agitatorSpeed = interpolate(params.agitatorBulkSpeed, params.agitatorCreepSpeed, remaining);
+
+  if ((int32_t)(pauseUntilMs - nowMs) > 0) {
+    turntableSpeed = 0;
+    runSinceMs = pauseUntilMs;
+    return;
+  }
+
+  if (remaining == 1) {
+    if (!pulsing) {
+      pulsing = true;
+      pulseStartMs = nowMs;
+    } else if (nowMs - pulseStartMs >= params.finalPulseMs) {
+      // Whatever this pulse released lands before the next one starts
+      pulsing = false;
+      pauseUntilMs = nowMs + params.flightMs;
+      turntableSpeed = 0;
+      return;
+    }
+    turntableSpeed = params.creepSpeed;
+    return;
+  }
+
+  int baseSpeed = interpolate(params.bulkSpeed, params.creepSpeed, remaining);
+  uint32_t desiredMs = (uint32_t)interpolate((int)params.bulkIntervalMs, (int)params.creepIntervalMs, remaining);
+
+  // While waiting for the next pill, the elapsed time is a lower bound on
+  // the interval, so a starved turntable speeds up without waiting for a pill.
+  uint32_t observedMs = intervalMs;
+  uint32_t sinceLastMs = nowMs - lastPillMs;
+  if (sinceLastMs > observedMs) {
+    observedMs = sinceLastMs;
+  }
+
+  // Positive error: pills are arriving too slowly
+  float error = ((float)observedMs - (float)desiredMs) / (float)desiredMs;
+  if (error > 2.0f) {
+    error = 2.0f;
+  }
+
+  integral += params.ki * error * baseSpeed;
+  integral = constrain(integral, -params.integralLimit, params.integralLimit);
+
+  int speed = baseSpeed + (int)(params.kp * error * baseSpeed + integral);
+  if (phase != PHASE_BULK) {
+    // Never exceed the profile once tapering, only nudge it upward
+    // far enough to keep the turntable moving.
+    speed = constrain(speed, params.minSpeed, baseSpeed);
+  }
+  turntableSpeed = constrain(speed, params.minSpeed, params.maxSpeed);
+
+  // Pills released within the last flight time are still in the air, one
+  // per observed interval
+  uint32_t airborneMs = nowMs - runSinceMs < params.flightMs ? nowMs - runSinceMs : params.flightMs;
+  if ((uint32_t)(remaining - 1) * observedMs < airborneMs) {
+    pauseUntilMs = nowMs + params.flightMs;
+    turntableSpeed = 0;
+  }
 }
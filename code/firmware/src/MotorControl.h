@@ -2,20 +2,196 @@
 #define MOTORCONTROL_H
 
 #include <Arduino.h>
-#include <ESP32Servo.h>
+#include "Hal.h"
+#include "MotionScheduler.h"
 
+// Pins of the first channel (see Channels.h for the full table)
 #define RPWM_PIN 25
 #define LPWM_PIN 26
 #define R_EN_PIN 27
 #define L_EN_PIN 14
+#define TURNTABLE_SOFT_START_MS 60  // Ramp up from standstill; changes while turning are immediate
 
-// #define SERVO_PIN 5
-void stopMotor();
-void motorSetup();
-void setMotorSpeed(int speed);
-void stopMotor();
-void servoSetup();
-void openGate();
-void closeGate();
+// N20 agitator driver (L298N or similar)
+#define N20_ENA 32    // Enable pin (PWM for speed control)
+#define N20_IN1 33    // Direction pin 1
+#define N20_IN2 2     // Direction pin 2
+#define N20_ENC_A 34  // Quadrature encoder (input-only pins)
+#define N20_ENC_B 35
+
+// BTS7960 turntable driver
+struct TurntablePins {
+  uint8_t rpwm;
+  uint8_t lpwm;
+  uint8_t rEn;
+  uint8_t lEn;
+};
+
+// N20 agitator driver; ena == HAL_NO_PIN when the bin has no agitator,
+// encA == HAL_NO_PIN when its motor has no encoder (open loop)
+struct AgitatorPins {
+  uint8_t ena;
+  uint8_t in1;
+  uint8_t in2;
+  uint8_t encA;
+  uint8_t encB;
+};
+
+void motorSetup(const TurntablePins &pins);
+void setMotorSpeed(const TurntablePins &pins, int speed);
+void stopMotor(const TurntablePins &pins);
+void openGate(HalServo gate);
+void closeGate(HalServo gate);
+
+// Encoder speed loop and jam recovery of an N20 with an encoder
+struct N20LoopParams {
+  float countsPerSecPerPwm = 50.0f;  // Unloaded speed per PWM count; converts the target
+  float kp = 0.01f;                  // PWM per count/s of speed error
+  float ki = 0.002f;                 // Integral gain (per update)
+  float kd = 0.0005f;                // Derivative gain, on the measured speed
+  float integralLimit = 60.0f;       // Anti-windup clamp, in PWM counts
+  uint8_t jamSpeedPct = 25;          // Below this share of the target speed...
+  uint16_t jamMs = 250;              // ...for this long, the agitator is jammed
+  uint16_t reverseMs = 300;          // Back off a jam for this long
+  int reversePwm = 200;
+  uint8_t maxRetries = 3;            // Jams in a row before giving up
+  uint16_t recoveredMs = 2000;       // Running this long clears the retry count
+};
+
+enum N20State : uint8_t {
+  N20_STOPPED,
+  N20_FORWARD,
+  N20_REVERSING,   // Backing off a jam, then retrying forward
+  N20_JAMMED       // Retries used up; outputs off until the next start
+};
+
+// State of one N20 agitator
+struct N20Motor {
+  AgitatorPins pins;
+  N20LoopParams params;
+  uint8_t encoderUnit;
+  bool hasEncoder;
+  bool running;
+  int speed;            // Target speed as PWM (0-255); without encoder, the PWM written
+  int pwm;              // PWM currently applied
+  N20State state;
+
+  // Odometry and speed loop (encoder only)
+  int32_t position;     // Encoder counts since setup
+  uint32_t lastUpdateMs;
+  float measuredCps;    // Smoothed speed, counts/s
+  float integral;
+  bool slow;            // Below the jam threshold since slowSinceMs
+  uint32_t slowSinceMs;
+  uint32_t stateSinceMs;
+  uint8_t retries;
+  uint16_t jams;        // Jams since startN20Motor(), recovered or not
+};
+
+void setupN20Motor(N20Motor &motor, const AgitatorPins &pins, uint8_t encoderUnit);
+void startN20Motor(N20Motor &motor);
+void stopN20Motor(N20Motor &motor);
+void setN20MotorSpeed(N20Motor &motor, int speed);
+void reverseN20Motor(N20Motor &motor);
+
+// Closed-loop update, every motor tick while running: reads the encoder,
+// drives the PWM toward the target speed, and backs off and retries when
+// the motor stalls. Open loop (no encoder) it only reports the state.
+N20State updateN20Motor(N20Motor &motor, uint32_t nowMs);
+
+// Tunable gains and limits for DispenseSpeedController. All values may be
+// changed at runtime with setParams(); they take effect on the next update().
+struct DispenseSpeedParams {
+  int bulkSpeed = 90;              // Turntable PWM while far from the target
+  int creepSpeed = 50;             // Turntable PWM for the final pills
+  int minSpeed = 30;               // Turntable stalls below this PWM
+  int maxSpeed = 160;
+  int agitatorBulkSpeed = 200;     // N20 PWM while far from the target
+  int agitatorCreepSpeed = 110;    // N20 PWM for the final pills
+  int taperPills = 8;              // Start slowing this many pills before target
+  int creepPills = 2;              // Creep speed and spacing for the last N pills
+  uint32_t bulkIntervalMs = 150;   // Desired pill spacing in bulk phase
+  uint32_t creepIntervalMs = 700;  // Desired pill spacing in creep phase
+  uint32_t flightMs = 70;          // Predicted turntable-to-beam flight time, worst case
+  uint32_t finalPulseMs = 70;      // Turntable run per try at the last pill, soft start included
+  float kp = 0.6f;                 // Gain on relative interval error
+  float ki = 0.05f;                // Integral gain (per update)
+  float integralLimit = 40.0f;     // Anti-windup clamp, in PWM counts
+};
+
+enum DispensePhase {
+  PHASE_IDLE,
+  PHASE_BULK,
+  PHASE_TAPER,
+  PHASE_CREEP,
+  PHASE_DONE
+};
+
+/**
+ * DispenseSpeedController - Closed-loop turntable/agitator speed profile
+ *
+ * Runs the turntable fast while many pills remain, tapers the speed as
+ * pillCount approaches the target, and finishes with a single-pill creep.
+ * The measured interval between laser-detected pills is the feedback
+ * signal: if pills arrive more slowly than the phase's desired interval,
+ * speed is raised, and vice versa.
+ *
+ * A pill is only counted flightMs after it left the turntable, so the
+ * controller stops feeding ahead of the count:
+ * - about flightMs / interval pills are in the air while the turntable
+ *   runs; once they alone could finish the order it holds the turntable
+ *   for flightMs to let them land, then goes on;
+ * - the last pill is fed in pulses of finalPulseMs, each followed by a
+ *   hold of flightMs, so the turntable has stopped before that pill can
+ *   reach the beam and nothing is released behind it.
+ * Each pulse is a fresh try: a pill released in it is counted before the
+ * next one starts. A second pill released behind the last one, in the
+ * rest of the same pulse, is the overshoot the timing cannot avoid; its
+ * odds grow with the pulse length and creep speed, so pulses are short
+ * and just fast enough to clear the soft start. Overshoot is also
+ * possible from a touching pair as the last transit, or pills counted as
+ * one.
+ * Every pill that lands is counted against the order (see Dispenser.cpp).
+ *
+ * Usage:
+ * 1. On dispense start: controller.begin(targetPillCount, millis());
+ * 2. For every counted pill: controller.onPill(count, millis());
+ * 3. On each motor tick: controller.update(millis()); then apply
+ *    getTurntableSpeed()/getAgitatorSpeed().
+ */
+class DispenseSpeedController {
+private:
+  DispenseSpeedParams params;
+  DispensePhase phase;
+  int target;
+  int dispensed;
+  uint32_t lastPillMs;
+  uint32_t intervalMs;       // Smoothed measured inter-pill interval
+  uint32_t pauseUntilMs;     // Turntable held until then
+  uint32_t runSinceMs;       // Turntable feeding since then
+  uint32_t pulseStartMs;
+  bool pulsing;              // Feeding the last pill
+  float integral;
+  int turntableSpeed;
+  int agitatorSpeed;
+
+  int interpolate(int bulkValue, int creepValue, int remaining) const;
+
+public:
+  DispenseSpeedController();
+
+  void begin(int targetCount, uint32_t nowMs);
+  void onPill(int count, uint32_t nowMs);
+  void update(uint32_t nowMs);
+  void stop();
+
+  void setParams(const DispenseSpeedParams &newParams) { params = newParams; }
+  const DispenseSpeedParams &getParams() const { return params; }
+
+  DispensePhase getPhase() const { return phase; }
+  int getTurntableSpeed() const { return turntableSpeed; }
+  int getAgitatorSpeed() const { return agitatorSpeed; }
+  uint32_t getIntervalMs() const { return intervalMs; }
+};
 
 #endif 
@@ -0,0 +1,132 @@
+#include "MqttConnection.h"
+
+MqttConnection::MqttConnection(PubSubClient &mqttClient, WiFiClientSecure &secureClient)
+    : client(mqttClient), net(secureClient) {
+    clientId = NULL;
+    willTopic = NULL;
+    willMessage = NULL;
+    onConnected = NULL;
+    state = LINK_WAIT_WIFI;
+    nextAttemptMs = 0;
+    backoffMs = 0;
+    attempts = 0;
+    reconnects = 0;
+    lastConnectMs = 0;
+    everConnected = false;
+}
+
+void MqttConnection::begin(const char *endpoint, uint16_t port,
+                           const char *caCert, const char *clientCert, const char *privateKey,
+                           const char *id, const char *lastWillTopic, const char *lastWillMessage) {
+    net.setCACert(caCert);
+    net.setCertificate(clientCert);
+    net.setPrivateKey(privateKey);
+    net.setHandshakeTimeout(config.handshakeTimeoutS);
+
+    client.setServer(endpoint, port);
+    client.setKeepAlive(config.keepAliveS);
+    client.setSocketTimeout(config.socketTimeoutS);
+
+    clientId = id;
+    willTopic = lastWillTopic;
+    willMessage = lastWillMessage;
+    backoffMs = config.baseBackoffMs;
+    state = LINK_WAIT_WIFI;
+}
+
+void MqttConnection::tick(uint32_t nowMs, bool wifiConnected) {
+    if (!wifiConnected && state != LINK_WAIT_WIFI) {
+        if (state == LINK_CONNECTED) {
+            Serial.println("MQTT: WiFi lost, link down");
+        }
+        client.disconnect();
+        state = LINK_WAIT_WIFI;
+        return;
+    }
+
+    switch (state) {
+        case LINK_WAIT_WIFI:
+            if (wifiConnected) {
+                state = LINK_CONNECTING;
+            }
+            break;
+
+        case LINK_BACKOFF:
+            if ((int32_t)(nowMs - nextAttemptMs) >= 0) {
+                state = LINK_CONNECTING;
+            }
+            break;
+
+        case LINK_CONNECTING:
+            attempt(nowMs);
+            break;
+
+        case LINK_CONNECTED:
+            if (!client.connected()) {
+                Serial.print("MQTT: connection lost, rc=");
+                Serial.println(client.state());
+                backoffMs = config.baseBackoffMs;
+                scheduleRetry(nowMs);
+            } else {
+                client.loop();
+            }
+            break;
+    }
+}
+
+void MqttConnection::attempt(uint32_t nowMs) {
+    attempts++;
+    Serial.println("Connecting to AWS IoT...");
+
+    uint32_t started = millis();
+    bool ok = client.connect(clientId, NULL, NULL, willTopic, 0, false, willMessage, config.cleanSession);
+    uint32_t elapsed = millis() - started;
+
+    if (!ok) {
+        Serial.print("Failed to connect to AWS IoT, rc=");
+        Serial.print(client.state());
+        scheduleRetry(nowMs + elapsed);
+        Serial.print(" Retrying in ");
+        Serial.print(nextAttemptMs - (nowMs + elapsed));
+        Serial.println(" ms");
+        return;
+    }
+
+    Serial.print("Connected to AWS IoT in ");
+    Serial.print(elapsed);
+    Serial.println(" ms");
+
+    if (everConnected) {
+        reconnects++;
+    }
+    everConnected = true;
+    lastConnectMs = elapsed;
+    backoffMs = config.baseBackoffMs;
+    state = LINK_CONNECTED;
+
+    if (onConnected) {
+        onConnected();
+    }
+}
+
+void MqttConnection::scheduleRetry(uint32_t nowMs) {
+    // Equal jitter: wait between half and all of the current backoff
+    uint32_t half = backoffMs / 2;
+    nextAttemptMs = nowMs + half + (uint32_t)random(half + 1);
+    state = LINK_BACKOFF;
+
+    backoffMs = backoffMs * 2;
+    if (backoffMs > config.maxBackoffMs) {
+        backoffMs = config.maxBackoffMs;
+    }
+}
+
+const char *MqttConnection::getStateName() const {
+    switch (state) {
+        case LINK_WAIT_WIFI: return "wait_wifi";
+        case LINK_BACKOFF: return "backoff";
+        case LINK_CONNECTING: return "connecting";
+        case LINK_CONNECTED: return "connected";
+    }
+    return "unknown";
+}
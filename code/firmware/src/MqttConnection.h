@@ -0,0 +1,95 @@
+#ifndef MQTT_CONNECTION_H
+#define MQTT_CONNECTION_H
+
+/**
+ * MqttConnection - Non-blocking MQTT/TLS connection state machine
+ *
+ * Replaces the blocking while(!connected) retry loop. tick() is called once
+ * per loop() pass and advances at most one step:
+ *
+ *   WAIT_WIFI -> CONNECTING -> CONNECTED
+ *                    |              |
+ *                    v              v
+ *                 BACKOFF <---- (link lost)
+ *
+ * Failed attempts back off exponentially (baseBackoffMs doubling up to
+ * maxBackoffMs) with random jitter, so a fleet of dispensers does not
+ * reconnect in lockstep after a broker outage. A single connect attempt is
+ * bounded by the TLS handshake and socket timeouts; while the link is down,
+ * loop() keeps counting pills and driving the motors.
+ *
+ * Certificates and server are configured once in begin(); reconnects reuse
+ * the same WiFiClientSecure instead of reloading them.
+ *
+ * The session is persistent (cleanSession false) unless configured
+ * otherwise: the broker keeps the subscriptions of CLIENT_ID and queues
+ * QoS 1 commands while the link is down, delivering them on reconnect.
+ */
+
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+#include <PubSubClient.h>
+
+enum MqttLinkState {
+    LINK_WAIT_WIFI,
+    LINK_BACKOFF,
+    LINK_CONNECTING,
+    LINK_CONNECTED
+};
+
+struct MqttConnectionConfig {
+    uint32_t baseBackoffMs = 1000;
+    uint32_t maxBackoffMs = 60000;
+    uint16_t handshakeTimeoutS = 5;  // TLS handshake limit per attempt
+    uint16_t socketTimeoutS = 5;     // CONNACK/read limit per attempt
+    uint16_t keepAliveS = 60;
+    bool cleanSession = false;
+};
+
+class MqttConnection {
+private:
+    PubSubClient &client;
+    WiFiClientSecure &net;
+    MqttConnectionConfig config;
+
+    const char *clientId;
+    const char *willTopic;
+    const char *willMessage;
+    void (*onConnected)();
+
+    MqttLinkState state;
+    uint32_t nextAttemptMs;
+    uint32_t backoffMs;
+    uint32_t attempts;        // Total connect attempts
+    uint32_t reconnects;      // Successful connects after the first
+    uint32_t lastConnectMs;   // Duration of the last successful attempt
+    bool everConnected;
+
+    void scheduleRetry(uint32_t nowMs);
+    void attempt(uint32_t nowMs);
+
+public:
+    MqttConnection(PubSubClient &mqttClient, WiFiClientSecure &secureClient);
+
+    // Configure TLS credentials, server and session parameters once
+    void begin(const char *endpoint, uint16_t port,
+               const char *caCert, const char *clientCert, const char *privateKey,
+               const char *id, const char *lastWillTopic, const char *lastWillMessage);
+
+    void setConfig(const MqttConnectionConfig &cfg) { config = cfg; }
+
+    // Called after every successful connect (subscribe, announce online)
+    void setOnConnected(void (*callback)()) { onConnected = callback; }
+
+    // Advance the state machine by at most one step; services the client when connected
+    void tick(uint32_t nowMs, bool wifiConnected);
+
+    bool isConnected() const { return state == LINK_CONNECTED; }
+    MqttLinkState getState() const { return state; }
+    const char *getStateName() const;
+    uint32_t getAttempts() const { return attempts; }
+    uint32_t getReconnects() const { return reconnects; }
+    uint32_t getLastConnectMs() const { return lastConnectMs; }
+};
+
+#endif
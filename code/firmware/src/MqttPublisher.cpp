@@ -0,0 +1,300 @@
+#include "MqttPublisher.h"
+
+#define MQTT_PUBLISH 0x30
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBACK 0x40
+#define MQTT_DUP 0x08
+
+MqttPublisher::MqttPublisher(Client &tlsClient) : net(tlsClient) {
+  slotHead = 0;
+  slotCount = 0;
+  arenaTail = 0;
+  nextPacketId = PUBLISH_FIRST_PACKET_ID;
+  inState = IN_HEADER;
+  inHeader = 0;
+  inRemaining = 0;
+  inLengthShift = 0;
+  inWord = 0;
+  session = false;
+  inboundLimit = 0;
+  ackHandler = NULL;
+  memset(&metrics, 0, sizeof(metrics));
+}
+
+// Contiguous space for one packet: after the newest packet, or at the
+// start of the arena when the end is too short. Returns -1 when full.
+int MqttPublisher::allocate(size_t length) {
+  if (slotCount == PUBLISH_SLOTS) {
+    return -1;
+  }
+  if (slotCount == 0) {
+    return length <= PUBLISH_ARENA_BYTES ? 0 : -1;
+  }
+  uint16_t headOffset = slotAt(0).offset;
+  if (arenaTail > headOffset) {
+    if ((size_t)(PUBLISH_ARENA_BYTES - arenaTail) >= length) {
+      return arenaTail;
+    }
+    return headOffset >= length ? 0 : -1;
+  }
+  return (size_t)(headOffset - arenaTail) >= length ? arenaTail : -1;
+}
+
+// Frees finished packets from the front; the arena is reused in order
+void MqttPublisher::release() {
+  while (slotCount > 0 && slotAt(0).state == SLOT_DONE) {
+    slotHead = (slotHead + 1) % PUBLISH_SLOTS;
+    slotCount--;
+  }
+  if (slotCount == 0) {
+    arenaTail = 0;
+  }
+  metrics.pending = slotCount;
+}
+
+bool MqttPublisher::enqueue(const char *topic, const uint8_t *payload, size_t length, uint8_t qos,
+                            uint16_t *packetIdOut) {
+  size_t topicLength = strlen(topic);
+  if (topicLength > OUTBOX_MAX_TOPIC || length > OUTBOX_MAX_PAYLOAD) {
+    metrics.refused++;
+    Serial.printf("MQTT: %u B message on %s is too large\n", (unsigned)length, topic);
+    return false;
+  }
+
+  size_t remaining = 2 + topicLength + (qos > 0 ? 2 : 0) + length;
+  size_t total = 1 + (remaining < 128 ? 1 : 2) + remaining;
+  int offset = allocate(total);
+  if (offset < 0) {
+    metrics.refused++;
+    return false;
+  }
+
+  uint16_t packetId = 0;
+  if (qos > 0) {
+    packetId = nextPacketId;
+    nextPacketId = nextPacketId == 0xFFFF ? PUBLISH_FIRST_PACKET_ID : nextPacketId + 1;
+  }
+
+  uint8_t *out = arena + offset;
+  *out++ = MQTT_PUBLISH | (qos > 0 ? 0x02 : 0x00);
+  if (remaining < 128) {
+    *out++ = (uint8_t)remaining;
+  } else {
+    *out++ = (uint8_t)(remaining & 0x7F) | 0x80;
+    *out++ = (uint8_t)(remaining >> 7);
+  }
+  *out++ = (uint8_t)(topicLength >> 8);
+  *out++ = (uint8_t)topicLength;
+  memcpy(out, topic, topicLength);
+  out += topicLength;
+  if (packetId != 0) {
+    *out++ = (uint8_t)(packetId >> 8);
+    *out++ = (uint8_t)packetId;
+  }
+  memcpy(out, payload, length);
+
+  Slot &slot = slots[(slotHead + slotCount) % PUBLISH_SLOTS];
+  slot.offset = (uint16_t)offset;
+  slot.length = (uint16_t)total;
+  slot.packetId = packetId;
+  slot.state = SLOT_QUEUED;
+  slotCount++;
+  arenaTail = (uint16_t)(offset + total);
+  metrics.queued++;
+  metrics.pending = slotCount;
+  if (packetIdOut != NULL) {
+    *packetIdOut = packetId;
+  }
+  return true;
+}
+
+void MqttPublisher::pump() {
+  uint8_t i = 0;
+  while (i < slotCount) {
+    Slot &first = slotAt(i);
+    if (first.state != SLOT_QUEUED) {
+      i++;
+      continue;
+    }
+    // A full window holds back everything behind it, so order is kept
+    if (first.packetId != 0 && metrics.inFlight >= PUBLISH_WINDOW) {
+      break;
+    }
+
+    // Packets adjacent in the arena go out in one write
+    uint16_t start = first.offset;
+    uint16_t end = start + first.length;
+    uint16_t windowUsed = metrics.inFlight + (first.packetId != 0 ? 1 : 0);
+    uint8_t next = i + 1;
+    while (next < slotCount) {
+      Slot &slot = slotAt(next);
+      if (slot.state != SLOT_QUEUED || slot.offset != end || end - start + slot.length > PUBLISH_RECORD_BYTES ||
+          (slot.packetId != 0 && windowUsed >= PUBLISH_WINDOW)) {
+        break;
+      }
+      end += slot.length;
+      windowUsed += slot.packetId != 0 ? 1 : 0;
+      next++;
+    }
+
+    size_t written = net.write(arena + start, end - start);
+    metrics.records++;
+    if (written != (size_t)(end - start)) {
+      // A partial packet leaves the stream unusable; reconnect
+      Serial.println("MQTT: publish write failed, dropping the link");
+      net.stop();
+      return;
+    }
+
+    for (; i < next; i++) {
+      Slot &slot = slotAt(i);
+      if (arena[slot.offset] & MQTT_DUP) {
+        metrics.resent++;
+      }
+      metrics.sent++;
+      if (slot.packetId != 0) {
+        slot.state = SLOT_SENT;
+        metrics.inFlight++;
+      } else {
+        slot.state = SLOT_DONE;
+      }
+    }
+  }
+  release();
+}
+
+// New connection: unacknowledged packets go out again, marked DUP
+void MqttPublisher::requeueUnacked() {
+  for (uint8_t i = 0; i < slotCount; i++) {
+    Slot &slot = slotAt(i);
+    if (slot.state == SLOT_SENT) {
+      slot.state = SLOT_QUEUED;
+      arena[slot.offset] |= MQTT_DUP;
+    }
+  }
+  metrics.inFlight = 0;
+}
+
+void MqttPublisher::acknowledge(uint16_t packetId) {
+  for (uint8_t i = 0; i < slotCount; i++) {
+    Slot &slot = slotAt(i);
+    if (slot.state == SLOT_SENT && slot.packetId == packetId) {
+      slot.state = SLOT_DONE;
+      metrics.inFlight--;
+      metrics.acked++;
+      if (ackHandler != NULL) {
+        ackHandler(packetId);
+      }
+      break;
+    }
+  }
+  release();
+}
+
+// Follows the packet framing of everything PubSubClient reads
+void MqttPublisher::inspect(uint8_t c) {
+  switch (inState) {
+    case IN_HEADER:
+      inHeader = c;
+      inRemaining = 0;
+      inLengthShift = 0;
+      inState = IN_LENGTH;
+      break;
+
+    case IN_LENGTH:
+      inRemaining |= (uint32_t)(c & 0x7F) << inLengthShift;
+      inLengthShift += 7;
+      if (c & 0x80) {
+        break;
+      }
+      if ((inHeader & 0xF0) == MQTT_PUBLISH && inboundLimit > 0 &&
+          1 + inLengthShift / 7 + inRemaining > inboundLimit) {
+        metrics.oversizeInbound++;
+        Serial.printf("MQTT: %lu B inbound message exceeds the %u B buffer\n",
+                      (unsigned long)inRemaining, inboundLimit);
+      }
+      inWord = 0;
+      inState = inRemaining > 0 ? IN_BODY : IN_HEADER;
+      break;
+
+    case IN_BODY:
+      if ((inHeader & 0xF0) == MQTT_PUBACK || (inHeader & 0xF0) == MQTT_CONNACK) {
+        inWord = (uint16_t)(inWord << 8 | c);
+      }
+      if (--inRemaining == 0) {
+        if ((inHeader & 0xF0) == MQTT_PUBACK) {
+          acknowledge(inWord);
+        } else if ((inHeader & 0xF0) == MQTT_CONNACK) {
+          session = (inWord >> 8) & 0x01;
+        }
+        inState = IN_HEADER;
+      }
+      break;
+  }
+}
+
+void MqttPublisher::inspect(const uint8_t *buf, int length) {
+  for (int i = 0; i < length; i++) {
+    inspect(buf[i]);
+  }
+}
+
+int MqttPublisher::connect(IPAddress ip, uint16_t port) {
+  inState = IN_HEADER;
+  session = false;
+  requeueUnacked();
+  return net.connect(ip, port);
+}
+
+int MqttPublisher::connect(const char *host, uint16_t port) {
+  inState = IN_HEADER;
+  session = false;
+  requeueUnacked();
+  return net.connect(host, port);
+}
+
+size_t MqttPublisher::write(uint8_t c) {
+  return net.write(c);
+}
+
+size_t MqttPublisher::write(const uint8_t *buf, size_t size) {
+  return net.write(buf, size);
+}
+
+int MqttPublisher::available() {
+  return net.available();
+}
+
+int MqttPublisher::read() {
+  int c = net.read();
+  if (c >= 0) {
+    inspect((uint8_t)c);
+  }
+  return c;
+}
+
+int MqttPublisher::read(uint8_t *buf, size_t size) {
+  int length = net.read(buf, size);
+  inspect(buf, length);
+  return length;
+}
+
+int MqttPublisher::peek() {
+  return net.peek();
+}
+
+void MqttPublisher::flush() {
+  net.flush();
+}
+
+void MqttPublisher::stop() {
+  net.stop();
+}
+
+uint8_t MqttPublisher::connected() {
+  return net.connected();
+}
+
+MqttPublisher::operator bool() {
+  return (bool)net;
+}
@@ -0,0 +1,148 @@
+#ifndef MQTT_PUBLISHER_H
+#define MQTT_PUBLISHER_H
+
+/**
+ * MqttPublisher - Queued MQTT publishing with batching and a QoS 1 window
+ *
+ * Sits between PubSubClient and the TLS client: PubSubClient is built on
+ * top of it (its own CONNECT/SUBSCRIBE/PING traffic passes straight
+ * through), while outgoing messages bypass PubSubClient's buffer.
+ *
+ * - enqueue() serialises a complete MQTT PUBLISH packet into a fixed
+ *   arena once and returns; it never touches the socket, so producers
+ *   (messageHandler(), telemetry, the outbox drain) cannot block on the
+ *   network. A message that does not fit is refused, never truncated.
+ * - pump() sends queued packets straight from the arena, several
+ *   contiguous packets per write, so one TLS record carries up to
+ *   PUBLISH_RECORD_BYTES of messages instead of one record per message.
+ * - QoS 1 packets stay in the arena until their PUBACK, which is picked
+ *   out of the inbound stream as PubSubClient reads it (PubSubClient
+ *   ignores acks). At most PUBLISH_WINDOW are unacknowledged; on a new
+ *   connection they are sent again with the DUP flag, ahead of anything
+ *   queued after them. Each PUBACK is passed to the onAck() handler with
+ *   its packet id, which enqueue() returned, so the outbox only removes a
+ *   record the broker has.
+ *
+ * Inbound PUBLISH packets larger than PubSubClient's buffer, which it
+ * would drop without a word, are counted in the metrics. The CONNACK's
+ * session-present flag, which PubSubClient does not expose either, is
+ * kept for sessionPresent().
+ *
+ * Sizes follow the message schema: the largest outgoing payload is an
+ * outbox record (OUTBOX_MAX_PAYLOAD, which also covers a health batch) on
+ * a topic of at most OUTBOX_MAX_TOPIC bytes.
+ *
+ * Usage:
+ * 1. MqttPublisher publisher(wifiClient); PubSubClient mqttClient(publisher);
+ *    publisher.onAck(handler);
+ * 2. producers: publisher.enqueue(topic, payload, length, 1, &packetId);
+ * 3. network task, while connected: mqttClient.loop(); publisher.pump();
+ */
+
+#include <Arduino.h>
+#include <Client.h>
+#include "Outbox.h"
+
+#define PUBLISH_PACKET_MAX (3 + 2 + OUTBOX_MAX_TOPIC + 2 + OUTBOX_MAX_PAYLOAD)
+#define PUBLISH_ARENA_BYTES 4096   // About 25 status messages, at least 7 of the largest
+#define PUBLISH_SLOTS 32
+#define PUBLISH_RECORD_BYTES 2048  // Per write; inside mbedTLS's 4 KB output buffer
+#define PUBLISH_WINDOW 4           // Unacknowledged QoS 1 packets
+#define PUBLISH_FIRST_PACKET_ID 0x8000  // PubSubClient numbers its SUBSCRIBEs from 1
+
+typedef void (*PublishAckFn)(uint16_t packetId);
+
+struct PublishMetrics {
+  uint32_t queued;
+  uint32_t refused;       // Queue full or message too large
+  uint32_t sent;          // Packets written, resends included
+  uint32_t resent;
+  uint32_t acked;
+  uint32_t records;       // Socket writes (TLS records)
+  uint32_t oversizeInbound;
+  uint16_t pending;       // Packets in the arena, sent or not
+  uint16_t inFlight;
+};
+
+class MqttPublisher : public Client {
+private:
+  enum SlotState : uint8_t { SLOT_QUEUED, SLOT_SENT, SLOT_DONE };
+
+  struct Slot {
+    uint16_t offset;
+    uint16_t length;
+    uint16_t packetId;    // 0 for QoS 0
+    SlotState state;
+  };
+
+  // Inbound packet framing, to find PUBACKs and the CONNACK
+  enum InboundState : uint8_t { IN_HEADER, IN_LENGTH, IN_BODY };
+
+  Client &net;
+
+  uint8_t arena[PUBLISH_ARENA_BYTES];
+  Slot slots[PUBLISH_SLOTS];
+  uint8_t slotHead;
+  uint8_t slotCount;
+  uint16_t arenaTail;     // Next free byte
+  uint16_t nextPacketId;
+
+  InboundState inState;
+  uint8_t inHeader;
+  uint32_t inRemaining;
+  uint8_t inLengthShift;
+  uint16_t inWord;        // First two body bytes: PUBACK id, CONNACK flags and code
+  bool session;
+  uint16_t inboundLimit;
+
+  PublishMetrics metrics;
+  PublishAckFn ackHandler;
+
+  Slot &slotAt(uint8_t i) { return slots[(slotHead + i) % PUBLISH_SLOTS]; }
+  int allocate(size_t length);
+  void release();
+  void requeueUnacked();
+  void acknowledge(uint16_t packetId);
+  void inspect(uint8_t c);
+  void inspect(const uint8_t *buf, int length);
+
+public:
+  explicit MqttPublisher(Client &tlsClient);
+
+  // Producer side: queue one message. False if it was refused; for QoS 1
+  // the packet id its PUBACK will carry is stored in *packetId.
+  bool enqueue(const char *topic, const uint8_t *payload, size_t length, uint8_t qos, uint16_t *packetId = NULL);
+  bool enqueue(const char *topic, const char *payload, uint8_t qos) {
+    return enqueue(topic, (const uint8_t *)payload, strlen(payload), qos);
+  }
+
+  // Network side, while the broker link is up: write what the window allows
+  void pump();
+
+  // Called from PubSubClient's reads with each acknowledged packet id
+  void onAck(PublishAckFn handler) { ackHandler = handler; }
+
+  // PubSubClient's buffer size; longer inbound messages are counted
+  void setInboundLimit(uint16_t bytes) { inboundLimit = bytes; }
+
+  PublishMetrics getMetrics() const { return metrics; }
+
+  // The broker resumed a stored session on the last connect
+  bool sessionPresent() const { return session; }
+
+  // Client, used by PubSubClient
+  int connect(IPAddress ip, uint16_t port);
+  int connect(const char *host, uint16_t port);
+  size_t write(uint8_t c);
+  size_t write(const uint8_t *buf, size_t size);
+  int available();
+  int read();
+  int read(uint8_t *buf, size_t size);
+  int peek();
+  void flush();
+  void stop();
+  uint8_t connected();
+  operator bool();
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include "OrderQueue.h"
+
+OrderQueue::OrderQueue() {
+  memset(orders, 0, sizeof(orders));
+  nextSeq = 0;
+  active = 0;
+  executedNext = 0;
+  executedCount = 0;
+}
+
+// FNV-1a
+uint32_t OrderQueue::idHash(const char *prescriptionId) {
+  uint32_t hash = 2166136261u;
+  for (const char *c = prescriptionId; *c != '\0'; c++) {
+    hash = (hash ^ (uint8_t)*c) * 16777619u;
+  }
+  return hash;
+}
+
+void OrderQueue::addExecuted(uint32_t idHash) {
+  executed[executedNext] = idHash;
+  executedNext = (executedNext + 1) % ORDER_EXECUTED_IDS;
+  if (executedCount < ORDER_EXECUTED_IDS) {
+    executedCount++;
+  }
+}
+
+bool OrderQueue::wasExecuted(const char *prescriptionId) const {
+  if (prescriptionId == NULL || prescriptionId[0] == '\0') {
+    return false;
+  }
+  uint32_t hash = idHash(prescriptionId);
+  for (uint8_t i = 0; i < executedCount; i++) {
+    if (executed[i] == hash) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint8_t OrderQueue::executedIds(uint32_t *out, uint8_t max) const {
+  uint8_t count = executedCount < max ? executedCount : max;
+  // The newest count entries, oldest first
+  for (uint8_t i = 0; i < count; i++) {
+    out[i] = executed[(executedNext + ORDER_EXECUTED_IDS - count + i) % ORDER_EXECUTED_IDS];
+  }
+  return count;
+}
+
+Order *OrderQueue::find(const char *prescriptionId) {
+  if (prescriptionId == NULL || prescriptionId[0] == '\0') {
+    return NULL;
+  }
+  Order *match = NULL;
+  for (int i = 0; i < ORDER_TABLE_SIZE; i++) {
+    Order &order = orders[i];
+    if (order.state != ORDER_EMPTY && strcmp(order.prescriptionId, prescriptionId) == 0 &&
+        (match == NULL || order.seq > match->seq)) {
+      match = &order;
+    }
+  }
+  return match;
+}
+
+// Free slot, or the oldest finished order when the table is full
+Order *OrderQueue::allocate() {
+  Order *oldest = NULL;
+  for (int i = 0; i < ORDER_TABLE_SIZE; i++) {
+    Order &order = orders[i];
+    if (order.state == ORDER_EMPTY) {
+      return &order;
+    }
+    if ((order.state == ORDER_COMPLETE || order.state == ORDER_FAILED) &&
+        (oldest == NULL || order.seq < oldest->seq)) {
+      oldest = &order;
+    }
+  }
+  return oldest;
+}
+
+OrderAdmit OrderQueue::enqueue(const char *prescriptionId, const char *medicineName, int32_t quantity,
+                               uint8_t channel, uint32_t nowMs, Order **order) {
+  Order *existing = find(prescriptionId);
+  // A failed order may be retried unless it was interrupted part-way and
+  // recorded as executed; anything else with this id already ran or will run
+  if (existing != NULL && (existing->state != ORDER_FAILED || wasExecuted(prescriptionId))) {
+    *order = existing;
+    return ORDER_DUPLICATE;
+  }
+  // Ran before its table slot was reused, or before a reset
+  if (existing == NULL && wasExecuted(prescriptionId)) {
+    *order = NULL;
+    return ORDER_DUPLICATE;
+  }
+
+  Order *slot = active < ORDER_QUEUE_DEPTH ? allocate() : NULL;
+  if (slot == NULL) {
+    *order = NULL;
+    return ORDER_QUEUE_FULL;
+  }
+
+  memset(slot, 0, sizeof(*slot));
+  strncpy(slot->prescriptionId, prescriptionId ? prescriptionId : "", ORDER_ID_LEN);
+  strncpy(slot->medicineName, medicineName ? medicineName : "", ORDER_ID_LEN);
+  slot->quantity = quantity;
+  slot->channel = channel;
+  slot->state = ORDER_QUEUED;
+  slot->seq = nextSeq++;
+  slot->enqueuedMs = nowMs;
+  active++;
+
+  *order = slot;
+  return ORDER_ADMITTED;
+}
+
+Order *OrderQueue::next(uint8_t channel) {
+  Order *oldest = NULL;
+  for (int i = 0; i < ORDER_TABLE_SIZE; i++) {
+    Order &order = orders[i];
+    if (order.state == ORDER_QUEUED && order.channel == channel && (oldest == NULL || order.seq < oldest->seq)) {
+      oldest = &order;
+    }
+  }
+  return oldest;
+}
+
+Order *OrderQueue::running(uint8_t channel) {
+  for (int i = 0; i < ORDER_TABLE_SIZE; i++) {
+    if (orders[i].state == ORDER_RUNNING && orders[i].channel == channel) {
+      return &orders[i];
+    }
+  }
+  return NULL;
+}
+
+void OrderQueue::start(Order *order, uint32_t nowMs) {
+  order->state = ORDER_RUNNING;
+  order->startedMs = nowMs;
+}
+
+void OrderQueue::finish(Order *order, bool ok, int32_t dispensed, uint32_t nowMs) {
+  if (order->state == ORDER_QUEUED || order->state == ORDER_RUNNING) {
+    active--;
+  }
+  if (ok && order->prescriptionId[0] != '\0') {
+    addExecuted(idHash(order->prescriptionId));
+  }
+  order->state = ok ? ORDER_COMPLETE : ORDER_FAILED;
+  order->dispensed = dispensed;
+  order->finishedMs = nowMs;
+}
+
+uint8_t OrderQueue::pending(Order **out, uint8_t max) {
+  uint8_t count = 0;
+  for (int i = 0; i < ORDER_TABLE_SIZE && count < max; i++) {
+    Order &order = orders[i];
+    if (order.state != ORDER_QUEUED && order.state != ORDER_RUNNING) {
+      continue;
+    }
+    // Insertion by admission order; at most ORDER_QUEUE_DEPTH entries
+    uint8_t at = count++;
+    while (at > 0 && out[at - 1]->seq > order.seq) {
+      out[at] = out[at - 1];
+      at--;
+    }
+    out[at] = &order;
+  }
+  return count;
+}
+
+uint8_t OrderQueue::position(const Order *order) const {
+  uint8_t ahead = 1;
+  for (int i = 0; i < ORDER_TABLE_SIZE; i++) {
+    if (orders[i].state == ORDER_QUEUED && orders[i].channel == order->channel &&
+        orders[i].seq < order->seq) {
+      ahead++;
+    }
+  }
+  return ahead;
+}
+
+int32_t OrderQueue::queuedPills(uint8_t channel) const {
+  int32_t owed = 0;
+  for (int i = 0; i < ORDER_TABLE_SIZE; i++) {
+    const Order &order = orders[i];
+    if (order.state == ORDER_QUEUED && order.channel == channel) {
+      owed += order.quantity;
+    }
+  }
+  return owed;
+}
+
+uint32_t OrderQueue::oldestWaitMs(uint32_t nowMs) const {
+  uint32_t wait = 0;
+  for (int i = 0; i < ORDER_TABLE_SIZE; i++) {
+    const Order &order = orders[i];
+    if (order.state == ORDER_QUEUED && nowMs - order.enqueuedMs > wait) {
+      wait = nowMs - order.enqueuedMs;
+    }
+  }
+  return wait;
+}
@@ -0,0 +1,115 @@
+#ifndef ORDERQUEUE_H
+#define ORDERQUEUE_H
+
+/**
+ * OrderQueue - Bounded on-device queue of dispense orders
+ *
+ * Orders are keyed by prescription_id, carry the channel (Channels.h) that
+ * dispenses them, and move through
+ *
+ *   QUEUED -> RUNNING -> COMPLETE | FAILED
+ *
+ * Each channel runs its own orders in FIFO order, independently of the
+ * others. At most ORDER_QUEUE_DEPTH orders may be queued or running across
+ * all channels. Finished
+ * orders stay in the fixed table until their slot is needed (oldest
+ * first), so a command that is re-sent for an order that already ran is
+ * recognised as a duplicate instead of being dispensed twice. Orders
+ * without a prescription_id are never treated as duplicates.
+ *
+ * Completed orders, and orders interrupted by a reset (the caller adds
+ * those with addExecuted()), also leave a 32-bit hash of their
+ * prescription_id in a ring of the last ORDER_EXECUTED_IDS, which outlives
+ * the table slot and is kept across resets in the dispense journal. A command the broker
+ * redelivers (QoS 1) after the order ran, even across a reboot, is
+ * rejected as a duplicate too. A hash collision with one of the recent
+ * ids (about 1 in 10^8 per command) would wrongly reject an order.
+ *
+ * Owned by the motion side; not thread-safe.
+ *
+ * Usage:
+ * 1. On a dispense command: queue.enqueue(id, medicine, quantity, channel, millis(), &order)
+ * 2. When a channel is free: if ((order = queue.next(channel))) queue.start(order, millis());
+ * 3. On completion/failure: queue.finish(order, ok, dispensed, millis());
+ */
+
+#include <Arduino.h>
+#include "CommandParser.h"
+
+#define ORDER_QUEUE_DEPTH 8      // Queued + running orders
+#define ORDER_TABLE_SIZE 16      // Including finished orders kept for dedup
+#define ORDER_ID_LEN COMMAND_MAX_STRING_LEN
+#define ORDER_EXECUTED_IDS 32    // Completed prescription_ids remembered for dedup
+
+enum OrderState : uint8_t {
+  ORDER_EMPTY,
+  ORDER_QUEUED,
+  ORDER_RUNNING,
+  ORDER_COMPLETE,
+  ORDER_FAILED
+};
+
+enum OrderAdmit : uint8_t {
+  ORDER_ADMITTED,
+  ORDER_DUPLICATE,
+  ORDER_QUEUE_FULL
+};
+
+struct Order {
+  char prescriptionId[ORDER_ID_LEN + 1];
+  char medicineName[ORDER_ID_LEN + 1];
+  int32_t quantity;
+  int32_t dispensed;
+  uint8_t channel;
+  OrderState state;
+  uint32_t seq;          // Admission order; FIFO among queued orders
+  uint32_t enqueuedMs;
+  uint32_t startedMs;
+  uint32_t finishedMs;
+};
+
+class OrderQueue {
+private:
+  Order orders[ORDER_TABLE_SIZE];
+  uint32_t nextSeq;
+  uint8_t active;        // Queued + running
+  uint32_t executed[ORDER_EXECUTED_IDS];  // Hashes, oldest overwritten first
+  uint8_t executedNext;
+  uint8_t executedCount;
+
+  Order *allocate();
+
+public:
+  OrderQueue();
+
+  // Admits a new order; *order is set to the new or the duplicate entry
+  // (NULL for a duplicate known only from the executed ids)
+  OrderAdmit enqueue(const char *prescriptionId, const char *medicineName, int32_t quantity,
+                     uint8_t channel, uint32_t nowMs, Order **order);
+
+  Order *find(const char *prescriptionId);
+  Order *next(uint8_t channel);     // Oldest queued order of a channel, or NULL
+  Order *running(uint8_t channel);  // Order the channel is dispensing, or NULL
+
+  void start(Order *order, uint32_t nowMs);
+  void finish(Order *order, bool ok, int32_t dispensed, uint32_t nowMs);
+
+  // 1-based position of a queued order among those queued on its channel
+  uint8_t position(const Order *order) const;
+
+  // Queued and running orders, oldest first; returns how many were stored in out
+  uint8_t pending(Order **out, uint8_t max);
+
+  // Hashes of recently completed prescription_ids, oldest first, for the
+  // journal; restore with addExecuted() in the same order
+  uint8_t executedIds(uint32_t *out, uint8_t max) const;
+  void addExecuted(uint32_t idHash);
+  bool wasExecuted(const char *prescriptionId) const;
+  static uint32_t idHash(const char *prescriptionId);
+
+  uint8_t depth() const { return active; }
+  int32_t queuedPills(uint8_t channel) const;   // Total quantity queued on a channel
+  uint32_t oldestWaitMs(uint32_t nowMs) const;  // Longest wait of a queued order
+};
+
+#endif
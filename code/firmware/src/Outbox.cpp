@@ -0,0 +1,380 @@
+#include "Outbox.h"
+
+#define OUTBOX_MAGIC 0xA5
+#define OUTBOX_CURSOR_PATH OUTBOX_DIR "/cursor"
+
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t length) {
+  // CRC-16/CCITT-FALSE
+  for (size_t i = 0; i < length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+  }
+  return crc;
+}
+
+Outbox::Outbox() {
+  mounted = false;
+  headSeq = 0;
+  headOffset = 0;
+  tailSeq = 0;
+  tailOffset = 0;
+  syncedOffset = 0;
+  sendSeq = 0;
+  sendOffset = 0;
+  inFlightHead = 0;
+  inFlightCount = 0;
+  uncommittedAcks = 0;
+  memset(&metrics, 0, sizeof(metrics));
+}
+
+void Outbox::segmentPath(uint32_t seq, char *path, size_t size) const {
+  snprintf(path, size, OUTBOX_DIR "/%lu.log", (unsigned long)seq);
+}
+
+bool Outbox::begin() {
+  if (!LittleFS.begin(true)) {
+    Serial.println("Outbox: LittleFS mount failed");
+    return false;
+  }
+  LittleFS.mkdir(OUTBOX_DIR);
+
+  // Find the oldest and newest segments on flash
+  bool found = false;
+  uint32_t minSeq = 0;
+  uint32_t maxSeq = 0;
+  uint16_t segments = 0;
+  File dir = LittleFS.open(OUTBOX_DIR);
+  if (dir && dir.isDirectory()) {
+    File entry = dir.openNextFile();
+    while (entry) {
+      const char *name = entry.name();
+      const char *slash = strrchr(name, '/');
+      if (slash) {
+        name = slash + 1;
+      }
+      if (strstr(name, ".log") != NULL) {
+        uint32_t seq = strtoul(name, NULL, 10);
+        if (!found || seq < minSeq) minSeq = seq;
+        if (!found || seq > maxSeq) maxSeq = seq;
+        found = true;
+        segments++;
+      }
+      entry.close();
+      entry = dir.openNextFile();
+    }
+    dir.close();
+  }
+
+  headSeq = found ? minSeq : 0;
+  headOffset = 0;
+  if (loadCursor() && headSeq < minSeq) {
+    headSeq = minSeq;
+    headOffset = 0;
+  }
+
+  // Never append after a record that may have been torn by a power loss
+  tailSeq = found ? maxSeq + 1 : headSeq;
+  tailOffset = 0;
+  if (!found) {
+    headSeq = tailSeq;
+  }
+
+  sendSeq = headSeq;
+  sendOffset = headOffset;
+
+  metrics.segments = segments;
+  mounted = true;
+  metrics.pending = countPending();
+
+  Serial.print("Outbox ready, pending messages: ");
+  Serial.println(metrics.pending);
+  return true;
+}
+
+bool Outbox::loadCursor() {
+  File file = LittleFS.open(OUTBOX_CURSOR_PATH, "r");
+  if (!file) {
+    return false;
+  }
+  uint32_t cursor[2];
+  bool ok = file.read((uint8_t *)cursor, sizeof(cursor)) == sizeof(cursor);
+  file.close();
+  if (ok) {
+    headSeq = cursor[0];
+    headOffset = cursor[1];
+  }
+  return ok;
+}
+
+void Outbox::commitCursor() {
+  File file = LittleFS.open(OUTBOX_CURSOR_PATH, "w");
+  if (!file) {
+    return;
+  }
+  uint32_t cursor[2] = { headSeq, headOffset };
+  file.write((const uint8_t *)cursor, sizeof(cursor));
+  file.close();
+  metrics.flashBytesWritten += sizeof(cursor);
+  uncommittedAcks = 0;
+}
+
+void Outbox::flush() {
+  sync();
+  if (mounted && uncommittedAcks > 0) {
+    commitCursor();
+  }
+}
+
+void Outbox::sync() {
+  if (!tailFile || tailOffset == syncedOffset) {
+    return;
+  }
+  tailFile.flush();
+  // Copy-on-write: the block is programmed again from the segment's start
+  metrics.flashBytesWritten += tailOffset;
+  metrics.syncs++;
+  syncedOffset = tailOffset;
+}
+
+bool Outbox::readRecord(File &file, Header &header) {
+  if (file.read((uint8_t *)&header, sizeof(header)) != sizeof(header)) {
+    return false;
+  }
+  if (header.magic != OUTBOX_MAGIC || header.topicLength > OUTBOX_MAX_TOPIC ||
+      header.payloadLength > OUTBOX_MAX_PAYLOAD) {
+    return false;
+  }
+  if (file.read((uint8_t *)topicBuffer, header.topicLength) != header.topicLength ||
+      file.read(payloadBuffer, header.payloadLength) != header.payloadLength) {
+    return false;
+  }
+  topicBuffer[header.topicLength] = '\0';
+  uint16_t crc = crc16(0xFFFF, (const uint8_t *)topicBuffer, header.topicLength);
+  crc = crc16(crc, payloadBuffer, header.payloadLength);
+  return crc == header.crc;
+}
+
+uint32_t Outbox::countPending() {
+  uint32_t count = 0;
+  char path[32];
+  for (uint32_t seq = headSeq; seq < tailSeq || (seq == tailSeq && tailOffset > 0); seq++) {
+    segmentPath(seq, path, sizeof(path));
+    File file = LittleFS.open(path, "r");
+    if (!file) {
+      continue;
+    }
+    if (seq == headSeq) {
+      file.seek(headOffset);
+    }
+    Header header;
+    while (readRecord(file, header)) {
+      count++;
+    }
+    file.close();
+  }
+  return count;
+}
+
+bool Outbox::enqueue(const char *topic, const char *payload) {
+  return enqueue(topic, (const uint8_t *)payload, strlen(payload));
+}
+
+bool Outbox::enqueue(const char *topic, const uint8_t *payload, size_t payloadLength) {
+  if (!mounted) {
+    return false;
+  }
+
+  size_t topicLength = strlen(topic);
+  if (topicLength > OUTBOX_MAX_TOPIC || payloadLength > OUTBOX_MAX_PAYLOAD) {
+    Serial.println("Outbox: message too large, not queued");
+    return false;
+  }
+
+  Header header;
+  header.magic = OUTBOX_MAGIC;
+  header.topicLength = (uint8_t)topicLength;
+  header.payloadLength = (uint16_t)payloadLength;
+  header.crc = crc16(crc16(0xFFFF, (const uint8_t *)topic, topicLength),
+                     payload, payloadLength);
+  size_t recordLength = sizeof(header) + topicLength + payloadLength;
+
+  if (tailOffset > 0 && tailOffset + recordLength > OUTBOX_SEGMENT_SIZE) {
+    sync();
+    tailFile.close();
+    tailSeq++;
+    tailOffset = 0;
+    syncedOffset = 0;
+  }
+  if (tailOffset == 0) {
+    metrics.segments++;
+    // Bounded: drop the oldest segment rather than fill the filesystem
+    while (metrics.segments > OUTBOX_MAX_SEGMENTS && headSeq < tailSeq) {
+      dropHeadSegment();
+    }
+  }
+
+  if (!tailFile) {
+    char path[32];
+    segmentPath(tailSeq, path, sizeof(path));
+    tailFile = LittleFS.open(path, "a");
+    if (!tailFile) {
+      return false;
+    }
+  }
+  bool ok = tailFile.write((const uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+            tailFile.write((const uint8_t *)topic, topicLength) == topicLength &&
+            tailFile.write(payload, payloadLength) == payloadLength;
+  if (!ok) {
+    // Start over in a fresh segment rather than after a partial record;
+    // drain() skips the partial one
+    sync();
+    tailFile.close();
+    tailSeq++;
+    tailOffset = 0;
+    syncedOffset = 0;
+    return false;
+  }
+
+  tailOffset += recordLength;
+  metrics.enqueued++;
+  metrics.pending++;
+  metrics.payloadBytes += topicLength + payloadLength;
+  return true;
+}
+
+void Outbox::dropHeadSegment() {
+  char path[32];
+  segmentPath(headSeq, path, sizeof(path));
+
+  // Account for the records that are lost with it
+  File file = LittleFS.open(path, "r");
+  if (file) {
+    file.seek(headOffset);
+    Header header;
+    while (readRecord(file, header) && metrics.pending > 0) {
+      metrics.pending--;
+    }
+    file.close();
+  }
+
+  metrics.droppedSegments++;
+  advanceHeadSegment();
+  if (sendSeq < headSeq) {
+    sendSeq = headSeq;
+    sendOffset = 0;
+  }
+}
+
+void Outbox::advanceHeadSegment() {
+  char path[32];
+  segmentPath(headSeq, path, sizeof(path));
+  LittleFS.remove(path);
+  if (metrics.segments > 0) {
+    metrics.segments--;
+  }
+  headSeq++;
+  headOffset = 0;
+  commitCursor();
+}
+
+size_t Outbox::drain(OutboxPublishFn publish, size_t maxRecords) {
+  if (!mounted || metrics.pending == 0) {
+    return 0;
+  }
+
+  size_t sent = 0;
+  char path[32];
+  while (sent < maxRecords && inFlightCount < OUTBOX_IN_FLIGHT) {
+    if (sendSeq == tailSeq && sendOffset >= syncedOffset) {
+      break;
+    }
+
+    segmentPath(sendSeq, path, sizeof(path));
+    File file = LittleFS.open(path, "r");
+    Header header;
+    bool valid = false;
+    size_t segmentSize = 0;
+    if (file) {
+      segmentSize = file.size();
+      file.seek(sendOffset);
+      valid = readRecord(file, header);
+      file.close();
+    }
+
+    if (!valid) {
+      if (sendSeq == tailSeq) {
+        break;
+      }
+      // End of segment, or the rest of it is unreadable; the segment is
+      // deleted once a record after it is acknowledged
+      if (sendOffset < segmentSize) {
+        metrics.corruptRecords++;
+      }
+      sendSeq++;
+      sendOffset = 0;
+      continue;
+    }
+
+    uint16_t packetId = publish(topicBuffer, payloadBuffer, header.payloadLength);
+    if (packetId == 0) {
+      break;
+    }
+
+    sendOffset += sizeof(header) + header.topicLength + header.payloadLength;
+    InFlight &entry = inFlight[(inFlightHead + inFlightCount) % OUTBOX_IN_FLIGHT];
+    entry.packetId = packetId;
+    entry.acked = false;
+    entry.seq = sendSeq;
+    entry.end = sendOffset;
+    inFlightCount++;
+    sent++;
+  }
+  return sent;
+}
+
+void Outbox::acknowledge(uint16_t packetId) {
+  for (uint8_t i = 0; i < inFlightCount; i++) {
+    InFlight &entry = inFlight[(inFlightHead + i) % OUTBOX_IN_FLIGHT];
+    if (!entry.acked && entry.packetId == packetId) {
+      entry.acked = true;
+      break;
+    }
+  }
+
+  // The read cursor only moves past records acknowledged in order
+  while (inFlightCount > 0 && inFlight[inFlightHead].acked) {
+    InFlight entry = inFlight[inFlightHead];
+    inFlightHead = (inFlightHead + 1) % OUTBOX_IN_FLIGHT;
+    inFlightCount--;
+    if (entry.seq < headSeq) {
+      continue;  // Its segment was dropped meanwhile, and counted then
+    }
+    while (headSeq < entry.seq) {
+      advanceHeadSegment();
+    }
+    headOffset = entry.end;
+    if (metrics.pending > 0) {
+      metrics.pending--;
+    }
+    metrics.delivered++;
+    if (++uncommittedAcks >= OUTBOX_CURSOR_BATCH) {
+      commitCursor();
+    }
+  }
+
+  if (metrics.pending == 0) {
+    flush();
+  }
+}
+
+OutboxMetrics Outbox::getMetrics() const {
+  OutboxMetrics m = metrics;
+  if (m.payloadBytes > 0) {
+    uint64_t pct = (uint64_t)m.flashBytesWritten * 100 / m.payloadBytes;
+    m.writeAmplificationPct = pct > UINT16_MAX ? UINT16_MAX : (uint16_t)pct;
+  }
+  m.ramBytes = sizeof(Outbox);
+  return m;
+}
@@ -0,0 +1,142 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+/**
+ * Outbox - Flash-backed store-and-forward queue for outgoing MQTT messages
+ *
+ * Messages are appended to a log on LittleFS before they are sent, and
+ * drained in order once the broker link is up. A message is only removed
+ * (the read cursor advanced) once the broker acknowledged it: drain()
+ * hands records to the publisher as QoS 1 packets and remembers their
+ * packet ids, and acknowledge() is called with each PUBACK. Records are
+ * removed in order, so one acknowledged ahead of an older one waits for
+ * it. Dispense completion events thus survive link drops and reboots.
+ *
+ * Layout:
+ * - /outbox/<seq>.log  Append-only segments of OUTBOX_SEGMENT_SIZE bytes
+ *                      (one flash block). A drained segment is deleted
+ *                      whole.
+ * - /outbox/cursor     Read position {segment seq, offset}. Commits are
+ *                      batched (every OUTBOX_CURSOR_BATCH records or when a
+ *                      segment is finished), so a reboot may replay up to a
+ *                      batch of already-sent records (at-least-once).
+ *
+ * The segment being appended to stays open. enqueue() only writes into
+ * it; sync() makes what was appended durable, once per network pass, so
+ * the records of one pass share a flash write. LittleFS is copy-on-write:
+ * each sync programs the segment's block again from its start, not just
+ * the new records, and flashBytesWritten counts it that way. A power loss
+ * loses the records appended since the last sync.
+ *
+ * At most OUTBOX_MAX_SEGMENTS segments are kept; when full, the oldest
+ * segment is dropped and counted in the metrics. Each boot starts a fresh
+ * segment so an append never follows a record torn by a power loss.
+ *
+ * Record: [0xA5][topic len u8][payload len u16][crc16 u16][topic][payload]
+ */
+
+#include <Arduino.h>
+#include <LittleFS.h>
+
+#define OUTBOX_DIR "/outbox"
+#define OUTBOX_SEGMENT_SIZE 4096
+#define OUTBOX_MAX_SEGMENTS 8
+#define OUTBOX_MAX_TOPIC 64
+#define OUTBOX_MAX_PAYLOAD 448
+#define OUTBOX_CURSOR_BATCH 8
+
+#define OUTBOX_IN_FLIGHT 8       // Records handed to the publisher and not acknowledged yet
+
+// Queues one record as a QoS 1 message; its packet id, 0 if it was refused
+typedef uint16_t (*OutboxPublishFn)(const char *topic, const uint8_t *payload, size_t length);
+
+struct OutboxMetrics {
+  uint32_t enqueued;           // Records accepted since boot
+  uint32_t delivered;          // Records acknowledged since boot
+  uint32_t pending;            // Records waiting in flash
+  uint32_t droppedSegments;    // Segments discarded because the outbox was full
+  uint32_t corruptRecords;     // Records skipped because of a bad header/CRC
+  uint32_t payloadBytes;       // Topic + payload bytes handed to enqueue()
+  uint32_t flashBytesWritten;  // Data programmed: each sync's whole segment so far, cursor commits
+  uint32_t syncs;              // Segment syncs, each also a LittleFS metadata commit
+  uint16_t writeAmplificationPct;  // flashBytesWritten / payloadBytes * 100
+  uint16_t segments;           // Segment files currently on flash
+  uint32_t ramBytes;           // Static RAM held by the outbox
+};
+
+class Outbox {
+private:
+  struct Header {
+    uint8_t magic;
+    uint8_t topicLength;
+    uint16_t payloadLength;
+    uint16_t crc;
+  } __attribute__((packed));
+
+  bool mounted;
+
+  uint32_t headSeq;       // Oldest segment (read side)
+  uint32_t headOffset;
+  uint32_t tailSeq;       // Segment being appended to
+  uint32_t tailOffset;
+  uint32_t syncedOffset;  // Part of the tail segment that is durable
+  File tailFile;
+  uint32_t sendSeq;       // Next record to hand to the publisher
+  uint32_t sendOffset;
+
+  // Records sent and not yet removed, oldest first
+  struct InFlight {
+    uint16_t packetId;
+    bool acked;
+    uint32_t seq;
+    uint32_t end;         // Offset after the record
+  };
+  InFlight inFlight[OUTBOX_IN_FLIGHT];
+  uint8_t inFlightHead;
+  uint8_t inFlightCount;
+
+  uint32_t uncommittedAcks;
+  OutboxMetrics metrics;
+
+  char topicBuffer[OUTBOX_MAX_TOPIC + 1];
+  uint8_t payloadBuffer[OUTBOX_MAX_PAYLOAD];
+
+  void segmentPath(uint32_t seq, char *path, size_t size) const;
+  bool loadCursor();
+  void commitCursor();
+  void dropHeadSegment();
+  void advanceHeadSegment();
+  uint32_t countPending();
+  bool readRecord(File &file, Header &header);
+
+public:
+  Outbox();
+
+  // Mount LittleFS and recover the queue from flash
+  bool begin();
+
+  // Append one message; returns false if it is too large or flash failed.
+  // Durable, and visible to drain(), after the next sync().
+  bool enqueue(const char *topic, const char *payload);
+  bool enqueue(const char *topic, const uint8_t *payload, size_t payloadLength);
+
+  // Write out the records appended since the last call; once per network pass
+  void sync();
+
+  // Hand up to maxRecords queued messages to the publisher in order; stops
+  // at the first one it refuses or at OUTBOX_IN_FLIGHT unacknowledged.
+  // Returns the number handed over.
+  size_t drain(OutboxPublishFn publish, size_t maxRecords);
+
+  // The broker acknowledged a QoS 1 packet; ids the outbox did not send are ignored
+  void acknowledge(uint16_t packetId);
+
+  // Persist the appended records and the read cursor now (e.g. before a
+  // planned restart)
+  void flush();
+
+  uint32_t pending() const { return metrics.pending; }
+  OutboxMetrics getMetrics() const;
+};
+
+#endif
@@ -0,0 +1,189 @@
+#include "PillDetector.h"
+
+static uint32_t hashName(const char *name, size_t length) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+PillDetector::PillDetector() {
+  state = CLEAR;
+  blockStartUs = 0;
+  clearAtUs = 0;
+  gapUs = 0;
+  learnedWidth16 = 0;
+  learnedDeviation16 = 0;
+  learnedSamples = 0;
+  activeEntry = -1;
+  useClock = 0;
+  memset(widthTable, 0, sizeof(widthTable));
+  resetStats();
+}
+
+void PillDetector::setConfig(const PillDetectorConfig &cfg) {
+  config = cfg;
+  if (config.bucketWidthUs == 0) {
+    config.bucketWidthUs = 1;
+  }
+}
+
+void PillDetector::resetStats() {
+  memset(histogram, 0, sizeof(histogram));
+  rejected = 0;
+  doubles = 0;
+}
+
+void PillDetector::beginDispense(const char *medicineName, size_t nameLength) {
+  state = CLEAR;
+  learnedWidth16 = 0;
+  learnedDeviation16 = 0;
+  learnedSamples = 0;
+  activeEntry = -1;
+  resetStats();
+
+  if (medicineName == NULL || nameLength == 0) {
+    return;
+  }
+
+  uint32_t hash = hashName(medicineName, nameLength);
+  int8_t victim = 0;
+  for (int8_t i = 0; i < PILL_WIDTH_TABLE_SIZE; i++) {
+    if (widthTable[i].samples > 0 && widthTable[i].nameHash == hash) {
+      activeEntry = i;
+      learnedWidth16 = widthTable[i].width16;
+      learnedDeviation16 = widthTable[i].deviation16;
+      learnedSamples = widthTable[i].samples;
+      widthTable[i].lastUsed = ++useClock;
+      return;
+    }
+    // Empty slots first, then least recently used
+    if (widthTable[victim].samples > 0 &&
+        (widthTable[i].samples == 0 || widthTable[i].lastUsed < widthTable[victim].lastUsed)) {
+      victim = i;
+    }
+  }
+
+  activeEntry = victim;
+  widthTable[victim].nameHash = hash;
+  widthTable[victim].width16 = 0;
+  widthTable[victim].deviation16 = 0;
+  widthTable[victim].samples = 0;
+  widthTable[victim].lastUsed = ++useClock;
+}
+
+void PillDetector::endDispense() {
+  if (activeEntry >= 0 && learnedSamples > 0) {
+    widthTable[activeEntry].width16 = learnedWidth16;
+    widthTable[activeEntry].deviation16 = learnedDeviation16;
+    widthTable[activeEntry].samples = learnedSamples;
+  }
+  activeEntry = -1;
+  state = CLEAR;
+}
+
+bool IRAM_ATTR PillDetector::onEdge(uint32_t timestampUs, bool blocked, PillEvent &pill) {
+  bool ready = false;
+
+  if (blocked) {
+    if (state == CLEAR) {
+      state = BLOCKED;
+      blockStartUs = timestampUs;
+      gapUs = 0;
+    } else if (state == PENDING) {
+      if (timestampUs - clearAtUs < config.glitchUs) {
+        // Gap was chatter: keep the original start and continue the transit
+        state = BLOCKED;
+        gapUs += timestampUs - clearAtUs;
+      } else {
+        ready = finalize(pill);
+        state = BLOCKED;
+        blockStartUs = timestampUs;
+        gapUs = 0;
+      }
+    }
+  } else if (state == BLOCKED) {
+    state = PENDING;
+    clearAtUs = timestampUs;
+  }
+
+  return ready;
+}
+
+bool IRAM_ATTR PillDetector::poll(uint32_t nowUs, PillEvent &pill) {
+  if (state != PENDING || nowUs - clearAtUs < config.glitchUs) {
+    return false;
+  }
+  state = CLEAR;
+  return finalize(pill);
+}
+
+bool IRAM_ATTR PillDetector::finalize(PillEvent &pill) {
+  uint32_t width = clearAtUs - blockStartUs;
+
+  uint32_t bucket = width / config.bucketWidthUs;
+  if (bucket >= PILL_HISTOGRAM_BUCKETS) {
+    bucket = PILL_HISTOGRAM_BUCKETS - 1;
+  }
+  histogram[bucket]++;
+
+  if (width < config.minBlockedUs || width < config.glitchUs) {
+    rejected++;
+    return false;
+  }
+
+  pill.startUs = blockStartUs;
+  pill.widthUs = width;
+  pill.count = 1;
+  pill.flags = 0;
+
+  if (width > config.maxBlockedUs) {
+    pill.flags |= PILL_FLAG_LONG;
+  }
+
+  // Wider than a single pill can be: the fewest pills that block the beam
+  // this long. Bridged gaps do not count, so two pills a chatter gap apart
+  // are two, not three. Until the spread is learned, the limit is a fixed
+  // share of the mean width. A stuck transit says nothing about its pills.
+  uint32_t blocked = width - gapUs;
+  uint32_t singleMaxUs = learnedSamples < config.warmupSamples
+                             ? (uint32_t)((uint64_t)learnedWidth16 * config.warmupLimitPct / 1600)
+                             : (learnedWidth16 + (uint32_t)((uint64_t)learnedDeviation16 * config.doubleSpreadPct / 100)) / 16;
+  if (learnedSamples > 0 && blocked > singleMaxUs && !(pill.flags & PILL_FLAG_LONG)) {
+    uint32_t count = (blocked + singleMaxUs - 1) / singleMaxUs;
+    pill.count = count < 2 ? 2 : count > PILL_MAX_PER_TRANSIT ? PILL_MAX_PER_TRANSIT : (uint8_t)count;
+    pill.flags |= PILL_FLAG_DOUBLE;
+    doubles++;
+  }
+  // Transits just past the limit are learned too, so the distribution is
+  // not cut off at its own edge and cannot shrink onto single pills
+  if (!(pill.flags & PILL_FLAG_LONG) &&
+      (learnedSamples == 0 || blocked <= singleMaxUs + learnedDeviation16 * config.learnSpreadPct / 1600)) {
+    learn(blocked);
+  }
+
+  return true;
+}
+
+void IRAM_ATTR PillDetector::learn(uint32_t widthUs) {
+  // A much narrower transit while warming up restarts learning: the ones
+  // before it were probably several pills
+  if (learnedSamples == 0 || (learnedSamples < config.warmupSamples && widthUs * 16 * 4 < learnedWidth16 * 3)) {
+    learnedSamples = 0;
+    learnedWidth16 = widthUs * 16;
+    learnedDeviation16 = widthUs * 2;
+  } else {
+    // Running mean over the first samples, then an EWMA
+    int32_t weight = learnedSamples < (1 << config.learnShift) ? learnedSamples + 1 : 1 << config.learnShift;
+    int32_t delta = (int32_t)(widthUs * 16) - (int32_t)learnedWidth16;
+    learnedWidth16 = (uint32_t)((int32_t)learnedWidth16 + delta / weight);
+    int32_t spread = (delta < 0 ? -delta : delta) - (int32_t)learnedDeviation16;
+    learnedDeviation16 = (uint32_t)((int32_t)learnedDeviation16 + spread / weight);
+  }
+  if (learnedSamples < UINT16_MAX) {
+    learnedSamples++;
+  }
+}
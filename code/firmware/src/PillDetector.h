@@ -0,0 +1,117 @@
+#ifndef PILLDETECTOR_H
+#define PILLDETECTOR_H
+
+/**
+ * PillDetector - Turns raw laser edges into pill transits
+ *
+ * Features:
+ * - Glitch filter: blocked pulses and clear gaps shorter than glitchUs are
+ *   treated as beam chatter (turntable/agitator vibration) and merged
+ * - Min/max blocked-duration classifier
+ * - Blocked-duration histogram for tuning
+ * - Multi-pill detection against the learned per-medicine width
+ *   distribution (mean and mean absolute deviation of single transits).
+ *   One pill blocks the beam for at most the mean plus doubleSpreadPct of
+ *   the deviation, or warmupLimitPct of the mean until warmupSamples
+ *   singles are learned; a longer transit is counted as the fewest pills
+ *   that fit its blocked time, so the decision follows each medicine's
+ *   own spread instead of one ratio for every pill shape.
+ *
+ * Every call is O(1), allocation-free and uses integer math only, so the
+ * detector can run inside the laser ISR as well as from loop().
+ *
+ * Usage:
+ * 1. On dispense start: detector.beginDispense(medicineName);
+ * 2. For every edge:    if (detector.onEdge(t, blocked, pill)) { ... }
+ * 3. Every loop pass:   if (detector.poll(micros(), pill)) { ... }
+ * 4. On dispense end:   detector.endDispense();
+ */
+
+#include <Arduino.h>
+
+#define PILL_HISTOGRAM_BUCKETS 16
+#define PILL_WIDTH_TABLE_SIZE 8
+#define PILL_MAX_PER_TRANSIT 8    // More merged pills than this is a jam, not a count
+
+struct PillDetectorConfig {
+    uint32_t glitchUs = 1500;        // Pulses/gaps shorter than this are chatter
+    uint32_t minBlockedUs = 2000;    // Shorter transits are rejected
+    uint32_t maxBlockedUs = 250000;  // Longer transits are flagged as stuck
+    uint16_t doubleSpreadPct = 260;  // Width > mean + 2.6 mean deviations => 2+ pills
+    uint16_t learnSpreadPct = 100;   // Transits up to this% of a deviation past the limit are learned
+    uint16_t warmupLimitPct = 125;   // Limit as a share of the mean until the spread is learned
+    uint8_t learnShift = 8;          // EWMA weight 1/2^learnShift for width learning
+    uint8_t warmupSamples = 16;      // Singles learned before the spread is trusted
+    uint32_t bucketWidthUs = 2000;   // Histogram bucket width
+};
+
+enum PillFlags : uint8_t {
+    PILL_FLAG_DOUBLE = 0x01,  // Two or more touching or overlapping pills
+    PILL_FLAG_LONG = 0x02,    // Blocked longer than maxBlockedUs
+};
+
+struct PillEvent {
+    uint32_t startUs;  // Beam blocked
+    uint32_t widthUs;  // Blocked duration after glitch merging
+    uint8_t count;     // Pills attributed to this transit (1 to PILL_MAX_PER_TRANSIT)
+    uint8_t flags;     // PillFlags
+};
+
+class PillDetector {
+public:
+    PillDetector();
+
+    void setConfig(const PillDetectorConfig &cfg);
+    const PillDetectorConfig &getConfig() const { return config; }
+
+    // Load/store the learned width for the medicine being dispensed
+    void beginDispense(const char *medicineName, size_t nameLength);
+    void endDispense();
+
+    // Feed one beam edge. Returns true and fills 'pill' when a transit is final.
+    bool onEdge(uint32_t timestampUs, bool blocked, PillEvent &pill);
+
+    // Finalises a pending transit once the glitch window has passed
+    bool poll(uint32_t nowUs, PillEvent &pill);
+
+    uint32_t getLearnedWidthUs() const { return learnedWidth16 / 16; }
+    uint32_t getLearnedDeviationUs() const { return learnedDeviation16 / 16; }
+    uint32_t getRejectedCount() const { return rejected; }
+    uint32_t getDoubleCount() const { return doubles; }
+    const uint32_t *getHistogram() const { return histogram; }
+    void resetStats();
+
+private:
+    enum State : uint8_t { CLEAR, BLOCKED, PENDING };
+
+    struct WidthEntry {
+        uint32_t nameHash;
+        uint32_t width16;
+        uint32_t deviation16;
+        uint16_t samples;
+        uint16_t lastUsed;
+    };
+
+    bool finalize(PillEvent &pill);
+    void learn(uint32_t widthUs);
+
+    PillDetectorConfig config;
+    State state;
+    uint32_t blockStartUs;
+    uint32_t clearAtUs;
+    uint32_t gapUs;  // Chatter gaps bridged inside the current transit
+
+    uint32_t learnedWidth16;      // Mean single width, 1/16 us
+    uint32_t learnedDeviation16;  // Mean absolute deviation of single widths, 1/16 us
+    uint16_t learnedSamples;
+
+    uint32_t histogram[PILL_HISTOGRAM_BUCKETS];  // Last bucket collects overflow
+    uint32_t rejected;
+    uint32_t doubles;
+
+    WidthEntry widthTable[PILL_WIDTH_TABLE_SIZE];
+    int8_t activeEntry;
+    uint16_t useClock;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include "RefillSequencer.h"
+
+RefillSequencer::RefillSequencer(HalServo refillServo) : servo(refillServo) {
+  state = REFILL_IDLE;
+  phaseStartMs = 0;
+}
+
+bool RefillSequencer::shouldRefill(int estimate, int demand, bool overlapSafe) const {
+  if (isBusy() || !overlapSafe) {
+    return false;
+  }
+  if (estimate < params.threshold) {
+    return true;
+  }
+  // Top up ahead of demand, as long as a full refill still fits
+  return estimate < demand + params.reserve &&
+         estimate + params.refillAmount <= params.capacity;
+}
+
+bool RefillSequencer::start(uint32_t nowMs) {
+  if (isBusy()) {
+    return false;
+  }
+  enter(REFILL_SWING_OUT, nowMs);
+  return true;
+}
+
+void RefillSequencer::enter(RefillState next, uint32_t nowMs) {
+  state = next;
+  phaseStartMs = nowMs;
+  if (next == REFILL_SWING_OUT) {
+    motionWrite(MOTION_OUT_SERVO, servo, params.dumpAngle, params.swingOutMs);
+  } else if (next == REFILL_SWING_BACK) {
+    motionWrite(MOTION_OUT_SERVO, servo, params.restAngle, params.swingBackMs);
+  }
+}
+
+bool RefillSequencer::update(uint32_t nowMs) {
+  uint32_t elapsed = nowMs - phaseStartMs;
+
+  switch (state) {
+    case REFILL_IDLE:
+      return false;
+
+    case REFILL_SWING_OUT:
+      if (elapsed >= params.swingOutMs) {
+        enter(REFILL_HOLD, nowMs);
+      }
+      return false;
+
+    case REFILL_HOLD:
+      if (elapsed >= params.holdMs) {
+        enter(REFILL_SWING_BACK, nowMs);
+      }
+      return false;
+
+    case REFILL_SWING_BACK:
+      if (elapsed >= params.swingBackMs) {
+        enter(REFILL_SETTLE, nowMs);
+      }
+      return false;
+
+    case REFILL_SETTLE:
+      if (elapsed >= params.settleMs) {
+        enter(REFILL_IDLE, nowMs);
+        return true;
+      }
+      return false;
+  }
+  return false;
+}
@@ -0,0 +1,77 @@
+#ifndef REFILLSEQUENCER_H
+#define REFILLSEQUENCER_H
+
+/**
+ * RefillSequencer - Non-blocking refill servo sequence
+ *
+ * Replaces the delay()-based triggerRefill(). The servo swing is a small
+ * state machine advanced by update() from the motion task. Each swing is
+ * one linear ramp between rest and dump angles, run by the motion
+ * scheduler's timer (MotionScheduler.h), so pill counting and motor
+ * control keep running during a refill:
+ *
+ *   IDLE -> SWING_OUT -> HOLD -> SWING_BACK -> SETTLE -> IDLE
+ *
+ * shouldRefill() decides when to start. Besides the low-water threshold it
+ * tops up ahead of known demand (pills still owed to running/queued
+ * orders), and it only overlaps a dispense while that is safe (not during
+ * the final creep).
+ */
+
+#include <Arduino.h>
+#include "Hal.h"
+#include "MotionScheduler.h"
+
+struct RefillParams {
+  int restAngle = 0;
+  int dumpAngle = 180;
+  uint16_t swingOutMs = 600;   // Ramp time rest -> dump
+  uint16_t holdMs = 400;       // Dwell at dump angle
+  uint16_t swingBackMs = 500;  // Ramp time dump -> rest
+  uint16_t settleMs = 150;     // Pills land on the turntable
+  int refillAmount = 10;       // Pills added per refill
+  int threshold = 3;           // Always refill below this estimate
+  int reserve = 2;             // Extra pills kept above known demand
+  int capacity = 30;           // Never top up beyond this estimate
+};
+
+enum RefillState {
+  REFILL_IDLE,
+  REFILL_SWING_OUT,
+  REFILL_HOLD,
+  REFILL_SWING_BACK,
+  REFILL_SETTLE
+};
+
+class RefillSequencer {
+private:
+  HalServo servo;
+  RefillParams params;
+  RefillState state;
+  uint32_t phaseStartMs;
+
+  void enter(RefillState next, uint32_t nowMs);
+
+public:
+  RefillSequencer(HalServo refillServo = 0);
+
+  void setServo(HalServo refillServo) { servo = refillServo; }
+
+  void setParams(const RefillParams &newParams) { params = newParams; }
+  const RefillParams &getParams() const { return params; }
+
+  // estimate: pills believed on the turntable; demand: pills still owed to
+  // running and queued orders; overlapSafe: a dispense may be disturbed
+  bool shouldRefill(int estimate, int demand, bool overlapSafe) const;
+
+  // Begin a sequence; ignored while one is running
+  bool start(uint32_t nowMs);
+
+  // Advance the sequence. Returns true on the call where it completes.
+  bool update(uint32_t nowMs);
+
+  bool isBusy() const { return state != REFILL_IDLE; }
+  RefillState getState() const { return state; }
+};
+
+#endif
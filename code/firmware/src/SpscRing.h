@@ -0,0 +1,64 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * SpscRing - Lock-free single-producer/single-consumer ring buffer
+ *
+ * Exactly one context may call push() (e.g. an ISR) and exactly one context
+ * may call pop() (e.g. loop()). Head and tail are free-running counters, so
+ * all N slots are usable. N must be a power of two.
+ *
+ * push() never blocks: when the ring is full the item is dropped and counted
+ * in dropped() so the consumer can tell that it fell behind.
+ */
+template <typename T, size_t N>
+class SpscRing {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+public:
+    // Producer side. Safe to call from an ISR.
+    inline __attribute__((always_inline)) bool push(const T &item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= N) {
+            overflows.store(overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+        buffer[h & (N - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side.
+    inline bool pop(T &item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = buffer[t & (N - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return size() == 0; }
+
+    static constexpr size_t capacity() { return N; }
+
+    // Number of items rejected because the ring was full.
+    uint32_t dropped() const { return overflows.load(std::memory_order_relaxed); }
+
+private:
+    T buffer[N];
+    std::atomic<uint32_t> head{0};      // Written by the producer only
+    std::atomic<uint32_t> tail{0};      // Written by the consumer only
+    std::atomic<uint32_t> overflows{0}; // Written by the producer only
+};
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef TASKMESSAGES_H
+#define TASKMESSAGES_H
+
+/**
+ * Messages exchanged between the network task (core 0) and the motion task
+ * (core 1). Both directions use fixed-size SpscRing queues, so neither task
+ * ever blocks on, or shares mutable state with, the other.
+ *
+ *   network --MotionCommand--> motion   (dispense/tune requests)
+ *   motion  --MotionEvent----> network  (queued/start/complete/error)
+ *   motion  --DispenseProgress-> network (pill count of the running order)
+ *
+ * Only order lifecycle transitions are events, and none is ever dropped:
+ * the motion side keeps a slot free for the completion or error of every
+ * running order, and queues or starts an order only while the ring has
+ * room beyond those. A network task held up by a reconnect or a flash
+ * write therefore delays orders instead of losing their reports. Pills
+ * are not events; their count is a shared word the network task samples.
+ */
+
+#include <Arduino.h>
+#include <atomic>
+#include "CommandParser.h"
+#include "SpscRing.h"
+
+#define MOTION_COMMAND_QUEUE_SIZE 8
+#define MOTION_EVENT_QUEUE_SIZE 32
+
+enum MotionCommandType : uint8_t {
+  MOTION_DISPENSE,
+  MOTION_TUNE
+};
+
+struct MotionCommand {
+  MotionCommandType type;
+  int32_t quantity;
+  char medicineName[COMMAND_MAX_STRING_LEN + 1];
+  char prescriptionId[COMMAND_MAX_STRING_LEN + 1];
+
+  // MOTION_TUNE: only fields whose CommandField bit is set are applied
+  uint32_t tuneFields;
+  int32_t bulkSpeed;
+  int32_t creepSpeed;
+  int32_t taperPills;
+  int32_t creepPills;
+  float kp;
+  float ki;
+};
+
+enum MotionEventType : uint8_t {
+  EVENT_ORDER_QUEUED,
+  EVENT_ORDER_REJECTED,
+  EVENT_DISPENSE_STARTED,
+  EVENT_DISPENSE_COMPLETE,
+  EVENT_DISPENSE_ERROR,
+  EVENT_DISPENSE_INTERRUPTED  // Order that was running at the last reset (see DispenseJournal.h)
+};
+
+#define MOTION_NO_CHANNEL 0xFF
+
+struct MotionEvent {
+  MotionEventType type;
+  uint8_t channel;        // Channel the event belongs to, MOTION_NO_CHANNEL if none
+  uint8_t position;       // EVENT_ORDER_QUEUED: place in the order queue
+  uint8_t order;          // EVENT_DISPENSE_STARTED: its DispenseProgress order number
+  int32_t pillCount;
+  int32_t targetCount;
+  uint32_t timeMs;        // millis() when the event happened
+  uint32_t rejected;      // EVENT_DISPENSE_COMPLETE: rejected transits
+  uint16_t jams;          // EVENT_DISPENSE_COMPLETE: agitator jams recovered from
+  uint16_t doubles;       // EVENT_DISPENSE_COMPLETE: transits counted as two pills
+  uint32_t intervalMinUs; // EVENT_DISPENSE_COMPLETE: pill spacing, 0 with fewer than two transits
+  uint32_t intervalMeanUs;
+  uint32_t intervalMaxUs;
+  const char *reason;     // EVENT_DISPENSE_ERROR/EVENT_ORDER_REJECTED: static string
+  char prescriptionId[COMMAND_MAX_STRING_LEN + 1];  // EVENT_ORDER_*, EVENT_DISPENSE_STARTED/INTERRUPTED
+};
+
+// Pill count of a channel's running order. Written by the motion task for
+// every counted transit, read by the network task whenever it publishes
+// progress. One word, so a reader never mixes two orders' figures:
+// [order u8][doubles u8][pills u16]. 'order' is bumped by every order the
+// channel starts and carried by its EVENT_DISPENSE_STARTED, so progress of
+// an order whose start was not forwarded yet is told apart.
+class DispenseProgress {
+private:
+  std::atomic<uint32_t> word{0};
+
+public:
+  void store(uint8_t order, int32_t pills, uint32_t doubles) {
+    uint32_t clampedPills = pills < 0 ? 0 : pills > 0xFFFF ? 0xFFFF : (uint32_t)pills;
+    uint32_t clampedDoubles = doubles > 0xFF ? 0xFF : doubles;
+    word.store((uint32_t)order << 24 | clampedDoubles << 16 | clampedPills, std::memory_order_release);
+  }
+
+  void load(uint8_t &order, int32_t &pills, uint32_t &doubles) const {
+    uint32_t value = word.load(std::memory_order_acquire);
+    order = (uint8_t)(value >> 24);
+    doubles = (value >> 16) & 0xFF;
+    pills = (int32_t)(value & 0xFFFF);
+  }
+};
+
+typedef SpscRing<MotionCommand, MOTION_COMMAND_QUEUE_SIZE> MotionCommandQueue;
+typedef SpscRing<MotionEvent, MOTION_EVENT_QUEUE_SIZE> MotionEventQueue;
+
+// Worst-case pass duration of a task loop. The owning task records; another
+// task may take() the value, which also starts a new window.
+class LoopLatency {
+private:
+  std::atomic<uint32_t> worstUs{0};
+
+public:
+  void record(uint32_t us) {
+    if (us > worstUs.load(std::memory_order_relaxed)) {
+      worstUs.store(us, std::memory_order_relaxed);
+    }
+  }
+
+  uint32_t take() { return worstUs.exchange(0, std::memory_order_relaxed); }
+};
+
+#endif
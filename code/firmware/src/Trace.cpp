@@ -0,0 +1,117 @@
+#include "Trace.h"
+#include "Hal.h"
+#include <atomic>
+
+static TraceRecord ring[TRACE_RECORDS];
+static std::atomic<uint32_t> head{0};       // Free-running write index
+static uint32_t dumpedUpTo = 0;             // head at the end of the last dump
+static std::atomic<bool> paused{false};
+static std::atomic<bool> dumpRequested{false};
+
+// Producers are the motion task, the network task and the laser ISR, on
+// both cores, so the slot is claimed with an atomic increment.
+void IRAM_ATTR traceRecord(uint8_t event, uint16_t arg) {
+  if (paused.load(std::memory_order_relaxed)) {
+    return;
+  }
+  uint32_t index = head.fetch_add(1, std::memory_order_relaxed);
+  TraceRecord &record = ring[index & (TRACE_RECORDS - 1)];
+  record.cycles = halCycleCount();
+  record.event = event;
+  record.core = halCoreId();
+  record.arg = arg;
+}
+
+void traceRequestDump() {
+  dumpRequested.store(true, std::memory_order_relaxed);
+}
+
+bool traceTakeDumpRequest() {
+  return dumpRequested.exchange(false, std::memory_order_relaxed);
+}
+
+static const char BASE64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static size_t base64Encode(const uint8_t *data, size_t length, char *out) {
+  size_t o = 0;
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t chunk = (uint32_t)data[i] << 16;
+    if (i + 1 < length) chunk |= (uint32_t)data[i + 1] << 8;
+    if (i + 2 < length) chunk |= data[i + 2];
+    out[o++] = BASE64[(chunk >> 18) & 0x3F];
+    out[o++] = BASE64[(chunk >> 12) & 0x3F];
+    out[o++] = i + 1 < length ? BASE64[(chunk >> 6) & 0x3F] : '=';
+    out[o++] = i + 2 < length ? BASE64[chunk & 0x3F] : '=';
+  }
+  out[o] = '\0';
+  return o;
+}
+
+// Streams the header and the records as one byte sequence, cut into lines
+struct DumpWriter {
+  TraceLineFn fn;
+  void *ctx;
+  uint16_t line;
+  uint16_t lines;
+  uint8_t buffer[TRACE_LINE_BYTES];
+  size_t used;
+
+  void flush() {
+    if (used == 0) {
+      return;
+    }
+    char text[24 + (TRACE_LINE_BYTES + 2) / 3 * 4 + 1];
+    int prefix = snprintf(text, sizeof(text), "MFTRACE %u/%u ", (unsigned)++line, (unsigned)lines);
+    base64Encode(buffer, used, text + prefix);
+    fn(text, ctx);
+    used = 0;
+  }
+
+  void write(const void *data, size_t length) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    while (length > 0) {
+      size_t n = TRACE_LINE_BYTES - used < length ? TRACE_LINE_BYTES - used : length;
+      memcpy(buffer + used, bytes, n);
+      used += n;
+      bytes += n;
+      length -= n;
+      if (used == TRACE_LINE_BYTES) {
+        flush();
+      }
+    }
+  }
+};
+
+size_t traceDump(TraceLineFn fn, void *ctx) {
+  paused.store(true, std::memory_order_relaxed);
+  // A producer that claimed a slot just before the pause may still be
+  // writing it; the record is at worst torn, never out of bounds.
+  uint32_t end = head.load(std::memory_order_relaxed);
+  uint32_t available = end - dumpedUpTo;
+  uint32_t count = available < TRACE_RECORDS ? available : TRACE_RECORDS;
+
+  TraceDumpHeader header;
+  header.magic = TRACE_MAGIC;
+  header.recordSize = sizeof(TraceRecord);
+  header.count = (uint16_t)count;
+  header.cpuHz = halCpuHz();
+  header.lost = available - count;
+
+  DumpWriter writer;
+  writer.fn = fn;
+  writer.ctx = ctx;
+  writer.line = 0;
+  writer.used = 0;
+  size_t bytes = sizeof(header) + count * sizeof(TraceRecord);
+  writer.lines = (uint16_t)((bytes + TRACE_LINE_BYTES - 1) / TRACE_LINE_BYTES);
+
+  writer.write(&header, sizeof(header));
+  for (uint32_t i = end - count; i != end; i++) {
+    writer.write(&ring[i & (TRACE_RECORDS - 1)], sizeof(TraceRecord));
+  }
+  writer.flush();
+
+  dumpedUpTo = end;
+  paused.store(false, std::memory_order_relaxed);
+  return count;
+}
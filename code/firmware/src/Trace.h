@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * Trace - Binary event trace of the hot paths, cheap enough to leave on
+ *
+ * Each TRACE() writes one 8-byte record {cycle counter, event, core, arg}
+ * into a RAM ring; the newest TRACE_RECORDS records are kept. Recording is
+ * lock-free (one atomic increment), callable from both tasks and from
+ * ISRs, and costs well under a microsecond, unlike a Serial.print.
+ *
+ * On demand the ring is dumped as text lines
+ *
+ *   MFTRACE <line>/<lines> <base64>
+ *
+ * over Serial (type "trace" in the monitor) or MQTT ({"command":"trace"},
+ * published on the trace topic). tools/trace/trace_decode turns a capture
+ * of those lines into a Chrome trace / Perfetto timeline.
+ *
+ * Build with -DMEDIFLOW_TRACE=0 to compile all trace points out.
+ *
+ * Usage:
+ *   TRACE(TRACE_PILL, channel << 8 | pills);
+ *   if (traceTakeDumpRequest()) traceDump(sendLine, ctx);
+ */
+
+#include <Arduino.h>
+#include "TraceEvents.h"
+
+#ifndef MEDIFLOW_TRACE
+#define MEDIFLOW_TRACE 1
+#endif
+
+#define TRACE_RECORDS 2048          // Must be a power of two (16 KB)
+#define TRACE_MAGIC 0x3154464D      // "MFT1"
+#define TRACE_LINE_BYTES 192        // Raw bytes per dump line (256 base64 chars)
+
+struct TraceRecord {
+  uint32_t cycles;   // CPU cycle counter of the recording core
+  uint8_t event;     // TraceEvent
+  uint8_t core;
+  uint16_t arg;
+};
+
+// Start of a dump, followed by 'count' records, oldest first
+struct TraceDumpHeader {
+  uint32_t magic;
+  uint16_t recordSize;
+  uint16_t count;
+  uint32_t cpuHz;
+  uint32_t lost;     // Records overwritten since the previous dump
+};
+
+void traceRecord(uint8_t event, uint16_t arg);
+
+#if MEDIFLOW_TRACE
+#define TRACE(event, arg) traceRecord((event), (uint16_t)(arg))
+#else
+#define TRACE(event, arg) do { } while (0)
+#endif
+
+// Flag a dump for the network task (e.g. from a command handler)
+void traceRequestDump();
+bool traceTakeDumpRequest();
+
+// Receives one dump line (NUL-terminated, without newline)
+typedef void (*TraceLineFn)(const char *line, void *ctx);
+
+// Writes the ring as dump lines and empties it. Recording is paused while
+// the dump runs. Returns the number of records dumped.
+size_t traceDump(TraceLineFn fn, void *ctx);
+
+#endif
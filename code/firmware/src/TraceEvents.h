@@ -0,0 +1,69 @@
+#ifndef TRACEEVENTS_H
+#define TRACEEVENTS_H
+
+/**
+ * Trace event table, shared by the firmware (Trace.h) and the host decoder
+ * (tools/trace/). Plain C preprocessor only, no Arduino dependencies.
+ *
+ * TRACE_EVENT(id, name, kind):
+ * - TRACE_KIND_BEGIN/END:   span on the recording core; pairs share a name
+ * - TRACE_KIND_ASYNC_BEGIN/END: span that may overlap others (arg = span id)
+ * - TRACE_KIND_INSTANT:     point event, arg shown as a value
+ * - TRACE_KIND_COUNTER:     arg plotted as a counter track
+ *
+ * Ids are written to dumps, so only append new events at the end.
+ */
+
+#define TRACE_KIND_BEGIN 0
+#define TRACE_KIND_END 1
+#define TRACE_KIND_ASYNC_BEGIN 2
+#define TRACE_KIND_ASYNC_END 3
+#define TRACE_KIND_INSTANT 4
+#define TRACE_KIND_COUNTER 5
+
+#define TRACE_EVENTS(TRACE_EVENT) \
+  TRACE_EVENT(TRACE_MOTION_STEP_BEGIN, "motion_step", TRACE_KIND_BEGIN) \
+  TRACE_EVENT(TRACE_MOTION_STEP_END, "motion_step", TRACE_KIND_END) \
+  TRACE_EVENT(TRACE_NETWORK_STEP_BEGIN, "network_step", TRACE_KIND_BEGIN) \
+  TRACE_EVENT(TRACE_NETWORK_STEP_END, "network_step", TRACE_KIND_END) \
+  TRACE_EVENT(TRACE_MQTT_TICK_BEGIN, "mqtt_tick", TRACE_KIND_BEGIN) \
+  TRACE_EVENT(TRACE_MQTT_TICK_END, "mqtt_tick", TRACE_KIND_END) \
+  TRACE_EVENT(TRACE_PUBLISH_BEGIN, "publish", TRACE_KIND_BEGIN)             /* arg: payload bytes */ \
+  TRACE_EVENT(TRACE_PUBLISH_END, "publish", TRACE_KIND_END) \
+  TRACE_EVENT(TRACE_OUTBOX_DRAIN_BEGIN, "outbox_drain", TRACE_KIND_BEGIN) \
+  TRACE_EVENT(TRACE_OUTBOX_DRAIN_END, "outbox_drain", TRACE_KIND_END) \
+  TRACE_EVENT(TRACE_MQTT_RX, "mqtt_rx", TRACE_KIND_INSTANT)                 /* arg: payload bytes */ \
+  TRACE_EVENT(TRACE_LASER_EDGE, "laser_edge", TRACE_KIND_INSTANT)           /* arg: channel << 1 | blocked */ \
+  TRACE_EVENT(TRACE_PILL, "pill", TRACE_KIND_INSTANT)                       /* arg: channel << 8 | pills */ \
+  TRACE_EVENT(TRACE_ORDER_BEGIN, "order", TRACE_KIND_ASYNC_BEGIN)           /* arg: channel */ \
+  TRACE_EVENT(TRACE_ORDER_END, "order", TRACE_KIND_ASYNC_END) \
+  TRACE_EVENT(TRACE_REFILL_BEGIN, "refill", TRACE_KIND_ASYNC_BEGIN)         /* arg: channel */ \
+  TRACE_EVENT(TRACE_REFILL_END, "refill", TRACE_KIND_ASYNC_END) \
+  TRACE_EVENT(TRACE_N20_JAM, "n20_jam", TRACE_KIND_INSTANT)                 /* arg: retry */ \
+  TRACE_EVENT(TRACE_QUEUE_DEPTH, "queue_depth", TRACE_KIND_COUNTER) \
+  TRACE_EVENT(TRACE_HEALTH, "health", TRACE_KIND_INSTANT) \
+  TRACE_EVENT(TRACE_ENV_SAMPLE_BEGIN, "env_sample", TRACE_KIND_BEGIN) \
+  TRACE_EVENT(TRACE_ENV_SAMPLE_END, "env_sample", TRACE_KIND_END) \
+  TRACE_EVENT(TRACE_JOURNAL_SAVE_BEGIN, "journal_save", TRACE_KIND_BEGIN) \
+  TRACE_EVENT(TRACE_JOURNAL_SAVE_END, "journal_save", TRACE_KIND_END) \
+  TRACE_EVENT(TRACE_PUBLISH_PUMP_BEGIN, "publish_pump", TRACE_KIND_BEGIN)   /* arg: queued packets */ \
+  TRACE_EVENT(TRACE_PUBLISH_PUMP_END, "publish_pump", TRACE_KIND_END) \
+  TRACE_EVENT(TRACE_LOCAL_RX, "local_rx", TRACE_KIND_INSTANT)               /* arg: length */ \
+  TRACE_EVENT(TRACE_DOSE_DUE, "dose_due", TRACE_KIND_INSTANT)               /* arg: seconds late */ \
+  TRACE_EVENT(TRACE_PILL_DOUBLE, "pill_double", TRACE_KIND_INSTANT)         /* arg: channel << 12 | width in 0.1 ms */ \
+  TRACE_EVENT(TRACE_FEED_STOP, "feed_stop", TRACE_KIND_INSTANT)             /* arg: channel << 12 | pills counted */ \
+  TRACE_EVENT(TRACE_TURNTABLE_REFILLED, "refilled", TRACE_KIND_INSTANT)     /* arg: channel << 12 | pills on the table */ \
+  TRACE_EVENT(TRACE_TURNTABLE_STARVED, "starved", TRACE_KIND_INSTANT)       /* arg: channel */ \
+  TRACE_EVENT(TRACE_N20_STATE, "n20_state", TRACE_KIND_INSTANT)             /* arg: channel << 8 | N20State */ \
+  TRACE_EVENT(TRACE_EVENT_DROPPED, "event_dropped", TRACE_KIND_INSTANT)     /* arg: MotionEventType */ \
+  TRACE_EVENT(TRACE_EDGES_DROPPED, "edges_dropped", TRACE_KIND_COUNTER)     /* arg: laser edges dropped so far */ \
+  TRACE_EVENT(TRACE_TUNE, "tune", TRACE_KIND_INSTANT)                       /* arg: tuned CommandField bits */
+
+#define TRACE_EVENT_ID(id, name, kind) id,
+enum TraceEvent {
+  TRACE_EVENTS(TRACE_EVENT_ID)
+  TRACE_EVENT_COUNT
+};
+#undef TRACE_EVENT_ID
+
+#endif
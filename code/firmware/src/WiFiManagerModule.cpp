@@ -1,15 +1,33 @@
 #include "WiFiManagerModule.h"
+#include <esp_attr.h>
+#include <esp_wifi.h>
+#include "Hal.h"
+
+#define WIFI_AP_CACHE_MAGIC 0x57415043  // "WAPC"
+#define WIFI_AP_CACHE_KEY "wifi"
+
+// Not initialised at boot, so it survives a software reset; the magic
+// tells a kept copy from power-on garbage
+RTC_NOINIT_ATTR static WiFiApCache apCache;
 
 WiFiManagerModule::WiFiManagerModule(int buttonPin) {
     resetButtonPin = buttonPin;
     pressStartTime = 0;
     resetting = false;
+    portalActive = false;
+    linkUp = false;
+    joinState = WIFI_JOIN_IDLE;
+    joinStartedMs = 0;
+    droppedMs = 0;
+    failedJoins = 0;
+    reconnects = 0;
+    joinAttempts = 0;
+    lastReconnectMs = 0;
 }
 
-bool WiFiManagerModule::begin() {
+void WiFiManagerModule::begin() {
     WiFi.mode(WIFI_STA); // explicitly set mode, esp defaults to STA+AP
     
-    Serial.begin(115200);
     pinMode(resetButtonPin, INPUT_PULLUP);
     
     // Check if button is held at startup (optional)
@@ -20,23 +38,157 @@ bool WiFiManagerModule::begin() {
         ESP.restart();
     }
 
-    WiFiManager wm;
-    
-    // Set timeout for portal (optional)
-    wm.setConfigPortalTimeout(180); // 3 minutes timeout
-    
-    bool res = wm.autoConnect(AP_NAME, AP_PASSWORD);
+    portal.setConfigPortalBlocking(false);
+    portal.setConfigPortalTimeout(WIFI_PORTAL_TIMEOUT_S);
 
-    if (!res) {
-        Serial.println("Failed to connect to WiFi");
-        delay(3000);
-        ESP.restart();
-        return false;
+    // After a power cycle the RTC copy is gone; fall back to flash
+    if (apCache.magic != WIFI_AP_CACHE_MAGIC &&
+        (halStoreRead(WIFI_AP_CACHE_KEY, &apCache, sizeof(apCache)) != sizeof(apCache) ||
+         apCache.magic != WIFI_AP_CACHE_MAGIC)) {
+        apCache.magic = 0;
+    }
+
+    if (portal.getWiFiIsSaved()) {
+        // Reconnects are ours: the driver's would rescan every time
+        WiFi.setAutoReconnect(false);
+        startJoin(millis());
     } else {
-        Serial.println("Connected to WiFi!");
-        Serial.print("IP Address: ");
-        Serial.println(WiFi.localIP());
-        return true;
+        startPortal();
+    }
+}
+
+void WiFiManagerModule::startPortal() {
+    Serial.print("Starting WiFi setup portal: ");
+    Serial.println(AP_NAME);
+    portal.startConfigPortal(AP_NAME, AP_PASSWORD);
+    portalActive = true;
+}
+
+// Joins the saved network: straight to the cached AP while direct attempts
+// are left, else with a full scan
+void WiFiManagerModule::startJoin(unsigned long nowMs) {
+    wifi_config_t saved;
+    if (esp_wifi_get_config(WIFI_IF_STA, &saved) != ESP_OK || saved.sta.ssid[0] == '\0') {
+        joinState = WIFI_JOIN_IDLE;
+        return;
+    }
+    char ssid[33];
+    memcpy(ssid, saved.sta.ssid, 32);
+    ssid[32] = '\0';
+    const char *password = (const char *)saved.sta.password;
+
+    bool direct = failedJoins < WIFI_FAST_ATTEMPTS && apCache.magic == WIFI_AP_CACHE_MAGIC &&
+                  strcmp(apCache.ssid, ssid) == 0;
+
+    // The driver keeps the BSSID lock in its config; persisting it would
+    // cost a flash write on every switch between the two kinds of join
+    WiFi.persistent(false);
+    WiFi.disconnect();
+    if (direct) {
+        WiFi.begin(ssid, password, apCache.channel, apCache.bssid);
+    } else {
+        WiFi.begin(ssid, password);
+    }
+    WiFi.persistent(true);
+
+    joinState = direct ? WIFI_JOIN_DIRECT : WIFI_JOIN_SCAN;
+    joinStartedMs = nowMs;
+    joinAttempts++;
+}
+
+// Caches the AP just joined; flash is only written when it changed
+void WiFiManagerModule::rememberAccessPoint() {
+    WiFiApCache current;
+    memset(&current, 0, sizeof(current));
+    current.magic = WIFI_AP_CACHE_MAGIC;
+    strncpy(current.ssid, WiFi.SSID().c_str(), sizeof(current.ssid) - 1);
+    const uint8_t *bssid = WiFi.BSSID();
+    if (bssid == NULL) {
+        return;
+    }
+    memcpy(current.bssid, bssid, sizeof(current.bssid));
+    current.channel = (uint8_t)WiFi.channel();
+
+    if (memcmp(&current, &apCache, sizeof(current)) != 0) {
+        apCache = current;
+        halStoreWrite(WIFI_AP_CACHE_KEY, &apCache, sizeof(apCache));
+    }
+}
+
+void WiFiManagerModule::tick(unsigned long nowMs) {
+    if (portalActive) {
+        // process() returns true once new credentials connected; it closes
+        // the portal by itself on timeout
+        if (portal.process() || !portal.getConfigPortalActive()) {
+            portalActive = false;
+            WiFi.setAutoReconnect(false);
+            if (!isConnected()) {
+                WiFi.mode(WIFI_STA);
+                failedJoins = 0;
+                startJoin(nowMs);
+            }
+        }
+        if (portalActive) {
+            return;
+        }
+    }
+
+    if (isConnected()) {
+        if (!linkUp) {
+            linkUp = true;
+            joinState = WIFI_JOIN_IDLE;
+            if (droppedMs != 0) {
+                reconnects++;
+                lastReconnectMs = nowMs - droppedMs;
+                Serial.printf("WiFi reconnected in %lu ms (%u failed joins)\n",
+                              (unsigned long)lastReconnectMs, failedJoins);
+            } else {
+                Serial.print("Connected to WiFi, IP Address: ");
+                Serial.println(WiFi.localIP());
+            }
+            rememberAccessPoint();
+        }
+        return;
+    }
+
+    if (linkUp) {
+        // Rejoin at once; a blip should not wait for a backoff
+        Serial.println("WiFi link lost, rejoining");
+        linkUp = false;
+        droppedMs = nowMs;
+        failedJoins = 0;
+        startJoin(nowMs);
+        return;
+    }
+
+    switch (joinState) {
+        case WIFI_JOIN_DIRECT:
+        case WIFI_JOIN_SCAN: {
+            unsigned long timeoutMs = joinState == WIFI_JOIN_DIRECT ? WIFI_FAST_TIMEOUT_MS : WIFI_SCAN_TIMEOUT_MS;
+            if (nowMs - joinStartedMs > timeoutMs) {
+                failedJoins++;
+                if (failedJoins < WIFI_FAST_ATTEMPTS && joinState == WIFI_JOIN_DIRECT) {
+                    startJoin(nowMs);
+                } else {
+                    joinState = WIFI_JOIN_BACKOFF;
+                    joinStartedMs = nowMs;
+                }
+            }
+            break;
+        }
+        case WIFI_JOIN_BACKOFF: {
+            uint8_t scans = failedJoins > WIFI_FAST_ATTEMPTS ? failedJoins - WIFI_FAST_ATTEMPTS : 0;
+            unsigned long backoffMs = WIFI_RETRY_MIN_MS << (scans < 5 ? scans : 5);
+            if (backoffMs > WIFI_RETRY_MAX_MS) {
+                backoffMs = WIFI_RETRY_MAX_MS;
+            }
+            if (nowMs - joinStartedMs >= backoffMs) {
+                startJoin(nowMs);
+            }
+            break;
+        }
+        case WIFI_JOIN_IDLE:
+            break;
     }
 }
 
@@ -63,6 +215,8 @@ void WiFiManagerModule::handleResetButton() {
 void WiFiManagerModule::resetCredentials() {
     WiFiManager wm;
     wm.resetSettings(); // erase credentials from flash
+    memset(&apCache, 0, sizeof(apCache));
+    halStoreWrite(WIFI_AP_CACHE_KEY, &apCache, sizeof(apCache));
     Serial.println("WiFi credentials reset");
 }
 
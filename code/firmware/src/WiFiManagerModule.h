@@ -5,15 +5,30 @@
  * WiFiManagerModule - A wrapper for WiFiManager library with reset button functionality
  * 
  * Features:
- * - Automatic WiFi connection with captive portal for configuration
+ * - Background WiFi connection with captive portal for configuration
  * - Reset button support (hold for 5+ seconds to reset credentials)
  * - Boot-time reset check
  * - Connection status monitoring
  * 
+ * Nothing here blocks: begin() starts associating with the saved network
+ * and returns at once, and tick() advances the connection from the network
+ * task. The captive portal runs non-blocking alongside the station, and is
+ * only opened for first-time provisioning (no saved credentials) or after
+ * an explicit reset; a portal that times out closes and the station
+ * retries, instead of restarting the device.
+ * 
+ * Reconnects: the access point last joined (BSSID and channel) is cached
+ * in RTC memory, which survives a software reset, and in flash, written
+ * only when it changes. A dropped link is rejoined straight to that AP on
+ * its channel, skipping the scan; after WIFI_FAST_ATTEMPTS direct attempts
+ * fail (the AP moved channel or is gone) the station falls back to a full
+ * scan, retried with backoff up to WIFI_RETRY_MAX_MS. The driver's own
+ * auto-reconnect is off, so only one of the two is ever joining.
+ * 
  * Usage:
  * 1. Create instance: WiFiManagerModule wifiManager;
  * 2. In setup(): wifiManager.begin();
- * 3. In loop(): wifiManager.handleResetButton();
+ * 3. In loop(): wifiManager.tick(millis()); wifiManager.handleResetButton();
  * 
  * Reset Process:
  * - Connect to "MediFlow-Setup" AP with password "12345678"
@@ -30,18 +45,58 @@
 #define RESET_HOLD_TIME 5000  // 5 seconds
 #define AP_NAME "MediFlow-Setup"
 #define AP_PASSWORD "12345678"
+#define WIFI_PORTAL_TIMEOUT_S 180    // Portal closes again after this long
+#define WIFI_FAST_ATTEMPTS 2         // Direct joins to the cached AP before scanning
+#define WIFI_FAST_TIMEOUT_MS 3000    // A direct join usually completes in well under 1 s
+#define WIFI_SCAN_TIMEOUT_MS 10000
+#define WIFI_RETRY_MIN_MS 1000       // Backoff between scan joins, doubling...
+#define WIFI_RETRY_MAX_MS 30000      // ...up to this
+
+// Access point last joined; kept in RTC memory and in flash ("wifi")
+struct WiFiApCache {
+    uint32_t magic;
+    char ssid[33];
+    uint8_t bssid[6];
+    uint8_t channel;
+};
+
+enum WiFiJoinState {
+    WIFI_JOIN_IDLE,      // Connected, or nothing to join
+    WIFI_JOIN_DIRECT,    // Joining the cached AP on its channel
+    WIFI_JOIN_SCAN,      // Joining the saved SSID after a full scan
+    WIFI_JOIN_BACKOFF    // Waiting before the next scan join
+};
 
 class WiFiManagerModule {
 private:
     unsigned long pressStartTime;
     bool resetting;
     int resetButtonPin;
+    WiFiManager portal;
+    bool portalActive;
+    bool linkUp;
+    WiFiJoinState joinState;
+    unsigned long joinStartedMs;
+    unsigned long droppedMs;      // 0 until the first connection
+    uint8_t failedJoins;          // Since the link dropped
+    
+    // Reconnect statistics, for health reporting
+    uint32_t reconnects;
+    uint32_t joinAttempts;
+    uint32_t lastReconnectMs;
+    
+    void startPortal();
+    void startJoin(unsigned long nowMs);
+    void rememberAccessPoint();
     
 public:
     WiFiManagerModule(int buttonPin = RESET_BUTTON_PIN);
     
-    // Initialize WiFi manager and connect
-    bool begin();
+    // Start connecting to the saved network (or the portal); returns at once
+    void begin();
+    
+    // Advance the connection and serve the portal; never blocks
+    void tick(unsigned long nowMs);
     
     // Check for reset button press in loop
     void handleResetButton();
@@ -54,6 +109,11 @@ public:
     
     // Get current IP address
     String getIPAddress();
+    
+    uint32_t getReconnects() const { return reconnects; }
+    uint32_t getJoinAttempts() const { return joinAttempts; }
+    // Drop to reconnected, of the latest reconnect
+    uint32_t getLastReconnectMs() const { return lastReconnectMs; }
 };
 
 #endif
@@ -0,0 +1,171 @@
+#include "WireFormat.h"
+#include <stdio.h>
+#include <string.h>
+
+#define WIRE_KEY_NAME(id, code, name) name,
+static const char *const KEY_NAME_LIST[] = { WIRE_KEYS(WIRE_KEY_NAME) };
+#undef WIRE_KEY_NAME
+#define WIRE_KEY_CODE(id, code, name) code,
+static const uint8_t KEY_CODE_LIST[] = { WIRE_KEYS(WIRE_KEY_CODE) };
+#undef WIRE_KEY_CODE
+static_assert(WIRE_KEY_END <= 128, "MessagePack keys must be positive fixints");
+
+#define WIRE_FORMAT_NAME(id, name) name,
+static const char *const FORMAT_NAMES[] = { WIRE_FORMATS(WIRE_FORMAT_NAME) };
+#undef WIRE_FORMAT_NAME
+
+static WireFormat statusFormat = WIRE_JSON;
+
+static const char *keyName(WireKey key) {
+  for (size_t i = 0; i < sizeof(KEY_CODE_LIST); i++) {
+    if (KEY_CODE_LIST[i] == key) {
+      return KEY_NAME_LIST[i];
+    }
+  }
+  return "?";
+}
+
+const char *wireFormatName(WireFormat format) {
+  return format < WIRE_FORMAT_COUNT ? FORMAT_NAMES[format] : "?";
+}
+
+bool wireFormatFromName(const char *name, size_t length, WireFormat &format) {
+  for (uint8_t i = 0; i < WIRE_FORMAT_COUNT; i++) {
+    if (strlen(FORMAT_NAMES[i]) == length && memcmp(FORMAT_NAMES[i], name, length) == 0) {
+      format = (WireFormat)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+WireFormat wireStatusFormat() {
+  return statusFormat;
+}
+
+void wireSetStatusFormat(WireFormat format) {
+  statusFormat = format;
+}
+
+WireWriter::WireWriter(void *buf, size_t size, WireFormat format)
+    : buf((uint8_t *)buf), size(size), len(0), format(format), fields(0), overflow(false) {
+  // MessagePack: fixmap header, count patched in by finish()
+  putByte(format == WIRE_MSGPACK ? 0x80 : '{');
+}
+
+void WireWriter::put(const void *data, size_t length) {
+  if (overflow || size - len < length) {
+    overflow = true;
+    return;
+  }
+  memcpy(buf + len, data, length);
+  len += length;
+}
+
+void WireWriter::key(WireKey key) {
+  if (++fields > WIRE_MAX_FIELDS) {
+    overflow = true;
+    return;
+  }
+  if (format == WIRE_MSGPACK) {
+    putByte((uint8_t)key);
+    return;
+  }
+  if (fields > 1) {
+    putByte(',');
+  }
+  const char *name = keyName(key);
+  putByte('"');
+  put(name, strlen(name));
+  put("\":", 2);
+}
+
+void WireWriter::addInt(WireKey k, int64_t value) {
+  key(k);
+  if (format != WIRE_MSGPACK) {
+    char text[24];
+    int n = snprintf(text, sizeof(text), "%lld", (long long)value);
+    put(text, (size_t)n);
+    return;
+  }
+
+  uint8_t out[9];
+  size_t n;
+  if (value >= 0 && value <= 0x7F) {
+    out[0] = (uint8_t)value;
+    n = 1;
+  } else if (value >= -32 && value < 0) {
+    out[0] = (uint8_t)(int8_t)value;
+    n = 1;
+  } else if (value >= 0) {
+    // Big-endian unsigned of the smallest width
+    uint8_t width = value <= 0xFF ? 1 : value <= 0xFFFF ? 2 : value <= 0xFFFFFFFFLL ? 4 : 8;
+    out[0] = width == 1 ? 0xCC : width == 2 ? 0xCD : width == 4 ? 0xCE : 0xCF;
+    for (uint8_t i = 0; i < width; i++) {
+      out[1 + i] = (uint8_t)((uint64_t)value >> (8 * (width - 1 - i)));
+    }
+    n = 1 + width;
+  } else {
+    uint8_t width = value >= -0x80 ? 1 : value >= -0x8000 ? 2 : value >= -0x80000000LL ? 4 : 8;
+    out[0] = width == 1 ? 0xD0 : width == 2 ? 0xD1 : width == 4 ? 0xD2 : 0xD3;
+    for (uint8_t i = 0; i < width; i++) {
+      out[1 + i] = (uint8_t)((uint64_t)value >> (8 * (width - 1 - i)));
+    }
+    n = 1 + width;
+  }
+  put(out, n);
+}
+
+void WireWriter::addString(WireKey k, const char *value) {
+  addString(k, value, strlen(value));
+}
+
+void WireWriter::addString(WireKey k, const char *value, size_t length) {
+  key(k);
+  if (format == WIRE_MSGPACK) {
+    if (length < 32) {
+      putByte((uint8_t)(0xA0 | length));
+    } else if (length <= 0xFF) {
+      uint8_t header[2] = { 0xD9, (uint8_t)length };
+      put(header, 2);
+    } else {
+      uint8_t header[3] = { 0xDA, (uint8_t)(length >> 8), (uint8_t)length };
+      put(header, 3);
+    }
+    put(value, length);
+    return;
+  }
+
+  // Ids and medicine names come from commands, so they may hold quotes
+  putByte('"');
+  for (size_t i = 0; i < length; i++) {
+    uint8_t c = (uint8_t)value[i];
+    if (c == '"' || c == '\\') {
+      uint8_t escaped[2] = { '\\', c };
+      put(escaped, 2);
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      put(escaped, 6);
+    } else {
+      putByte(c);
+    }
+  }
+  putByte('"');
+}
+
+size_t WireWriter::finish() {
+  if (format == WIRE_MSGPACK) {
+    if (!overflow && len > 0) {
+      buf[0] = (uint8_t)(0x80 | fields);
+    }
+  } else {
+    putByte('}');
+    if (!overflow && len < size) {
+      buf[len] = '\0';
+    } else {
+      overflow = true;
+    }
+  }
+  return overflow ? 0 : len;
+}
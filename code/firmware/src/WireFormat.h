@@ -0,0 +1,73 @@
+#ifndef WIREFORMAT_H
+#define WIREFORMAT_H
+
+/**
+ * WireFormat - Status messages in JSON or MessagePack from one code path
+ *
+ * Messages on PUBLISH_TOPIC are flat maps of WireSchema.h keys to integers
+ * and strings. WireWriter builds one into a caller buffer, either as the
+ * JSON the topic always carried ({"status":"queued",...}, same key order)
+ * or as a MessagePack map with 1-byte integer keys, which is roughly half
+ * the size and needs no number formatting or parsing.
+ *
+ * The format is selected per device: JSON by default, switched with the
+ * "wire" command (see Dispenser.cpp) and reported in the online message.
+ * Commands are accepted in either format regardless (CommandParser tells
+ * them apart by the first byte).
+ *
+ * No Arduino dependencies, so the host tools build it too (tools/bench/).
+ *
+ * Usage:
+ *   WireWriter msg(buf, sizeof(buf), wireStatusFormat());
+ *   msg.addString(WIRE_KEY_STATUS, "queued");
+ *   msg.addInt(WIRE_KEY_TARGET_COUNT, 20);
+ *   size_t length = msg.finish();   // 0 if it did not fit
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "WireSchema.h"
+
+#define WIRE_MAX_FIELDS 15   // One-byte MessagePack map header
+
+#define WIRE_FORMAT_ENUM(id, name) id,
+enum WireFormat : uint8_t {
+  WIRE_FORMATS(WIRE_FORMAT_ENUM)
+  WIRE_FORMAT_COUNT
+};
+#undef WIRE_FORMAT_ENUM
+
+const char *wireFormatName(WireFormat format);
+// Matches a format name (not NUL-terminated); false if unknown
+bool wireFormatFromName(const char *name, size_t length, WireFormat &format);
+
+// Format of outgoing status messages; network task only
+WireFormat wireStatusFormat();
+void wireSetStatusFormat(WireFormat format);
+
+class WireWriter {
+private:
+  uint8_t *buf;
+  size_t size;
+  size_t len;
+  WireFormat format;
+  uint8_t fields;
+  bool overflow;
+
+  void put(const void *data, size_t length);
+  void putByte(uint8_t b) { put(&b, 1); }
+  void key(WireKey key);
+
+public:
+  WireWriter(void *buf, size_t size, WireFormat format);
+
+  void addInt(WireKey key, int64_t value);
+  void addString(WireKey key, const char *value);
+  void addString(WireKey key, const char *value, size_t length);
+
+  // Closes the map; returns its length, or 0 if it did not fit. JSON is
+  // also NUL-terminated (not counted).
+  size_t finish();
+};
+
+#endif
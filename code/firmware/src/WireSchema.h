@@ -0,0 +1,64 @@
+#ifndef WIRESCHEMA_H
+#define WIRESCHEMA_H
+
+/**
+ * Wire schema of the command and status topics, shared by the firmware
+ * (CommandParser, WireFormat), the host tools and the backend
+ * (backend/src/utils/wireSchema.js is generated from this table by
+ * tools/wire/wire_schema_js.cpp). Plain C preprocessor only, no Arduino
+ * dependencies.
+ *
+ * WIRE_KEY(id, code, name):
+ * - JSON messages use name as the object key
+ * - MessagePack messages are maps keyed by code (a 1-byte positive fixint)
+ *
+ * Codes are on the wire, so never reuse or renumber one; add new keys at
+ * the end with the next code (at most 127).
+ */
+
+#define WIRE_KEYS(WIRE_KEY) \
+  WIRE_KEY(WIRE_KEY_COMMAND, 1, "command") \
+  WIRE_KEY(WIRE_KEY_QUANTITY, 2, "quantity") \
+  WIRE_KEY(WIRE_KEY_MEDICINE_NAME, 3, "medicine_name") \
+  WIRE_KEY(WIRE_KEY_MEDICINE_ID, 4, "medicine_id") \
+  WIRE_KEY(WIRE_KEY_PRESCRIPTION_ID, 5, "prescription_id") \
+  WIRE_KEY(WIRE_KEY_TIMESTAMP, 6, "timestamp") \
+  WIRE_KEY(WIRE_KEY_BULK_SPEED, 7, "bulkSpeed") \
+  WIRE_KEY(WIRE_KEY_CREEP_SPEED, 8, "creepSpeed") \
+  WIRE_KEY(WIRE_KEY_TAPER_PILLS, 9, "taperPills") \
+  WIRE_KEY(WIRE_KEY_CREEP_PILLS, 10, "creepPills") \
+  WIRE_KEY(WIRE_KEY_KP, 11, "kp") \
+  WIRE_KEY(WIRE_KEY_KI, 12, "ki") \
+  WIRE_KEY(WIRE_KEY_FORMAT, 13, "format") \
+  WIRE_KEY(WIRE_KEY_STATUS, 14, "status") \
+  WIRE_KEY(WIRE_KEY_ERROR, 15, "error") \
+  WIRE_KEY(WIRE_KEY_REASON, 16, "reason") \
+  WIRE_KEY(WIRE_KEY_OFFSET, 17, "offset") \
+  WIRE_KEY(WIRE_KEY_TARGET_COUNT, 18, "targetCount") \
+  WIRE_KEY(WIRE_KEY_PILL_COUNT, 19, "pillCount") \
+  WIRE_KEY(WIRE_KEY_POSITION, 20, "position") \
+  WIRE_KEY(WIRE_KEY_CHANNEL, 21, "channel") \
+  WIRE_KEY(WIRE_KEY_OVERSHOOT, 22, "overshoot") \
+  WIRE_KEY(WIRE_KEY_DURATION_MS, 23, "durationMs") \
+  WIRE_KEY(WIRE_KEY_INTERVAL_MIN_MS, 24, "intervalMinMs") \
+  WIRE_KEY(WIRE_KEY_INTERVAL_MEAN_MS, 25, "intervalMeanMs") \
+  WIRE_KEY(WIRE_KEY_INTERVAL_MAX_MS, 26, "intervalMaxMs") \
+  WIRE_KEY(WIRE_KEY_DOUBLES, 27, "doubles") \
+  WIRE_KEY(WIRE_KEY_REJECTED, 28, "rejected") \
+  WIRE_KEY(WIRE_KEY_JAMS, 29, "jams") \
+  WIRE_KEY(WIRE_KEY_TIMES, 30, "times") \
+  WIRE_KEY(WIRE_KEY_GRACE, 31, "grace")
+
+#define WIRE_KEY_ENUM(id, code, name) id = code,
+enum WireKey {
+  WIRE_KEYS(WIRE_KEY_ENUM)
+  WIRE_KEY_END
+};
+#undef WIRE_KEY_ENUM
+
+// Formats a device can be switched to with {"command":"wire","format":...}
+#define WIRE_FORMATS(WIRE_FORMAT) \
+  WIRE_FORMAT(WIRE_JSON, "json") \
+  WIRE_FORMAT(WIRE_MSGPACK, "msgpack")
+
+#endif
@@ -1,39 +1,30 @@
 #include <Arduino.h>
-#include <DHT.h>
-#include "MotorControl.h"
-#include "LaserModule.h"
+#include "Hal.h"
+#include "Dispenser.h"
+#include "Channels.h"
+#include "DispenseTelemetry.h"
+#include "EnvSampler.h"
+#include "HealthSeries.h"
 #include "WiFiManagerModule.h"
+#include "MqttConnection.h"
+#include "MqttPublisher.h"
+#include "LocalEndpoint.h"
+#include "Outbox.h"
+#include "TaskMessages.h"
+#include "Trace.h"
 #include <WiFi.h>
+#include <esp_system.h>
+#include <esp_sntp.h>
+#include <time.h>
 #include <WiFiClientSecure.h>
 #include <PubSubClient.h>
 #include "certs/certificates.h"
-#include <ESP32Servo.h>
 #include "turbine.h"
 
-// N20 Motor Driver Pins (using L298N or similar)
-const int N20_ENA = 32;    // Enable pin (PWM for speed control)
-const int N20_IN1 = 33;    // Direction pin 1
-const int N20_IN2 = 2;     // Direction pin 2
-
 // LED Status Indicators
 const int WIFI_LED_PIN = 18;    // LED for WiFi connection status
 const int IOT_LED_PIN = 19;     // LED for IoT connection status
 
-// N20 Motor control variables
-bool n20MotorRunning = false;
-int n20MotorSpeed = 150;   // PWM value (0-255)
-
-void setupN20Motor() {
-  pinMode(N20_ENA, OUTPUT);
-  pinMode(N20_IN1, OUTPUT);
-  pinMode(N20_IN2, OUTPUT);
-  
-  // Initialize motor to stopped state
-  digitalWrite(N20_ENA, LOW);
-  digitalWrite(N20_IN1, LOW);
-  digitalWrite(N20_IN2, LOW);
-}
-
 void setupStatusLEDs() {
   pinMode(WIFI_LED_PIN, OUTPUT);
   pinMode(IOT_LED_PIN, OUTPUT);
@@ -53,43 +44,6 @@ void updateIoTLED(bool connected) {
   digitalWrite(IOT_LED_PIN, connected ? HIGH : LOW);
 }
 
-void startN20Motor() {
-  digitalWrite(N20_IN1, HIGH);
-  digitalWrite(N20_IN2, LOW);
-  analogWrite(N20_ENA, n20MotorSpeed);
-  n20MotorRunning = true;
-  Serial.println("N20 Motor started");
-}
-
-void stopN20Motor() {
-  digitalWrite(N20_ENA, LOW);
-  digitalWrite(N20_IN1, LOW);
-  digitalWrite(N20_IN2, LOW);
-  n20MotorRunning = false;
-  Serial.println("N20 Motor stopped");
-}
-
-void setN20MotorSpeed(int speed) {
-  n20MotorSpeed = constrain(speed, 0, 255);
-  if (n20MotorRunning) {
-    analogWrite(N20_ENA, n20MotorSpeed);
-  }
-}
-
-void reverseN20Motor() {
-  digitalWrite(N20_IN1, LOW);
-  digitalWrite(N20_IN2, HIGH);
-  analogWrite(N20_ENA, n20MotorSpeed);
-  n20MotorRunning = true;
-  Serial.println("N20 Motor reversed");
-}
-
-unsigned long previousMillis = 0;
-const unsigned long interval = 10; // 10 ms interval
-
-Servo refillServo;
-const int SERVO_PIN = 21;  
-
 // WiFi Manager instance
 WiFiManagerModule wifiManager;
 
@@ -101,321 +55,470 @@ WiFiManagerModule wifiManager;
 #define SUBSCRIBE_TOPIC "mediflow/" THING_NAME "/command"
 #define PUBLISH_TOPIC "mediflow/" THING_NAME "/status"
 #define PUBLISH_TOPIC_HEALTH "mediflow/" THING_NAME "/health"
+#define PUBLISH_TOPIC_HEALTH_BATCH "mediflow/" THING_NAME "/health/batch"
+#define PUBLISH_TOPIC_TRACE "mediflow/" THING_NAME "/trace"
+#define PUBLISH_TOPIC_LOCAL "mediflow/" THING_NAME "/local"   // Commands taken over the LAN
+
+// 64 hex digits shared with the LAN clients; define it next to the AWS
+// credentials in certs/certificates.h to turn the LAN endpoint on
+#ifndef LOCAL_CONTROL_KEY
+#define LOCAL_CONTROL_KEY ""
+#endif
+
+// Wall clock of the dose schedule (DoseSchedule.h), from SNTP. Corrections
+// are slewed rather than stepped once the clock is set; DEVICE_TZ is the
+// POSIX TZ of the ward (override it in certs/certificates.h).
+#ifndef DEVICE_TZ
+#define DEVICE_TZ "<+0530>-5:30"
+#endif
+#define SNTP_SERVER_1 "pool.ntp.org"
+#define SNTP_SERVER_2 "time.google.com"
+#define SNTP_SYNC_INTERVAL_MS 3600000  // Keeps the RTC's drift to well under a second
+#define SCHEDULE_POLL_MS 1000
+
+// PubSubClient's buffer now only holds inbound commands and its own control
+// packets (CONNECT with the will). The largest command, three strings of up
+// to COMMAND_MAX_STRING_LEN and a dozen numeric fields, is under 450 B as
+// JSON with the topic. Outgoing messages are sized by MqttPublisher.
+#define MQTT_INBOUND_BYTES 512
+
+// Task layout: networking on the protocol core, motion/counting on the
+// application core (where the laser ISR is also registered).
+#define NETWORK_TASK_CORE 0
+#define MOTION_TASK_CORE 1
+#define NETWORK_TASK_STACK 12288  // TLS handshake runs on this stack
+#define MOTION_TASK_STACK 4096
+#define NETWORK_TASK_PRIORITY 1
+#define MOTION_TASK_PRIORITY 3
+#define NETWORK_TASK_PERIOD_MS 5
+#define MOTION_TASK_PERIOD_MS 1
 
 // MQTT and WiFiClientSecure setup
 WiFiClientSecure wifiClient;
-PubSubClient mqttClient(wifiClient);
+MqttPublisher publisher(wifiClient);  // Outgoing queue; PubSubClient reads and writes through it
+PubSubClient mqttClient(publisher);
+LocalEndpoint localEndpoint;
+MqttConnection mqttLink(mqttClient, wifiClient);
+Outbox outbox;
+
+// Health is sampled every HEALTH_SAMPLE_MS and published as one compressed
+// batch every HEALTH_BATCH_MS (see HealthSeries.h)
+#define HEALTH_SAMPLE_MS 10000
+#define HEALTH_BATCH_MS 300000
+unsigned long lastHealthSample = 0;
+unsigned long lastHealthBatch = 0;
+
+bool sntpStarted = false;
+std::atomic<bool> clockSet{false};   // Set from the SNTP callback (lwIP task)
+unsigned long lastSchedulePoll = 0;
+
+LoopLatency motionLatency;
+LoopLatency networkLatency;
+
+// Milliseconds from reset to each boot stage. setup() only does the first
+// two; the rest are reached in the background on the network task and the
+// breakdown goes out once, in the first online message.
+struct BootTimes {
+  uint32_t safeMs;     // Actuators stopped, gates closed
+  uint32_t readyMs;    // Motion task running: local dispensing available
+  uint32_t outboxMs;   // Flash outbox mounted
+  uint32_t wifiMs;     // First WiFi association
+  uint32_t mqttMs;     // First broker connection
+  bool reported;
+};
+BootTimes bootTimes;
+
+// --- Network task state (owned by networkTask only) ---
+DispenseTelemetry telemetry[CHANNEL_MAX];  // One per dispenser channel
+EnvSampler envSampler;                     // Sole reader of the DHT sensor
+HealthSeries healthSeries(HEALTH_SAMPLE_MS / 1000);
+
+// Publisher used by Outbox when draining. A full publish queue stops the
+// drain, leaving the record in flash for the next pass.
+uint16_t publishOutboxRecord(const char *topic, const uint8_t *payload, size_t length) {
+  uint16_t packetId = 0;
+  return publisher.enqueue(topic, payload, length, 1, &packetId) ? packetId : 0;
+}
 
-unsigned long lastHealthPublish = 0;
+// A record leaves the outbox only when the broker's PUBACK for it arrives
+void acknowledgeOutboxRecord(uint16_t packetId) {
+  outbox.acknowledge(packetId);
+}
 
-#define DHTPIN 5
-#define DHTTYPE DHT11
-DHT dht(DHTPIN, DHTTYPE);
+// Durable messages go through the flash outbox so they survive link drops
+// and reboots, and are published at QoS 1; best-effort ones are queued
+// only while the link is up. Nothing here waits for the network or the
+// flash: the outbox is synced and drained, and the publisher's queue
+// written out, at the end of networkStep().
+bool publishMessage(const char *topic, const uint8_t *payload, size_t length, bool durable) {
+  TRACE(TRACE_PUBLISH_BEGIN, length);
+  bool sent = false;
+  if (durable) {
+    sent = outbox.enqueue(topic, payload, length);
+    // Flash failed: fall back to a direct publish
+  }
+  if (!sent) {
+    sent = mqttLink.isConnected() && publisher.enqueue(topic, payload, length, durable ? 1 : 0);
+  }
+  TRACE(TRACE_PUBLISH_END, 0);
+  return sent;
+}
 
-int pillCount = 0;
-int targetPillCount = 10;
-bool wasLaserBlocked = false;
-bool dispensing = false; 
+bool publishMessage(const char *topic, const char *payload, bool durable) {
+  return publishMessage(topic, (const uint8_t *)payload, strlen(payload), durable);
+}
 
-int turntablePillCount = 10;   // Starting number of pills on the turntable
-const int PILL_THRESHOLD = 3;  // Refill when fewer than this remain
-const int REFILL_AMOUNT = 10;   // How many pills added per refill
-bool refilling = false;         // Flag to prevent overlapping refills
+// Publisher used by DispenseTelemetry
+bool publishStatus(const uint8_t *payload, size_t length, bool durable) {
+  return publishMessage(PUBLISH_TOPIC, payload, length, durable);
+}
 
-// MQTT message callback
+// MQTT message callback (runs on the network task). Parsing and hand-off
+// to the motion task happen in dispenserSubmit().
 void messageHandler(char *topic, byte *payload, unsigned int length)
 {
+  TRACE(TRACE_MQTT_RX, length);
   Serial.print("Incoming message on topic: ");
   Serial.println(topic);
 
-  char message[length + 1];
-  memcpy(message, payload, length);
-  message[length] = '\0';
+  uint8_t reply[DISPENSER_REPLY_LEN];
+  size_t replyLength = dispenserSubmit(payload, length, reply, sizeof(reply));
+  if (replyLength > 0) {
+    publisher.enqueue(PUBLISH_TOPIC, reply, replyLength, 1);
+  }
+}
+
+// LAN endpoint: the same dispense path as messageHandler(); the reply goes
+// back over HTTP, status messages follow on the usual topics
+size_t handleLocalCommand(uint8_t *payload, size_t length, uint8_t *reply, size_t replySize) {
+  TRACE(TRACE_LOCAL_RX, length);
+  size_t replyLength = dispenserSubmit(payload, length, reply, replySize);
+  if (replyLength == 0) {
+    WireWriter msg(reply, replySize, wireStatusFormat());
+    msg.addString(WIRE_KEY_STATUS, "accepted");
+    replyLength = msg.finish();
+  }
+  return replyLength;
+}
 
-  Serial.print("Complete Message: ");
-  Serial.println(message);
+// Reconciles a LAN command with the cloud: durable, so it is delivered
+// once the broker is reachable again
+void recordLocalCommand(const uint8_t *payload, size_t length) {
+  publishMessage(PUBLISH_TOPIC_LOCAL, payload, length, true);
+}
+
+const char *resetReasonName(esp_reset_reason_t reason) {
+  switch (reason) {
+    case ESP_RST_POWERON: return "poweron";
+    case ESP_RST_BROWNOUT: return "brownout";
+    case ESP_RST_PANIC: return "panic";
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT: return "watchdog";
+    case ESP_RST_SW: return "software";
+    case ESP_RST_DEEPSLEEP: return "deepsleep";
+    default: return "other";
+  }
+}
 
-  if (strstr(message, "\"command\":\"dispense\"") != NULL || 
-      strstr(message, "\"command\": \"dispense\"") != NULL)
+// Called by mqttLink after every successful (re)connect
+void onAWSConnected()
+{
+  updateIoTLED(true); // Turn on IoT LED when connected
+  // Always JSON, like the LWT; "wire" is the status format in use. The
+  // first message after boot also carries the boot-time breakdown.
+  char msg[224];
+  int length = snprintf(msg, sizeof(msg), "{\"status\":\"%s\",\"wire\":\"%s\"", "online",
+                        wireFormatName(wireStatusFormat()));
+  if (!bootTimes.reported) {
+    bootTimes.mqttMs = millis();
+    length += snprintf(msg + length, sizeof(msg) - length,
+                       ",\"boot\":{\"reset\":\"%s\",\"safeMs\":%lu,\"readyMs\":%lu,"
+                       "\"outboxMs\":%lu,\"wifiMs\":%lu,\"mqttMs\":%lu}",
+                       resetReasonName(esp_reset_reason()), (unsigned long)bootTimes.safeMs,
+                       (unsigned long)bootTimes.readyMs, (unsigned long)bootTimes.outboxMs,
+                       (unsigned long)bootTimes.wifiMs, (unsigned long)bootTimes.mqttMs);
+    bootTimes.reported = true;
+  }
+  snprintf(msg + length, sizeof(msg) - length, "}");
+  publisher.enqueue(PUBLISH_TOPIC_HEALTH, msg, 0);
+
+  // A resumed session still holds the subscription, and the commands
+  // queued for it arrive without asking
+  if (publisher.sessionPresent())
   {
-    Serial.println("✓ Dispense command detected");
-    
-    char *quantityStart = strstr(message, "\"quantity\":");
-    if (quantityStart)
-    {
-      quantityStart += 11;
-      while (*quantityStart == ' ' || *quantityStart == '\t') {
-        quantityStart++;
-      }
-      targetPillCount = atoi(quantityStart);
-      Serial.print("Target pill count set to: ");
-      Serial.println(targetPillCount);
-    }
-    else
-    {
-      Serial.println("Warning: No quantity specified, using default");
-      targetPillCount = 10;
-    }
-    
-    char *medicineStart = strstr(message, "\"medicine_name\":\"");
-    if (medicineStart) {
-      medicineStart += 17;
-      char *medicineEnd = strstr(medicineStart, "\"");
-      if (medicineEnd) {
-        int nameLength = medicineEnd - medicineStart;
-        char medicineName[nameLength + 1];
-        strncpy(medicineName, medicineStart, nameLength);
-        medicineName[nameLength] = '\0';
-        Serial.print("Medicine: ");
-        Serial.println(medicineName);
-      }
-    }
-    
-    pillCount = 0;
-    dispensing = true; 
-    openGate();
-    Serial.println("=== STARTING DISPENSE OPERATION ===");
-    Serial.print("Target pills: ");
-    Serial.println(targetPillCount);
-    
-    char confirmMsg[256];
-    char *prescriptionStart = strstr(message, "\"prescription_id\":\"");
-    if (prescriptionStart) {
-      prescriptionStart += 19;
-      char *prescriptionEnd = strstr(prescriptionStart, "\"");
-      if (prescriptionEnd) {
-        int idLength = prescriptionEnd - prescriptionStart;
-        char prescriptionId[idLength + 1];
-        strncpy(prescriptionId, prescriptionStart, idLength);
-        prescriptionId[idLength] = '\0';
-        
-        sprintf(confirmMsg, "{\"status\":\"dispensing_started\",\"targetCount\":%d,\"prescription_id\":\"%s\"}", 
-                targetPillCount, prescriptionId);
-      } else {
-        sprintf(confirmMsg, "{\"status\":\"dispensing_started\",\"targetCount\":%d}", targetPillCount);
-      }
-    } else {
-      sprintf(confirmMsg, "{\"status\":\"dispensing_started\",\"targetCount\":%d}", targetPillCount);
-    }
-    
-    mqttClient.publish(PUBLISH_TOPIC, confirmMsg);
+    Serial.println("MQTT session resumed, subscription kept");
+  }
+  else if (mqttClient.subscribe(SUBSCRIBE_TOPIC, 1))
+  {
+    Serial.print("Subscribed to: ");
+    Serial.println(SUBSCRIBE_TOPIC);
   }
   else
   {
-    Serial.println("No dispense command found in message");
-    Serial.println("Expected: \"command\":\"dispense\"");
+    Serial.println("Failed to subscribe");
   }
 }
 
-// Connect to AWS IoT
+// Configure the AWS IoT connection. The connection itself is brought up
+// (and re-established) by mqttLink.tick() on the network task.
 void connectToAWS()
 {
-  wifiClient.setCACert(AWS_CERT_CA);
-  wifiClient.setCertificate(AWS_CERT_CRT);
-  wifiClient.setPrivateKey(AWS_CERT_PRIVATE);
-
-  mqttClient.setServer(AWS_IOT_ENDPOINT, AWS_IOT_PORT);
+  mqttClient.setBufferSize(MQTT_INBOUND_BYTES);
+  publisher.setInboundLimit(MQTT_INBOUND_BYTES);
   mqttClient.setCallback(messageHandler);
 
-  Serial.println("Connecting to AWS IoT...");
+  mqttLink.setOnConnected(onAWSConnected);
+  mqttLink.begin(AWS_IOT_ENDPOINT, AWS_IOT_PORT,
+                 AWS_CERT_CA, AWS_CERT_CRT, AWS_CERT_PRIVATE,
+                 CLIENT_ID, PUBLISH_TOPIC_HEALTH, "{\"status\":\"offline\"}");
+}
 
-  while (!mqttClient.connected())
-  {
-    if (mqttClient.connect(
-        CLIENT_ID,
-        PUBLISH_TOPIC_HEALTH,
-        0,
-        false,
-        "{\"status\":\"offline\"}"
-      ))
-    {
-      Serial.println("Connected to AWS IoT");
-      updateIoTLED(true); // Turn on IoT LED when connected
-      char msg[64];
-      sprintf(msg, "{\"status\":\"%s\"}", "online");
-      mqttClient.publish(PUBLISH_TOPIC_HEALTH, msg);
-
-      if (mqttClient.subscribe(SUBSCRIBE_TOPIC))
-      {
-        Serial.print("Subscribed to: ");
-        Serial.println(SUBSCRIBE_TOPIC);
-      }
-      else
-      {
-        Serial.println("Failed to subscribe");
+// Trace dump sinks (see Trace.h)
+void printTraceLine(const char *line, void *ctx) {
+  Serial.println(line);
+}
+
+// A dump is larger than the publish queue, so it goes out synchronously
+// through PubSubClient; it only runs on request
+void publishTraceLine(const char *line, void *ctx) {
+  mqttClient.publish(PUBLISH_TOPIC_TRACE, line);
+}
+
+// A "trace" line typed into the serial monitor dumps the trace there
+void pollSerialCommands() {
+  static char line[16];
+  static size_t length = 0;
+  while (Serial.available() > 0) {
+    char c = (char)Serial.read();
+    if (c == '\n' || c == '\r') {
+      line[length] = '\0';
+      if (strcmp(line, "trace") == 0) {
+        traceDump(printTraceLine, NULL);
       }
-    }
-    else
-    {
-      updateIoTLED(false); // Turn off IoT LED when disconnected
-      Serial.print("Failed to connect to AWS IoT, rc=");
-      Serial.print(mqttClient.state());
-      Serial.println(" Retrying in 5 seconds...");
-      delay(5000);
+      length = 0;
+    } else if (length < sizeof(line) - 1) {
+      line[length++] = c;
     }
   }
 }
 
-void triggerRefill() {
-  Serial.println("Triggering refill...");
-  refilling = true;
-
-  refillServo.write(180);
-  Serial.println("Servo to 180°");
-  delay(1000);
-
-  refillServo.write(0);
-  Serial.println("Servo to 0°");
-  delay(500);
+// Health value scaled to an integer, HEALTH_MISSING when there is none
+int32_t healthValue(float value, float scale) {
+  return isnan(value) ? HEALTH_MISSING : (int32_t)lroundf(value * scale);
+}
 
-  turntablePillCount += REFILL_AMOUNT;
-  Serial.print("Turntable refilled: ");
-  Serial.println(turntablePillCount);
-  refilling = false;
+// Durable, so batches taken while offline are delivered on reconnect
+void publishHealthBatch() {
+  const uint8_t *batch = healthSeries.seal();
+  TRACE(TRACE_HEALTH, healthSeries.size());
+  publishMessage(PUBLISH_TOPIC_HEALTH_BATCH, batch, healthSeries.size(), true);
+  healthSeries.reset();
 }
 
-void setup()
-{
-  Serial.begin(115200);
-  motorSetup();
-  laserSetup();
-  stopMotor();
-  dht.begin();
+void onTimeSync(struct timeval *tv) {
+  clockSet = true;
+}
 
-  // Setup N20 motor instead of stepper
-  setupN20Motor();
-  
-  // Setup status LEDs
-  setupStatusLEDs();
+// Started on the first WiFi connection; the SNTP client retries by itself
+// after that
+void startClock() {
+  sntp_set_sync_mode(SNTP_SYNC_MODE_SMOOTH);
+  sntp_set_sync_interval(SNTP_SYNC_INTERVAL_MS);
+  sntp_set_time_sync_notification_cb(onTimeSync);
+  configTzTime(DEVICE_TZ, SNTP_SERVER_1, SNTP_SERVER_2);
+  sntpStarted = true;
+}
 
-  refillServo.attach(SERVO_PIN);
-  ESP32PWM::allocateTimer(0);
-  ESP32PWM::allocateTimer(1);
-  ESP32PWM::allocateTimer(2);
-  ESP32PWM::allocateTimer(3);
-  refillServo.setPeriodHertz(50);
-  refillServo.attach(SERVO_PIN, 500, 2400);
+// Local time minus UTC at 'now', DST included
+int32_t utcOffsetSeconds(time_t now) {
+  struct tm local;
+  struct tm utc;
+  localtime_r(&now, &local);
+  gmtime_r(&now, &utc);
+  int32_t days = local.tm_yday - utc.tm_yday;
+  if (local.tm_year != utc.tm_year) {
+    days = local.tm_year > utc.tm_year ? 1 : -1;
+  }
+  return ((days * 24 + local.tm_hour - utc.tm_hour) * 60 + local.tm_min - utc.tm_min) * 60 +
+         local.tm_sec - utc.tm_sec;
+}
 
-  Serial.println();
-  Serial.println("Initializing WiFi Manager...");
-  
-  if (wifiManager.begin()) {
-    Serial.println("WiFi connected successfully");
-    updateWiFiLED(true); // Turn on WiFi LED when connected
-    Serial.print("IP address: ");
-    Serial.println(wifiManager.getIPAddress());
-    connectToAWS();
-  } else {
-    Serial.println("Failed to connect to WiFi");
-    updateWiFiLED(false); // Turn off WiFi LED when disconnected
+// Doses fall due on the device; missed ones are reported on PUBLISH_TOPIC
+void runDoseSchedule() {
+  time_t now = time(NULL);
+  uint8_t report[DISPENSER_REPLY_LEN];
+  while (size_t length = dispenserRunSchedule((uint32_t)now, utcOffsetSeconds(now), report, sizeof(report))) {
+    publishStatus(report, length, true);
   }
+}
 
-  delay(2000);
+// One row of the health series, in HealthMetrics.h column order
+void sampleHealth(unsigned long currentMillis) {
+  EnvReading env = envSampler.reading(currentMillis);
+  bool envCurrent = env.valid && !env.stale;
+  DispenserQueueStats queue = dispenserTakeQueueStats();
+
+  int32_t values[HEALTH_METRIC_COUNT];
+  values[HEALTH_TEMPERATURE] = envCurrent ? healthValue(env.temperatureC, 100) : HEALTH_MISSING;
+  values[HEALTH_HUMIDITY] = envCurrent ? healthValue(env.humidityPct, 100) : HEALTH_MISSING;
+  values[HEALTH_RSSI] = WiFi.status() == WL_CONNECTED ? WiFi.RSSI() : HEALTH_MISSING;
+  values[HEALTH_HEAP_FREE] = (int32_t)ESP.getFreeHeap();
+  values[HEALTH_MOTION_MAX_US] = (int32_t)motionLatency.take();
+  values[HEALTH_NETWORK_MAX_US] = (int32_t)networkLatency.take();
+  values[HEALTH_RECONNECTS] = (int32_t)mqttLink.getReconnects();
+  values[HEALTH_OUTBOX_PENDING] = (int32_t)outbox.pending();
+  values[HEALTH_QUEUE_DEPTH] = queue.depth;
+  values[HEALTH_QUEUE_WAIT_MAX_MS] = (int32_t)queue.maxWaitMs;
+  values[HEALTH_ENV_FAILURES] = (int32_t)env.failures;
+  values[HEALTH_WIFI_RECONNECTS] = (int32_t)wifiManager.getReconnects();
+  values[HEALTH_WIFI_JOIN_ATTEMPTS] = (int32_t)wifiManager.getJoinAttempts();
+  values[HEALTH_WIFI_RECONNECT_MS] = (int32_t)wifiManager.getLastReconnectMs();
+  if (!healthSeries.add(values, currentMillis / 1000)) {
+    publishHealthBatch();
+    healthSeries.add(values, currentMillis / 1000);
+  }
 }
 
-void loop() {
+// One pass of the connectivity/telemetry loop
+void networkStep() {
+  TRACE(TRACE_NETWORK_STEP_BEGIN, 0);
   unsigned long currentMillis = millis();
 
-  // === STEP 1: N20 Motor control ===
-  // N20 motor runs continuously during dispensing, no auto-stop needed
-
-  // === STEP 2: WiFi Reset Handling ===
+  // === STEP 1: WiFi Connection and Reset Handling ===
+  wifiManager.tick(currentMillis);
   wifiManager.handleResetButton();
-
-  // === STEP 3: MQTT & AWS IoT Reconnection ===
-  if (!mqttClient.connected()) {
-    updateIoTLED(false); // Turn off IoT LED when disconnected
-    connectToAWS();
-  }
-  mqttClient.loop();
-
-  if (!wifiManager.isConnected()) {
-    updateWiFiLED(false); // Turn off WiFi LED when disconnected
-    Serial.println("WiFi connection lost. Attempting to reconnect...");
-    if (wifiManager.begin()) {
-      Serial.println("WiFi reconnected");
-      updateWiFiLED(true); // Turn on WiFi LED when reconnected
-      if (!mqttClient.connected()) {
-        connectToAWS();
-      }
-    } else {
-      Serial.println("Failed to reconnect to WiFi");
-      updateWiFiLED(false); // Keep WiFi LED off if reconnection fails
-    }
+  bool wifiConnected = wifiManager.isConnected();
+  updateWiFiLED(wifiConnected);
+  if (wifiConnected && bootTimes.wifiMs == 0) {
+    bootTimes.wifiMs = currentMillis;
   }
 
-  // === STEP 4: Pill Counting via Laser Detection ===
-  bool isBlocked = isLaserBlocked();
-
-  if (dispensing && wasLaserBlocked && !isBlocked) {
-    pillCount++;
-    turntablePillCount--;
-
-    Serial.print("Pill count: ");
-    Serial.println(pillCount);
-
-    char msg[128];
-    sprintf(msg, "{\"pillCount\":%d,\"targetCount\":%d}", pillCount, targetPillCount);
-    mqttClient.publish(PUBLISH_TOPIC, msg);
+  // LAN commands work with or without the broker
+  localEndpoint.poll(currentMillis, wifiConnected);
+  if (wifiConnected && !sntpStarted) {
+    startClock();
+  }
 
-    if (pillCount >= targetPillCount) {
-      stopMotor();
-      stopN20Motor(); // Stop N20 motor instead of stepper
-      closeGate();
-      Serial.println("Target pill count reached.");
+  // === STEP 2: MQTT & AWS IoT Reconnection ===
+  // Advances at most one connection step per pass; the motion task keeps
+  // dispensing locally while the link is down.
+  TRACE(TRACE_MQTT_TICK_BEGIN, 0);
+  mqttLink.tick(currentMillis, wifiConnected);
+  TRACE(TRACE_MQTT_TICK_END, 0);
+  updateIoTLED(mqttLink.isConnected());
+
+  // === STEP 3: Dispense Telemetry, State Journal and Dose Schedule ===
+  dispenserForwardEvents(telemetry);
+  dispenserSaveJournal();
+  // Once SNTP has set the clock it keeps running across link drops
+  if (clockSet && currentMillis - lastSchedulePoll >= SCHEDULE_POLL_MS) {
+    runDoseSchedule();
+    lastSchedulePoll = currentMillis;
+  }
+  // Flush coalesced progress that is older than the telemetry cadence
+  for (uint8_t i = 0; i < channelCount; i++) {
+    telemetry[i].poll(currentMillis);
+  }
 
-      sprintf(msg, "{\"pillCount\":%d,\"targetCount\":%d,\"status\":\"complete\"}",
-              pillCount, targetPillCount);
-      mqttClient.publish(PUBLISH_TOPIC, msg);
+  // === STEP 4: Environment Sampling (only while the dispenser is idle) ===
+  envSampler.poll(currentMillis, dispenserBusy());
 
-      dispensing = false;
+  // === STEP 5: Health Sampling and Batched Reporting ===
+  if (currentMillis - lastHealthSample >= HEALTH_SAMPLE_MS) {
+    sampleHealth(currentMillis);
+    lastHealthSample = currentMillis;
+  }
+  if (currentMillis - lastHealthBatch >= HEALTH_BATCH_MS) {
+    if (healthSeries.sampleCount() > 0) {
+      publishHealthBatch();
     }
+    lastHealthBatch = currentMillis;
   }
 
-  // === STEP 5: Refill Logic ===
-  if (turntablePillCount < PILL_THRESHOLD && !refilling) {
-    triggerRefill();
+  // === STEP 6: Trace Dumps (on request) ===
+  pollSerialCommands();
+  if (mqttLink.isConnected() && traceTakeDumpRequest()) {
+    size_t records = traceDump(publishTraceLine, NULL);
+    Serial.print("Trace dumped over MQTT, records: ");
+    Serial.println((unsigned)records);
   }
 
-  // === STEP 6: Store Laser State for Next Loop ===
-  wasLaserBlocked = isBlocked;
+  // === STEP 7: Outbox and Publish Queue ===
+  // Last, so everything queued during this pass shares the writes: one
+  // outbox sync, then the queued status/health messages are replayed in
+  // order and sent
+  outbox.sync();
+  if (mqttLink.isConnected()) {
+    TRACE(TRACE_OUTBOX_DRAIN_BEGIN, 0);
+    outbox.drain(publishOutboxRecord, 4);
+    TRACE(TRACE_OUTBOX_DRAIN_END, 0);
+    TRACE(TRACE_PUBLISH_PUMP_BEGIN, publisher.getMetrics().pending);
+    publisher.pump();
+    TRACE(TRACE_PUBLISH_PUMP_END, 0);
+  }
+  TRACE(TRACE_NETWORK_STEP_END, 0);
+}
 
-  // === STEP 7: DC Motor Control (timed interval) ===
-  if (currentMillis - previousMillis >= interval) {
-    previousMillis = currentMillis;
-    if (dispensing) {
-      setMotorSpeed(60);
-      if (!n20MotorRunning) {
-        startN20Motor(); // Start N20 motor with DC motor
-      }
-    } else {
-      stopMotor();
-      if (n20MotorRunning) {
-        stopN20Motor(); // Stop N20 motor with DC motor
-      }
-    }
+// Real-time pill counting and motor control, pinned to MOTION_TASK_CORE
+void motionTask(void *arg) {
+  TickType_t lastWake = xTaskGetTickCount();
+  for (;;) {
+    uint32_t started = micros();
+    dispenserStep();
+    motionLatency.record(micros() - started);
+    vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(MOTION_TASK_PERIOD_MS));
   }
+}
 
-  // === STEP 8: Run Turbine Pump (non-blocking) ===
-  //runTurbine(true);
-
-  // === STEP 9: Periodic Health Reporting ===
-  if (currentMillis - lastHealthPublish >= 30000) {
-    float temperature = dht.readTemperature();
-    char msg[128];
-    if (isnan(temperature)) {
-      sprintf(msg, "{\"status\":\"%s\", \"temperature\":null}", "online");
-    } else {
-      sprintf(msg, "{\"status\":\"%s\", \"temperature\":%.2f}", "online", temperature);
-    }
-    mqttClient.publish(PUBLISH_TOPIC_HEALTH, msg);
-    lastHealthPublish = currentMillis;
+// WiFi, MQTT, outbox and health reporting, pinned to NETWORK_TASK_CORE
+void networkTask(void *arg) {
+  // Mounting LittleFS can take seconds (a format on first boot), so it is
+  // done here rather than in setup()
+  outbox.begin();
+  bootTimes.outboxMs = millis();
+
+  for (;;) {
+    uint32_t started = micros();
+    networkStep();
+    networkLatency.record(micros() - started);
+    vTaskDelay(pdMS_TO_TICKS(NETWORK_TASK_PERIOD_MS));
   }
+}
+
+void setup()
+{
+  Serial.begin(115200);
 
-  static bool lastDispensing = false;
-  if (dispensing != lastDispensing) {
-    Serial.print("Dispensing state changed to: ");
-    Serial.println(dispensing ? "TRUE" : "FALSE");
-    lastDispensing = dispensing;
+  // Stage 1: hardware safe state
+  dispenserSetup();
+  setupStatusLEDs();
+  bootTimes.safeMs = millis();
+
+  // Stage 2: local operation. Dispensing needs neither WiFi nor the broker.
+  halSensorBegin();
+  for (uint8_t i = 0; i < channelCount; i++) {
+    telemetry[i].setChannel(i);
+    telemetry[i].setPublisher(publishStatus);
   }
-}
\ No newline at end of file
+  xTaskCreatePinnedToCore(motionTask, "motion", MOTION_TASK_STACK, NULL,
+                          MOTION_TASK_PRIORITY, NULL, MOTION_TASK_CORE);
+  bootTimes.readyMs = millis();
+
+  // Stage 3: connectivity, brought up in the background by the network task
+  publisher.onAck(acknowledgeOutboxRecord);
+  connectToAWS();
+  wifiManager.begin();
+  localEndpoint.begin(LOCAL_CONTROL_KEY, handleLocalCommand, recordLocalCommand);
+  xTaskCreatePinnedToCore(networkTask, "network", NETWORK_TASK_STACK, NULL,
+                          NETWORK_TASK_PRIORITY, NULL, NETWORK_TASK_CORE);
+
+  Serial.print("Ready for local dispensing after ");
+  Serial.print(bootTimes.readyMs);
+  Serial.println(" ms");
+}
+
+void loop() {
+  // All work runs on motionTask and networkTask
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,62 @@
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+/**
+ * Arduino.h for the native env
+ *
+ * The subset of the Arduino core that the portable modules use: fixed-width
+ * types, HIGH/LOW, constrain(), millis()/micros()/delay() on the
+ * simulator's virtual clock, and a Serial that is silent unless the
+ * simulator runs with --verbose. Hardware access is not provided here on
+ * purpose; it goes through Hal.h.
+ */
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x01
+#define OUTPUT 0x03
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+typedef uint8_t byte;
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+
+class SimSerial {
+public:
+    bool enabled = false;
+
+    void begin(unsigned long) {}
+
+    void print(const char *s) { if (enabled) fputs(s, stdout); }
+    void print(char c) { if (enabled) putchar(c); }
+    void print(int v) { if (enabled) printf("%d", v); }
+    void print(unsigned int v) { if (enabled) printf("%u", v); }
+    void print(long v) { if (enabled) printf("%ld", v); }
+    void print(unsigned long v) { if (enabled) printf("%lu", v); }
+    void print(double v) { if (enabled) printf("%.2f", v); }
+
+    void println() { if (enabled) putchar('\n'); }
+
+    template <typename T>
+    void println(T value) {
+        print(value);
+        println();
+    }
+};
+
+extern SimSerial Serial;
+
+#endif
@@ -0,0 +1,33 @@
+#include "Channels.h"
+
+// Three bins, so the simulator exercises routing and channels dispensing
+// side by side: one with an encoder on its agitator, one with a gate servo
+// and no agitator, and an open-loop catch-all. The pins only have to be distinct, not a real board layout.
+const ChannelConfig channelTable[] = {
+  {
+    "Paracetamol 500mg",
+    LASER_PIN,
+    0, HAL_NO_PIN,
+    1, 21,
+    { RPWM_PIN, LPWM_PIN, R_EN_PIN, L_EN_PIN },
+    { N20_ENA, N20_IN1, N20_IN2, N20_ENC_A, N20_ENC_B },
+  },
+  {
+    "Metformin 850mg",
+    39,
+    2, 13,
+    3, 15,
+    { 16, 17, 18, 19 },
+    { HAL_NO_PIN, 0, 0, HAL_NO_PIN, 0 },
+  },
+  {
+    NULL,
+    28,
+    4, HAL_NO_PIN,
+    5, 4,
+    { 12, 0, 1, 3 },
+    { 36, 37, 38, HAL_NO_PIN, 0 },
+  },
+};
+
+const uint8_t channelCount = sizeof(channelTable) / sizeof(channelTable[0]);
@@ -0,0 +1,101 @@
+#include "Hal.h"
+#include "Simulator.h"
+
+// Hal.h and the Arduino timing calls, backed by the simulator
+
+SimSerial Serial;
+
+uint32_t millis() {
+  return (uint32_t)(sim.now() / 1000);
+}
+
+uint32_t micros() {
+  return (uint32_t)sim.now();
+}
+
+void delay(uint32_t ms) {
+  sim.advanceTo(sim.now() + (uint64_t)ms * 1000);
+}
+
+void halPinMode(uint8_t pin, uint8_t mode) {
+  sim.pinMode(pin, mode);
+}
+
+void halDigitalWrite(uint8_t pin, uint8_t level) {
+  sim.digitalWrite(pin, level);
+}
+
+int halDigitalRead(uint8_t pin) {
+  return sim.digitalRead(pin);
+}
+
+void halPwmWrite(uint8_t pin, uint8_t duty) {
+  sim.pwmWrite(pin, duty);
+}
+
+void halAttachEdgeInterrupt(uint8_t pin, HalIsr isr) {
+  sim.attachEdgeInterrupt(pin, isr);
+}
+
+uint32_t halMicros() {
+  return micros();
+}
+
+bool halEncoderAttach(uint8_t unit, uint8_t pinA, uint8_t pinB) {
+  (void)pinB;
+  sim.encoderAttach(unit, pinA);
+  return unit < HAL_ENCODER_COUNT;
+}
+
+int32_t halEncoderRead(uint8_t unit) {
+  return sim.encoderRead(unit);
+}
+
+void halServoAttach(HalServo servo, uint8_t pin, int minPulseUs, int maxPulseUs) {
+  (void)minPulseUs;
+  (void)maxPulseUs;
+  if (pin != HAL_NO_PIN) {
+    sim.servoAttach(servo);
+  }
+}
+
+void halServoWrite(HalServo servo, int angle) {
+  sim.servoWrite(servo, angle);
+}
+
+// A 240 MHz core running on the virtual clock
+#define SIM_CPU_HZ 240000000UL
+
+uint32_t halCycleCount() {
+  return (uint32_t)(sim.now() * (SIM_CPU_HZ / 1000000UL));
+}
+
+uint8_t halCoreId() {
+  return 0;
+}
+
+uint32_t halCpuHz() {
+  return SIM_CPU_HZ;
+}
+
+void halSensorBegin() {
+}
+
+bool halReadEnvironment(float &temperatureC, float &humidityPct) {
+  temperatureC = sim.getConfig().temperatureC;
+  humidityPct = sim.getConfig().humidityPct;
+  return true;
+}
+
+bool halTimerStart(uint32_t periodUs, HalTimerFn fn) {
+  sim.startTimer(periodUs, fn);
+  return true;
+}
+
+size_t halStoreRead(const char *key, void *data, size_t size) {
+  return sim.storeRead(key, data, size);
+}
+
+bool halStoreWrite(const char *key, const void *data, size_t length) {
+  return sim.storeWrite(key, data, length);
+}
@@ -0,0 +1,398 @@
+#include "Simulator.h"
+#include <math.h>
+#include <string.h>
+
+#define SIM_PLANT_STEP_US 1000   // Turntable integration step
+#define SIM_GATE_OPEN_ANGLE 45
+#define SIM_DUMP_ANGLE 150       // Refill servo angle at which pills fall
+#define SIM_MAX_COMMAND_LEN 512
+
+Simulator sim;
+
+Simulator::Simulator() {
+  configure(SimConfig());
+  commandHandler = NULL;
+  observer = NULL;
+}
+
+void Simulator::configure(const SimConfig &newConfig) {
+  config = newConfig;
+  // Beam events must land after the integration step that released them
+  if (config.flightJitterUs + SIM_PLANT_STEP_US >= config.flightUs) {
+    config.flightJitterUs = config.flightUs > 2 * SIM_PLANT_STEP_US ? config.flightUs - 2 * SIM_PLANT_STEP_US : 0;
+    if (config.flightUs <= 2 * SIM_PLANT_STEP_US) {
+      config.flightUs = 2 * SIM_PLANT_STEP_US;
+    }
+  }
+
+  memset(&stats, 0, sizeof(stats));
+  events = decltype(events)();
+  timerFn = NULL;
+  commands.clear();
+  nextSeq = 0;
+  nowUs = 0;
+  plantUs = 0;
+
+  // splitmix64 of the seed, so small seeds still give well-mixed streams
+  uint64_t z = config.seed + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  rng = (z ^ (z >> 31)) | 1;
+
+  memset(plants, 0, sizeof(plants));
+  for (uint8_t i = 0; i < CHANNEL_MAX; i++) {
+    gateCycles[i].clear();
+    crossings[i].clear();
+    gateCommandedOpen[i] = false;
+  }
+  for (uint8_t i = 0; i < channelCount; i++) {
+    plants[i].tablePills = config.tablePills;
+    plants[i].nextRelease = -log(1.0 - uniform());
+  }
+  memset(pinLevel, 0, sizeof(pinLevel));
+  memset(pwmDuty, 0, sizeof(pwmDuty));
+  memset(pinIsr, 0, sizeof(pinIsr));
+  memset(encoderPinA, HAL_NO_PIN, sizeof(encoderPinA));
+  memset(servoAttached, 0, sizeof(servoAttached));
+  memset(servoAngle, 0, sizeof(servoAngle));
+}
+
+uint64_t Simulator::random() {
+  // xorshift64*
+  rng ^= rng >> 12;
+  rng ^= rng << 25;
+  rng ^= rng >> 27;
+  return rng * 0x2545F4914F6CDD1DULL;
+}
+
+double Simulator::uniform() {
+  return (random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+uint32_t Simulator::jitter(uint32_t value, uint32_t spread) {
+  if (spread == 0) {
+    return value;
+  }
+  int64_t offset = (int64_t)(random() % (2 * (uint64_t)spread + 1)) - spread;
+  return (uint32_t)((int64_t)value + offset);
+}
+
+void Simulator::schedule(uint64_t timeUs, EventType type, uint8_t channel, uint32_t arg) {
+  Event event;
+  event.timeUs = timeUs;
+  event.seq = nextSeq++;
+  event.type = type;
+  event.channel = channel;
+  event.arg = arg;
+  events.push(event);
+}
+
+void Simulator::advanceTo(uint64_t timeUs) {
+  for (;;) {
+    uint64_t horizon = plantUs + SIM_PLANT_STEP_US;
+    if (horizon > timeUs) {
+      horizon = timeUs;
+    }
+    if (!events.empty() && events.top().timeUs <= horizon) {
+      Event event = events.top();
+      events.pop();
+      integratePlant(event.timeUs);
+      nowUs = event.timeUs;
+      dispatch(event);
+      continue;
+    }
+    integratePlant(horizon);
+    nowUs = horizon;
+    if (horizon >= timeUs) {
+      return;
+    }
+  }
+}
+
+float Simulator::releaseRate(uint8_t channel) const {
+  const ChannelConfig &ch = channelTable[channel];
+  const Plant &plant = plants[channel];
+  bool gateOpen = !servoAttached[ch.gateServo] || servoAngle[ch.gateServo] >= SIM_GATE_OPEN_ANGLE;
+  int duty = pwmDuty[ch.turntable.lpwm];
+  if (plant.tablePills <= 0 || plant.jammed || !gateOpen || duty <= config.stallDuty) {
+    return 0;
+  }
+
+  float rate = config.releaseRateMax * (duty - config.stallDuty) / (255 - config.stallDuty);
+  const AgitatorPins &agitator = ch.agitator;
+  bool agitating = agitator.ena != HAL_NO_PIN && pwmDuty[agitator.ena] > 0 &&
+                   pinLevel[agitator.in1] != pinLevel[agitator.in2];
+  if (!agitating) {
+    rate *= config.idleAgitatorFactor;
+  }
+  if (plant.tablePills < config.fullTable) {
+    rate = rate * plant.tablePills / config.fullTable;
+  }
+  return rate;
+}
+
+// Signed agitator encoder speed in counts/s; 0 without an encoder
+float Simulator::encoderSpeed(uint8_t channel) const {
+  const AgitatorPins &agitator = channelTable[channel].agitator;
+  if (agitator.ena == HAL_NO_PIN || agitator.encA == HAL_NO_PIN || pinLevel[agitator.in1] == pinLevel[agitator.in2]) {
+    return 0;
+  }
+  bool forward = pinLevel[agitator.in1] == HIGH;
+  const Plant &plant = plants[channel];
+  if (forward && plant.jammed) {
+    return 0;
+  }
+  int pills = plant.tablePills < 20 ? plant.tablePills : 20;
+  float speed = config.encoderCpsPerPwm * pwmDuty[agitator.ena] * (1.0f - config.loadPerPill * pills);
+  return forward ? speed : -speed;
+}
+
+void Simulator::turnEncoders(uint64_t stepUs) {
+  for (uint8_t i = 0; i < channelCount; i++) {
+    Plant &plant = plants[i];
+    double counts = encoderSpeed(i) * stepUs / 1e6;
+    plant.encoderCounts += counts;
+    if (plant.jammed && counts < 0) {
+      plant.reverseTravel -= counts;
+      if (plant.reverseTravel >= config.jamClearCounts) {
+        plant.jammed = false;
+      }
+    }
+  }
+}
+
+// Rates only change when the firmware writes a pin, which never happens
+// inside advanceTo(), so each channel is a Poisson process with a constant
+// rate up to untilUs; the earliest release among them is taken first.
+void Simulator::integratePlant(uint64_t untilUs) {
+  while (plantUs < untilUs) {
+    double perUs[CHANNEL_MAX];
+    int first = -1;
+    uint64_t firstUs = untilUs;
+    for (uint8_t i = 0; i < channelCount; i++) {
+      perUs[i] = releaseRate(i) / 1e6;
+      if (perUs[i] <= 0) {
+        continue;
+      }
+      double waitUs = ceil((plants[i].nextRelease - plants[i].hazard) / perUs[i]);
+      if (waitUs > (double)(untilUs - plantUs)) {
+        continue;
+      }
+      uint64_t dueUs = plantUs + (uint64_t)waitUs;
+      if (first < 0 || dueUs < firstUs) {
+        first = i;
+        firstUs = dueUs;
+      }
+    }
+
+    uint64_t stepUs = firstUs - plantUs;
+    turnEncoders(stepUs);
+    for (uint8_t i = 0; i < channelCount; i++) {
+      if (perUs[i] > 0 && (int)i != first) {
+        plants[i].hazard += stepUs * perUs[i];
+      }
+    }
+    plantUs = firstUs;
+    if (first < 0) {
+      return;
+    }
+    plants[first].hazard = 0;
+    plants[first].nextRelease = -log(1.0 - uniform());
+    releasePill((uint8_t)first, plantUs);
+  }
+}
+
+void Simulator::releasePill(uint8_t channel, uint64_t atUs) {
+  Plant &plant = plants[channel];
+  bool pair = plant.tablePills >= 2 && random() % 1000 < config.doublePermille;
+  uint32_t pills = pair ? 2 : 1;
+  plant.tablePills -= pills;
+  stats.releases++;
+  stats.pillsReleased += pills;
+  if (channelTable[channel].agitator.encA != HAL_NO_PIN && random() % 1000 < config.jamPermille) {
+    plant.jammed = true;
+    plant.reverseTravel = 0;
+    stats.jams++;
+  }
+
+  uint64_t startUs = atUs + jitter(config.flightUs, config.flightJitterUs);
+  uint32_t widthUs = jitter(config.pillWidthUs, config.pillWidthUs * config.widthJitterPct / 100);
+  if (pair) {
+    // Touching pills overlap slightly in the beam
+    widthUs += widthUs * 8 / 10;
+    stats.doublesInjected++;
+  }
+
+  crossings[channel].push_back({ atUs, startUs, widthUs, (uint8_t)pills });
+  schedule(startUs, BEAM_ON, channel, pills);
+  if (config.chatterUs * 2 < widthUs && random() % 1000 < config.chatterPermille) {
+    uint64_t dropUs = startUs + widthUs / 3;
+    schedule(dropUs, BEAM_OFF, channel, 0);
+    schedule(dropUs + config.chatterUs, BEAM_ON, channel, 0);
+    stats.chatterInjected++;
+  }
+  schedule(startUs + widthUs, BEAM_OFF, channel, 0);
+}
+
+void Simulator::setBeam(uint8_t channel, bool blocked) {
+  uint8_t pin = channelTable[channel].laserPin;
+  pinLevel[pin] = blocked ? HIGH : LOW;
+  stats.edges++;
+  if (pinIsr[pin]) {
+    pinIsr[pin]();
+  }
+}
+
+void Simulator::dispatch(const Event &event) {
+  switch (event.type) {
+    case BEAM_ON:
+      stats.pillsThroughBeam += event.arg;
+      plants[event.channel].beamPills += event.arg;
+      if (++plants[event.channel].blockers == 1) {
+        setBeam(event.channel, true);
+      }
+      break;
+
+    case BEAM_OFF:
+      if (--plants[event.channel].blockers == 0) {
+        setBeam(event.channel, false);
+      }
+      break;
+
+    case DELIVER_COMMAND:
+      if (commandHandler) {
+        // The firmware parses in place, like inside PubSubClient's buffer
+        static char buffer[SIM_MAX_COMMAND_LEN];
+        const std::string &payload = commands[event.arg];
+        size_t length = payload.size() < sizeof(buffer) ? payload.size() : sizeof(buffer);
+        memcpy(buffer, payload.data(), length);
+        commandHandler((uint8_t *)buffer, length);
+      }
+      break;
+
+    case TIMER_TICK:
+      if (timerFn) {
+        timerFn();
+        schedule(nowUs + timerPeriodUs, TIMER_TICK, 0, 0);
+      }
+      break;
+  }
+}
+
+void Simulator::sendCommand(const char *payload) {
+  commands.push_back(payload);
+  schedule(nowUs + config.brokerLatencyUs, DELIVER_COMMAND, 0, (uint32_t)(commands.size() - 1));
+  stats.commands++;
+}
+
+void Simulator::startTimer(uint32_t periodUs, HalTimerFn fn) {
+  timerFn = fn;
+  timerPeriodUs = periodUs;
+  schedule(nowUs + periodUs, TIMER_TICK, 0, 0);
+}
+
+void Simulator::publish(const char *topic, const char *payload) {
+  stats.published++;
+  stats.publishedBytes += strlen(topic) + strlen(payload);
+  if (observer) {
+    observer(topic, payload);
+  }
+}
+
+void Simulator::pinMode(uint8_t pin, uint8_t mode) {
+  (void)pin;
+  (void)mode;
+}
+
+void Simulator::digitalWrite(uint8_t pin, uint8_t level) {
+  if (pin < SIM_PIN_COUNT) {
+    pinLevel[pin] = level;
+    pwmDuty[pin] = level ? 255 : 0;
+  }
+}
+
+int Simulator::digitalRead(uint8_t pin) const {
+  return pin < SIM_PIN_COUNT ? pinLevel[pin] : LOW;
+}
+
+void Simulator::pwmWrite(uint8_t pin, uint8_t duty) {
+  if (pin < SIM_PIN_COUNT) {
+    pwmDuty[pin] = duty;
+    pinLevel[pin] = duty > 0 ? HIGH : LOW;
+  }
+}
+
+void Simulator::attachEdgeInterrupt(uint8_t pin, HalIsr isr) {
+  if (pin < SIM_PIN_COUNT) {
+    pinIsr[pin] = isr;
+  }
+}
+
+void Simulator::encoderAttach(uint8_t unit, uint8_t pinA) {
+  if (unit < HAL_ENCODER_COUNT) {
+    encoderPinA[unit] = pinA;
+  }
+}
+
+int32_t Simulator::encoderRead(uint8_t unit) const {
+  for (uint8_t i = 0; unit < HAL_ENCODER_COUNT && i < channelCount; i++) {
+    if (channelTable[i].agitator.encA == encoderPinA[unit]) {
+      return (int32_t)plants[i].encoderCounts;
+    }
+  }
+  return 0;
+}
+
+void Simulator::servoAttach(HalServo servo) {
+  if (servo < HAL_SERVO_COUNT) {
+    servoAttached[servo] = true;
+  }
+}
+
+void Simulator::servoWrite(HalServo servo, int angle) {
+  if (servo >= HAL_SERVO_COUNT) {
+    return;
+  }
+  // Gate commands mark the orders, whether or not the gate is fitted
+  for (uint8_t i = 0; i < channelCount; i++) {
+    if (channelTable[i].gateServo != servo || (angle >= SIM_GATE_OPEN_ANGLE) == gateCommandedOpen[i]) {
+      continue;
+    }
+    gateCommandedOpen[i] = angle >= SIM_GATE_OPEN_ANGLE;
+    if (gateCommandedOpen[i]) {
+      gateCycles[i].push_back({ plants[i].beamPills, 0, nowUs, false });
+    } else if (!gateCycles[i].empty()) {
+      gateCycles[i].back().beamAtClose = plants[i].beamPills;
+      gateCycles[i].back().closed = true;
+    }
+  }
+  if (!servoAttached[servo]) {
+    return;
+  }
+  if (angle >= SIM_DUMP_ANGLE && servoAngle[servo] < SIM_DUMP_ANGLE) {
+    for (uint8_t i = 0; i < channelCount; i++) {
+      if (channelTable[i].refillServo == servo) {
+        plants[i].tablePills += config.hopperDrop;
+        stats.refills++;
+      }
+    }
+  }
+  servoAngle[servo] = angle;
+}
+
+size_t Simulator::storeRead(const char *key, void *data, size_t size) const {
+  auto entry = store.find(key);
+  if (entry == store.end() || entry->second.size() > size) {
+    return 0;
+  }
+  memcpy(data, entry->second.data(), entry->second.size());
+  return entry->second.size();
+}
+
+bool Simulator::storeWrite(const char *key, const void *data, size_t length) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  store[key].assign(bytes, bytes + length);
+  stats.storeWrites++;
+  stats.storeBytes += length;
+  return true;
+}
@@ -0,0 +1,231 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+/**
+ * Simulator - Discrete-event model of the dispenser hardware (native env)
+ *
+ * Time is virtual: nothing sleeps, so a dispense of thousands of pills
+ * replays in well under a second, and the same seed always produces the
+ * same run. The firmware side is driven exactly as on the device: the
+ * laser ISR is called at the virtual time of every beam edge, and
+ * millis()/micros() read the virtual clock.
+ *
+ * Models (one plant per channel of the channel table, see Channels.h):
+ * - Turntable: pills leave at a rate set by the turntable PWM above a stall
+ *   duty, scaled down while the agitator is off or few pills remain
+ *   (Poisson arrivals, integrated every tick).
+ * - Pill stream: each pill falls through the beam after a jittered flight
+ *   time, so pills already in the air when the motor stops still arrive.
+ *   Touching pairs (one long transit) and beam chatter are injected.
+ * - Agitator encoder: counts at a speed set by the N20 PWM and direction,
+ *   slowed by the load of pills on the table. A release may jam the
+ *   turntable of a channel with an encoder: the N20 stalls and no pills
+ *   leave until the N20 has run backwards far enough to free it.
+ * - Refill servo: a swing past the dump angle drops pills on the table.
+ * - Gate servo: closed below 45 degrees; a gate that was never attached
+ *   (as on the current hardware) is open. The firmware commands a
+ *   channel's gate open when an order starts and closed when the order
+ *   ends, fitted or not, so the beam count at each of those commands
+ *   (getGateCycles) is the ground truth of every order, taken when the
+ *   motion side acted. Every release is also logged with its turntable
+ *   and beam times and width (getCrossings), so a replay can tell pills
+ *   that merged into one transit, or were already falling when an order
+ *   stopped, from counting and stopping errors.
+ * - Broker: commands reach the firmware after a latency; everything the
+ *   firmware publishes is counted and passed to an observer.
+ * - Hardware timer: halTimerStart callbacks run as events on the virtual
+ *   clock, between motion passes (on the device the timer task preempts
+ *   the motion task instead).
+ * - NVS: halStoreWrite/halStoreRead records are kept in memory; writes
+ *   and bytes are counted to size flash wear.
+ *
+ * Usage:
+ *   sim.configure(config);
+ *   sim.setCommandHandler(fn);  sim.setObserver(fn);
+ *   loop: sim.advanceTo(t); dispenserStep(); ...
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+#include "Hal.h"
+#include "Channels.h"
+
+#define SIM_PIN_COUNT 40
+
+struct SimConfig {
+  uint64_t seed = 1;
+  int tablePills = 10;              // Pills on each turntable at power-up
+  int hopperDrop = 10;              // Pills added by one refill swing
+  int stallDuty = 30;               // Turntable does not move below this PWM
+  float releaseRateMax = 25.0f;     // Pills/s leaving the table at PWM 255
+  float idleAgitatorFactor = 0.3f;  // Release rate scale with the N20 off
+  int fullTable = 6;                // Release rate drops below this many pills
+  uint32_t flightUs = 60000;        // Turntable edge -> laser beam
+  uint32_t flightJitterUs = 3000;
+  uint32_t pillWidthUs = 5000;      // Beam-blocked time of one pill
+  uint32_t widthJitterPct = 15;
+  uint16_t doublePermille = 20;     // Touching pairs per 1000 releases
+  uint16_t chatterPermille = 30;    // Transits with a beam dropout
+  uint32_t chatterUs = 300;
+  float encoderCpsPerPwm = 50.0f;    // Unloaded N20 encoder counts/s per PWM count
+  float loadPerPill = 0.015f;       // Encoder speed lost per pill on the table
+  uint16_t jamPermille = 2;         // Releases that jam the turntable
+  uint32_t jamClearCounts = 1000;   // Reverse travel that frees a jam
+  uint32_t brokerLatencyUs = 40000;
+  float temperatureC = 26.5f;
+  float humidityPct = 61.0f;
+};
+
+struct SimStats {
+  uint32_t releases;        // Transits leaving the turntable
+  uint32_t pillsReleased;   // Pills in those transits
+  uint32_t pillsThroughBeam;       // All channels
+  uint32_t doublesInjected;
+  uint32_t chatterInjected;
+  uint32_t refills;
+  uint32_t jams;
+  uint32_t edges;           // Beam transitions delivered to the ISR
+  uint32_t commands;
+  uint32_t published;
+  uint32_t publishedBytes;
+  uint32_t storeWrites;     // halStoreWrite calls
+  uint32_t storeBytes;
+};
+
+// One opening of a channel's gate
+struct SimGateCycle {
+  uint32_t beamAtOpen;      // Pills that had crossed the channel's beam when it opened
+  uint32_t beamAtClose;     // ... and when it closed again
+  uint64_t openUs;
+  bool closed;
+};
+
+// One release from a turntable, as it reached the channel's beam
+struct SimCrossing {
+  uint64_t releaseUs;       // Left the turntable
+  uint64_t beamUs;          // Started blocking the beam
+  uint32_t widthUs;         // Blocked it for this long
+  uint8_t pills;            // 2 for a touching pair
+};
+
+typedef void (*SimCommandHandler)(uint8_t *payload, size_t length);
+typedef void (*SimObserver)(const char *topic, const char *payload);
+
+class Simulator {
+private:
+  enum EventType : uint8_t {
+    BEAM_ON,
+    BEAM_OFF,
+    DELIVER_COMMAND,
+    TIMER_TICK
+  };
+
+  struct Event {
+    uint64_t timeUs;
+    uint64_t seq;       // Tie-break so equal times keep insertion order
+    EventType type;
+    uint8_t channel;    // BEAM_*: beam of this channel
+    uint32_t arg;       // BEAM_ON: pills in the transit; DELIVER_COMMAND: index
+
+    bool operator>(const Event &other) const {
+      return timeUs != other.timeUs ? timeUs > other.timeUs : seq > other.seq;
+    }
+  };
+
+  SimConfig config;
+  SimStats stats;
+  std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+  std::vector<std::string> commands;
+  uint64_t nextSeq;
+
+  // Turntable, beam and hopper of one channel
+  struct Plant {
+    int tablePills;
+    int blockers;           // Transits currently in the beam
+    double hazard;          // Accumulated release intensity
+    double nextRelease;     // Exponential threshold for the next release
+    uint32_t beamPills;     // Pills that crossed this channel's beam
+    double encoderCounts;   // Agitator encoder position
+    bool jammed;
+    double reverseTravel;   // Encoder counts run backwards while jammed
+  };
+
+  uint64_t nowUs;
+  uint64_t plantUs;         // Turntable models integrated up to here
+  uint64_t rng;
+  Plant plants[CHANNEL_MAX];
+  std::vector<SimGateCycle> gateCycles[CHANNEL_MAX];
+  std::vector<SimCrossing> crossings[CHANNEL_MAX];
+  bool gateCommandedOpen[CHANNEL_MAX];
+
+  uint8_t pinLevel[SIM_PIN_COUNT];
+  uint8_t pwmDuty[SIM_PIN_COUNT];
+  HalIsr pinIsr[SIM_PIN_COUNT];
+  uint8_t encoderPinA[HAL_ENCODER_COUNT];
+  bool servoAttached[HAL_SERVO_COUNT];
+  int servoAngle[HAL_SERVO_COUNT];
+  std::map<std::string, std::vector<uint8_t>> store;
+
+  SimCommandHandler commandHandler;
+  SimObserver observer;
+  HalTimerFn timerFn;
+  uint32_t timerPeriodUs;
+
+  void schedule(uint64_t timeUs, EventType type, uint8_t channel, uint32_t arg);
+  void dispatch(const Event &event);
+  void setBeam(uint8_t channel, bool blocked);
+  void integratePlant(uint64_t untilUs);
+  void releasePill(uint8_t channel, uint64_t atUs);
+  float releaseRate(uint8_t channel) const;
+  float encoderSpeed(uint8_t channel) const;
+  void turnEncoders(uint64_t stepUs);
+
+  uint64_t random();
+  double uniform();
+  uint32_t jitter(uint32_t value, uint32_t spread);
+
+public:
+  Simulator();
+
+  void configure(const SimConfig &newConfig);
+  const SimConfig &getConfig() const { return config; }
+  const SimStats &getStats() const { return stats; }
+
+  void setCommandHandler(SimCommandHandler fn) { commandHandler = fn; }
+  void setObserver(SimObserver fn) { observer = fn; }
+
+  // Process every event up to timeUs and move the clock there
+  void advanceTo(uint64_t timeUs);
+  uint64_t now() const { return nowUs; }
+  int getTablePills(uint8_t channel) const { return plants[channel].tablePills; }
+  uint32_t getBeamPills(uint8_t channel) const { return plants[channel].beamPills; }
+  const std::vector<SimGateCycle> &getGateCycles(uint8_t channel) const { return gateCycles[channel]; }
+  // Every release of a channel, in release order (flight jitter may swap beam order)
+  const std::vector<SimCrossing> &getCrossings(uint8_t channel) const { return crossings[channel]; }
+
+  // Broker side
+  void sendCommand(const char *payload);
+  void publish(const char *topic, const char *payload);
+
+  // HAL side (see SimHal.cpp)
+  void pinMode(uint8_t pin, uint8_t mode);
+  void digitalWrite(uint8_t pin, uint8_t level);
+  int digitalRead(uint8_t pin) const;
+  void pwmWrite(uint8_t pin, uint8_t duty);
+  void attachEdgeInterrupt(uint8_t pin, HalIsr isr);
+  void encoderAttach(uint8_t unit, uint8_t pinA);
+  int32_t encoderRead(uint8_t unit) const;
+  void servoAttach(HalServo servo);
+  void servoWrite(HalServo servo, int angle);
+  void startTimer(uint32_t periodUs, HalTimerFn fn);
+  size_t storeRead(const char *key, void *data, size_t size) const;
+  bool storeWrite(const char *key, const void *data, size_t length);
+};
+
+extern Simulator sim;
+
+#endif
@@ -0,0 +1,470 @@
+/**
+ * Dispense replay on the host (native env)
+ *
+ * Runs the real dispense logic (Dispenser, PillDetector,
+ * DispenseSpeedController, RefillSequencer, DispenseTelemetry) against the
+ * Simulator: orders are sent through the simulated broker, keeping
+ * --inflight of them queued on the device, until --pills pills were
+ * requested. Orders rotate over three medicines, so every channel of the
+ * simulator's channel table (sim/SimChannelTable.cpp) dispenses. The
+ * counted result is then compared with the pills that actually crossed
+ * each channel's beam, taken when the firmware opened and closed the gate
+ * for the order (Simulator::getGateCycles), not when its status messages
+ * reached the broker.
+ *
+ *   pio run -e native && .pio/build/native/program --pills 5000 --seed 7
+ *
+ * Options: --pills N, --order N (pills per order), --inflight N (orders
+ * outstanding, 1 = wait for each completion), --seed N, --jams N (turntable
+ * jams per 1000 releases on channels with an encoder), --trace FILE (write
+ * a trace dump of the end of the run, see tools/trace/), --verbose
+ * (firmware Serial output and every published message).
+ * Exit status is 1 if an order did not complete or if counting or
+ * stopping went wrong beyond what one beam can resolve:
+ * - a pill left the turntable after the order's last pill could be
+ *   counted (the controller should have stopped);
+ * - more than SIM_IN_FLIGHT_PCT pills per 100 orders went past the
+ *   quantity while already falling: a touching pair completing an order
+ *   (2% of releases) or a second release in the last pulse (about 4%);
+ * - a reported count differs from the pills that crossed the beam by more
+ *   than the pills merged into transits no wider than fewer pills, in
+ *   more than one pill per SIM_MISCOUNT_PILLS, or an order's flagged
+ *   transits are not its multi-pill ones (every transit wider than one
+ *   pill, plus at most the merges that fit in one pill's width) in more
+ *   than one order per SIM_MISCOUNT_PILLS. That allowance is the noise of
+ *   a limit learned from a few hundred transits, which can sit just under
+ *   the widest single pill (at most 1 per run in 40 seeds of 5000 pills);
+ * - while a channel's detector learns the medicine's widths (its first
+ *   SIM_LEARNING_PILLS pills), flags are not checked and up to
+ *   SIM_LEARNING_MISCOUNTS unexplained pills are allowed: a merge among
+ *   the first transits cannot be told from a single (at most 2 per run
+ *   in 40 seeds).
+ * So the pills past the quantity are the ones the device could not see
+ * plus those already in flight; a run is a regression test of counting,
+ * multi-pill detection and stop timing.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Channels.h"
+#include "Dispenser.h"
+#include "DispenseTelemetry.h"
+#include "LaserModule.h"
+#include "MotionScheduler.h"
+#include "PillDetector.h"
+#include "Simulator.h"
+#include "Trace.h"
+
+#define SIM_THING "Dispenser_A"
+#define SIM_STATUS_TOPIC "mediflow/" SIM_THING "/status"
+#define SIM_MOTION_PERIOD_US 1000    // MOTION_TASK_PERIOD_MS
+#define SIM_NETWORK_PERIOD_US 5000   // NETWORK_TASK_PERIOD_MS
+#define SIM_STALL_US 300000000ULL    // Give up when no order finished for this long
+#define SIM_SETTLE_US 1000000        // Let stragglers land after the last order
+#define SIM_RESOLUTION_PCT 6         // Width margin of a learned single pill (see scoreWindow)
+#define SIM_LEARNING_PILLS 100       // A channel's detector is still learning widths before this many
+#define SIM_LEARNING_MISCOUNTS 2     // Unexplained miscounted pills allowed per channel meanwhile
+#define SIM_MISCOUNT_PILLS 5000      // One unexplained miscount or misflagged order allowed per this many pills after
+#define SIM_IN_FLIGHT_PCT 15         // Pills already falling past the quantity, per 100 orders
+
+static const char *MEDICINES[] = { "Paracetamol 500mg", "Metformin 850mg", "Amlodipine 5mg" };
+
+static DispenseTelemetry telemetry[CHANNEL_MAX];
+static bool verbose = false;
+
+struct SimOrder {
+  int quantity;
+  int channel;
+  bool started;
+  bool done;
+  bool failed;
+  int counted;
+  int doubles;
+  int rejected;
+  int jams;
+  size_t gateCycle;         // Index in its channel's Simulator::getGateCycles()
+};
+
+// What one order's window of a channel's beam held (see scoreWindow)
+struct SimWindow {
+  int multiTransits;        // Transits of two or more pills
+  int resolvable;           // ... of which wider than any single pill
+  int unresolvable;         // Pills hidden in transits no wider than fewer pills
+  int pairs;                // Touching pairs released
+  int inFlight;             // Pills past the needed ones, released before the last could be counted
+  int late;                 // ... released after it could
+};
+
+static std::vector<SimOrder> orders;
+static size_t startedOnChannel[CHANNEL_MAX];
+static size_t finished = 0;
+static uint64_t lastFinishUs = 0;
+
+static int jsonInt(const char *payload, const char *key) {
+  const char *at = strstr(payload, key);
+  return at ? atoi(at + strlen(key)) : 0;
+}
+
+// Orders are numbered rx-1, rx-2, ... in the order they were sent
+static SimOrder *findOrder(const char *payload) {
+  const char *id = strstr(payload, "\"prescription_id\":\"rx-");
+  if (id == NULL) {
+    return NULL;
+  }
+  size_t index = (size_t)atoi(id + strlen("\"prescription_id\":\"rx-"));
+  return index >= 1 && index <= orders.size() ? &orders[index - 1] : NULL;
+}
+
+static void onPublish(const char *topic, const char *payload) {
+  if (verbose) {
+    printf("[%10.3f] %s %s\n", sim.now() / 1e6, topic, payload);
+  }
+  SimOrder *order = findOrder(payload);
+  if (order == NULL) {
+    return;
+  }
+  if (strstr(payload, "\"status\":\"dispensing_started\"")) {
+    order->channel = jsonInt(payload, "\"channel\":");
+    order->started = true;
+    // Orders of a channel start, and open its gate, one after another
+    order->gateCycle = startedOnChannel[order->channel]++;
+    return;
+  }
+  if (strstr(payload, "\"status\":\"complete\"")) {
+    order->done = true;
+    order->counted = jsonInt(payload, "\"pillCount\":");
+    order->doubles = jsonInt(payload, "\"doubles\":");
+    order->rejected = jsonInt(payload, "\"rejected\":");
+    order->jams = jsonInt(payload, "\"jams\":");
+  } else if (strstr(payload, "\"status\":\"error\"") || strstr(payload, "\"status\":\"rejected\"")) {
+    order->done = true;
+    order->failed = true;
+  } else {
+    return;
+  }
+  finished++;
+  lastFinishUs = sim.now();
+}
+
+// Groups the releases that reached a channel's beam from fromUs until
+// toUs into the transits the detector sees: beam intervals that overlap
+// or are closer than its glitch filter. A transit of several pills whose
+// blocked time fits fewer pills of the widest single width (plus
+// SIM_RESOLUTION_PCT, how closely the detector can learn that width) is
+// indistinguishable from fewer pills on one beam; its extra pills count as
+// unresolvable instead of as detector misses.
+//
+// Pills past the needed ones (the quantity, plus any the device could not
+// see) are split by when they left the turntable: one already falling when
+// the last needed pill could first be counted and the turntable stopped
+// (its transit over, the glitch window passed, a motion pass run and its
+// output applied) could not be stopped any more; one released after that
+// was fed by a controller that should have stopped.
+static SimWindow scoreWindow(const std::vector<SimCrossing> &byBeam, uint64_t fromUs, uint64_t toUs, int needed) {
+  SimWindow window;
+  memset(&window, 0, sizeof(window));
+  const SimConfig &config = sim.getConfig();
+  uint32_t glitchUs = PillDetectorConfig().glitchUs;
+  uint64_t singleMaxUs = (uint64_t)config.pillWidthUs * (100 + config.widthJitterPct) / 100 *
+                         (100 + SIM_RESOLUTION_PCT) / 100;
+
+  size_t first = 0;
+  while (first < byBeam.size() && byBeam[first].beamUs < fromUs) {
+    first++;
+  }
+
+  int crossed = 0;
+  uint64_t countedUs = 0;
+  for (size_t i = first; i < byBeam.size() && byBeam[i].beamUs < toUs; i++) {
+    const SimCrossing &crossing = byBeam[i];
+    int before = crossed;
+    crossed += crossing.pills;
+    if (before < needed) {
+      // A touching pair may complete the order with a pill to spare
+      countedUs = crossing.beamUs + crossing.widthUs + glitchUs + SIM_MOTION_PERIOD_US + MOTION_TIMER_PERIOD_US;
+      window.inFlight += crossed > needed ? crossed - needed : 0;
+    } else if (crossing.releaseUs <= countedUs) {
+      window.inFlight += crossing.pills;
+    } else {
+      window.late += crossing.pills;
+    }
+  }
+
+  size_t i = first;
+  while (i < byBeam.size() && byBeam[i].beamUs < toUs) {
+    int pills = 0;
+    uint64_t blockedUs = 0;
+    uint64_t endUs = byBeam[i].beamUs;
+    do {
+      const SimCrossing &crossing = byBeam[i];
+      uint64_t crossingEndUs = crossing.beamUs + crossing.widthUs;
+      if (crossingEndUs > endUs) {
+        blockedUs += crossingEndUs - (crossing.beamUs > endUs ? crossing.beamUs : endUs);
+        endUs = crossingEndUs;
+      }
+      pills += crossing.pills;
+      window.pairs += crossing.pills > 1;
+      i++;
+    } while (i < byBeam.size() && byBeam[i].beamUs < endUs + glitchUs);
+
+    int fewest = (int)((blockedUs + singleMaxUs - 1) / singleMaxUs);
+    if (pills > 1) {
+      window.multiTransits++;
+      window.resolvable += fewest > 1;
+      window.unresolvable += pills > fewest ? pills - fewest : 0;
+    }
+  }
+  return window;
+}
+
+static void writeTraceLine(const char *line, void *ctx) {
+  fprintf((FILE *)ctx, "%s\n", line);
+}
+
+// The replay stays on the default JSON status format (NUL-terminated)
+static bool publishStatus(const uint8_t *payload, size_t length, bool durable) {
+  (void)length;
+  (void)durable;
+  sim.publish(SIM_STATUS_TOPIC, (const char *)payload);
+  return true;
+}
+
+static void onCommand(uint8_t *payload, size_t length) {
+  uint8_t reply[DISPENSER_REPLY_LEN];
+  if (dispenserSubmit(payload, length, reply, sizeof(reply)) > 0) {
+    sim.publish(SIM_STATUS_TOPIC, (const char *)reply);
+  }
+}
+
+// Advance both "tasks" to untilUs on their device periods
+static void runUntil(uint64_t untilUs) {
+  static uint64_t nextNetworkUs = 0;
+  while (sim.now() < untilUs) {
+    sim.advanceTo(sim.now() + SIM_MOTION_PERIOD_US);
+    dispenserStep();
+    if (sim.now() >= nextNetworkUs) {
+      dispenserForwardEvents(telemetry);
+      dispenserSaveJournal();
+      for (uint8_t i = 0; i < channelCount; i++) {
+        telemetry[i].poll(millis());
+      }
+      nextNetworkUs += SIM_NETWORK_PERIOD_US;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  SimConfig config;
+  long totalPills = 5000;
+  int orderSize = 30;
+  size_t inflight = 6;
+  const char *tracePath = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--pills") == 0 && i + 1 < argc) {
+      totalPills = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--order") == 0 && i + 1 < argc) {
+      orderSize = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--inflight") == 0 && i + 1 < argc) {
+      inflight = (size_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      config.seed = strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--jams") == 0 && i + 1 < argc) {
+      config.jamPermille = (uint16_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      tracePath = argv[++i];
+    } else if (strcmp(argv[i], "--verbose") == 0) {
+      verbose = true;
+    } else {
+      fprintf(stderr, "usage: %s [--pills N] [--order N] [--inflight N] [--seed N] [--jams N] [--trace FILE] [--verbose]\n", argv[0]);
+      return 2;
+    }
+  }
+  if (totalPills <= 0 || orderSize <= 0 || inflight == 0) {
+    fprintf(stderr, "--pills, --order and --inflight must be positive\n");
+    return 2;
+  }
+
+  Serial.enabled = verbose;
+  sim.configure(config);
+  sim.setCommandHandler(onCommand);
+  sim.setObserver(onPublish);
+  for (uint8_t i = 0; i < channelCount; i++) {
+    telemetry[i].setChannel(i);
+    telemetry[i].setPublisher(publishStatus);
+  }
+
+  auto wallStart = std::chrono::steady_clock::now();
+  dispenserSetup();
+
+  long requested = 0;
+  bool stalled = false;
+  lastFinishUs = sim.now();
+  while (requested < totalPills || finished < orders.size()) {
+    // Keep the device queue topped up
+    while (requested < totalPills && orders.size() - finished < inflight) {
+      int quantity = (int)(totalPills - requested < orderSize ? totalPills - requested : orderSize);
+      SimOrder order;
+      memset(&order, 0, sizeof(order));
+      order.quantity = quantity;
+      orders.push_back(order);
+      requested += quantity;
+
+      char payload[192];
+      snprintf(payload, sizeof(payload),
+               "{\"command\":\"dispense\",\"medicine_name\":\"%s\",\"quantity\":%d,\"prescription_id\":\"rx-%u\"}",
+               MEDICINES[orders.size() % 3], quantity, (unsigned)orders.size());
+      sim.sendCommand(payload);
+    }
+    runUntil(sim.now() + SIM_MOTION_PERIOD_US);
+    if (sim.now() - lastFinishUs > SIM_STALL_US) {
+      stalled = true;
+      break;
+    }
+  }
+  runUntil(sim.now() + SIM_SETTLE_US);
+
+  if (tracePath != NULL) {
+    FILE *traceFile = fopen(tracePath, "w");
+    if (traceFile == NULL) {
+      fprintf(stderr, "cannot write %s\n", tracePath);
+      return 2;
+    }
+    traceDump(writeTraceLine, traceFile);
+    fclose(traceFile);
+  }
+
+  long counted = 0;
+  long delivered = 0;
+  long afterClose = 0;
+  long overshootTotal = 0;
+  long overshootReported = 0;
+  int overshootMax = 0;
+  int miscounted = 0;
+  int failed = 0;
+  long doublesFlagged = 0;
+  long rejected = 0;
+  long jamsRecovered = 0;
+  long multiTransits = 0;
+  long pairs = 0;
+  long resolvable = 0;
+  long unresolvable = 0;
+  long undetected = 0;
+  long learningMiscounts = 0;
+  long inFlight = 0;
+  long lateStop = 0;
+  int misflagged = 0;
+  int learningOrders = 0;
+  std::vector<SimCrossing> byBeam[CHANNEL_MAX];
+  for (uint8_t i = 0; i < channelCount; i++) {
+    byBeam[i] = sim.getCrossings(i);
+    std::sort(byBeam[i].begin(), byBeam[i].end(),
+              [](const SimCrossing &a, const SimCrossing &b) { return a.beamUs < b.beamUs; });
+  }
+  for (size_t i = 0; i < orders.size(); i++) {
+    const SimOrder &order = orders[i];
+    if (!order.done || order.failed) {
+      failed++;
+      continue;
+    }
+    // Everything that crossed the channel's beam from the gate opening for
+    // this order until it opened for the next, including pills still in
+    // flight when it closed
+    const std::vector<SimGateCycle> &cycles = sim.getGateCycles(order.channel);
+    if (order.gateCycle >= cycles.size()) {
+      failed++;
+      continue;
+    }
+    const SimGateCycle &cycle = cycles[order.gateCycle];
+    uint32_t beamNow = sim.getBeamPills(order.channel);
+    uint32_t beamClose = cycle.closed ? cycle.beamAtClose : beamNow;
+    uint32_t beamNext = order.gateCycle + 1 < cycles.size() ? cycles[order.gateCycle + 1].beamAtOpen : beamNow;
+    int actual = (int)(beamNext - cycle.beamAtOpen);
+    delivered += actual;
+    afterClose += beamNext - beamClose;
+    counted += order.counted;
+    doublesFlagged += order.doubles;
+    rejected += order.rejected;
+    jamsRecovered += order.jams;
+    // The device stops once it counted the quantity, which takes as many
+    // more pills as it did not see
+    int unseen = actual > order.counted ? actual - order.counted : 0;
+    uint64_t nextOpenUs = order.gateCycle + 1 < cycles.size() ? cycles[order.gateCycle + 1].openUs : sim.now();
+    SimWindow window = scoreWindow(byBeam[order.channel], cycle.openUs, nextOpenUs, order.quantity + unseen);
+    multiTransits += window.multiTransits;
+    pairs += window.pairs;
+    resolvable += window.resolvable;
+    unresolvable += window.unresolvable;
+    // Every pill the order got must be counted and reported, unless it was
+    // hidden in a transit no wider than fewer pills
+    int missed = actual - order.counted;
+    int unexplained = missed > window.unresolvable ? missed - window.unresolvable : missed < 0 ? -missed : 0;
+    if (actual != order.counted) {
+      miscounted++;
+    }
+    // ... and every transit wider than one pill is flagged, and nothing
+    // else but pills that did merge, once the channel's widths are learned
+    if (cycle.beamAtOpen < SIM_LEARNING_PILLS) {
+      learningOrders++;
+      learningMiscounts += unexplained;
+    } else {
+      undetected += unexplained;
+      if (order.doubles < window.resolvable || order.doubles > window.multiTransits) {
+        misflagged++;
+      }
+    }
+    if (order.counted > order.quantity) {
+      overshootReported += order.counted - order.quantity;
+    }
+    inFlight += window.inFlight;
+    lateStop += window.late;
+    if (actual > order.quantity) {
+      overshootTotal += actual - order.quantity;
+      if (actual - order.quantity > overshootMax) {
+        overshootMax = actual - order.quantity;
+      }
+    }
+  }
+
+  double wallS = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  double simS = sim.now() / 1e6;
+  const SimStats &stats = sim.getStats();
+
+  printf("MediFlow dispense simulation (seed %llu)\n", (unsigned long long)config.seed);
+  printf("orders              %u (failed %d, miscounted %d%s)\n", (unsigned)orders.size(), failed, miscounted,
+         stalled ? ", stalled" : "");
+  printf("pills requested     %ld\n", requested);
+  printf("pills counted       %ld\n", counted);
+  printf("pills delivered     %ld (crossed the beam, %ld of them after the gate closed)\n", delivered, afterClose);
+  printf("overshoot           %ld total, %d max per order (%ld reported by the device)\n", overshootTotal, overshootMax,
+         overshootReported);
+  printf("                    %ld already falling when the last pill was counted, %ld fed after it\n", inFlight,
+         lateStop);
+  printf("touching pairs      %lu injected\n", (unsigned long)stats.doublesInjected);
+  printf("multi-pill transits %ld (%ld touching pairs, %ld wider than one pill), %ld flagged\n", multiTransits, pairs,
+         resolvable, doublesFlagged);
+  printf("                    %d orders misflagged (%d not checked while learning)\n", misflagged, learningOrders);
+  printf("miscounted pills    %ld unresolvable (merged no wider than fewer pills), %ld not (+%ld while learning)\n",
+         unresolvable, undetected, learningMiscounts);
+  printf("beam chatter        %lu injected, %ld transits rejected\n", (unsigned long)stats.chatterInjected, rejected);
+  printf("refills             %lu\n", (unsigned long)stats.refills);
+  printf("turntable jams      %lu injected, %ld recovered\n", (unsigned long)stats.jams, jamsRecovered);
+  printf("laser edges         %lu (%lu dropped)\n", (unsigned long)stats.edges, (unsigned long)laserDroppedEdges());
+  printf("broker              %lu commands, %lu messages, %lu bytes\n", (unsigned long)stats.commands,
+         (unsigned long)stats.published, (unsigned long)stats.publishedBytes);
+  printf("flash store         %lu writes, %lu bytes\n", (unsigned long)stats.storeWrites,
+         (unsigned long)stats.storeBytes);
+  printf("actuator writes     %lu\n", (unsigned long)motionHardwareWrites());
+  printf("time                %.1f s simulated in %.3f s (%.0fx real time)\n", simS, wallS,
+         wallS > 0 ? simS / wallS : 0.0);
+
+  long allowed = (delivered + SIM_MISCOUNT_PILLS - 1) / SIM_MISCOUNT_PILLS;
+  bool countingOk = undetected <= allowed && misflagged <= allowed &&
+                    learningMiscounts <= (long)channelCount * SIM_LEARNING_MISCOUNTS;
+  bool stoppingOk = lateStop == 0 && inFlight * 100 <= (long)orders.size() * SIM_IN_FLIGHT_PCT;
+  return stalled || failed > 0 || !countingOk || !stoppingOk ? 1 : 0;
+}
@@ -0,0 +1,203 @@
+/*
+ * Host-side fuzz and throughput benchmark for CommandParser.
+ *
+ * Compares the in-place tokenizer with the previous strstr/atoi/VLA
+ * approach from messageHandler(), and fuzzes the tokenizer with mutated
+ * payloads. Build and run from code/firmware:
+ *
+ *   g++ -O2 -std=gnu++17 -fsanitize=address,undefined -Isrc \
+ *       tools/bench/command_parser_bench.cpp src/CommandParser.cpp -o /tmp/parser_bench
+ *   /tmp/parser_bench [fuzz_iterations]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "CommandParser.h"
+
+static const char *SAMPLES[] = {
+  "{\"command\":\"dispense\",\"medicine_id\":12,\"medicine_name\":\"Paracetamol 500mg\","
+  "\"quantity\":20,\"prescription_id\":\"RX-2025-000123\",\"timestamp\":\"2025-07-01T10:00:00.000Z\"}",
+  "{ \"command\": \"dispense\", \"quantity\": 5, \"medicine_name\": \"Amoxicillin\" }",
+  "{\"prescription_id\":\"RX-9\",\"quantity\":3,\"command\":\"dispense\"}",
+  "{\n  \"command\" : \"dispense\",\n  \"quantity\" : 12,\n  \"meta\" : {\"source\":[1,2,{\"a\":null}]}\n}",
+  "{\"command\":\"tune\",\"kp\":0.45,\"ki\":0.02,\"bulkSpeed\":110}",
+};
+
+// The parser used by messageHandler() before CommandParser, kept verbatim
+// apart from Serial output.
+struct LegacyResult {
+  bool dispense;
+  int quantity;
+  int nameLength;
+  int idLength;
+};
+
+static volatile int legacySink;
+
+static LegacyResult legacyParse(const uint8_t *payload, unsigned int length) {
+  LegacyResult r = { false, 0, 0, 0 };
+  char message[length + 1];
+  memcpy(message, payload, length);
+  message[length] = '\0';
+
+  if (strstr(message, "\"command\":\"dispense\"") != NULL ||
+      strstr(message, "\"command\": \"dispense\"") != NULL) {
+    r.dispense = true;
+    char *quantityStart = strstr(message, "\"quantity\":");
+    if (quantityStart) {
+      quantityStart += 11;
+      while (*quantityStart == ' ' || *quantityStart == '\t') {
+        quantityStart++;
+      }
+      r.quantity = atoi(quantityStart);
+    } else {
+      r.quantity = 10;
+    }
+    char *medicineStart = strstr(message, "\"medicine_name\":\"");
+    if (medicineStart) {
+      medicineStart += 17;
+      char *medicineEnd = strstr(medicineStart, "\"");
+      if (medicineEnd) {
+        int nameLength = medicineEnd - medicineStart;
+        char medicineName[nameLength + 1];
+        strncpy(medicineName, medicineStart, nameLength);
+        medicineName[nameLength] = '\0';
+        legacySink = medicineName[0];
+        r.nameLength = nameLength;
+      }
+    }
+    char *prescriptionStart = strstr(message, "\"prescription_id\":\"");
+    if (prescriptionStart) {
+      prescriptionStart += 19;
+      char *prescriptionEnd = strstr(prescriptionStart, "\"");
+      if (prescriptionEnd) {
+        int idLength = prescriptionEnd - prescriptionStart;
+        char prescriptionId[idLength + 1];
+        strncpy(prescriptionId, prescriptionStart, idLength);
+        prescriptionId[idLength] = '\0';
+        legacySink = prescriptionId[0];
+        r.idLength = idLength;
+      }
+    }
+  }
+  return r;
+}
+
+static void reportCorrectness() {
+  printf("%-4s %-10s %-10s\n", "#", "legacy", "tokenizer");
+  for (size_t i = 0; i < sizeof(SAMPLES) / sizeof(SAMPLES[0]); i++) {
+    std::vector<uint8_t> buf(SAMPLES[i], SAMPLES[i] + strlen(SAMPLES[i]));
+    LegacyResult legacy = legacyParse(buf.data(), buf.size());
+    Command cmd;
+    ParseError err = parseCommand(buf.data(), buf.size(), cmd);
+    char tokenizer[32];
+    if (err != PARSE_OK) {
+      snprintf(tokenizer, sizeof(tokenizer), "%s", parseErrorName(err));
+    } else if (cmd.type == CMD_DISPENSE) {
+      snprintf(tokenizer, sizeof(tokenizer), "qty=%d", cmd.has(FIELD_QUANTITY) ? cmd.quantity : 10);
+    } else {
+      snprintf(tokenizer, sizeof(tokenizer), "%.*s", (int)cmd.command.len, cmd.command.ptr);
+    }
+    char legacyText[32];
+    if (legacy.dispense) {
+      snprintf(legacyText, sizeof(legacyText), "qty=%d", legacy.quantity);
+    } else {
+      snprintf(legacyText, sizeof(legacyText), "rejected");
+    }
+    printf("%-4zu %-10s %-10s\n", i, legacyText, tokenizer);
+  }
+}
+
+template <typename Fn>
+static double nsPerMessage(Fn fn, size_t iterations) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; i++) {
+    fn(i);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+static void reportThroughput() {
+  const size_t iterations = 2000000;
+  const char *sample = SAMPLES[0];
+  size_t length = strlen(sample);
+
+  // The tokenizer decodes in place, so both sides work on a fresh copy of
+  // the payload, as they would on a freshly received MQTT buffer.
+  std::vector<uint8_t> buf(length);
+  volatile int sink = 0;
+
+  double legacyNs = nsPerMessage([&](size_t) {
+    memcpy(buf.data(), sample, length);
+    sink += legacyParse(buf.data(), length).quantity;
+  }, iterations);
+
+  double tokenizerNs = nsPerMessage([&](size_t) {
+    memcpy(buf.data(), sample, length);
+    Command cmd;
+    parseCommand(buf.data(), length, cmd);
+    sink += cmd.quantity;
+  }, iterations);
+
+  printf("\nThroughput on a %zu-byte dispense command (%zu iterations)\n", length, iterations);
+  printf("  legacy strstr : %8.1f ns/msg  %8.0f msg/s\n", legacyNs, 1e9 / legacyNs);
+  printf("  tokenizer     : %8.1f ns/msg  %8.0f msg/s\n", tokenizerNs, 1e9 / tokenizerNs);
+  (void)sink;
+}
+
+static void runFuzz(size_t iterations) {
+  std::mt19937 rng(12345);
+  size_t accepted = 0;
+  size_t errors[PARSE_MISSING_COMMAND + 1] = { 0 };
+
+  for (size_t i = 0; i < iterations; i++) {
+    const char *seed = SAMPLES[rng() % (sizeof(SAMPLES) / sizeof(SAMPLES[0]))];
+    std::string text(seed);
+
+    int mutations = 1 + rng() % 4;
+    for (int m = 0; m < mutations && !text.empty(); m++) {
+      size_t at = rng() % text.size();
+      switch (rng() % 5) {
+        case 0: text[at] = (char)(rng() & 0xFF); break;
+        case 1: text.erase(at, 1 + rng() % 8); break;
+        case 2: text.insert(at, 1, "{}[]\":,\\u0e-"[rng() % 12]); break;
+        case 3: text.resize(at); break;
+        case 4: text.insert(at, text.substr(0, rng() % text.size())); break;
+      }
+    }
+
+    // Exact-size heap copy so AddressSanitizer catches any overread
+    std::vector<uint8_t> buf(text.begin(), text.end());
+    Command cmd;
+    ParseError err = parseCommand(buf.data(), buf.size(), cmd);
+    errors[err]++;
+    if (err == PARSE_OK) {
+      accepted++;
+      if (cmd.medicineName.len > COMMAND_MAX_STRING_LEN || cmd.prescriptionId.len > COMMAND_MAX_STRING_LEN) {
+        printf("fuzz: slice longer than schema limit\n");
+        exit(1);
+      }
+    }
+  }
+
+  printf("\nFuzz: %zu mutated payloads, %zu accepted\n", iterations, accepted);
+  for (int e = PARSE_OK + 1; e <= PARSE_MISSING_COMMAND; e++) {
+    if (errors[e]) {
+      printf("  %-16s %zu\n", parseErrorName((ParseError)e), errors[e]);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t fuzzIterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+  reportCorrectness();
+  reportThroughput();
+  runFuzz(fuzzIterations);
+  return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Host-side size/throughput benchmark and fuzzer for the wire formats.
+ *
+ * Encodes the status messages with WireWriter in JSON and MessagePack,
+ * parses the same dispense command in both formats with CommandParser,
+ * checks that both decode to the same fields, and fuzzes the MessagePack
+ * path with mutated payloads. Build and run from code/firmware:
+ *
+ *   g++ -O2 -std=gnu++17 -fsanitize=address,undefined -Isrc \
+ *       tools/bench/wire_bench.cpp src/CommandParser.cpp src/WireFormat.cpp -o /tmp/wire_bench
+ *   /tmp/wire_bench [fuzz_iterations]
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "CommandParser.h"
+#include "WireFormat.h"
+
+static const char *DISPENSE_JSON =
+  "{\"command\":\"dispense\",\"medicine_id\":12,\"medicine_name\":\"Paracetamol 500mg\","
+  "\"quantity\":20,\"prescription_id\":\"RX-2025-000123\",\"timestamp\":\"2025-07-01T10:00:00.000Z\"}";
+
+static size_t encodeDispense(uint8_t *buf, size_t size, WireFormat format) {
+  WireWriter msg(buf, size, format);
+  msg.addString(WIRE_KEY_COMMAND, "dispense");
+  msg.addInt(WIRE_KEY_MEDICINE_ID, 12);
+  msg.addString(WIRE_KEY_MEDICINE_NAME, "Paracetamol 500mg");
+  msg.addInt(WIRE_KEY_QUANTITY, 20);
+  msg.addString(WIRE_KEY_PRESCRIPTION_ID, "RX-2025-000123");
+  msg.addString(WIRE_KEY_TIMESTAMP, "2025-07-01T10:00:00.000Z");
+  return msg.finish();
+}
+
+// The largest status message: DispenseTelemetry::complete()
+static size_t encodeComplete(uint8_t *buf, size_t size, WireFormat format, int i) {
+  WireWriter msg(buf, size, format);
+  msg.addInt(WIRE_KEY_PILL_COUNT, 20 + (i & 1));
+  msg.addInt(WIRE_KEY_TARGET_COUNT, 20);
+  msg.addString(WIRE_KEY_STATUS, "complete");
+  msg.addInt(WIRE_KEY_OVERSHOOT, i & 1);
+  msg.addInt(WIRE_KEY_DURATION_MS, 14250 + i % 1000);
+  msg.addInt(WIRE_KEY_INTERVAL_MIN_MS, 310);
+  msg.addInt(WIRE_KEY_INTERVAL_MEAN_MS, 702);
+  msg.addInt(WIRE_KEY_INTERVAL_MAX_MS, 1840);
+  msg.addInt(WIRE_KEY_DOUBLES, 1);
+  msg.addInt(WIRE_KEY_REJECTED, 0);
+  msg.addString(WIRE_KEY_PRESCRIPTION_ID, "RX-2025-000123");
+  msg.addInt(WIRE_KEY_CHANNEL, 0);
+  return msg.finish();
+}
+
+static size_t encodeProgress(uint8_t *buf, size_t size, WireFormat format, int i) {
+  WireWriter msg(buf, size, format);
+  msg.addInt(WIRE_KEY_PILL_COUNT, 5 + i % 15);
+  msg.addInt(WIRE_KEY_TARGET_COUNT, 20);
+  msg.addInt(WIRE_KEY_CHANNEL, 0);
+  return msg.finish();
+}
+
+static bool sameSlice(const StrSlice &a, const StrSlice &b) {
+  return a.len == b.len && memcmp(a.ptr, b.ptr, a.len) == 0;
+}
+
+static void reportCorrectness() {
+  std::vector<uint8_t> json(DISPENSE_JSON, DISPENSE_JSON + strlen(DISPENSE_JSON));
+  uint8_t packed[256];
+  size_t packedLength = encodeDispense(packed, sizeof(packed), WIRE_MSGPACK);
+
+  Command a;
+  Command b;
+  ParseError errA = parseCommand(json.data(), json.size(), a);
+  ParseError errB = parseCommand(packed, packedLength, b);
+  bool same = errA == PARSE_OK && errB == PARSE_OK && a.type == b.type && a.quantity == b.quantity &&
+              sameSlice(a.medicineName, b.medicineName) && sameSlice(a.prescriptionId, b.prescriptionId) &&
+              a.encoding == WIRE_JSON && b.encoding == WIRE_MSGPACK;
+  printf("Dispense command: JSON %zu bytes, MessagePack %zu bytes, same fields: %s\n",
+         json.size(), packedLength, same ? "yes" : "NO");
+  if (!same) {
+    printf("  json %s, msgpack %s\n", parseErrorName(errA), parseErrorName(errB));
+    exit(1);
+  }
+
+  // A map keyed by name, as a generic MessagePack encoder would write it
+  static const uint8_t NAMED[] = { 0x82, 0xA7, 'c', 'o', 'm', 'm', 'a', 'n', 'd', 0xA4, 'w', 'i', 'r', 'e',
+                                   0xA6, 'f', 'o', 'r', 'm', 'a', 't', 0xA4, 'j', 's', 'o', 'n' };
+  std::vector<uint8_t> named(NAMED, NAMED + sizeof(NAMED));
+  Command c;
+  if (parseCommand(named.data(), named.size(), c) != PARSE_OK || c.type != CMD_WIRE || !c.format.equals("json")) {
+    printf("Name-keyed MessagePack map not accepted\n");
+    exit(1);
+  }
+}
+
+template <typename Fn>
+static double nsPerMessage(Fn fn, size_t iterations) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; i++) {
+    fn(i);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+static void reportThroughput() {
+  const size_t iterations = 2000000;
+  uint8_t buf[320];
+  volatile size_t sink = 0;
+
+  printf("\n%-22s %8s %8s %12s %12s\n", "", "JSON B", "MP B", "JSON ns", "MP ns");
+
+  size_t sizes[2];
+  double ns[2];
+  for (int f = 0; f < 2; f++) {
+    WireFormat format = f == 0 ? WIRE_JSON : WIRE_MSGPACK;
+    sizes[f] = encodeComplete(buf, sizeof(buf), format, 0);
+    ns[f] = nsPerMessage([&](size_t i) { sink += encodeComplete(buf, sizeof(buf), format, (int)i); }, iterations);
+  }
+  printf("%-22s %8zu %8zu %12.1f %12.1f\n", "encode complete", sizes[0], sizes[1], ns[0], ns[1]);
+
+  for (int f = 0; f < 2; f++) {
+    WireFormat format = f == 0 ? WIRE_JSON : WIRE_MSGPACK;
+    sizes[f] = encodeProgress(buf, sizeof(buf), format, 0);
+    ns[f] = nsPerMessage([&](size_t i) { sink += encodeProgress(buf, sizeof(buf), format, (int)i); }, iterations);
+  }
+  printf("%-22s %8zu %8zu %12.1f %12.1f\n", "encode progress", sizes[0], sizes[1], ns[0], ns[1]);
+
+  // Parsing is in place, so each pass works on a fresh copy, as it would
+  // on a freshly received MQTT buffer
+  std::vector<uint8_t> source[2];
+  source[0].assign(DISPENSE_JSON, DISPENSE_JSON + strlen(DISPENSE_JSON));
+  source[1].assign(buf, buf + encodeDispense(buf, sizeof(buf), WIRE_MSGPACK));
+  for (int f = 0; f < 2; f++) {
+    std::vector<uint8_t> work(source[f].size());
+    sizes[f] = source[f].size();
+    ns[f] = nsPerMessage([&](size_t) {
+      memcpy(work.data(), source[f].data(), work.size());
+      Command cmd;
+      parseCommand(work.data(), work.size(), cmd);
+      sink += (size_t)cmd.quantity;
+    }, iterations);
+  }
+  printf("%-22s %8zu %8zu %12.1f %12.1f\n", "parse dispense", sizes[0], sizes[1], ns[0], ns[1]);
+  (void)sink;
+}
+
+static void runFuzz(size_t iterations) {
+  std::mt19937 rng(12345);
+  uint8_t seed[256];
+  size_t seedLength = encodeDispense(seed, sizeof(seed), WIRE_MSGPACK);
+  size_t accepted = 0;
+  size_t errors[PARSE_MISSING_COMMAND + 1] = { 0 };
+  static const uint8_t TYPE_BYTES[] = { 0xC0, 0xC4, 0xC7, 0xCA, 0xCB, 0xCF, 0xD3, 0xD8, 0xD9,
+                                        0xDB, 0xDC, 0xDD, 0xDE, 0xDF, 0x9F, 0x8F, 0xBF, 0xFF };
+
+  for (size_t i = 0; i < iterations; i++) {
+    std::vector<uint8_t> data(seed, seed + seedLength);
+    int mutations = 1 + rng() % 4;
+    for (int m = 0; m < mutations && !data.empty(); m++) {
+      size_t at = rng() % data.size();
+      switch (rng() % 5) {
+        case 0: data[at] = (uint8_t)rng(); break;
+        case 1: data.erase(data.begin() + at, data.begin() + std::min(data.size(), at + 1 + rng() % 8)); break;
+        case 2: data.insert(data.begin() + at, TYPE_BYTES[rng() % sizeof(TYPE_BYTES)]); break;
+        case 3: data.resize(at); break;
+        case 4: data.insert(data.begin() + at, data.begin(), data.begin() + rng() % data.size()); break;
+      }
+    }
+
+    // Exact-size heap copy so AddressSanitizer catches any overread
+    std::vector<uint8_t> buf(data);
+    Command cmd;
+    ParseError err = parseCommand(buf.data(), buf.size(), cmd);
+    errors[err]++;
+    if (err == PARSE_OK) {
+      accepted++;
+      if (cmd.medicineName.len > COMMAND_MAX_STRING_LEN || cmd.prescriptionId.len > COMMAND_MAX_STRING_LEN) {
+        printf("fuzz: slice longer than schema limit\n");
+        exit(1);
+      }
+    }
+  }
+
+  printf("\nFuzz: %zu mutated MessagePack payloads, %zu accepted\n", iterations, accepted);
+  for (int e = PARSE_OK + 1; e <= PARSE_MISSING_COMMAND; e++) {
+    if (errors[e]) {
+      printf("  %-16s %zu\n", parseErrorName((ParseError)e), errors[e]);
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t fuzzIterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+  reportCorrectness();
+  reportThroughput();
+  runFuzz(fuzzIterations);
+  return 0;
+}
@@ -0,0 +1,221 @@
+/*
+ * Decoder for health batches (see src/HealthSeries.h).
+ *
+ * Reads one batch per line as hex, which is what
+ *
+ *   mosquitto_sub -t 'mediflow/+/health/batch' -F %x
+ *
+ * prints, and writes one JSON object per sample, with the uptime of the
+ * sample and null for metrics that had no value. A summary of the batch
+ * sizes against the same rows as JSON goes to stderr.
+ *
+ * Build and run from code/firmware:
+ *
+ *   g++ -O2 -std=gnu++17 -Isrc tools/health/health_decode.cpp -o /tmp/health_decode
+ *   /tmp/health_decode capture.hex > health.jsonl
+ */
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "HealthMetrics.h"
+
+struct MetricInfo {
+  const char *name;
+  int scale;
+  int encoding;
+};
+
+#define HEALTH_METRIC_INFO(id, name, scale, encoding) { name, scale, encoding },
+static const MetricInfo METRICS[] = {
+  HEALTH_METRICS(HEALTH_METRIC_INFO)
+};
+#undef HEALTH_METRIC_INFO
+
+static uint32_t readLe32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t readLe16(const uint8_t *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static bool hexDecode(const std::string &text, std::vector<uint8_t> &out) {
+  int high = -1;
+  for (char c : text) {
+    if (isspace((unsigned char)c)) {
+      continue;
+    }
+    if (!isxdigit((unsigned char)c)) {
+      return false;
+    }
+    int v = isdigit((unsigned char)c) ? c - '0' : tolower(c) - 'a' + 10;
+    if (high < 0) {
+      high = v;
+    } else {
+      out.push_back((uint8_t)(high << 4 | v));
+      high = -1;
+    }
+  }
+  return high < 0;
+}
+
+class BitReader {
+public:
+  BitReader(const uint8_t *data, uint32_t bits) : data(data), bits(bits), at(0) {}
+
+  bool read(uint8_t count, uint64_t &value) {
+    if (at + count > bits) {
+      return false;
+    }
+    value = 0;
+    for (uint8_t i = 0; i < count; i++, at++) {
+      value = value << 1 | ((data[at >> 3] >> (7 - (at & 7))) & 1);
+    }
+    return true;
+  }
+
+  // One code (HealthMetrics.h); false at the end of the stream, missing
+  // set for the "no value" code
+  bool code(int64_t &value, bool &missing) {
+    static const uint8_t WIDTHS[] = { 7, 9, 12, 40 };
+    uint64_t bit = 0;
+    uint8_t ones = 0;
+    while (ones < 5) {
+      if (!read(1, bit)) {
+        return false;
+      }
+      if (bit == 0) {
+        break;
+      }
+      ones++;
+    }
+    missing = ones == 5;
+    uint64_t zigzag = 0;
+    if (ones > 0 && ones < 5 && !read(WIDTHS[ones - 1], zigzag)) {
+      return false;
+    }
+    value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+    return true;
+  }
+
+private:
+  const uint8_t *data;
+  uint32_t bits;
+  uint32_t at;
+};
+
+struct Totals {
+  size_t batches = 0;
+  size_t samples = 0;
+  size_t batchBytes = 0;
+  size_t jsonBytes = 0;
+};
+
+// Writes the samples of one batch; returns false if it is malformed
+static bool decodeBatch(const std::vector<uint8_t> &data, Totals &totals) {
+  if (data.size() < HEALTH_HEADER_BYTES || readLe16(&data[0]) != HEALTH_BATCH_MAGIC ||
+      data[2] != HEALTH_BATCH_VERSION) {
+    fprintf(stderr, "batch: bad header\n");
+    return false;
+  }
+  uint8_t metrics = data[3];
+  uint16_t sequence = readLe16(&data[4]);
+  uint8_t samples = data[6];
+  uint16_t periodS = readLe16(&data[8]);
+  uint16_t bits = readLe16(&data[10]);
+  uint32_t startS = readLe32(&data[12]);
+  if (data.size() < HEALTH_HEADER_BYTES + (bits + 7u) / 8) {
+    fprintf(stderr, "batch %u: truncated\n", sequence);
+    return false;
+  }
+  if (metrics > HEALTH_METRIC_COUNT) {
+    // Written by newer firmware: the extra columns cannot be skipped
+    fprintf(stderr, "batch %u: %u metrics, decoder knows %d\n", sequence, metrics, HEALTH_METRIC_COUNT);
+    return false;
+  }
+
+  BitReader reader(&data[HEALTH_HEADER_BYTES], bits);
+  int64_t previous[HEALTH_METRIC_COUNT] = {};
+  int64_t previousDelta[HEALTH_METRIC_COUNT] = {};
+  bool seen[HEALTH_METRIC_COUNT] = {};
+  for (uint8_t s = 0; s < samples; s++) {
+    char row[1024];
+    int len = snprintf(row, sizeof(row), "{\"seq\":%u,\"uptimeS\":%lu", sequence,
+                       (unsigned long)(startS + (uint32_t)s * periodS));
+    for (uint8_t m = 0; m < metrics; m++) {
+      int64_t code;
+      bool missing;
+      if (!reader.code(code, missing)) {
+        fprintf(stderr, "batch %u: stream ends in sample %u\n", sequence, s);
+        return false;
+      }
+      if (missing) {
+        len += snprintf(row + len, sizeof(row) - len, ",\"%s\":null", METRICS[m].name);
+        continue;
+      }
+      int64_t value = code;
+      if (seen[m]) {
+        int64_t delta = METRICS[m].encoding == HEALTH_ENCODING_DOD ? previousDelta[m] + code : code;
+        value = previous[m] + delta;
+        previousDelta[m] = delta;
+      }
+      seen[m] = true;
+      previous[m] = value;
+      if (METRICS[m].scale == 1) {
+        len += snprintf(row + len, sizeof(row) - len, ",\"%s\":%lld", METRICS[m].name, (long long)value);
+      } else {
+        len += snprintf(row + len, sizeof(row) - len, ",\"%s\":%g", METRICS[m].name,
+                        (double)value / METRICS[m].scale);
+      }
+    }
+    len += snprintf(row + len, sizeof(row) - len, "}");
+    printf("%s\n", row);
+    totals.jsonBytes += len;
+  }
+  totals.batches++;
+  totals.samples += samples;
+  totals.batchBytes += data.size();
+  return true;
+}
+
+int main(int argc, char **argv) {
+  std::ifstream file;
+  if (argc > 2) {
+    fprintf(stderr, "usage: %s [capture.hex] > health.jsonl\n", argv[0]);
+    return 2;
+  }
+  if (argc == 2) {
+    file.open(argv[1]);
+    if (!file) {
+      fprintf(stderr, "cannot open %s\n", argv[1]);
+      return 2;
+    }
+  }
+  std::istream &in = argc == 2 ? file : std::cin;
+
+  Totals totals;
+  int bad = 0;
+  std::string line;
+  while (std::getline(in, line)) {
+    std::vector<uint8_t> data;
+    if (line.find_first_not_of(" \t\r") == std::string::npos) {
+      continue;
+    }
+    if (!hexDecode(line, data) || !decodeBatch(data, totals)) {
+      bad++;
+    }
+  }
+
+  fprintf(stderr, "%zu batch(es), %zu samples, %d bad\n", totals.batches, totals.samples, bad);
+  if (totals.samples > 0) {
+    fprintf(stderr, "%zu bytes batched (%.1f per sample), %zu bytes as JSON rows (%.1fx)\n",
+            totals.batchBytes, (double)totals.batchBytes / totals.samples, totals.jsonBytes,
+            totals.batchBytes ? (double)totals.jsonBytes / totals.batchBytes : 0.0);
+  }
+  return totals.batches > 0 && bad == 0 ? 0 : 1;
+}
@@ -0,0 +1,475 @@
+/*
+ * Round-trip latency of dispenser commands: over the LAN endpoint
+ * (src/LocalEndpoint.h) and over an MQTT broker, with a Mosquitto broker
+ * on a Linux host standing in for AWS IoT.
+ *
+ * Each request is a "ping" command, which the device answers without
+ * touching the motors, signed like any other command (LocalProtocol.h).
+ * Build and run from code/firmware:
+ *
+ *   g++ -O2 -std=gnu++17 -Isrc tools/local/local_bench.cpp src/LocalProtocol.cpp -o /tmp/local_bench
+ *
+ *   # Against the device (the key is LOCAL_CONTROL_KEY of certs/certificates.h)
+ *   /tmp/local_bench http --host 192.168.1.50 --key <hex> --count 200
+ *
+ *   # Host stand-in for the device, answering over HTTP and through Mosquitto
+ *   mosquitto -p 1883 &
+ *   /tmp/local_bench serve --key <hex> --broker 127.0.0.1:1883 &
+ *   /tmp/local_bench http --host 127.0.0.1 --key <hex>
+ *   /tmp/local_bench mqtt --broker 127.0.0.1:1883
+ *
+ * The MQTT path is plain TCP at QoS 0, so it measures the broker hop
+ * itself; TLS and the distance to the cloud come on top of it in the field.
+ */
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "LocalProtocol.h"
+
+static const char *PING = "{\"command\":\"ping\"}";
+static const char *PONG = "{\"status\":\"pong\"}";
+static const char *ACCEPTED = "{\"status\":\"accepted\"}";
+
+static double nowUs() {
+  using namespace std::chrono;
+  return (double)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Grows with wall time so nonces stay fresh across runs
+static uint64_t nextNonce() {
+  using namespace std::chrono;
+  static uint64_t last = 0;
+  uint64_t now = (uint64_t)duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+  last = now > last ? now : last + 1;
+  return last;
+}
+
+static void splitHostPort(const std::string &text, std::string &host, int &port) {
+  size_t colon = text.rfind(':');
+  if (colon != std::string::npos) {
+    host = text.substr(0, colon);
+    port = atoi(text.c_str() + colon + 1);
+  } else {
+    host = text;
+  }
+}
+
+static int connectTcp(const std::string &host, int port) {
+  addrinfo hints = {};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *found = NULL;
+  if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0) {
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, found->ai_addr, found->ai_addrlen) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(found);
+  if (fd >= 0) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  return fd;
+}
+
+static bool sendAll(int fd, const void *data, size_t length) {
+  const uint8_t *bytes = (const uint8_t *)data;
+  while (length > 0) {
+    ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      return false;
+    }
+    bytes += sent;
+    length -= (size_t)sent;
+  }
+  return true;
+}
+
+static void report(const char *path, std::vector<double> &rtt, int failures) {
+  if (rtt.empty()) {
+    printf("%s: no replies (%d failures)\n", path, failures);
+    return;
+  }
+  std::sort(rtt.begin(), rtt.end());
+  double sum = 0;
+  for (double v : rtt) {
+    sum += v;
+  }
+  auto at = [&](double q) { return rtt[std::min(rtt.size() - 1, (size_t)(q * rtt.size()))] / 1000.0; };
+  printf("%s: %zu replies, %d failures; ms min %.2f  median %.2f  mean %.2f  p99 %.2f  max %.2f\n", path,
+         rtt.size(), failures, rtt.front() / 1000.0, at(0.5), sum / rtt.size() / 1000.0, at(0.99),
+         rtt.back() / 1000.0);
+}
+
+// --- LAN endpoint ---
+
+static std::string signedRequest(const uint8_t key[LOCAL_KEY_BYTES], const char *body, uint64_t nonce) {
+  char signature[LOCAL_SIGNATURE_HEX + 1];
+  localSign(key, "req", nonce, (const uint8_t *)body, strlen(body), signature);
+  char head[256];
+  snprintf(head, sizeof(head),
+           "POST /command HTTP/1.1\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n"
+           "X-MediFlow-Nonce: %llu\r\nX-MediFlow-Signature: %s\r\n\r\n",
+           strlen(body), (unsigned long long)nonce, signature);
+  return std::string(head) + body;
+}
+
+// Reads one message; false on a closed connection or a framing error
+static bool readMessage(int fd, LocalMessage &msg) {
+  LocalStatus status = msg.commit(0);
+  while (status == LOCAL_INCOMPLETE) {
+    size_t room;
+    uint8_t *at = msg.space(&room);
+    ssize_t got = recv(fd, at, room, 0);
+    if (got <= 0) {
+      return false;
+    }
+    status = msg.commit((size_t)got);
+  }
+  return status == LOCAL_COMPLETE;
+}
+
+static int runHttp(const std::string &host, int port, const uint8_t key[LOCAL_KEY_BYTES], int count) {
+  int fd = connectTcp(host, port);
+  if (fd < 0) {
+    fprintf(stderr, "cannot connect to %s:%d\n", host.c_str(), port);
+    return 1;
+  }
+  std::vector<double> rtt;
+  int failures = 0;
+  static LocalMessage reply;
+  for (int i = 0; i < count; i++) {
+    uint64_t nonce = nextNonce();
+    std::string request = signedRequest(key, PING, nonce);
+    double started = nowUs();
+    if (!sendAll(fd, request.data(), request.size()) || !readMessage(fd, reply)) {
+      fprintf(stderr, "connection lost\n");
+      failures++;
+      break;
+    }
+    double elapsed = nowUs() - started;
+
+    char expected[LOCAL_SIGNATURE_HEX + 1];
+    localSign(key, "res", nonce, reply.body(), reply.bodyLength(), expected);
+    bool ok = reply.startsWith("HTTP/1.1 200") && reply.nonceValid() && reply.getNonce() == nonce &&
+              localSignatureEquals(expected, reply.getSignature());
+    if (ok) {
+      rtt.push_back(elapsed);
+    } else {
+      failures++;
+      fprintf(stderr, "bad reply: %.*s\n", (int)reply.bodyLength(), (const char *)reply.body());
+    }
+    reply.consume();
+  }
+  close(fd);
+  report("http", rtt, failures);
+  return failures > 0 && rtt.empty();
+}
+
+// --- Minimal MQTT 3.1.1 client, plain TCP, QoS 0 ---
+
+static std::string mqttString(const std::string &text) {
+  std::string out;
+  out += (char)(text.size() >> 8);
+  out += (char)(text.size() & 0xFF);
+  return out + text;
+}
+
+static bool mqttSend(int fd, uint8_t type, const std::string &body) {
+  std::string packet(1, (char)type);
+  size_t remaining = body.size();
+  do {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    packet += (char)(digit | (remaining > 0 ? 0x80 : 0));
+  } while (remaining > 0);
+  packet += body;
+  return sendAll(fd, packet.data(), packet.size());
+}
+
+static bool readExact(int fd, void *data, size_t length) {
+  uint8_t *bytes = (uint8_t *)data;
+  while (length > 0) {
+    ssize_t got = recv(fd, bytes, length, 0);
+    if (got <= 0) {
+      return false;
+    }
+    bytes += got;
+    length -= (size_t)got;
+  }
+  return true;
+}
+
+static bool mqttRead(int fd, uint8_t &type, std::string &body) {
+  uint8_t header;
+  if (!readExact(fd, &header, 1)) {
+    return false;
+  }
+  size_t remaining = 0;
+  for (int shift = 0; shift < 28; shift += 7) {
+    uint8_t digit;
+    if (!readExact(fd, &digit, 1)) {
+      return false;
+    }
+    remaining |= (size_t)(digit & 0x7F) << shift;
+    if (!(digit & 0x80)) {
+      break;
+    }
+  }
+  type = header;
+  body.resize(remaining);
+  return remaining == 0 || readExact(fd, &body[0], remaining);
+}
+
+static int mqttConnect(const std::string &broker, const char *clientId) {
+  std::string host = broker;
+  int port = 1883;
+  splitHostPort(broker, host, port);
+  int fd = connectTcp(host, port);
+  if (fd < 0) {
+    return -1;
+  }
+  std::string connect = mqttString("MQTT");
+  connect += (char)4;     // Protocol level 3.1.1
+  connect += (char)0x02;  // Clean session
+  connect += (char)0;
+  connect += (char)60;    // Keep alive
+  connect += mqttString(clientId);
+  uint8_t type;
+  std::string body;
+  if (!mqttSend(fd, 0x10, connect) || !mqttRead(fd, type, body) || type != 0x20 || body.size() < 2 ||
+      body[1] != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool mqttSubscribe(int fd, const std::string &topic) {
+  std::string body;
+  body += (char)0;
+  body += (char)1;  // Packet id
+  body += mqttString(topic);
+  body += (char)0;  // QoS 0
+  uint8_t type;
+  std::string ack;
+  return mqttSend(fd, 0x82, body) && mqttRead(fd, type, ack) && type == 0x90;
+}
+
+static bool mqttPublish(int fd, const std::string &topic, const std::string &payload) {
+  return mqttSend(fd, 0x30, mqttString(topic) + payload);
+}
+
+// Splits a received PUBLISH (QoS 0) into topic and payload
+static bool mqttParsePublish(uint8_t type, const std::string &body, std::string &topic, std::string &payload) {
+  if ((type & 0xF0) != 0x30 || body.size() < 2) {
+    return false;
+  }
+  size_t topicLength = (uint8_t)body[0] << 8 | (uint8_t)body[1];
+  if (2 + topicLength > body.size()) {
+    return false;
+  }
+  topic = body.substr(2, topicLength);
+  payload = body.substr(2 + topicLength);
+  return true;
+}
+
+static int runMqtt(const std::string &broker, const std::string &thing, int count) {
+  int fd = mqttConnect(broker, "mediflow-bench");
+  std::string commandTopic = "mediflow/" + thing + "/command";
+  std::string statusTopic = "mediflow/" + thing + "/status";
+  if (fd < 0 || !mqttSubscribe(fd, statusTopic)) {
+    fprintf(stderr, "cannot use broker %s\n", broker.c_str());
+    return 1;
+  }
+  std::vector<double> rtt;
+  int failures = 0;
+  for (int i = 0; i < count; i++) {
+    double started = nowUs();
+    if (!mqttPublish(fd, commandTopic, PING)) {
+      failures++;
+      break;
+    }
+    bool answered = false;
+    while (!answered) {
+      pollfd waitFor = { fd, POLLIN, 0 };
+      if (poll(&waitFor, 1, 2000) <= 0) {
+        break;
+      }
+      uint8_t type;
+      std::string body, topic, payload;
+      if (!mqttRead(fd, type, body)) {
+        break;
+      }
+      answered = mqttParsePublish(type, body, topic, payload) && topic == statusTopic &&
+                 payload.find("pong") != std::string::npos;
+    }
+    if (answered) {
+      rtt.push_back(nowUs() - started);
+    } else {
+      failures++;
+    }
+  }
+  close(fd);
+  report("mqtt", rtt, failures);
+  return failures > 0 && rtt.empty();
+}
+
+// --- Host stand-in for the device ---
+
+static void serveRequest(int fd, LocalMessage &request, const uint8_t key[LOCAL_KEY_BYTES], uint64_t &lastNonce) {
+  char expected[LOCAL_SIGNATURE_HEX + 1];
+  localSign(key, "req", request.getNonce(), request.body(), request.bodyLength(), expected);
+  bool ok = request.startsWith("POST /command ") && request.nonceValid() && request.getNonce() > lastNonce &&
+            localSignatureEquals(expected, request.getSignature());
+  std::string body = !ok ? "{\"error\":\"auth\"}"
+                         : (std::string((const char *)request.body(), request.bodyLength()).find("ping") !=
+                                    std::string::npos
+                                ? PONG
+                                : ACCEPTED);
+  char head[256];
+  int length = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n",
+                        ok ? "200 OK" : "401 Unauthorized", body.size());
+  if (ok) {
+    lastNonce = request.getNonce();
+    char signature[LOCAL_SIGNATURE_HEX + 1];
+    localSign(key, "res", lastNonce, (const uint8_t *)body.data(), body.size(), signature);
+    length += snprintf(head + length, sizeof(head) - length, "X-MediFlow-Nonce: %llu\r\nX-MediFlow-Signature: %s\r\n",
+                       (unsigned long long)lastNonce, signature);
+  }
+  std::string response = std::string(head, length) + "\r\n" + body;
+  sendAll(fd, response.data(), response.size());
+}
+
+static int runServe(int port, const uint8_t key[LOCAL_KEY_BYTES], const std::string &broker, const std::string &thing) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 4) != 0) {
+    fprintf(stderr, "cannot listen on port %d\n", port);
+    return 1;
+  }
+
+  int mqtt = -1;
+  std::string commandTopic = "mediflow/" + thing + "/command";
+  std::string statusTopic = "mediflow/" + thing + "/status";
+  if (!broker.empty()) {
+    mqtt = mqttConnect(broker, "mediflow-standin");
+    if (mqtt < 0 || !mqttSubscribe(mqtt, commandTopic)) {
+      fprintf(stderr, "cannot use broker %s\n", broker.c_str());
+      return 1;
+    }
+  }
+  printf("stand-in listening on port %d%s%s\n", port, mqtt >= 0 ? ", subscribed via " : "", broker.c_str());
+
+  int client = -1;
+  uint64_t lastNonce = 0;
+  static LocalMessage request;
+  for (;;) {
+    pollfd fds[3] = { { listener, POLLIN, 0 }, { client, POLLIN, 0 }, { mqtt, POLLIN, 0 } };
+    if (poll(fds, 3, -1) < 0) {
+      return 1;
+    }
+    if (fds[0].revents & POLLIN) {
+      int accepted = accept(listener, NULL, NULL);
+      if (client >= 0) {
+        close(client);  // One client at a time, like the device
+      }
+      client = accepted;
+      setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      request.clear();
+    }
+    if (client >= 0 && (fds[1].revents & (POLLIN | POLLHUP))) {
+      size_t room;
+      uint8_t *at = request.space(&room);
+      ssize_t got = recv(client, at, room, 0);
+      LocalStatus status = got > 0 ? request.commit((size_t)got) : LOCAL_MALFORMED;
+      while (status == LOCAL_COMPLETE) {
+        serveRequest(client, request, key, lastNonce);
+        request.consume();
+        status = request.commit(0);
+      }
+      if (status != LOCAL_INCOMPLETE) {
+        close(client);
+        client = -1;
+        request.clear();
+      }
+    }
+    if (mqtt >= 0 && (fds[2].revents & POLLIN)) {
+      uint8_t type;
+      std::string body, topic, payload;
+      if (!mqttRead(mqtt, type, body)) {
+        fprintf(stderr, "broker connection lost\n");
+        return 1;
+      }
+      if (mqttParsePublish(type, body, topic, payload) && topic == commandTopic) {
+        mqttPublish(mqtt, statusTopic, payload.find("ping") != std::string::npos ? PONG : ACCEPTED);
+      }
+    }
+  }
+}
+
+static void usage() {
+  fprintf(stderr,
+          "usage: local_bench http  --host H [--port P] --key HEX [--count N]\n"
+          "       local_bench mqtt  --broker H[:P] [--thing NAME] [--count N]\n"
+          "       local_bench serve --key HEX [--port P] [--broker H[:P]] [--thing NAME]\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage();
+    return 2;
+  }
+  std::string mode = argv[1];
+  std::string host = "127.0.0.1", broker, thing = "Dispenser_A", keyHex;
+  int port = LOCAL_PORT, count = 100;
+  for (int i = 2; i + 1 < argc; i += 2) {
+    std::string flag = argv[i];
+    const char *value = argv[i + 1];
+    if (flag == "--host") host = value;
+    else if (flag == "--port") port = atoi(value);
+    else if (flag == "--key") keyHex = value;
+    else if (flag == "--count") count = atoi(value);
+    else if (flag == "--broker") broker = value;
+    else if (flag == "--thing") thing = value;
+    else {
+      usage();
+      return 2;
+    }
+  }
+
+  uint8_t key[LOCAL_KEY_BYTES];
+  bool haveKey = localKeyFromHex(keyHex.c_str(), key);
+  if (mode == "http" && haveKey) {
+    return runHttp(host, port, key, count);
+  }
+  if (mode == "mqtt" && !broker.empty()) {
+    return runMqtt(broker, thing, count);
+  }
+  if (mode == "serve" && haveKey) {
+    return runServe(port, key, broker, thing);
+  }
+  usage();
+  return 2;
+}
@@ -0,0 +1,241 @@
+/*
+ * Decoder for firmware trace dumps (see src/Trace.h).
+ *
+ * Reads any text containing "MFTRACE <line>/<lines> <base64>" lines (a
+ * serial monitor capture, or `mosquitto_sub -t mediflow/<thing>/trace`
+ * output) and writes a Chrome trace JSON, which chrome://tracing and
+ * https://ui.perfetto.dev open directly. Every dump in the input becomes
+ * one process in the timeline, with one thread per CPU core.
+ *
+ * Build and run from code/firmware:
+ *
+ *   g++ -O2 -std=gnu++17 -Isrc tools/trace/trace_decode.cpp -o /tmp/trace_decode
+ *   /tmp/trace_decode capture.log > trace.json
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "TraceEvents.h"
+
+// Same layout as TraceDumpHeader / TraceRecord in src/Trace.h
+#define TRACE_MAGIC 0x3154464D
+#define HEADER_SIZE 16
+#define RECORD_SIZE 8
+
+struct EventInfo {
+  const char *name;
+  int kind;
+};
+
+#define TRACE_EVENT_INFO(id, name, kind) { name, kind },
+static const EventInfo EVENTS[] = {
+  TRACE_EVENTS(TRACE_EVENT_INFO)
+};
+#undef TRACE_EVENT_INFO
+
+static uint32_t readLe32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t readLe16(const uint8_t *p) {
+  return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static int base64Value(char c) {
+  if (c >= 'A' && c <= 'Z') return c - 'A';
+  if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+  if (c >= '0' && c <= '9') return c - '0' + 52;
+  if (c == '+') return 62;
+  if (c == '/') return 63;
+  return -1;
+}
+
+static bool base64Decode(const char *text, std::vector<uint8_t> &out) {
+  uint32_t chunk = 0;
+  int bits = 0;
+  for (const char *p = text; *p && *p != '=' && *p != '"' && *p != '\r' && *p != '\n'; p++) {
+    int v = base64Value(*p);
+    if (v < 0) {
+      return false;
+    }
+    chunk = chunk << 6 | (uint32_t)v;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out.push_back((uint8_t)(chunk >> bits));
+    }
+  }
+  return true;
+}
+
+class ChromeWriter {
+public:
+  explicit ChromeWriter(FILE *out) : out(out), first(true) {
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  }
+
+  ~ChromeWriter() {
+    fprintf(out, "\n]}\n");
+  }
+
+  void processName(int pid, const char *name) {
+    separator();
+    fprintf(out, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", pid, name);
+  }
+
+  void event(const EventInfo &info, int pid, int core, double ts, uint16_t arg) {
+    separator();
+    switch (info.kind) {
+      case TRACE_KIND_BEGIN:
+        fprintf(out, "{\"ph\":\"B\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"arg\":%u}}",
+                info.name, pid, core, ts, arg);
+        break;
+      case TRACE_KIND_END:
+        fprintf(out, "{\"ph\":\"E\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}", info.name, pid, core, ts);
+        break;
+      case TRACE_KIND_ASYNC_BEGIN:
+      case TRACE_KIND_ASYNC_END:
+        fprintf(out, "{\"ph\":\"%s\",\"name\":\"%s\",\"cat\":\"%s\",\"id\":%u,\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+                info.kind == TRACE_KIND_ASYNC_BEGIN ? "b" : "e", info.name, info.name, arg, pid, core, ts);
+        break;
+      case TRACE_KIND_COUNTER:
+        fprintf(out, "{\"ph\":\"C\",\"name\":\"%s\",\"pid\":%d,\"ts\":%.3f,\"args\":{\"value\":%u}}",
+                info.name, pid, ts, arg);
+        break;
+      default:
+        fprintf(out, "{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"args\":{\"arg\":%u}}",
+                info.name, pid, core, ts, arg);
+        break;
+    }
+  }
+
+private:
+  FILE *out;
+  bool first;
+
+  void separator() {
+    if (!first) {
+      fprintf(out, ",\n");
+    }
+    first = false;
+  }
+};
+
+// Emits one complete dump; returns false if it is malformed
+static bool decodeDump(const std::vector<uint8_t> &data, int pid, ChromeWriter &writer) {
+  if (data.size() < HEADER_SIZE || readLe32(&data[0]) != TRACE_MAGIC || readLe16(&data[4]) != RECORD_SIZE) {
+    fprintf(stderr, "dump %d: bad header\n", pid);
+    return false;
+  }
+  uint16_t count = readLe16(&data[6]);
+  uint32_t cpuHz = readLe32(&data[8]);
+  uint32_t lost = readLe32(&data[12]);
+  if (data.size() < HEADER_SIZE + (size_t)count * RECORD_SIZE || cpuHz == 0) {
+    fprintf(stderr, "dump %d: truncated\n", pid);
+    return false;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "dump %d (%u records, %u lost)", pid, count, lost);
+  writer.processName(pid, name);
+
+  // The cycle counter is 32 bits per core (17.9 s at 240 MHz); records of
+  // one core are in order, so a backwards step is a wrap.
+  uint64_t base[2] = { 0, 0 };
+  uint32_t last[2] = { 0, 0 };
+  bool seen[2] = { false, false };
+  bool haveStart = false;
+  uint64_t start = 0;
+  double cyclesPerUs = cpuHz / 1e6;
+
+  for (uint16_t i = 0; i < count; i++) {
+    const uint8_t *r = &data[HEADER_SIZE + (size_t)i * RECORD_SIZE];
+    uint32_t cycles = readLe32(r);
+    uint8_t event = r[4];
+    uint8_t core = r[5] & 1;
+    uint16_t arg = readLe16(r + 6);
+    if (event >= TRACE_EVENT_COUNT) {
+      continue;
+    }
+    if (seen[core] && cycles < last[core]) {
+      base[core] += 1ULL << 32;
+    }
+    seen[core] = true;
+    last[core] = cycles;
+    uint64_t at = base[core] + cycles;
+    if (!haveStart) {
+      start = at;
+      haveStart = true;
+    }
+    double ts = at >= start ? (at - start) / cyclesPerUs : 0;
+    writer.event(EVENTS[event], pid, core, ts, arg);
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  std::ifstream file;
+  if (argc > 2) {
+    fprintf(stderr, "usage: %s [capture.log] > trace.json\n", argv[0]);
+    return 2;
+  }
+  if (argc == 2) {
+    file.open(argv[1]);
+    if (!file) {
+      fprintf(stderr, "cannot open %s\n", argv[1]);
+      return 2;
+    }
+  }
+  std::istream &in = argc == 2 ? file : std::cin;
+
+  ChromeWriter writer(stdout);
+  std::vector<uint8_t> data;
+  unsigned expected = 0;
+  int dumps = 0;
+  int decoded = 0;
+  int bad = 0;
+  std::string line;
+  while (std::getline(in, line)) {
+    size_t at = line.find("MFTRACE ");
+    if (at == std::string::npos) {
+      continue;
+    }
+    unsigned index = 0;
+    unsigned total = 0;
+    int offset = 0;
+    if (sscanf(line.c_str() + at, "MFTRACE %u/%u %n", &index, &total, &offset) != 2 || offset == 0) {
+      continue;
+    }
+    if (index == 1) {
+      data.clear();
+      expected = 1;
+    }
+    if (index != expected) {
+      // Lost or reordered line; skip to the next dump
+      expected = 0;
+      continue;
+    }
+    if (!base64Decode(line.c_str() + at + offset, data)) {
+      expected = 0;
+      bad++;
+      continue;
+    }
+    expected++;
+    if (index == total) {
+      if (decodeDump(data, ++dumps, writer)) {
+        decoded++;
+      } else {
+        bad++;
+      }
+    }
+  }
+
+  fprintf(stderr, "%d dump(s) decoded, %d bad\n", decoded, bad);
+  return decoded > 0 && bad == 0 ? 0 : 1;
+}
@@ -0,0 +1,33 @@
+/*
+ * Generates the backend's copy of the wire schema (src/WireSchema.h) so
+ * firmware and backend share one table of keys and formats.
+ *
+ * Build and run from code/firmware after changing WireSchema.h:
+ *
+ *   g++ -O2 -std=gnu++17 -Isrc tools/wire/wire_schema_js.cpp -o /tmp/wire_schema_js
+ *   /tmp/wire_schema_js > ../backend/src/utils/wireSchema.js
+ */
+#include <cstdio>
+
+#include "WireSchema.h"
+
+int main() {
+  printf("// Generated from code/firmware/src/WireSchema.h by\n");
+  printf("// code/firmware/tools/wire/wire_schema_js.cpp. Do not edit.\n\n");
+  printf("// MessagePack map key code of every JSON key\n");
+  printf("const keys = {\n");
+#define WIRE_KEY_JS(id, code, name) printf("  %s: %d,\n", name, code);
+  WIRE_KEYS(WIRE_KEY_JS)
+#undef WIRE_KEY_JS
+  printf("};\n\n");
+
+  printf("// Status formats a device can be switched to with the \"wire\" command\n");
+  printf("const formats = [\n");
+#define WIRE_FORMAT_JS(id, name) printf("  '%s',\n", name);
+  WIRE_FORMATS(WIRE_FORMAT_JS)
+#undef WIRE_FORMAT_JS
+  printf("];\n\n");
+
+  printf("module.exports = { keys, formats };\n");
+  return 0;
+}